@@ -0,0 +1,110 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_ACTOR_STORE_H
+#define EQUILIBRE_ACTOR_STORE_H
+
+#include <QHash>
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+#include "EQuilibre/Render/LinearMath.h"
+#include "EQuilibre/Render/Geometry.h"
+
+class WLDAnimation;
+class WLDCharActor;
+
+/*!
+  \brief Holds the state of many character actors in packed arrays, so that
+  movement, animation and culling can be done with tight loops.
+
+  Actors are referred to by handles which stay valid until the actor is
+  destroyed. The state arrays are indexed by slot and kept packed by moving
+  the last actor into the slot of a destroyed one.
+
+  An actor is bounded by a sphere whose center is half its height above its
+  position, which is at its feet.
+  */
+class GAME_DLL ActorStore
+{
+public:
+    ActorStore();
+
+    static const uint32_t InvalidHandle;
+
+    uint32_t count() const;
+
+    uint32_t create(WLDCharActor *actor = NULL);
+    void destroy(uint32_t handle);
+    void clear();
+    bool contains(uint32_t handle) const;
+    uint32_t slot(uint32_t handle) const;
+    uint32_t handleAt(uint32_t slot) const;
+    WLDCharActor * actor(uint32_t handle) const;
+
+    // Per-actor state, indexed by handle.
+    vec3 & position(uint32_t handle);
+    vec3 & orientation(uint32_t handle);
+    vec3 & velocity(uint32_t handle);
+    uint32_t & animationID(uint32_t handle);
+    float & animationTime(uint32_t handle);
+    uint32_t & skinID(uint32_t handle);
+    float & radius(uint32_t handle);
+    float & height(uint32_t handle);
+
+    // Packed state arrays, indexed by slot.
+    const vec3 * positions() const;
+    const vec3 * orientations() const;
+    const vec3 * velocities() const;
+    const uint32_t * animationIDs() const;
+    const float * animationTimes() const;
+    const uint32_t * skinIDs() const;
+    const float * radii() const;
+    const float * heights() const;
+
+    // Animations are referred to by ID, 0 meaning 'no animation'.
+    uint32_t animationID(WLDAnimation *anim);
+    WLDAnimation * animation(uint32_t animID) const;
+    void clearAnimations();
+
+    void updateMovement(float dt);
+    void updateAnimations(float dt);
+    void findVisible(const Frustum &frustum, QVector<uint32_t> &handles);
+
+private:
+    void removeSlot(uint32_t slot);
+
+    QVector<vec3> m_positions;
+    QVector<vec3> m_orientations;
+    QVector<vec3> m_velocities;
+    QVector<uint32_t> m_animIDs;
+    QVector<float> m_animTimes;
+    QVector<uint32_t> m_skinIDs;
+    QVector<float> m_radii;
+    QVector<float> m_heights;
+    QVector<WLDCharActor *> m_actors;
+    /** Centers of the bounding spheres, computed when culling. */
+    QVector<vec3> m_centers;
+    /** Slot -> handle. */
+    QVector<uint32_t> m_handles;
+    /** Handle -> slot, or InvalidHandle for free handles. */
+    QVector<uint32_t> m_slots;
+    QVector<uint32_t> m_freeHandles;
+    QVector<WLDAnimation *> m_animations;
+    QVector<float> m_animDurations;
+    QHash<WLDAnimation *, uint32_t> m_animLookup;
+};
+
+#endif
@@ -34,8 +34,11 @@ class Zone;
 class ZoneSky;
 class WLDAnimation;
 class WLDCharActor;
+class ActorStore;
+class MeshPool;
 class WLDMesh;
 class WLDData;
+class TrackRegistry;
 
 /*!
   \brief Contains the global state of the game.
@@ -50,6 +53,10 @@ public:
     bool showObjects() const;
     bool showFog() const;
     bool cullObjects() const;
+    bool usePVS() const;
+    bool occlusionCulling() const;
+    int cullThreadCount() const;
+    float objectCellSize() const;
     bool showSoundTriggers() const;
     bool frustumIsFrozen() const;
     bool allowMultiJumps() const;
@@ -59,6 +66,10 @@ public:
     void setShowObjects(bool show);
     void setShowFog(bool show);
     void setCullObjects(bool enabled);
+    void setUsePVS(bool enabled);
+    void setOcclusionCulling(bool enabled);
+    void setCullThreadCount(int count);
+    void setObjectCellSize(float size);
     void setShowSoundTriggers(bool show);
     void setApplyGravity(bool enabled);
     
@@ -72,6 +83,8 @@ public:
     void unFreezeFrustum();
     
     WLDCharActor * player() const;
+    ActorStore * actorStore() const;
+    MeshPool * meshPool() const;
     Zone * zone() const;
     ZoneSky * sky() const;
     QList<ObjectPack *> objectPacks() const;
@@ -92,9 +105,9 @@ public:
     void update(RenderContext *renderCtx, double currentTime,
                 double sinceLastUpdate);
     
-    void drawPlayer(RenderContext *renderCtx, RenderProgram *prog);
-    void drawBuiltinObject(MeshData *object, RenderContext *renderCtx,
-                           RenderProgram *prog);
+    void queuePlayer(RenderContext *renderCtx, CommandQueue &queue, uint64_t key);
+    void queueBuiltinObject(MeshData *object, RenderContext *renderCtx,
+                            CommandQueue &queue, uint64_t key);
     
     void clear(RenderContext *renderCtx);
     void clearZone(RenderContext *renderCtx);
@@ -116,6 +129,10 @@ private:
     bool m_showObjects;
     bool m_showFog;
     bool m_cullObjects;
+    bool m_usePVS;
+    bool m_occlusionCulling;
+    int m_cullThreadCount;
+    float m_objectCellSize;
     bool m_showSoundTriggers;
     bool m_frustumIsFrozen;
     bool m_drawCapsule;
@@ -124,39 +141,48 @@ private:
     vec3 m_gravity;
     FrameStat *m_updateStat;
     float m_minDistanceToShowCharacter;
+    ActorStore *m_actors;
+    MeshPool *m_meshPool;
     WLDCharActor *m_player;
 };
 
 /*!
-  \brief Holds the resources needed to render static objects.
+  \brief Holds the resources needed to render static objects. The meshes'
+  geometry is stored in a mesh pool shared with other packs.
   */
 class GAME_DLL ObjectPack
 {
 public:
-    ObjectPack();
+    ObjectPack(MeshPool *pool);
     virtual ~ObjectPack();
     
     const QMap<QString, WLDMesh *> & models() const;
-    MeshBuffer * buffer() const;
+    bool uploaded() const;
     
     bool load(QString archivePath, QString wldName);
-    MeshBuffer * upload(RenderContext *renderCtx);
+    void import(RenderContext *renderCtx);
+    void upload(RenderContext *renderCtx);
     void clear(RenderContext *renderCtx);
     
 private:
     PFSArchive *m_archive;
     WLDData *m_wld;
     QMap<QString, WLDMesh *> m_models;
-    MeshBuffer *m_meshBuf;
+    MeshPool *m_pool;
+    /** Allocation of each mesh in the pool. */
+    QVector<uint32_t> m_handles;
+    bool m_imported;
+    bool m_uploaded;
 };
 
 /*!
-  \brief Holds the resources needed to render characters.
+  \brief Holds the resources needed to render characters. The meshes of each
+  model are stored together in a mesh pool shared with other packs.
   */
 class GAME_DLL CharacterPack
 {
 public:
-    CharacterPack();
+    CharacterPack(MeshPool *pool);
     virtual ~CharacterPack();
     
     const QMap<QString, WLDModel *> models() const;
@@ -174,6 +200,10 @@ private:
     PFSArchive *m_archive;
     WLDData *m_wld;
     QMap<QString, WLDModel *> m_models;
+    TrackRegistry *m_tracks;
+    MeshPool *m_pool;
+    /** Allocation of each uploaded model in the pool. */
+    QVector<uint32_t> m_handles;
 };
 
 #endif
@@ -19,6 +19,7 @@
 
 #include <QObject>
 #include <QMap>
+#include <QHash>
 #include <QPair>
 #include "Newton.h"
 #include "EQuilibre/Render/Platform.h"
@@ -34,11 +35,12 @@ class WLDMesh;
 class WLDActor;
 class WLDAnimation;
 class Game;
-class MaterialMap;
 class RenderContext;
+class CommandQueue;
 class Octree;
 class OctreeIndex;
 class Zone;
+class ActorStore;
 
 class ActorEquip
 {
@@ -67,7 +69,8 @@ public:
     {
         Static = 0,
         Character,
-        LightSource
+        LightSource,
+        StaticBatch
     };
     
     WLDActor(ActorType type);
@@ -112,12 +115,14 @@ public:
     const static ActorType Kind = Static;
 
     const matrix4 & modelMatrix() const;
+    const vec3 & scale() const;
     WLDMesh * mesh() const;
     ActorFragment * frag() const;
     const BufferSegment & colorSegment() const;
 
     void update();
     void importColorData(MeshBuffer *meshBuf);
+    void importVertexData(MeshBuffer *meshBuf) const;
     
 private:
     ActorFragment *m_frag;
@@ -128,7 +133,52 @@ private:
 };
 
 /*!
-  \brief Describes an instance of a character model.
+  \brief Objects of a batch that use the same mesh. Their vertices are stored
+  one object after the other, and each level of detail of the mesh has a
+  matching mesh that draws all of the objects.
+  */
+struct GAME_DLL WLDBatchPart
+{
+    WLDMesh *mesh;
+    QVector<WLDStaticActor *> objects;
+    AABox bounds;
+    /** Largest scale of the objects, to convert LOD errors to zone units. */
+    float scale;
+    QVector<MeshData *> lods;
+};
+
+/*!
+  \brief Describes static objects that are close to each other, merged into
+  pre-transformed meshes so that they are culled as one actor and drawn
+  without per-object transforms. The lighting colors of the objects are
+  copied to the vertices of the batch.
+  */
+class GAME_DLL WLDBatchActor : public WLDActor
+{
+public:
+    WLDBatchActor();
+    virtual ~WLDBatchActor();
+    const static ActorType Kind = StaticBatch;
+    
+    static const uint32_t NoCell;
+    
+    const QVector<WLDStaticActor *> & objects() const;
+    const QVector<WLDBatchPart> & parts() const;
+    
+    void addObject(WLDStaticActor *actor);
+    void importFrom(MeshBuffer *meshBuf);
+    
+    static uint32_t findCells(const AABox *bounds, uint32_t count, float cellSize,
+                              uint32_t *cells);
+    
+private:
+    QVector<WLDStaticActor *> m_objects;
+    QVector<WLDBatchPart> m_parts;
+};
+
+/*!
+  \brief Describes an instance of a character model. The actor's location,
+  orientation, animation and skin are kept in the game's ActorStore.
   */
 class GAME_DLL WLDCharActor : public WLDActor
 {
@@ -138,6 +188,8 @@ public:
     const static ActorType Kind = Character;
     
     Game * game() const;
+    uint32_t handle() const;
+    const vec3 & location() const;
     Zone * zone() const;
     
     WLDModel * model() const;
@@ -178,18 +230,12 @@ public:
     bool hasCamera() const;
     void setHasCamera(bool camera);
     
-    MaterialMap * materialMap() const;
-    
     WLDAnimation * animation() const;
     void setAnimation(WLDAnimation *newAnim);
 
     double animTime() const;
     void setAnimTime(double newTime);
 
-    // XXX use integer
-    QString paletteName() const;
-    void setPaletteName(QString palName);
-
     enum EquipSlot
     {
         Head,
@@ -201,8 +247,10 @@ public:
 
     bool addEquip(EquipSlot slot, WLDMesh *actor, MaterialArray *materials);
     WLDAnimation * findAnimation(QString animName);
+    uint32_t skinID() const;
     void setSkin(uint32_t skinID);
     void draw(RenderContext *renderCtx, RenderProgram *prog);
+    void queue(RenderContext *renderCtx, CommandQueue &queue, uint64_t key);
     
     void enteredZone(Zone *newZone, const vec3 &initialPos);
     void leftZone(Zone *oldZone);
@@ -212,12 +260,19 @@ public:
     
     void interpolateState(double alpha);
     void updatePosition(double dt);
+    void updateBounds();
     void calculateViewFrustum(Frustum &frustum) const;
 
 private:
     static QString slotName(EquipSlot slot);
+    uint32_t animate(BonePalette *bones, uint32_t &boneCount) const;
+    void applyTransform(RenderContext *renderCtx) const;
+    void drawEquip(RenderContext *renderCtx, RenderProgram *prog,
+                   const BonePalette *bones, uint32_t boneBase, uint32_t boneCount);
+    void queueEquip(RenderContext *renderCtx, CommandQueue &queue, uint64_t key,
+                    const BonePalette *bones, uint32_t boneBase, uint32_t boneCount);
 
-    vec3 m_rotation, m_scale;
+    vec3 m_scale;
     bool m_hasCamera;
     float m_lookOrientX;
     float m_lookOrientZ;
@@ -241,17 +296,14 @@ private:
     int m_movementStateY;
     
     Game *m_game;
+    ActorStore *m_store;
+    uint32_t m_handle;
     Zone *m_zone;
     WLDModel *m_model;
-    WLDAnimation *m_animation;
     WLDAnimation *m_idleAnim;
     WLDAnimation *m_walkingAnim;
     WLDAnimation *m_runningAnim;
     WLDAnimation *m_jumpingAnim;
-    double m_startAnimationTime;
-    double m_animTime;
-    QString m_palName;
-    MaterialMap *m_materialMap; // Slot ID -> Material ID in MaterialArray
     QMap<EquipSlot, ActorEquip> m_equip;
     NewtonCollision *m_shape;
     float m_capsuleHeight;
@@ -278,24 +330,60 @@ private:
 
 typedef void (*OctreeCallback)(WLDActor *actor, void *user);
 
+/*!
+  \brief Loose octree of actors which supports adding, moving and removing
+  actors without rebuilding the tree.
+
+  Moved actors are queued and re-inserted in one batch by update(), which
+  is called before each query. An actor stays in its octant as long as it
+  fits the octant's loose bounds, so actors moving around a boundary do not
+  keep switching octants. Octants left empty are not deleted right away but
+  in batches by compact().
+  */
 class GAME_DLL OctreeIndex
 {
 public:
     OctreeIndex(AABox bounds, int maxDepth=5);
     ~OctreeIndex();
     
+    int count() const;
+    bool contains(WLDActor *actor) const;
+    Octree * octant(WLDActor *actor) const;
+    
     Octree * add(WLDActor *actor);
+    void remove(WLDActor *actor);
+    void move(WLDActor *actor);
+    void update();
+    void compact();
+    
     void findVisible(const Frustum &f, OctreeCallback callback, void *user, bool cull);
     void findVisible(const Sphere &s, OctreeCallback callback, void *user, bool cull);
     void findIdealInsertion(AABox bb, int &x, int &y, int &z, int &depth);
     Octree * findBestFittingOctant(int x, int y, int z, int depth);
     
 private:
+    struct Entry
+    {
+        /** Octant holding the actor, or NULL if it is outside of the tree. */
+        Octree *octant;
+        /** Position of the actor in the octant's actor list. */
+        int index;
+        bool moved;
+    };
+    
+    void insert(WLDActor *actor, Entry &entry);
+    void detach(Entry &entry);
     void findVisible(const Frustum &f, Octree *octant, OctreeCallback callback, void *user, bool cull);
     void findVisible(const Sphere &f, Octree *octant, OctreeCallback callback, void *user, bool cull);
     
     Octree *m_root;
     int m_maxDepth;
+    QHash<WLDActor *, Entry> m_entries;
+    QVector<WLDActor *> m_moved;
+    /** Actors that do not fit in the root's loose bounds. */
+    QVector<WLDActor *> m_outside;
+    /** Number of actors removed from octants since the last compaction. */
+    int m_removed;
 };
 
 class GAME_DLL Octree
@@ -309,6 +397,7 @@ public:
     QVector<WLDActor *> & actors();
     Octree *child(int index) const;
     Octree *createChild(int index);
+    bool prune();
     
 private:
     AABox m_bounds;
@@ -317,4 +406,74 @@ private:
     QVector<WLDActor *> m_actors;
 };
 
+/*!
+  \brief Node of a LinearOctree. The node's actors and the actors of its
+  subtree are stored in the range [firstActor, subtreeEnd).
+  */
+struct GAME_DLL LinearOctreeNode
+{
+    /** Tight bounds of all the actors in the subtree. */
+    AABox bounds;
+    uint32_t firstActor;
+    uint32_t actorCount;
+    uint32_t subtreeEnd;
+    /** Index of the next node after this node's subtree. */
+    uint32_t skip;
+};
+
+/*!
+  \brief Loose octree built in one pass from a list of actors. Actors are
+  sorted by the Morton code of their octant so that the actors of a subtree
+  are contiguous, and nodes are stored contiguously in depth-first order.
+  Actor bounds are kept in separate arrays (one per component) so that
+  they can be culled several at a time.
+  */
+class GAME_DLL LinearOctree
+{
+public:
+    LinearOctree(int maxDepth=8);
+    
+    const AABox & bounds() const;
+    uint32_t actorCount() const;
+    uint32_t nodeCount() const;
+    WLDActor * actor(uint32_t index) const;
+    AABox actorBounds(uint32_t index) const;
+    const LinearOctreeNode * nodes() const;
+    
+    void build(const QVector<WLDActor *> &actors);
+    void clear();
+    
+    /** Write the indices of the visible actors to the array, which must hold
+      * at least actorCount() elements. Return the number of visible actors. */
+    uint32_t findVisible(const Frustum &f, uint32_t *visible, bool cull) const;
+    uint32_t findVisible(const Sphere &s, uint32_t *visible, bool cull) const;
+    /** Only visit the nodes in [firstNode, lastNode), which must be made of
+      * whole subtrees except for ancestors of these subtrees. */
+    uint32_t findVisible(const Frustum &f, uint32_t firstNode, uint32_t lastNode,
+                         uint32_t *visible, bool cull) const;
+    void findSubtrees(QVector<uint32_t> &ranges) const;
+    
+    static uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z);
+    
+private:
+    struct Entry
+    {
+        uint32_t code;
+        uint32_t depth;
+        WLDActor *actor;
+        bool operator<(const Entry &e) const;
+    };
+    
+    template<typename T>
+    uint32_t findVisibleIn(const T &volume, uint32_t firstNode, uint32_t lastNode,
+                           uint32_t *visible, bool cull) const;
+    void buildNode(const QVector<Entry> &entries, uint32_t depth, uint32_t begin, uint32_t end);
+    
+    AABox m_bounds;
+    int m_maxDepth;
+    QVector<LinearOctreeNode> m_nodes;
+    QVector<WLDActor *> m_actors;
+    AABoxArray m_actorBounds;
+};
+
 #endif
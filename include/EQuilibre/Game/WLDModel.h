@@ -19,6 +19,7 @@
 
 #include <QList>
 #include <QMap>
+#include <QVector>
 #include "EQuilibre/Render/Platform.h"
 #include "EQuilibre/Render/Vertex.h"
 #include "EQuilibre/Render/Geometry.h"
@@ -34,12 +35,14 @@ class MaterialMap;
 class PFSArchive;
 class RenderContext;
 class RenderProgram;
+class CommandQueue;
 class MeshData;
 class MeshBuffer;
 class WLDMesh;
 class WLDModelSkin;
 class WLDSkeleton;
 class BoneTransform;
+class BonePalette;
 class WLDAnimation;
 class WLDMaterialPalette;
 
@@ -64,6 +67,7 @@ public:
     void setSkeleton(WLDSkeleton *skeleton);
 
     WLDModelSkin *skin() const;
+    WLDModelSkin *skin(uint32_t skinID) const;
     const QMap<QString, WLDModelSkin *> & skins() const;
 
     WLDModelSkin * newSkin(QString name);
@@ -74,6 +78,8 @@ private:
     WLDSkeleton *m_skel;
     WLDModelSkin *m_skin;
     QMap<QString, WLDModelSkin *> m_skins;
+    /** Skins indexed by their numeric ID, for drawing. */
+    QVector<WLDModelSkin *> m_skinsByID;
     WLDMesh *m_mainMesh;
     QList<WLDMesh *> m_meshes;
 };
@@ -89,13 +95,28 @@ public:
 
     MeshData * data() const;
     void setData(MeshData *data);
+    MeshBuffer * buffer() const;
+    uint32_t baseVertex() const;
+    uint32_t indexOffset() const;
     MeshDefFragment *def() const;
     WLDMaterialPalette * palette() const;
     uint32_t partID() const;
     const AABox & boundsAA() const;
+    const QVector<uint32_t> & vertexOrder() const;
+    
+    static const uint32_t MaxLODs;
+    static const float LODThreshold;
+    
+    uint32_t lodCount() const;
+    MeshData * lod(uint32_t level) const;
+    float lodError(uint32_t level) const;
+    uint32_t selectLOD(float lodScale) const;
+    static float lodScale(const AABox &bounds, const matrix4 &modelView,
+                          const matrix4 &projection);
 
     WLDMaterialPalette * importPalette(PFSArchive *archive);
     MeshData * importFrom(MeshBuffer *meshBuf, uint32_t paletteOffset = 0);
+    void importLODs(MeshBuffer *meshBuf);
     static MeshBuffer *combine(const QVector<WLDMesh *> &meshes);
 
 private:
@@ -109,6 +130,11 @@ private:
     MeshDefFragment *m_meshDef;
     WLDMaterialPalette *m_palette;
     AABox m_boundsAA;
+    /** Original index of each imported vertex, relative to the mesh. */
+    QVector<uint32_t> m_vertexOrder;
+    /** Simplified versions of the mesh, which share its vertices. */
+    QVector<MeshData *> m_lods;
+    QVector<float> m_lodErrors;
 };
 
 /*!
@@ -122,6 +148,11 @@ public:
     virtual ~WLDModelSkin();
 
     QString name() const;
+    uint32_t skinID() const;
+    
+    /** Slot ID -> Material ID in the model's MaterialArray. */
+    MaterialMap * materialMap() const;
+    void updateMaterialMap();
     
     const AABox & boundsAA() const;
     
@@ -133,16 +164,24 @@ public:
     static bool explodeMeshName(QString defName, QString &actorName,
                                 QString &meshName, QString &skinName);
 
-    void draw(RenderProgram *prog, const QVector<BoneTransform> &bones,
-              MaterialMap *materialMap);
+    void draw(RenderProgram *prog, const BonePalette *bones, uint32_t boneBase,
+              uint32_t boneCount, MaterialMap *materialMap);
+    void queue(CommandQueue &queue, uint64_t key, uint32_t transform,
+               const BonePalette *bones, uint32_t boneBase, uint32_t boneCount,
+               MaterialMap *materialMap, float lodScale);
 
 private:
     void updateBounds();
+    MaterialArray * beginDraw(RenderProgram *prog, MaterialMap *materialMap);
     
     QString m_name;
+    uint32_t m_skinID;
     WLDModel *m_model;
+    MaterialMap *m_materialMap;
     QList<WLDMesh *> m_parts;
     AABox m_boundsAA;
+    /** Material groups of the parts, as drawn by the last call to beginDraw. */
+    QVector<MaterialGroup> m_drawGroups;
 };
 
 #endif
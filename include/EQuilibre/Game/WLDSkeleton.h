@@ -19,6 +19,7 @@
 
 #include <QObject>
 #include <QMap>
+#include <QHash>
 #include <QVector>
 #include "EQuilibre/Render/Platform.h"
 #include "EQuilibre/Render/Geometry.h"
@@ -29,6 +30,7 @@ class TrackDefFragment;
 class TrackFragment;
 class MeshFragment;
 class WLDAnimation;
+class quat;
 
 class SkeletonNode
 {
@@ -47,49 +49,94 @@ class GAME_DLL WLDSkeleton : public QObject
 {
 public:
     WLDSkeleton(HierSpriteDefFragment *def, QObject *parent = 0);
+    virtual ~WLDSkeleton();
 
     WLDAnimation *pose() const;
     const QMap<QString, WLDAnimation *> & animations() const;
     const QVector<SkeletonNode> &tree() const;
+    const QVector<QString> & boneNames() const;
+    
+    int boneIndex(QString boneName) const;
+    int findBone(QString name) const;
+    const QVector<int> & boneMapFrom(WLDSkeleton *skel);
 
-    void addTrack(QString animName, TrackDefFragment *track);
+    void addTrack(QString animName, TrackFragment *track);
     void copyAnimationsFrom(WLDSkeleton *skel);
     WLDAnimation * copyFrom(WLDSkeleton *skel, QString animName);
 
 private:
+    bool hasSameLayout(WLDSkeleton *skel);
+    
     HierSpriteDefFragment *m_def;
     QMap<QString, WLDAnimation *> m_animations;
     WLDAnimation *m_pose;
+    /** Name of each bone, without the actor name. */
+    QVector<QString> m_boneNames;
+    QHash<QString, int> m_boneIndices;
+    /** For each other skeleton, index of their bone matching each of our bones. */
+    QMap<WLDSkeleton *, QVector<int> > m_boneMaps;
 };
 
 /*!
-  \brief Describes one way of animating a model's skeleton.
+  \brief Describes one way of animating a model's skeleton. Animations can be
+  shared by skeletons with the same layout and are reference-counted.
   */
-class GAME_DLL WLDAnimation : public QObject
+class GAME_DLL WLDAnimation
 {
 public:
-    WLDAnimation(QString name, QVector<TrackDefFragment *> tracks, WLDSkeleton *skel,
-                 QObject *parent = 0);
+    WLDAnimation(QString name, QVector<TrackDefFragment *> tracks, WLDSkeleton *skel);
 
     QString name() const;
     const QVector<TrackDefFragment *> & tracks() const;
     WLDSkeleton * skeleton() const;
 
-    int findTrack(QString name) const;
-    void replaceTrack(TrackDefFragment *track);
-    WLDAnimation * copy(QString newName, QObject *parent = 0) const;
-    QVector<BoneTransform> transformationsAtTime(double t) const;
-    QVector<BoneTransform> transformationsAtFrame(double f) const;
+    void ref();
+    bool deref();
+
+    void setTrack(int boneID, TrackDefFragment *track);
+    WLDAnimation * copy(QString newName) const;
+    uint32_t boneCount() const;
+    double duration() const;
+    void transformationsAtTime(double t, vec4 *dualQuats) const;
+    void transformationsAtFrame(double f, vec4 *dualQuats) const;
 
 private:
-    void transformPiece(QVector<BoneTransform> &transforms, const QVector<SkeletonNode> &tree,
-        uint32_t pieceID, double f, BoneTransform parentTrans) const;
-    BoneTransform interpolate(TrackDefFragment *track, double f) const;
+    void transformPiece(vec4 *dualQuats, uint32_t pieceID, double f,
+                        const quat &parentRot, const vec3 &parentLoc) const;
+    void interpolate(TrackDefFragment *track, double f, quat &rot, vec3 &loc) const;
 
     QString m_name;
     QVector<TrackDefFragment *> m_tracks;
+    QVector<SkeletonNode> m_tree;
     WLDSkeleton *m_skel;
     uint32_t m_frameCount;
+    int m_refCount;
+};
+
+/*!
+  \brief Keeps one copy of each distinct animation track, so that identical
+  tracks used by different models (or bones) share the same frames.
+  */
+class GAME_DLL TrackRegistry
+{
+public:
+    TrackRegistry();
+    
+    uint32_t count() const;
+    uint32_t duplicates() const;
+    
+    TrackDefFragment * intern(TrackDefFragment *track);
+    void clear();
+    
+    static uint32_t hashFrames(const QVector<BoneTransform> &frames);
+
+private:
+    static bool sameFrames(const TrackDefFragment *a, const TrackDefFragment *b);
+    
+    QMultiHash<uint32_t, TrackDefFragment *> m_tracks;
+    /** Duplicate track -> registered track with the same frames. */
+    QHash<TrackDefFragment *, TrackDefFragment *> m_canonical;
+    uint32_t m_duplicates;
 };
 
 #endif
@@ -19,12 +19,15 @@
 
 #include <vector>
 #include <QList>
+#include <QHash>
 #include <QMap>
+#include <QPair>
 #include "Newton.h"
 #include "EQuilibre/Render/Platform.h"
 #include "EQuilibre/Render/Vertex.h"
 #include "EQuilibre/Render/Geometry.h"
 #include "EQuilibre/Render/RenderContext.h"
+#include "EQuilibre/Render/CommandQueue.h"
 
 class Game;
 class PFSArchive;
@@ -33,11 +36,12 @@ class WLDModel;
 class WLDMesh;
 class WLDActor;
 class WLDStaticActor;
+class WLDBatchActor;
 class WLDCharActor;
 class WLDLightActor;
 class ActorIndex;
 class ActorIndexNode;
-class OctreeIndex;
+class LinearOctree;
 class WLDSkeleton;
 class WLDMaterialPalette;
 class MaterialArray;
@@ -46,10 +50,14 @@ struct ActorState;
 class ActorDefFragment;
 class RegionTreeFragment;
 class RegionFragment;
+class MeshDefFragment;
 struct RegionTreeNode;
 class SoundTrigger;
 class RenderContext;
 class FrameStat;
+class OcclusionBuffer;
+class CullJob;
+class QThreadPool;
 class MeshBuffer;
 class ZoneTerrain;
 class ZoneObjects;
@@ -75,6 +83,19 @@ public:
     int flags;
 };
 
+/*!
+  \brief Parts of a zone that record draw packets. The source is used as the
+  program of the packets' sort keys so that within a pass, the terrain is
+  drawn before objects and characters.
+  */
+enum ZoneRenderSource
+{
+    SkySource = 0,
+    TerrainSource = 1,
+    ObjectSource = 2,
+    CharacterSource = 3
+};
+
 /*!
   \brief Describes a zone of the world.
   */
@@ -88,7 +109,8 @@ public:
     ZoneObjects * objects() const;
     const QVector<WLDLightActor *> & lights() const;
     QList<CharacterPack *> characterPacks() const;
-    OctreeIndex * actorIndex() const;
+    LinearOctree * actorIndex() const;
+    const QVector<WLDCharActor *> & visibleCharacters() const;
     NewtonWorld * collisionWorld();
     const ZoneInfo & info() const;
     void setInfo(const ZoneInfo &info);
@@ -105,6 +127,7 @@ public:
     void draw(RenderContext *renderCtx, RenderProgram *prog);
     void update(RenderContext *renderCtx, double currentTime,
                 double sinceLastUpdate);
+    void cull(const Frustum &frustum);
     
     void acceptPlayer(WLDCharActor *player, const vec3 &initialPos);
     void playerJumped();
@@ -116,9 +139,10 @@ public:
 
 private:
     bool importLightSources(PFSArchive *archive);
-    static void frustumCullingCallback(WLDActor *actor, void *user);
     void updateMovement(double sinceLastUpdate);
     void handlePlayerCollisions(ActorState &state);
+    void cullOccluded(RenderContext *renderCtx, const Frustum &frustum);
+    void createCullJobs(int threadCount);
 
     Game *m_game;
     WLDCharActor *m_player;
@@ -128,11 +152,32 @@ private:
     QList<CharacterPack *> m_charPacks;
     PFSArchive *m_mainArchive;
     WLDData *m_mainWld;
-    OctreeIndex *m_actorTree;
+    LinearOctree *m_actorTree;
+    QVector<uint32_t> m_visibleActors;
+    /** Region each actor of m_actorTree is in, or zero if several. */
+    QVector<uint32_t> m_actorRegions;
+    QVector<WLDCharActor *> m_visibleCharacters;
     QVector<WLDLightActor *> m_lights;
     QVector<SoundTrigger *> m_soundTriggers;
     Frustum m_frustum;
     Frustum m_frozenFrustum;
+    OcclusionBuffer *m_occlusion;
+    FrameStat *m_occlusionStat;
+    FrameStat *m_occludedStat;
+    /** Culling work of a frame, split into jobs that are merged in order. */
+    QVector<CullJob *> m_cullJobs;
+    QThreadPool *m_cullPool;
+    int m_cullThreadCount;
+    FrameStat *m_cullStat;
+    FrameStat *m_cullThreadsStat;
+    /** Draw packets recorded during the frame. */
+    CommandQueue m_commands;
+    FrameStat *m_queueStat;
+    FrameStat *m_drawStat;
+    FrameStat *m_drawStatGPU;
+    FrameStat *m_packetsStat;
+    FrameStat *m_batchesStat;
+    FrameStat *m_trianglesStat;
     
     // Duration between the newest movement tick and the current frame.
     double m_movementAheadTime;
@@ -141,6 +186,140 @@ private:
     NewtonWorld *m_collisionWorld;
 };
 
+/*!
+  \brief Inner node of a RegionTree. A child reference is either the index of
+  another node or, if RegionTree::LeafBit is set, a region ID.
+  */
+struct GAME_DLL RegionTreeFlatNode
+{
+    /** Splitting plane: normal and distance. */
+    float plane[4];
+    /** Child on the front (distance >= 0) and back side of the plane. */
+    uint32_t children[2];
+    uint32_t padding[2];
+};
+
+/*!
+  \brief BSP tree of zone regions, repacked from the RegionTreeFragment into
+  a flat array of nodes in depth-first order so that it can be descended
+  without recursion.
+  */
+class GAME_DLL RegionTree
+{
+public:
+    RegionTree();
+    
+    static const uint32_t LeafBit;
+    
+    uint32_t nodeCount() const;
+    const RegionTreeFlatNode * nodes() const;
+    
+    void build(const QVector<RegionTreeNode> &nodes);
+    void clear();
+    
+    uint32_t findRegion(const vec3 &pos) const;
+    void findRegions(const vec3 *points, uint32_t count, uint32_t *regions,
+                     QVector<uint32_t> &scratch) const;
+    uint32_t findRegions(const Sphere &s, uint32_t *regions, uint32_t maxRegions) const;
+    uint32_t findContainingRegion(const Sphere &s) const;
+    
+private:
+    QVector<RegionTreeFlatNode> m_nodes;
+    /** Reference to the root node, or a leaf if there is only one region. */
+    uint32_t m_root;
+};
+
+/*!
+  \brief Potentially visible set of each zone region, built from the regions'
+  nearby lists. Each region has a bitset in which bit N is set if region N
+  can be seen from it.
+  */
+class GAME_DLL RegionPVS
+{
+public:
+    RegionPVS();
+    
+    uint32_t regionCount() const;
+    uint32_t wordCount() const;
+    const uint32_t * bits(uint32_t regionID) const;
+    bool isVisible(uint32_t fromRegion, uint32_t toRegion) const;
+    
+    void build(WLDData *wld);
+    void clear();
+    
+private:
+    uint32_t m_regionCount;
+    /** Number of 32-bit words in each region's bitset. */
+    uint32_t m_wordCount;
+    QVector<uint32_t> m_bits;
+};
+
+/*!
+  \brief Group of neighbouring zone regions that are culled and drawn as one
+  unit. The chunk's region IDs are stored in TerrainChunks::regions().
+  */
+struct GAME_DLL TerrainChunk
+{
+    /** Bounds of the chunk's regions. */
+    AABox bounds;
+    uint32_t firstRegion;
+    uint32_t regionCount;
+    uint32_t triangleCount;
+};
+
+/*!
+  \brief Clusters the regions of a zone into chunks, so that the terrain can be
+  culled and drawn at a coarser granularity than the (often tiny) regions.
+
+  The region tree is walked depth-first, front side first. Subtrees that are
+  small enough become one unit and consecutive units are packed into the
+  current chunk until it would exceed the target triangle count or maximum
+  size. Regions without triangles are not part of any chunk.
+  */
+class GAME_DLL TerrainChunks
+{
+public:
+    TerrainChunks();
+    
+    static const uint32_t NoChunk;
+    static const uint32_t DefaultTargetTriangles;
+    static const float DefaultMaxSize;
+    
+    uint32_t count() const;
+    const TerrainChunk & chunk(uint32_t chunkID) const;
+    const uint32_t * regions() const;
+    uint32_t chunkOf(uint32_t regionID) const;
+    uint32_t wordCount() const;
+    const uint32_t * loadedBits() const;
+    const uint32_t * pvsBits(uint32_t regionID) const;
+    
+    void build(const RegionTree &tree, const AABoxArray &regionBounds,
+               const uint32_t *triangleCounts, uint32_t regionCount,
+               uint32_t targetTriangles, float maxSize);
+    void buildPVS(const uint32_t *regionBits, uint32_t regionWordCount);
+    void clear();
+    
+private:
+    void addRegions(const uint32_t *regionIDs, uint32_t count,
+                    uint32_t triangles, const AABox &bounds);
+    
+    QVector<TerrainChunk> m_chunks;
+    /** Region IDs of all chunks, chunk by chunk. */
+    QVector<uint32_t> m_regions;
+    /** Chunk of each region, indexed by region ID. */
+    QVector<uint32_t> m_regionChunks;
+    uint32_t m_regionCount;
+    /** Number of 32-bit words in a chunk bitset. */
+    uint32_t m_wordCount;
+    uint32_t m_targetTriangles;
+    float m_maxSize;
+    /** Bitset of all chunks. */
+    QVector<uint32_t> m_loadedBits;
+    /** Chunks that contain a region visible from each region, indexed by
+      * region ID. */
+    QVector<uint32_t> m_pvsBits;
+};
+
 /*!
   \brief Holds the resources needed to render a zone's terrain.
   */
@@ -153,15 +332,28 @@ public:
     const AABox & bounds() const;
     uint32_t currentRegion() const;
     NewtonCollision * currentRegionShape() const;
+    const RegionTree & regionTree() const;
+    const RegionPVS & pvs() const;
+    const TerrainChunks & chunks() const;
+    MeshBuffer * buffer() const;
+    uint32_t regionCount() const;
+    WLDStaticActor * regionActor(uint32_t regionID) const;
+    uint32_t chunkWordCount() const;
+    uint32_t visibleChunkCount() const;
+    const QVector<uint32_t> & visibleChunks() const;
+    bool isRegionVisible(uint32_t regionID) const;
 
     bool load(PFSArchive *archive, WLDData *wld);
     void update(double currentTime);
-    void draw(RenderContext *renderCtx, RenderProgram *prog);
+    void queue(RenderContext *renderCtx, CommandQueue &queue);
     void clear(RenderContext *renderCtx);
     void resetVisible();
-    void showAllRegions(const Frustum &frustum);
-    void showNearbyRegions(const Frustum &frustum);
-    void showCurrentRegion(const Frustum &frustum);
+    void showAllChunks(const Frustum &frustum);
+    void showNearbyChunks(const Frustum &frustum);
+    void showCurrentChunk(const Frustum &frustum);
+    void cullChunks(const Frustum &frustum, bool usePVS, uint32_t firstWord,
+                    uint32_t lastWord);
+    void showCulledChunks();
     uint32_t findRegionShapes(Sphere sphere, NewtonCollision **regions,
                               uint32_t maxRegions);
     uint32_t findNearbyRegionShapes(NewtonCollision **firstRegion,
@@ -169,29 +361,55 @@ public:
     uint32_t findAllRegionShapes(NewtonCollision **firstRegion,
                                  uint32_t maxRegions);
     uint32_t findCurrentRegion(const vec3 &cameraPos);
+    uint32_t findRegion(const vec3 &pos) const;
+    uint32_t findContainingRegion(const Sphere &s) const;
     NewtonCollision * loadRegionShape(uint32_t regionID);
+    uint32_t addOccluders(OcclusionBuffer &buffer, const vec3 &eye,
+                          uint32_t maxTriangles);
 
 private:
-    uint32_t findRegion(const vec3 &pos, const RegionTreeNode *nodes, uint32_t nodeIdx);
-    void findRegionShapes(const Sphere &sphere, const RegionTreeNode *nodes,
-                          uint32_t nodeIdx, NewtonCollision **regions,
-                          uint32_t maxRegions, uint32_t &found);
     void upload(RenderContext *renderCtx);
+    void importOccluders(MeshDefFragment *meshDef, uint32_t regionID);
+    void createChunkGroups();
 
     WLDData *m_zoneWld;
     uint32_t m_regionCount;
     uint32_t m_currentRegion;
     Zone *m_zone;
     std::vector<WLDStaticActor *> m_regionActors;
-    std::vector<WLDStaticActor *> m_visibleRegions;
-    RegionTreeFragment *m_regionTree;
+    /** Bounds of each region, indexed by region ID. */
+    AABoxArray m_regionBounds;
+    RegionPVS m_pvs;
+    TerrainChunks m_chunks;
+    /** Bounds of each chunk, indexed by chunk ID. */
+    AABoxArray m_chunkBounds;
+    /** Chunks both in the PVS of the current region (if used) and in the
+      * frustum. */
+    std::vector<uint32_t> m_visibleBits;
+    QVector<uint32_t> m_visibleChunks;
+    RegionTree m_regionTree;
     MeshBuffer *m_zoneBuffer;
+    /** Material groups of all chunks, chunk by chunk. The groups of a chunk's
+      * regions are merged where their indices are contiguous. */
+    QVector<MaterialGroup> m_chunkGroups;
+    /** First group of each chunk in m_chunkGroups, plus the total count. */
+    QVector<uint32_t> m_chunkFirstGroups;
+    /** Material groups of the visible chunks, gathered when queueing. */
+    QVector<MaterialGroup> m_visibleGroups;
     WLDMaterialPalette *m_palette;
     bool m_uploaded;
+    /** Whether some of the terrain's materials need blending. */
+    bool m_hasTransparent;
     AABox m_zoneBounds;
     std::vector<NewtonCollision *> m_regionShapes;
-    FrameStat *m_zoneStat;
-    FrameStat *m_zoneStatGPU;
+    /** Large solid triangles of the regions, used as occluders. */
+    QVector<vec3> m_occluderVertices;
+    /** First occluder triangle of each region, indexed by region ID. */
+    QVector<uint32_t> m_occluderOffsets;
+    /** Number of occluder triangles of each region, indexed by region ID. */
+    QVector<uint32_t> m_occluderCounts;
+    /** Regions of the visible chunks sorted by distance to the camera. */
+    QVector<QPair<float, uint32_t> > m_occluderRegions;
 };
 
 /*!
@@ -206,11 +424,14 @@ public:
     const AABox & bounds() const;
     const QMap<QString, WLDMesh *> & models() const;
     QVector<WLDStaticActor *> & visibleObjects();
+    const QVector<WLDBatchActor *> & batches() const;
+    QVector<WLDBatchActor *> & visibleBatches();
 
     bool load(QString path, QString name, PFSArchive *mainArchive);
-    void addTo(OctreeIndex *tree);
+    void createBatches(float cellSize);
+    void addTo(QVector<WLDActor *> &actors);
     void update(double currentTime);
-    void draw(RenderContext *renderCtx, RenderProgram *prog);
+    void queue(RenderContext *renderCtx, CommandQueue &queue, const Frustum &frustum);
     void clear(RenderContext *renderCtx);
     void resetVisible();
 
@@ -224,10 +445,21 @@ private:
     ObjectPack *m_pack;
     WLDData *m_objDefWld;
     QVector<WLDStaticActor *> m_objects;
+    /** Objects that are not part of any batch. */
+    QVector<WLDStaticActor *> m_singleObjects;
+    QVector<WLDBatchActor *> m_batches;
     QVector<WLDStaticActor *> m_visibleObjects;
-    FrameStat *m_objectsStat;
-    FrameStat *m_objectsStatGPU;
+    QVector<WLDBatchActor *> m_visibleBatches;
+    MeshBuffer *m_batchBuf;
+    /** Lighting colors of the objects that are not part of any batch. */
+    MeshBuffer *m_colorBuf;
+    /** ID of each mesh, used to group objects in the render queue. */
+    QHash<WLDMesh *, uint32_t> m_meshIDs;
+    /** Passes each mesh is drawn in, as a bitset, indexed by mesh ID. */
+    QVector<uint32_t> m_meshPasses;
     FrameStat *m_drawnObjectsStat;
+    FrameStat *m_reducedObjectsStat;
+    FrameStat *m_drawnBatchesStat;
 };
 
 class GAME_DLL SkyDef
@@ -250,7 +482,7 @@ public:
     void clear(RenderContext *renderCtx);
     bool upload(RenderContext *renderCtx);
     bool load(QString path);
-    void draw(RenderContext *renderCtx, RenderProgram *prog, Zone *zone);
+    void queue(RenderContext *renderCtx, CommandQueue &queue, Zone *zone);
     
 private:
     PFSArchive *m_skyArchive;
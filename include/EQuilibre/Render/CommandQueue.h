@@ -0,0 +1,201 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_RENDER_COMMAND_QUEUE_H
+#define EQUILIBRE_RENDER_COMMAND_QUEUE_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+#include "EQuilibre/Render/LinearMath.h"
+#include "EQuilibre/Render/Vertex.h"
+#include "EQuilibre/Render/FrameArena.h"
+#include "EQuilibre/Render/RenderQueue.h"
+
+class BonePalette;
+class MaterialArray;
+class MaterialMap;
+class RenderContext;
+class RenderProgram;
+
+/*!
+  \brief Everything needed to draw one instance of a mesh: its geometry, the
+  range of material groups to draw, its model-view transformation and the
+  render state to use.
+  */
+struct RENDER_DLL DrawPacket
+{
+    DrawPacket();
+    
+    enum StateFlags
+    {
+        DefaultState = 0,
+        /** Do not write to the depth buffer. */
+        NoDepthWrite = 1,
+        /** Use the per-instance colors in the color segment. */
+        InstanceColors = 2
+    };
+    
+    MeshBuffer *meshBuf;
+    MaterialArray *materials;
+    MaterialMap *materialMap;
+    const BonePalette *bones;
+    uint32_t boneBase;
+    uint32_t boneCount;
+    /** Range of material groups in the command queue. */
+    uint32_t firstGroup;
+    uint32_t groupCount;
+    /** Index of the model-view matrix in the command queue. */
+    uint32_t transform;
+    /** Buffer that holds the per-instance colors, and the instance's part of it. */
+    buffer_t colorBuffer;
+    BufferSegment colors;
+    uint32_t state;
+};
+
+/*!
+  \brief Receives the draw calls issued when executing a command queue.
+  */
+class RENDER_DLL RenderBackend
+{
+public:
+    virtual ~RenderBackend();
+    virtual void setState(uint32_t state) = 0;
+    virtual void setMaterialMap(MaterialArray *materials, MaterialMap *materialMap) = 0;
+    virtual void beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                               uint32_t groupCount, MaterialArray *materials,
+                               const BonePalette *bones, uint32_t boneBase,
+                               uint32_t boneCount) = 0;
+    virtual void drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                               const BufferSegment *colorSegments,
+                               uint32_t instances) = 0;
+    virtual void drawSkinnedMeshBatch(const matrix4 *mvMatrices,
+                                      const uint32_t *boneBases,
+                                      uint32_t instances) = 0;
+    virtual void endDrawMesh() = 0;
+};
+
+/*!
+  \brief Issues the draw calls of a command queue through a render program.
+  */
+class RENDER_DLL ProgramBackend : public RenderBackend
+{
+public:
+    ProgramBackend(RenderContext *renderCtx, RenderProgram *prog);
+    virtual void setState(uint32_t state);
+    virtual void setMaterialMap(MaterialArray *materials, MaterialMap *materialMap);
+    virtual void beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                               uint32_t groupCount, MaterialArray *materials,
+                               const BonePalette *bones, uint32_t boneBase,
+                               uint32_t boneCount);
+    virtual void drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                               const BufferSegment *colorSegments,
+                               uint32_t instances);
+    virtual void drawSkinnedMeshBatch(const matrix4 *mvMatrices,
+                                      const uint32_t *boneBases,
+                                      uint32_t instances);
+    virtual void endDrawMesh();
+
+private:
+    RenderContext *m_renderCtx;
+    RenderProgram *m_prog;
+};
+
+/*!
+  \brief Counts the draw calls of a command queue without drawing anything,
+  so that batching can be measured without a GPU.
+  */
+class RENDER_DLL NullBackend : public RenderBackend
+{
+public:
+    NullBackend();
+    virtual void setState(uint32_t state);
+    virtual void setMaterialMap(MaterialArray *materials, MaterialMap *materialMap);
+    virtual void beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                               uint32_t groupCount, MaterialArray *materials,
+                               const BonePalette *bones, uint32_t boneBase,
+                               uint32_t boneCount);
+    virtual void drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                               const BufferSegment *colorSegments,
+                               uint32_t instances);
+    virtual void drawSkinnedMeshBatch(const matrix4 *mvMatrices,
+                                      const uint32_t *boneBases,
+                                      uint32_t instances);
+    virtual void endDrawMesh();
+    void reset();
+    
+    /** Number of beginDrawMesh calls. */
+    uint32_t meshes;
+    /** Number of drawMeshBatch and drawSkinnedMeshBatch calls. */
+    uint32_t batches;
+    uint32_t instances;
+    /** Number of material groups drawn, one draw call each. */
+    uint32_t groups;
+    /** Number of draw calls when each batch is drawn with instancing. */
+    uint32_t drawCalls;
+    uint32_t stateChanges;
+    uint32_t materialMapChanges;
+    /** Translation of each instance drawn, in order. */
+    QVector<vec3> drawnOrigins;
+    
+private:
+    uint32_t m_groupCount;
+};
+
+/*!
+  \brief Records draw packets while the scene is traversed, then sorts them by
+  key and merges consecutive packets that only differ by their transformation
+  (and bones or colors) into instanced batches.
+  */
+class RENDER_DLL CommandQueue
+{
+public:
+    CommandQueue();
+    
+    uint32_t packetCount() const;
+    const DrawPacket * packets() const;
+    const matrix4 & transform(uint32_t index) const;
+    const MaterialGroup * groups(const DrawPacket &packet) const;
+    uint32_t batchCount() const;
+    uint32_t triangleCount() const;
+    FrameArena & arena();
+    
+    uint32_t addTransform(const matrix4 &mvMatrix);
+    void addGroups(DrawPacket &packet, const MaterialGroup *groups, uint32_t count);
+    void addGroups(DrawPacket &packet, MeshData *mesh);
+    void addGroups(DrawPacket &packet, MeshData *mesh, MaterialArray *materials,
+                   bool opaque);
+    void addSortedGroups(DrawPacket &packet, const MaterialGroup *groups, uint32_t count);
+    void add(uint64_t key, const DrawPacket &packet);
+    void execute(RenderBackend *backend);
+    void clear();
+    
+private:
+    bool canMerge(const DrawPacket &a, const DrawPacket &b) const;
+    
+    RenderQueue m_order;
+    QVector<DrawPacket> m_packets;
+    QVector<MaterialGroup> m_groups;
+    QVector<matrix4> m_transforms;
+    /** Scratch memory for sorting groups by offset. */
+    QVector<RenderItem> m_groupOrder;
+    QVector<RenderItem> m_groupScratch;
+    /** Scratch memory for the per-instance data of batches. */
+    FrameArena m_arena;
+    uint32_t m_batchCount;
+    uint32_t m_triangleCount;
+};
+
+#endif
@@ -0,0 +1,62 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#ifndef EQUILIBRE_RENDER_FRAME_ARENA_H
+#define EQUILIBRE_RENDER_FRAME_ARENA_H
+
+#include "EQuilibre/Render/Platform.h"
+
+/*!
+  \brief Scratch memory that is allocated linearly during a frame and released
+  all at once at the end of it.
+
+  Allocations that don't fit in the arena are served by overflow blocks, which
+  stay valid until the next reset. The arena then grows to what the frame
+  needed, so that steady-state frames do not touch the heap at all.
+  */
+class RENDER_DLL FrameArena
+{
+public:
+    FrameArena(size_t capacity = 0);
+    ~FrameArena();
+    
+    size_t capacity() const;
+    size_t used() const;
+    uint32_t overflows() const;
+    
+    void * allocate(size_t size);
+    template<typename T>
+    T * allocate(uint32_t count)
+    {
+        return (T *)allocate(count * sizeof(T));
+    }
+    void reset();
+
+private:
+    static const size_t Alignment;
+    
+    uint8_t *m_block;
+    uint8_t *m_data;
+    size_t m_capacity;
+    size_t m_used;
+    /** Overflow blocks, each starting with a pointer to the previous one. */
+    uint8_t *m_overflow;
+    size_t m_overflowSize;
+    uint32_t m_overflows;
+};
+
+#endif
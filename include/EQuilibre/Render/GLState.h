@@ -0,0 +1,235 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#ifndef EQUILIBRE_RENDER_GL_STATE_H
+#define EQUILIBRE_RENDER_GL_STATE_H
+
+#include <QHash>
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+
+/*!
+  \brief Receives the GL calls made while drawing a frame. The default device
+  forwards them to the GL driver, other devices can record them instead.
+  */
+class RENDER_DLL GLDevice
+{
+public:
+    virtual ~GLDevice();
+
+    virtual bool hasVertexArrays() const = 0;
+
+    virtual void useProgram(uint32_t program) = 0;
+    virtual void bindBuffer(uint32_t target, buffer_t buffer) = 0;
+    virtual void bufferData(uint32_t target, size_t size, const void *data, uint32_t usage) = 0;
+    virtual void bufferSubData(uint32_t target, size_t offset, size_t size, const void *data) = 0;
+    virtual void getBufferSubData(uint32_t target, size_t offset, size_t size, void *data) = 0;
+    virtual uint32_t createVertexArray() = 0;
+    virtual void deleteVertexArray(uint32_t vertexArray) = 0;
+    virtual void bindVertexArray(uint32_t vertexArray) = 0;
+    virtual void enableVertexAttribArray(uint32_t index) = 0;
+    virtual void disableVertexAttribArray(uint32_t index) = 0;
+    virtual void vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                     bool normalized, int stride, const void *pointer) = 0;
+    virtual void vertexAttribDivisor(uint32_t index, uint32_t divisor) = 0;
+    virtual void activeTexture(uint32_t unit) = 0;
+    virtual void bindTexture(uint32_t target, texture_t texture) = 0;
+    virtual void enable(uint32_t cap) = 0;
+    virtual void disable(uint32_t cap) = 0;
+    virtual void blendFunc(uint32_t src, uint32_t dst) = 0;
+    virtual void depthMask(bool write) = 0;
+    virtual void uniform1i(int location, int32_t value) = 0;
+    virtual void uniform1f(int location, float value) = 0;
+    virtual void uniform2f(int location, float x, float y) = 0;
+    virtual void uniform3fv(int location, int count, const float *values) = 0;
+    virtual void uniform4fv(int location, int count, const float *values) = 0;
+    virtual void uniformMatrix4fv(int location, int count, const float *values) = 0;
+    virtual void drawArrays(uint32_t mode, int first, int count) = 0;
+    virtual void drawArraysInstanced(uint32_t mode, int first, int count, int instances) = 0;
+    virtual void drawElements(uint32_t mode, int count, uint32_t type, const void *indices) = 0;
+    virtual void drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                       const void *indices, int instances) = 0;
+    virtual void multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                   const void * const *indices, int drawCount) = 0;
+};
+
+/*!
+  \brief Device that makes the calls through GLEW.
+  */
+class RENDER_DLL GLDeviceGL2 : public GLDevice
+{
+public:
+    virtual bool hasVertexArrays() const;
+
+    virtual void useProgram(uint32_t program);
+    virtual void bindBuffer(uint32_t target, buffer_t buffer);
+    virtual void bufferData(uint32_t target, size_t size, const void *data, uint32_t usage);
+    virtual void bufferSubData(uint32_t target, size_t offset, size_t size, const void *data);
+    virtual void getBufferSubData(uint32_t target, size_t offset, size_t size, void *data);
+    virtual uint32_t createVertexArray();
+    virtual void deleteVertexArray(uint32_t vertexArray);
+    virtual void bindVertexArray(uint32_t vertexArray);
+    virtual void enableVertexAttribArray(uint32_t index);
+    virtual void disableVertexAttribArray(uint32_t index);
+    virtual void vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                     bool normalized, int stride, const void *pointer);
+    virtual void vertexAttribDivisor(uint32_t index, uint32_t divisor);
+    virtual void activeTexture(uint32_t unit);
+    virtual void bindTexture(uint32_t target, texture_t texture);
+    virtual void enable(uint32_t cap);
+    virtual void disable(uint32_t cap);
+    virtual void blendFunc(uint32_t src, uint32_t dst);
+    virtual void depthMask(bool write);
+    virtual void uniform1i(int location, int32_t value);
+    virtual void uniform1f(int location, float value);
+    virtual void uniform2f(int location, float x, float y);
+    virtual void uniform3fv(int location, int count, const float *values);
+    virtual void uniform4fv(int location, int count, const float *values);
+    virtual void uniformMatrix4fv(int location, int count, const float *values);
+    virtual void drawArrays(uint32_t mode, int first, int count);
+    virtual void drawArraysInstanced(uint32_t mode, int first, int count, int instances);
+    virtual void drawElements(uint32_t mode, int count, uint32_t type, const void *indices);
+    virtual void drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                       const void *indices, int instances);
+    virtual void multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                   const void * const *indices, int drawCount);
+};
+
+/*!
+  \brief Shadow copy of the GL state that is changed while drawing a frame.
+  Calls that would not change the state (binding the current program, buffer,
+  vertex array or texture, setting a uniform to its current value...) are
+  dropped before they reach the device.
+
+  State that is unknown, for example after other code used the context, is
+  always set. Uniform values and the state of the vertex array objects created
+  through this class are kept across frames, since other code can't change them.
+  */
+class RENDER_DLL GLState
+{
+public:
+    GLState(GLDevice *device);
+
+    GLDevice * device() const;
+    bool shadowing() const;
+    void setShadowing(bool enabled);
+    bool hasVertexArrays() const;
+    void setVertexArraysEnabled(bool enabled);
+
+    /** Number of calls made to the device since the counters were reset. */
+    uint32_t calls() const;
+    /** Number of calls that were dropped since the counters were reset. */
+    uint32_t redundantCalls() const;
+    void resetCounters();
+
+    void invalidate();
+    void reset();
+
+    // program and uniforms
+
+    uint32_t program() const;
+    void useProgram(uint32_t program);
+    void programDeleted(uint32_t program);
+    void uniform1i(int location, int32_t value);
+    void uniform1f(int location, float value);
+    void uniform2f(int location, float x, float y);
+    void uniform3fv(int location, int count, const float *values);
+    void uniform4fv(int location, int count, const float *values);
+    void uniformMatrix4fv(int location, int count, const float *values);
+
+    // buffers and vertex arrays
+
+    void bindBuffer(uint32_t target, buffer_t buffer);
+    void bufferData(uint32_t target, size_t size, const void *data, uint32_t usage);
+    void bufferSubData(uint32_t target, size_t offset, size_t size, const void *data);
+    void getBufferSubData(uint32_t target, size_t offset, size_t size, void *data);
+    void buffersDeleted(const buffer_t *buffers, int count);
+    uint32_t createVertexArray();
+    void deleteVertexArray(uint32_t vertexArray);
+    void bindVertexArray(uint32_t vertexArray);
+    void enableVertexAttribArray(uint32_t index);
+    void disableVertexAttribArray(uint32_t index);
+    void vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                             bool normalized, int stride, const void *pointer);
+    void vertexAttribDivisor(uint32_t index, uint32_t divisor);
+
+    // textures and fixed-function state
+
+    void activeTexture(uint32_t unit);
+    bool bindTexture(uint32_t target, texture_t texture);
+    void textureDeleted(texture_t texture);
+    void setBlending(bool enabled);
+    void setDepthWrite(bool write);
+
+    // draw calls
+
+    void drawArrays(uint32_t mode, int first, int count);
+    void drawArraysInstanced(uint32_t mode, int first, int count, int instances);
+    void drawElements(uint32_t mode, int count, uint32_t type, const void *indices);
+    void drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                               const void *indices, int instances);
+    void multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                           const void * const *indices, int drawCount);
+
+private:
+    /** Element buffer and enabled attributes of a vertex array object. */
+    struct VertexArrayState
+    {
+        uint32_t elementBuffer;
+        uint32_t enabledAttribs;
+        uint32_t knownAttribs;
+    };
+
+    struct TextureBinding
+    {
+        uint32_t unit;
+        uint32_t target;
+        texture_t texture;
+    };
+
+    struct UniformValue
+    {
+        uint32_t type;
+        uint32_t size;
+        uint32_t data[16];
+    };
+
+    bool redundant(bool sameState);
+    bool uniformChanged(int location, uint32_t type, const void *data, uint32_t words);
+    void setAttribArray(uint32_t index, bool enabled);
+    void saveVertexArray();
+    void loadVertexArray(uint32_t vertexArray);
+
+    GLDevice *m_device;
+    bool m_shadowing;
+    bool m_vertexArraysEnabled;
+    uint32_t m_calls;
+    uint32_t m_redundantCalls;
+    uint32_t m_program;
+    QVector<UniformValue> *m_programUniforms;
+    QHash<uint32_t, QVector<UniformValue> > m_uniforms;
+    uint32_t m_arrayBuffer;
+    uint32_t m_vertexArray;
+    VertexArrayState m_arrayState;
+    QHash<uint32_t, VertexArrayState> m_vertexArrays;
+    uint32_t m_activeTexture;
+    QVector<TextureBinding> m_textures;
+    int m_blending;
+    int m_depthWrite;
+};
+
+#endif
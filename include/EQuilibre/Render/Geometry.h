@@ -17,6 +17,7 @@
 #ifndef EQUILIBRE_RENDER_GEOMETRY_H
 #define EQUILIBRE_RENDER_GEOMETRY_H
 
+#include <QVector>
 #include "EQuilibre/Render/Platform.h"
 #include "EQuilibre/Render/LinearMath.h"
 
@@ -33,6 +34,7 @@ struct RENDER_DLL Plane
     Plane(vec3 point, vec3 normal);
     const vec3 & p() const;
     const vec3 & n() const;
+    float offset() const;
     float distance(vec3 v) const;
     
 private:
@@ -61,6 +63,32 @@ struct RENDER_DLL AABox
     void scaleCenter(float s);
 };
 
+/*!
+  \brief Array of axis-aligned boxes stored as one array per component, so
+  that several boxes can be tested at once.
+  */
+class RENDER_DLL AABoxArray
+{
+public:
+    uint32_t count() const;
+    AABox at(uint32_t index) const;
+    void set(uint32_t index, const AABox &b);
+    void append(const AABox &b);
+    void resize(uint32_t count);
+    void clear();
+    
+    const float * lowX() const;
+    const float * lowY() const;
+    const float * lowZ() const;
+    const float * highX() const;
+    const float * highY() const;
+    const float * highZ() const;
+
+private:
+    QVector<float> m_lowX, m_lowY, m_lowZ;
+    QVector<float> m_highX, m_highY, m_highZ;
+};
+
 struct RENDER_DLL Sphere
 {
     vec3 pos;
@@ -120,6 +148,20 @@ public:
     TestResult containsPoint(vec3 v) const;
     TestResult containsAABox(const AABox &b) const;
     TestResult containsBox(const vec3 *corners) const;
+    
+    void containsAABoxes4(const AABoxArray &boxes, uint32_t first,
+                          uint32_t &outsideMask, uint32_t &intersectMask) const;
+    void containsAABoxes(const AABoxArray &boxes, uint32_t first,
+                         uint32_t count, uint8_t *results) const;
+    uint32_t findVisible(const AABoxArray &boxes, uint32_t first,
+                         uint32_t count, uint32_t *visible) const;
+    uint32_t findVisibleIndexed(const AABoxArray &boxes, const uint32_t *indices,
+                                uint32_t count, uint32_t *visible) const;
+    void findVisibleBits(const AABoxArray &boxes, const uint32_t *mask,
+                         uint32_t firstWord, uint32_t lastWord,
+                         uint32_t *visibleBits) const;
+    uint32_t findVisible(const vec3 *centers, const float *radii,
+                         uint32_t count, uint32_t *visible) const;
 
 private:
     float m_angle, m_aspect, m_nearPlane, m_farPlane;
@@ -146,6 +146,8 @@ public:
     QVector4D map(const QVector4D &v);
     void toDualQuaternion(vec4 &d0, vec4 &d1) const;
 
+    static BoneTransform fromDualQuaternion(const vec4 &d0, const vec4 &d1);
+    static vec3 mapDualQuaternion(const vec4 &d0, const vec4 &d1, const vec3 &v);
     static BoneTransform interpolate(BoneTransform a, BoneTransform b, double c);
 };
 
@@ -0,0 +1,138 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#ifndef EQUILIBRE_RENDER_MESH_POOL_H
+#define EQUILIBRE_RENDER_MESH_POOL_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+
+class MeshBuffer;
+class MeshData;
+class RenderContext;
+
+/*!
+  \brief Contiguous range of elements in a buffer.
+  */
+struct RENDER_DLL MeshRange
+{
+    uint32_t offset;
+    uint32_t count;
+};
+
+/*!
+  \brief Location of a group of meshes in one of the buffers of a pool.
+  */
+struct RENDER_DLL MeshAllocation
+{
+    MeshAllocation();
+    
+    /** Buffer holding the meshes, or NULL if the allocation is free. */
+    MeshBuffer *buffer;
+    uint32_t baseVertex;
+    uint32_t vertexCount;
+    uint32_t indexOffset;
+    uint32_t indexCount;
+    /** Meshes that were moved to the buffer, which now owns them. */
+    QVector<MeshData *> meshes;
+};
+
+/*!
+  \brief Buffer of a mesh pool and its free ranges, sorted by offset.
+  */
+struct RENDER_DLL MeshPoolPage
+{
+    MeshBuffer *buffer;
+    uint32_t vertexCapacity;
+    uint32_t indexCapacity;
+    uint32_t allocations;
+    QVector<MeshRange> freeVertices;
+    QVector<MeshRange> freeIndices;
+    /** Parts of the buffer that changed since the last upload. */
+    MeshRange dirtyVertices;
+    MeshRange dirtyIndices;
+    bool dirtyRanges;
+    /** Whether the vertices and indices are kept in memory after uploading. */
+    bool keepGeometry;
+    /** Whether all of the buffer's vertices and indices are in memory. */
+    bool inMemory;
+};
+
+/*!
+  \brief Places the vertices and indices of static meshes from many packs into
+  a few large buffers, so that drawing meshes from different models does not
+  need to bind other buffers.
+
+  Meshes are imported into a staging buffer first and then added to the pool
+  with @ref add, which moves them to a buffer with enough free space. Their
+  indices stay absolute, with the base vertex of the allocation folded in.
+  Buffers are allocated at a fixed capacity and only the parts that changed
+  are uploaded. Allocations are referred to by handles, since @ref defragment
+  moves them to the start of their buffer. They never move to another buffer.
+
+  Once uploaded, the vertices and indices are freed from memory unless the
+  allocation asked to keep them (e.g.\ for software skinning). Buffers that
+  need to be compacted are then read back from the GPU.
+  */
+class RENDER_DLL MeshPool
+{
+public:
+    MeshPool(uint32_t vertexCapacity = DefaultVertexCapacity,
+             uint32_t indexCapacity = DefaultIndexCapacity);
+    ~MeshPool();
+    
+    static const uint32_t DefaultVertexCapacity;
+    static const uint32_t DefaultIndexCapacity;
+    static const uint32_t InvalidHandle;
+    
+    uint32_t vertexCapacity() const;
+    uint32_t indexCapacity() const;
+    uint32_t bufferCount() const;
+    MeshBuffer * buffer(uint32_t index) const;
+    uint32_t allocationCount() const;
+    uint32_t usedVertices() const;
+    uint32_t usedIndices() const;
+    uint32_t freeRangeCount() const;
+    
+    bool contains(uint32_t handle) const;
+    const MeshAllocation & allocation(uint32_t handle) const;
+    
+    uint32_t add(MeshBuffer *staging, bool keepGeometry = false);
+    void remove(uint32_t handle);
+    void defragment(RenderContext *renderCtx);
+    void upload(RenderContext *renderCtx);
+    void clear(RenderContext *renderCtx);
+
+private:
+    int findPage(uint32_t vertexCount, uint32_t indexCount, bool keepGeometry) const;
+    int pageOf(const MeshBuffer *buffer) const;
+    int createPage(uint32_t vertexCapacity, uint32_t indexCapacity, bool keepGeometry);
+    void uploadPage(RenderContext *renderCtx, MeshPoolPage &page);
+    void readPage(RenderContext *renderCtx, MeshPoolPage &page);
+    void compactPage(MeshPoolPage &page);
+    static void invalidateRanges(MeshPoolPage &page);
+    
+    uint32_t m_vertexCapacity;
+    uint32_t m_indexCapacity;
+    QVector<MeshPoolPage> m_pages;
+    QVector<MeshAllocation> m_allocations;
+    QVector<uint32_t> m_freeHandles;
+    /** Indices converted to 16-bit integers for uploading. */
+    QVector<uint16_t> m_packedIndices;
+};
+
+#endif
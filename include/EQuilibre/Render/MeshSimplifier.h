@@ -0,0 +1,96 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#ifndef EQUILIBRE_RENDER_MESH_SIMPLIFIER_H
+#define EQUILIBRE_RENDER_MESH_SIMPLIFIER_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+
+class Vertex;
+class MaterialGroup;
+
+/*!
+  \brief Reduces the number of triangles of a mesh by collapsing edges in
+  order of increasing quadric error (Garland and Heckbert). Vertices are only
+  collapsed onto other vertices of the mesh, so that simplified meshes can
+  share the vertices of the original one.
+
+  Material groups keep their order. Vertices shared by several groups,
+  vertices on texture seams and corners of open borders are never moved, and
+  vertices are only collapsed onto vertices influenced by the same bone.
+  */
+class RENDER_DLL MeshSimplifier
+{
+public:
+    MeshSimplifier();
+    
+    float error() const;
+    
+    uint32_t simplify(const Vertex *vertices, uint32_t vertexCount,
+                      const uint32_t *indices, const MaterialGroup *groups,
+                      uint32_t groupCount, uint32_t targetIndexCount, float maxError,
+                      QVector<uint32_t> &dstIndices, MaterialGroup *dstGroups);
+
+private:
+    enum VertexKind
+    {
+        Manifold,
+        Border,
+        Locked
+    };
+    
+    struct Collapse
+    {
+        uint32_t from;
+        uint32_t to;
+        float cost;
+        bool operator<(const Collapse &other) const;
+    };
+    
+    void classifyVertices(const Vertex *vertices, uint32_t vertexCount);
+    void findEdges();
+    bool isBorderEdge(uint32_t a, uint32_t b) const;
+    void computeQuadrics(const Vertex *vertices, uint32_t vertexCount);
+    void buildAdjacency(uint32_t vertexCount);
+    bool canCollapse(const Vertex *vertices, uint32_t from, uint32_t to) const;
+    float collapseCost(const Vertex *vertices, uint32_t from, uint32_t to) const;
+    bool collapseFlips(const Vertex *vertices, uint32_t from, uint32_t to) const;
+    uint32_t collapse(uint32_t from, uint32_t to);
+    void removeDegenerate();
+    
+    /** Triangles being simplified, three indices each, and their group. */
+    QVector<uint32_t> m_triangles;
+    QVector<uint32_t> m_triGroups;
+    /** Per-vertex state, indexed by local vertex ID. */
+    QVector<uint8_t> m_kinds;
+    /** First vertex with the same position, used to find borders. */
+    QVector<uint32_t> m_welded;
+    /** Plane quadrics, ten coefficients per vertex. */
+    QVector<double> m_quadrics;
+    QVector<uint32_t> m_adjOffsets;
+    QVector<uint32_t> m_adjTriangles;
+    QVector<uint32_t> m_remap;
+    QVector<uint8_t> m_touched;
+    /** Sorted keys of the edges that belong to one triangle only. */
+    QVector<uint64_t> m_borderEdges;
+    QVector<uint64_t> m_edges;
+    QVector<Collapse> m_collapses;
+    float m_error;
+};
+
+#endif
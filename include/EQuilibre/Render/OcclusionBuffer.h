@@ -0,0 +1,103 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_RENDER_OCCLUSION_BUFFER_H
+#define EQUILIBRE_RENDER_OCCLUSION_BUFFER_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+#include "EQuilibre/Render/LinearMath.h"
+#include "EQuilibre/Render/Geometry.h"
+
+class QThreadPool;
+class OcclusionTileJob;
+
+/*!
+  \brief Triangle of an occluder, in screen space. Depth is stored as 1/w,
+  which can be interpolated linearly across the screen.
+  */
+struct RENDER_DLL OccluderTriangle
+{
+    float x[3];
+    float y[3];
+    float invW[3];
+};
+
+/*!
+  \brief Low-resolution depth buffer rasterized on the CPU, used to find
+  objects that are hidden behind large occluders before drawing them.
+
+  Occluder triangles are binned into screen tiles, which are rasterized
+  independently (possibly on several threads), four pixels at a time. The
+  buffer holds 1/w, the reciprocal of the view depth, so that nearer is
+  larger and precision doesn't depend on the near plane. A hierarchical
+  buffer keeps the farthest depth of each 8x8 block so that most occlusion
+  tests don't have to look at individual pixels.
+  */
+class RENDER_DLL OcclusionBuffer
+{
+public:
+    OcclusionBuffer(int width = 320, int height = 192);
+    ~OcclusionBuffer();
+    
+    static const int TileWidth;
+    static const int TileHeight;
+    static const int BlockSize;
+    
+    int width() const;
+    int height() const;
+    int threadCount() const;
+    void setThreadCount(int count);
+    const float * depth() const;
+    const float * blockDepth() const;
+    
+    void clear(const matrix4 &viewProj);
+    void addOccluder(const vec3 *triangles, uint32_t triangleCount);
+    void rasterize();
+    bool isOccluded(const AABox &bounds) const;
+    
+    // Statistics about the last frame.
+    uint32_t triangleCount() const;
+    double rasterTime() const;
+    
+private:
+    friend class OcclusionTileJob;
+    
+    bool project(const vec3 &v, vec4 &clip) const;
+    void addTriangle(const vec4 *clip);
+    void rasterizeTiles(int first, int last);
+    void rasterizeTriangle(const OccluderTriangle &t, int x0, int y0, int x1, int y1);
+    void updateBlocks(int x0, int y0, int x1, int y1);
+    
+    int m_width;
+    int m_height;
+    int m_tilesX;
+    int m_tilesY;
+    int m_threadCount;
+    QThreadPool *m_pool;
+    vec4 m_viewProj[4];
+    /** 1/w of the nearest occluder at each pixel, zero when empty. */
+    QVector<float> m_depth;
+    /** Smallest 1/w (farthest depth) of each 8x8 block of pixels. */
+    QVector<float> m_blockDepth;
+    QVector<OccluderTriangle> m_triangles;
+    /** Indices of the triangles that overlap each tile. */
+    QVector<QVector<uint32_t> > m_bins;
+    QVector<OcclusionTileJob *> m_jobs;
+    double m_rasterTime;
+};
+
+#endif
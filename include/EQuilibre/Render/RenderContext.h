@@ -27,11 +27,14 @@ class QImage;
 class QVector3D;
 class QQuaternion;
 class BoneTransform;
+class BonePalette;
 class Frustum;
 class AABox;
 class Material;
 class MaterialArray;
 class FrameStat;
+class GLDevice;
+class GLState;
 class MeshBuffer;
 class RenderContextPrivate;
 class RenderProgram;
@@ -53,7 +56,7 @@ struct RENDER_DLL FogParams
 class RENDER_DLL RenderContext
 {
 public:
-    RenderContext();
+    RenderContext(GLDevice *device = NULL);
     virtual ~RenderContext();
 
     void init();
@@ -67,6 +70,7 @@ public:
     
     RenderProgram * programByID(Shader shaderID) const;
     void setCurrentProgram(RenderProgram *prog);
+    GLState * state() const;
 
     // matrix operations
 
@@ -103,6 +107,10 @@ public:
     void endFrame();
     
     void setDepthWrite(bool write);
+    
+    // skinning operations
+    
+    BonePalette * bonePalette();
 
     // material operations
 
@@ -113,7 +121,10 @@ public:
     // buffer operations
     
     buffer_t createBuffer(const void *data, size_t size);
+    void updateBuffer(buffer_t buffer, size_t offset, const void *data, size_t size);
+    void readBuffer(buffer_t buffer, size_t offset, void *data, size_t size);
     void freeBuffers(buffer_t *buffers, int count);
+    void freeVertexArray(uint32_t vertexArray);
 
     // Performance measurement
 
@@ -33,7 +33,9 @@ const int A_TEX_COORDS = 2;
 const int A_COLOR = 3;
 const int A_BONE_INDEX = 4;
 const int A_MODEL_VIEW_0 = 5;
-const int A_MAX = A_MODEL_VIEW_0;
+const int A_BONE_BASE = 6;
+const int A_TEX_LAYER = 7;
+const int A_MAX = A_TEX_LAYER;
 
 const int U_MODELVIEW_MATRIX = 0;
 const int U_PROJECTION_MATRIX = 1;
@@ -47,7 +49,8 @@ const int U_FOG_START = 8;
 const int U_FOG_END = 9;
 const int U_FOG_DENSITY = 10;
 const int U_FOG_COLOR = 11;
-const int U_MAX = U_FOG_COLOR;
+const int U_INSTANCED = 12;
+const int U_MAX = U_INSTANCED;
 
 struct RENDER_DLL ShaderSymbolInfo
 {
@@ -55,7 +58,8 @@ struct RENDER_DLL ShaderSymbolInfo
     const char *Name;
 };
 
-class BoneTransform;
+class BonePalette;
+class GLState;
 class Material;
 class MaterialArray;
 class MaterialMap;
@@ -66,10 +70,18 @@ public:
     void clear();
     
     const MeshBuffer *meshBuf;
-    const BoneTransform *bones;
+    const MaterialGroup *groups;
+    uint32_t groupCount;
+    const BonePalette *bones;
+    uint32_t boneBase;
     uint32_t boneCount;
     MaterialArray *materials;
-    const uint32_t *indices;
+    /** Indices in client memory, or NULL when using the index buffer. */
+    const uint8_t *indices;
+    uint32_t indexSize;
+    uint32_t indexType;
+    /** Vertex array object bound for the mesh, or 0 when using the default one. */
+    uint32_t vertexArray;
     bool haveIndices;
     bool pending;
 };
@@ -96,11 +108,23 @@ public:
      * For example, send the geometry to the GPU if it isn't there already.
      * @param geom Geometry of the mesh (vertices and indices).
      * @param materials Mesh materials or NULL if the mesh has no material.
-     * @param bones Array of bone transformations or NULL if the mesh is not skinned.
-     * @param boneCount Number of bone transformations.
+     * @param bones Bone palette or NULL if the mesh is not skinned.
+     * @param boneBase Index of the mesh's first bone in the palette.
+     * @param boneCount Number of bone transformations used by the mesh.
      */
-    virtual void beginDrawMesh(const MeshBuffer *geom, MaterialArray *materials,
-                               const BoneTransform *bones = 0, uint32_t boneCount = 0);
+    void beginDrawMesh(const MeshBuffer *geom, MaterialArray *materials,
+                       const BonePalette *bones = 0, uint32_t boneBase = 0,
+                       uint32_t boneCount = 0);
+    /**
+     * @brief Same as above, but only draw the given material groups instead
+     * of all the groups of the buffer.
+     * @param groups Material groups to draw, with offsets in the index buffer.
+     * They have to stay valid until @ref endDrawMesh is called.
+     */
+    virtual void beginDrawMesh(const MeshBuffer *geom, const MaterialGroup *groups,
+                               uint32_t groupCount, MaterialArray *materials,
+                               const BonePalette *bones = 0, uint32_t boneBase = 0,
+                               uint32_t boneCount = 0);
     /**
      * @brief Draw a mesh whose geometry was passed to @ref beginDrawMesh.
      * Multiple instances of the same mesh can be drawn by calling @ref drawMesh
@@ -109,9 +133,18 @@ public:
     virtual void drawMesh();
     /**
      * @brief Draw several instances of a mesh whose geometry was passed to
-     * @ref beginDrawMesh, each with a different model-view matrix.
+     * @ref beginDrawMesh, each with a different model-view matrix. When
+     * instancing is supported, all instances are drawn with one call per
+     * material group.
      */
-    virtual void drawMeshBatch(const matrix4 *mvMatrices, const BufferSegment *colorSegments, uint32_t instances) ;
+    virtual void drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                               const BufferSegment *colorSegments, uint32_t instances);
+    /**
+     * @brief Draw several instances of a skinned mesh whose geometry was passed
+     * to @ref beginDrawMesh. Instance i uses the model-view matrix mvMatrices[i]
+     * and the bones starting at boneBases[i] in the bone palette.
+     */
+    virtual void drawSkinnedMeshBatch(const matrix4 *mvMatrices, const uint32_t *boneBases, uint32_t instances);
     /**
      * @brief Clean up the resources used by @ref beginDrawMesh and allow it to be
      * called again.
@@ -134,7 +167,6 @@ public:
     void setModelViewMatrix(const matrix4 &modelView);
     void setProjectionMatrix(const matrix4 &projection);
     void setMaterialMap(MaterialArray *materials, MaterialMap *materialMap = NULL);
-    void setBoneTransforms(const BoneTransform *transforms, int count);
     void setAmbientLight(vec4 lightColor);
     void setLightingMode(LightingMode newMode);
     void setFogParams(const FogParams &fogParams);
@@ -145,30 +177,46 @@ protected:
     void enableVertexAttribute(int attr, int index = 0);
     void disableVertexAttribute(int attr, int index = 0);
     void uploadVertexAttributes(const MeshBuffer *meshBuf);
+    uint32_t vertexArray(const MeshBuffer *meshBuf);
     void beginApplyMaterial(MaterialArray *array, Material *m);
     void endApplyMaterial(MaterialArray *array, Material *m);
+    void updateBlending();
+    void drawMaterialGroups(const MaterialGroup *groups, uint32_t count);
+    void drawRanges(const MaterialGroup *ranges, uint32_t count);
     void drawMaterialGroup(const MaterialGroup &mg);
-    void bindColorBuffer(const BufferSegment *colorSegments, int instanceID, bool &enabledColor);
+    void bindColorBuffer(buffer_t colorBuffer, const BufferSegment *colorSegments,
+                         int instanceID, bool &enabledColor);
+    bool needsVertexColors() const;
+    void beginInstances(const matrix4 *mvMatrices, const uint32_t *boneBases, uint32_t instances);
+    void endInstances();
+    void setInstanceAttributes(bool enabled, size_t boneBaseOffset);
     virtual void beginSkinMesh();
     virtual void endSkinMesh();
     void createCube();
     void uploadCube();
 
     RenderContext *m_renderCtx;
+    GLState *m_state;
     uint32_t m_vertexShader;
     uint32_t m_fragmentShader;
     uint32_t m_program;
     int m_attr[A_MAX+1];
     int m_uniform[U_MAX+1];
-    vec4 *m_bones;
     MeshDataGL2 m_meshData;
     int m_drawCalls;
     int m_textureBinds;
+    uint32_t m_instanceCount;
+    bool m_supportsInstancing;
+    uint32_t m_instanceBuffer;
+    LightingMode m_lightingMode;
     bool m_projectionSent;
-    bool m_blendingEnabled;
     bool m_currentMatNeedsBlending;
     MeshBuffer *m_cube;
     MaterialArray *m_cubeMats;
+    /** Vertices skinned in software and the range they replace in the buffer. */
+    QVector<Vertex> m_skinnedVertices;
+    uint32_t m_skinnedFirst;
+    uint32_t m_skinnedCount;
 };
 
 class UniformSkinningProgram : public RenderProgram
@@ -181,6 +229,11 @@ public:
 
 private:
     int m_bonesLoc;
+    /** Bones uploaded for the current mesh, followed by identity transforms. */
+    QVector<vec4> m_bones;
+    /** Number of bone slots that may not hold the identity transform. */
+    uint32_t m_usedSlots;
+    bool m_warnedBoneCount;
 };
 
 class TextureSkinningProgram : public RenderProgram
@@ -189,12 +242,27 @@ public:
     TextureSkinningProgram(RenderContext *renderCtx);
     virtual ~TextureSkinningProgram();
     virtual bool init();
+    virtual void drawSkinnedMeshBatch(const matrix4 *mvMatrices, const uint32_t *boneBases, uint32_t instances);
     virtual void beginSkinMesh();
     virtual void endSkinMesh();
 
 private:
+    bool paletteFits(const BonePalette *palette) const;
+    void reserveBones(uint32_t count);
+    void uploadBones(const BonePalette *palette);
+    void uploadBoneRange(const vec4 *bones, uint32_t first, uint32_t count);
+
     int m_bonesLoc;
+    int m_boneBaseLoc;
+    int m_bonesSizeLoc;
     uint32_t m_boneTexture;
+    /** Number of bones stored in each row of the texture (two texels per bone). */
+    uint32_t m_bonesPerRow;
+    uint32_t m_boneTextureRows;
+    uint32_t m_maxBoneTextureRows;
+    const BonePalette *m_uploadedPalette;
+    uint32_t m_uploadedEpoch;
+    uint32_t m_uploadedBones;
 };
 
 #endif
@@ -0,0 +1,80 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_RENDER_RENDER_QUEUE_H
+#define EQUILIBRE_RENDER_RENDER_QUEUE_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+
+/*!
+  \brief Something to draw, such as a mesh or part of a mesh. The source and
+  index are only used by the subsystem that queued the item to find out what
+  to draw.
+  */
+struct RENDER_DLL RenderItem
+{
+    uint64_t key;
+    uint32_t source;
+    uint32_t index;
+};
+
+/*!
+  \brief Collects what has to be drawn in a frame and sorts it by a 64-bit key.
+
+  The key starts with the pass, so that the sky is drawn first and transparent
+  items last. Opaque items are then sorted by program, texture array, material
+  group and finally depth so that state changes are minimized and instances of
+  the same mesh are drawn front to back. Transparent items are sorted back to
+  front first, since blending depends on the drawing order.
+  */
+class RENDER_DLL RenderQueue
+{
+public:
+    enum Pass
+    {
+        SkyPass = 0,
+        OpaquePass = 1,
+        TransparentPass = 2
+    };
+    
+    static const uint32_t ProgramBits;
+    static const uint32_t TextureBits;
+    static const uint32_t GroupBits;
+    static const uint32_t DepthBits;
+    
+    RenderQueue();
+    
+    uint32_t count() const;
+    const RenderItem * items() const;
+    
+    static uint64_t makeKey(Pass pass, uint32_t program, uint32_t texture,
+                            uint32_t group, uint32_t depth);
+    static uint32_t quantizeDepth(float distance, float maxDistance);
+    static Pass keyPass(uint64_t key);
+    
+    void add(uint64_t key, uint32_t source, uint32_t index);
+    void sort();
+    void clear();
+    
+    static void radixSort(RenderItem *items, RenderItem *scratch, uint32_t count);
+    
+private:
+    QVector<RenderItem> m_items;
+    QVector<RenderItem> m_scratch;
+};
+
+#endif
@@ -0,0 +1,352 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_RENDER_SIMD_MATH_H
+#define EQUILIBRE_RENDER_SIMD_MATH_H
+
+#include <cmath>
+#include "EQuilibre/Render/Platform.h"
+#include "EQuilibre/Render/LinearMath.h"
+
+// Header-only, float-only math types for hot loops (animation, skinning,
+// culling). SSE is used when the compiler targets it, otherwise the same
+// operations are done with scalar code.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#define EQ_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define EQ_ALIGN16 __declspec(align(16))
+#define EQ_INLINE __forceinline
+#else
+#define EQ_ALIGN16 __attribute__((aligned(16)))
+#define EQ_INLINE inline __attribute__((always_inline))
+#endif
+
+/*!
+  \brief Four floats stored in a SSE register (or emulated).
+  */
+class EQ_ALIGN16 float4
+{
+public:
+#ifdef EQ_SIMD_SSE
+    __m128 v;
+    EQ_INLINE float4() {}
+    EQ_INLINE float4(__m128 m) : v(m) {}
+    EQ_INLINE float4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+    EQ_INLINE static float4 splat(float s) { return float4(_mm_set1_ps(s)); }
+    EQ_INLINE static float4 load(const float *p) { return float4(_mm_loadu_ps(p)); }
+    EQ_INLINE void store(float *p) const { _mm_storeu_ps(p, v); }
+    EQ_INLINE float x() const { return _mm_cvtss_f32(v); }
+    EQ_INLINE float4 operator+(const float4 &b) const { return float4(_mm_add_ps(v, b.v)); }
+    EQ_INLINE float4 operator-(const float4 &b) const { return float4(_mm_sub_ps(v, b.v)); }
+    EQ_INLINE float4 operator*(const float4 &b) const { return float4(_mm_mul_ps(v, b.v)); }
+    EQ_INLINE float4 operator-() const { return float4(_mm_sub_ps(_mm_setzero_ps(), v)); }
+    /** Return the sum of the four components in every lane. */
+    EQ_INLINE float4 hsum() const
+    {
+        __m128 s = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return float4(_mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+    /** Return a mask where bit i is set when a[i] < b[i]. */
+    EQ_INLINE static int lessThan(const float4 &a, const float4 &b)
+    {
+        return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v));
+    }
+    EQ_INLINE static float4 max(const float4 &a, const float4 &b)
+    {
+        return float4(_mm_max_ps(a.v, b.v));
+    }
+    EQ_INLINE static float4 rsqrt(const float4 &a)
+    {
+        // One Newton-Raphson step brings the estimate close to full precision.
+        __m128 e = _mm_rsqrt_ps(a.v);
+        __m128 e2 = _mm_mul_ps(_mm_mul_ps(a.v, e), e);
+        return float4(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), e),
+                                 _mm_sub_ps(_mm_set1_ps(3.0f), e2)));
+    }
+#else
+    float f[4];
+    inline float4() {}
+    inline float4(float x, float y, float z, float w) { f[0] = x; f[1] = y; f[2] = z; f[3] = w; }
+    inline static float4 splat(float s) { return float4(s, s, s, s); }
+    inline static float4 load(const float *p) { return float4(p[0], p[1], p[2], p[3]); }
+    inline void store(float *p) const { p[0] = f[0]; p[1] = f[1]; p[2] = f[2]; p[3] = f[3]; }
+    inline float x() const { return f[0]; }
+    inline float4 operator+(const float4 &b) const { return float4(f[0] + b.f[0], f[1] + b.f[1], f[2] + b.f[2], f[3] + b.f[3]); }
+    inline float4 operator-(const float4 &b) const { return float4(f[0] - b.f[0], f[1] - b.f[1], f[2] - b.f[2], f[3] - b.f[3]); }
+    inline float4 operator*(const float4 &b) const { return float4(f[0] * b.f[0], f[1] * b.f[1], f[2] * b.f[2], f[3] * b.f[3]); }
+    inline float4 operator-() const { return float4(-f[0], -f[1], -f[2], -f[3]); }
+    inline float4 hsum() const { return splat(f[0] + f[1] + f[2] + f[3]); }
+    inline static int lessThan(const float4 &a, const float4 &b)
+    {
+        return (a.f[0] < b.f[0]) | ((a.f[1] < b.f[1]) << 1) |
+               ((a.f[2] < b.f[2]) << 2) | ((a.f[3] < b.f[3]) << 3);
+    }
+    inline static float4 max(const float4 &a, const float4 &b)
+    {
+        return float4(qMax(a.f[0], b.f[0]), qMax(a.f[1], b.f[1]),
+                      qMax(a.f[2], b.f[2]), qMax(a.f[3], b.f[3]));
+    }
+    inline static float4 rsqrt(const float4 &a)
+    {
+        return float4(1.0f / sqrtf(a.f[0]), 1.0f / sqrtf(a.f[1]),
+                      1.0f / sqrtf(a.f[2]), 1.0f / sqrtf(a.f[3]));
+    }
+#endif
+    EQ_INLINE float4 operator*(float s) const { return *this * splat(s); }
+    EQ_INLINE static float dot(const float4 &a, const float4 &b) { return (a * b).hsum().x(); }
+};
+
+/*!
+  \brief Unit quaternion (x, y, z, w) representing a rotation. The layout is
+  the same as the rotation part of the dual quaternions in a BonePalette.
+  */
+class EQ_ALIGN16 quat
+{
+public:
+    float4 q;
+
+    EQ_INLINE quat() : q(0.0f, 0.0f, 0.0f, 1.0f) {}
+    EQ_INLINE quat(float4 v) : q(v) {}
+    EQ_INLINE quat(float x, float y, float z, float w) : q(x, y, z, w) {}
+    EQ_INLINE explicit quat(const vec4 &v) : q(float4::load(&v.x)) {}
+    EQ_INLINE explicit quat(const QQuaternion &r) : q((float)r.x(), (float)r.y(), (float)r.z(), (float)r.scalar()) {}
+
+    EQ_INLINE vec4 toVec4() const { vec4 v; q.store(&v.x); return v; }
+
+    EQ_INLINE quat conjugate() const
+    {
+        return quat(q * float4(-1.0f, -1.0f, -1.0f, 1.0f));
+    }
+
+    EQ_INLINE quat normalized() const
+    {
+        return quat(q * float4::rsqrt((q * q).hsum()));
+    }
+
+    /*!
+      \brief Hamilton product: the rotation b followed by the rotation a.
+      */
+    EQ_INLINE static quat mul(const quat &a, const quat &b)
+    {
+#ifdef EQ_SIMD_SSE
+        __m128 av = a.q.v, bv = b.q.v;
+        __m128 aw = _mm_shuffle_ps(av, av, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 ax = _mm_shuffle_ps(av, av, _MM_SHUFFLE(0, 0, 0, 0));
+        __m128 ay = _mm_shuffle_ps(av, av, _MM_SHUFFLE(1, 1, 1, 1));
+        __m128 az = _mm_shuffle_ps(av, av, _MM_SHUFFLE(2, 2, 2, 2));
+        __m128 r = _mm_mul_ps(aw, bv);
+        __m128 t = _mm_mul_ps(ax, _mm_shuffle_ps(bv, bv, _MM_SHUFFLE(0, 1, 2, 3)));
+        r = _mm_add_ps(r, _mm_mul_ps(t, _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f)));
+        t = _mm_mul_ps(ay, _mm_shuffle_ps(bv, bv, _MM_SHUFFLE(1, 0, 3, 2)));
+        r = _mm_add_ps(r, _mm_mul_ps(t, _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f)));
+        t = _mm_mul_ps(az, _mm_shuffle_ps(bv, bv, _MM_SHUFFLE(2, 3, 0, 1)));
+        r = _mm_add_ps(r, _mm_mul_ps(t, _mm_setr_ps(-1.0f, 1.0f, 1.0f, -1.0f)));
+        return quat(float4(r));
+#else
+        const float *p = a.q.f, *o = b.q.f;
+        return quat(p[3] * o[0] + p[0] * o[3] + p[1] * o[2] - p[2] * o[1],
+                    p[3] * o[1] - p[0] * o[2] + p[1] * o[3] + p[2] * o[0],
+                    p[3] * o[2] + p[0] * o[1] - p[1] * o[0] + p[2] * o[3],
+                    p[3] * o[3] - p[0] * o[0] - p[1] * o[1] - p[2] * o[2]);
+#endif
+    }
+
+    EQ_INLINE quat operator*(const quat &b) const { return mul(*this, b); }
+
+    EQ_INLINE vec3 rotate(const vec3 &v) const
+    {
+        // v' = v + w * t + cross(r, t) with t = 2 * cross(r, v)
+        EQ_ALIGN16 float c[4];
+        q.store(c);
+        float tx = 2.0f * (c[1] * v.z - c[2] * v.y);
+        float ty = 2.0f * (c[2] * v.x - c[0] * v.z);
+        float tz = 2.0f * (c[0] * v.y - c[1] * v.x);
+        return vec3(v.x + c[3] * tx + (c[1] * tz - c[2] * ty),
+                    v.y + c[3] * ty + (c[2] * tx - c[0] * tz),
+                    v.z + c[3] * tz + (c[0] * ty - c[1] * tx));
+    }
+
+    /*!
+      \brief Linear interpolation between two rotations, normalized.
+      Takes the shortest path.
+      */
+    EQ_INLINE static quat nlerp(const quat &a, const quat &b, float t)
+    {
+        float d = float4::dot(a.q, b.q);
+        float4 bq = (d < 0.0f) ? -b.q : b.q;
+        return quat(a.q + (bq - a.q) * t).normalized();
+    }
+
+    /*!
+      \brief Approximation of slerp: nlerp with a corrected interpolation
+      factor, which compensates for the non-constant speed of nlerp. The
+      correction is a polynomial fit depending on the angle between a and b.
+      */
+    EQ_INLINE static quat slerpFast(const quat &a, const quat &b, float t)
+    {
+        float d = fabsf(float4::dot(a.q, b.q));
+        float ka = 1.0904f + d * (-3.2452f + d * (3.55645f - d * 1.43519f));
+        float kb = 0.848013f + d * (-1.06021f + d * 0.215638f);
+        float k = ka * (t - 0.5f) * (t - 0.5f) + kb;
+        float t2 = t + t * (t - 0.5f) * (t - 1.0f) * k;
+        return nlerp(a, b, t2);
+    }
+};
+
+/*!
+  \brief Dual quaternion representing a rigid transformation (rotation then
+  translation), as stored in a BonePalette.
+  */
+class EQ_ALIGN16 dualquat
+{
+public:
+    quat real;
+    quat dual;
+
+    EQ_INLINE dualquat() : real(), dual(0.0f, 0.0f, 0.0f, 0.0f) {}
+    EQ_INLINE dualquat(const quat &r, const quat &d) : real(r), dual(d) {}
+    EQ_INLINE dualquat(const vec4 &d0, const vec4 &d1) : real(d0), dual(d1) {}
+
+    EQ_INLINE static dualquat fromRotationTranslation(const quat &r, const vec3 &t)
+    {
+        // dual = 0.5 * t * r
+        quat tq(t.x * 0.5f, t.y * 0.5f, t.z * 0.5f, 0.0f);
+        return dualquat(r, tq * r);
+    }
+
+    EQ_INLINE void store(vec4 &d0, vec4 &d1) const
+    {
+        real.q.store(&d0.x);
+        dual.q.store(&d1.x);
+    }
+
+    EQ_INLINE vec3 translation() const
+    {
+        // t = 2 * dual * conjugate(real)
+        EQ_ALIGN16 float r[4], d[4];
+        real.q.store(r);
+        dual.q.store(d);
+        return vec3(2.0f * (r[3] * d[0] - d[3] * r[0] + r[1] * d[2] - r[2] * d[1]),
+                    2.0f * (r[3] * d[1] - d[3] * r[1] + r[2] * d[0] - r[0] * d[2]),
+                    2.0f * (r[3] * d[2] - d[3] * r[2] + r[0] * d[1] - r[1] * d[0]));
+    }
+
+    /*!
+      \brief Transformation b followed by transformation a.
+      */
+    EQ_INLINE static dualquat mul(const dualquat &a, const dualquat &b)
+    {
+        return dualquat(a.real * b.real,
+                        quat((a.real * b.dual).q + (a.dual * b.real).q));
+    }
+
+    EQ_INLINE dualquat operator*(const dualquat &b) const { return mul(*this, b); }
+
+    EQ_INLINE vec3 map(const vec3 &v) const
+    {
+        // Same computation as the skinning vertex shaders.
+        vec3 p = real.rotate(v);
+        vec3 t = translation();
+        return vec3(p.x + t.x, p.y + t.y, p.z + t.z);
+    }
+};
+
+/*!
+  \brief Affine transformation stored as a row-major 3x4 matrix. Best suited
+  to transforming many points with the same transformation.
+  */
+class EQ_ALIGN16 affine3
+{
+public:
+    float4 rows[3];
+
+    EQ_INLINE affine3()
+    {
+        rows[0] = float4(1.0f, 0.0f, 0.0f, 0.0f);
+        rows[1] = float4(0.0f, 1.0f, 0.0f, 0.0f);
+        rows[2] = float4(0.0f, 0.0f, 1.0f, 0.0f);
+    }
+
+    EQ_INLINE static affine3 fromRotationTranslation(const quat &r, const vec3 &t)
+    {
+        vec4 q = r.toVec4();
+        float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+        affine3 m;
+        m.rows[0] = float4(1.0f - 2.0f * (yy + zz), 2.0f * (xy - wz), 2.0f * (xz + wy), t.x);
+        m.rows[1] = float4(2.0f * (xy + wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz - wx), t.y);
+        m.rows[2] = float4(2.0f * (xz - wy), 2.0f * (yz + wx), 1.0f - 2.0f * (xx + yy), t.z);
+        return m;
+    }
+
+    EQ_INLINE static affine3 fromDualQuaternion(const dualquat &dq)
+    {
+        return fromRotationTranslation(dq.real, dq.translation());
+    }
+
+    EQ_INLINE vec3 map(const vec3 &v) const
+    {
+        float4 p(v.x, v.y, v.z, 1.0f);
+        return vec3(float4::dot(rows[0], p), float4::dot(rows[1], p), float4::dot(rows[2], p));
+    }
+
+    /*!
+      \brief Transform four points at once.
+      */
+    EQ_INLINE void map4(const vec3 *in, vec3 *out) const
+    {
+        float4 x(in[0].x, in[1].x, in[2].x, in[3].x);
+        float4 y(in[0].y, in[1].y, in[2].y, in[3].y);
+        float4 z(in[0].z, in[1].z, in[2].z, in[3].z);
+        EQ_ALIGN16 float res[3][4];
+        for(int i = 0; i < 3; i++)
+        {
+            EQ_ALIGN16 float m[4];
+            rows[i].store(m);
+            float4 r = x * m[0] + y * m[1] + z * m[2] + float4::splat(m[3]);
+            r.store(res[i]);
+        }
+        for(int j = 0; j < 4; j++)
+            out[j] = vec3(res[0][j], res[1][j], res[2][j]);
+    }
+
+    /*!
+      \brief Transform eight points at once.
+      */
+    EQ_INLINE void map8(const vec3 *in, vec3 *out) const
+    {
+        map4(in, out);
+        map4(in + 4, out + 4);
+    }
+
+    inline void mapPoints(const vec3 *in, vec3 *out, uint32_t count) const
+    {
+        uint32_t i = 0;
+        for(; (i + 8) <= count; i += 8)
+            map8(in + i, out + i);
+        for(; (i + 4) <= count; i += 4)
+            map4(in + i, out + i);
+        for(; i < count; i++)
+            out[i] = map(in[i]);
+    }
+};
+
+#endif
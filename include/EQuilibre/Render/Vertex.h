@@ -25,15 +25,32 @@ class MeshBuffer;
 class MaterialArray;
 class RenderContext;
 
+/*!
+  \brief Vertex as stored in GPU buffers (24 bytes). Normals are encoded with
+  the octahedral mapping and texture coordinates as 8.8 fixed-point numbers.
+  Texture coordinates are rounded to the nearest multiple of 1/256 and clamped
+  to [-128, 128). Scaling them to the texture array rounds them again, so they
+  can be off by up to 1/256 after MeshBuffer::updateTexCoords.
+  */
 class RENDER_DLL Vertex
 {
 public:
     vec3 position;
-    vec3 normal;
-    vec3 texCoords;
+    int16_t texCoords[2];
+    int8_t normal[2];
+    /** Material slot or texture array layer. */
+    uint8_t layer;
+    uint8_t bone;
     uint32_t color;
-    uint32_t bone;
-    uint32_t padding[1]; // align on 16-bytes boundaries
+    
+    static const float TexCoordScale;
+    static const uint32_t MaxLayers;
+    static const uint32_t MaxBones;
+    
+    vec3 unpackNormal() const;
+    void packNormal(const vec3 &n);
+    vec2 unpackTexCoords() const;
+    bool packTexCoords(const vec2 &tc);
 };
 
 class RENDER_DLL MaterialGroup
@@ -56,18 +73,36 @@ struct RENDER_DLL BufferSegment
     size_t address() const;
 };
 
+/*!
+  \brief Vertex array object that records how a program reads the vertices of
+  a buffer, so that they can be bound with one call.
+  */
+struct RENDER_DLL VertexArray
+{
+    uint32_t program;
+    uint32_t name;
+    buffer_t vertexBuffer;
+    buffer_t indexBuffer;
+};
+
 class RENDER_DLL MeshData
 {
 public:
     MeshData(MeshBuffer *buffer, uint32_t groups);
     ~MeshData();
+    
+    static const uint32_t NoRange;
+    
     void updateTexCoords(MaterialArray *array, bool useMap = false);
+    const MaterialGroup * ranges() const;
     
     MeshBuffer *buffer;
     BufferSegment vertexSegment;
     BufferSegment indexSegment;
     MaterialGroup *matGroups;
     uint32_t groupCount;
+    /** Index of the mesh's first draw range in the buffer, or NoRange. */
+    uint32_t firstRange;
 };
 
 class RENDER_DLL MeshBuffer
@@ -77,8 +112,12 @@ public:
     ~MeshBuffer();
     MeshData *createMesh(uint32_t groups);
     void addMaterialGroups(MeshData *mesh);
+    void buildRanges();
+    void groupIndicesByMaterial(MaterialArray *materials);
     void updateTexCoords(MaterialArray *array, const MaterialGroup *matGroups,
                          uint32_t groupCount, uint32_t startIndex, bool useMap);
+    static uint32_t indexSizeFor(uint32_t vertexCount);
+    void shortIndices(QVector<uint16_t> &dst) const;
     void upload(RenderContext *renderCtx);
     void clear(RenderContext *renderCtx);
     void clearVertices();
@@ -89,6 +128,8 @@ public:
     QVector<uint32_t> indices;
     QVector<uint32_t> colors;
     QVector<MaterialGroup> matGroups;
+    /** Material groups of all meshes, with offsets relative to the buffer. */
+    QVector<MaterialGroup> ranges;
     QVector<MeshData *> meshes;
     buffer_t vertexBuffer;
     buffer_t indexBuffer;
@@ -96,6 +137,41 @@ public:
     uint32_t vertexBufferSize;
     uint32_t indexBufferSize;
     uint32_t colorBufferSize;
+    /** Size of the indices in the index buffer, in bytes. */
+    uint32_t indexSize;
+    /** Vertex arrays created by the programs that drew the buffer. */
+    mutable QVector<VertexArray> vertexArrays;
+};
+
+/*!
+  \brief Packed array of bone transformations, stored as dual quaternions
+  (two vec4 per bone) so that it can be uploaded to the GPU as-is.
+  Several skinned meshes can share one palette, each using a contiguous range
+  of bones that starts at the base offset returned by @ref allocate.
+  */
+class RENDER_DLL BonePalette
+{
+public:
+    BonePalette();
+    
+    uint32_t boneCount() const;
+    uint32_t capacity() const;
+    uint32_t epoch() const;
+    const vec4 * constData() const;
+    
+    uint32_t allocate(uint32_t count);
+    vec4 * bones(uint32_t base);
+    const vec4 * bones(uint32_t base) const;
+    BoneTransform transform(uint32_t index) const;
+    void setTransform(uint32_t index, const BoneTransform &transform);
+    void clear();
+    
+    bool checkLayout(const uint32_t *bases, uint32_t boneCount, uint32_t instances) const;
+
+private:
+    QVector<vec4> m_data;
+    uint32_t m_count;
+    uint32_t m_epoch;
 };
 
 #endif
@@ -0,0 +1,91 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_RENDER_VERTEX_CACHE_H
+#define EQUILIBRE_RENDER_VERTEX_CACHE_H
+
+#include <QVector>
+#include "EQuilibre/Render/Platform.h"
+
+class MeshData;
+
+/*!
+  \brief Simulates the post-transform vertex cache of a GPU, either as a FIFO
+  (most hardware) or as a LRU cache (the model used by the optimizer).
+  */
+class RENDER_DLL VertexCache
+{
+public:
+    enum Policy
+    {
+        FIFO,
+        LRU
+    };
+    
+    VertexCache(uint32_t size, Policy policy = FIFO);
+    
+    uint32_t size() const;
+    Policy policy() const;
+    
+    bool access(uint32_t vertexID);
+    void clear();
+    
+    static float acmr(const uint32_t *indices, uint32_t indexCount, uint32_t cacheSize,
+                      Policy policy = FIFO);
+
+private:
+    QVector<uint32_t> m_entries;
+    uint32_t m_size;
+    uint32_t m_count;
+    /** Position of the next entry to replace, for FIFO caches. */
+    uint32_t m_next;
+    Policy m_policy;
+};
+
+/*!
+  \brief Reorders the triangles of a mesh for the post-transform vertex cache
+  using Tom Forsyth's linear-speed algorithm, then renumbers its vertices in
+  the order they are first used so that they are fetched sequentially.
+  */
+class RENDER_DLL VertexCacheOptimizer
+{
+public:
+    VertexCacheOptimizer();
+    
+    static const uint32_t CacheSize;
+    
+    void optimizeTriangles(uint32_t *indices, uint32_t indexCount,
+                           uint32_t firstVertex, uint32_t vertexCount);
+    void optimizeMesh(MeshData *mesh, QVector<uint32_t> &vertexOrder);
+
+private:
+    float vertexScore(int cachePos, uint32_t remaining) const;
+    
+    QVector<float> m_cacheScores;
+    QVector<float> m_valenceScores;
+    /** Per-vertex state, indexed by local vertex ID. */
+    QVector<uint32_t> m_remaining;
+    QVector<int> m_cachePos;
+    QVector<float> m_scores;
+    QVector<uint32_t> m_adjOffsets;
+    /** Triangles that use each vertex, the remaining ones first. */
+    QVector<uint32_t> m_adjTriangles;
+    QVector<uint8_t> m_triAdded;
+    QVector<uint32_t> m_output;
+    QVector<uint32_t> m_remap;
+};
+
+#endif
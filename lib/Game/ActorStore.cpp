@@ -0,0 +1,302 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include "EQuilibre/Game/ActorStore.h"
+#include "EQuilibre/Game/WLDSkeleton.h"
+
+const uint32_t ActorStore::InvalidHandle = 0xffffffff;
+
+ActorStore::ActorStore()
+{
+    clearAnimations();
+}
+
+uint32_t ActorStore::count() const
+{
+    return m_handles.count();
+}
+
+uint32_t ActorStore::create(WLDCharActor *actor)
+{
+    uint32_t handle;
+    uint32_t slot = m_handles.count();
+    if(m_freeHandles.count() > 0)
+    {
+        handle = m_freeHandles.last();
+        m_freeHandles.pop_back();
+        m_slots[handle] = slot;
+    }
+    else
+    {
+        handle = m_slots.count();
+        m_slots.append(slot);
+    }
+    m_handles.append(handle);
+    m_positions.append(vec3(0.0, 0.0, 0.0));
+    m_orientations.append(vec3(0.0, 0.0, 0.0));
+    m_velocities.append(vec3(0.0, 0.0, 0.0));
+    m_animIDs.append(0);
+    m_animTimes.append(0.0f);
+    m_skinIDs.append(0);
+    m_radii.append(0.0f);
+    m_heights.append(0.0f);
+    m_actors.append(actor);
+    return handle;
+}
+
+void ActorStore::destroy(uint32_t handle)
+{
+    if(!contains(handle))
+        return;
+    removeSlot(m_slots[handle]);
+    m_slots[handle] = InvalidHandle;
+    m_freeHandles.append(handle);
+}
+
+void ActorStore::removeSlot(uint32_t slot)
+{
+    // Move the last actor to the free slot to keep the arrays packed.
+    uint32_t last = m_handles.count() - 1;
+    if(slot != last)
+    {
+        uint32_t lastHandle = m_handles[last];
+        m_handles[slot] = lastHandle;
+        m_positions[slot] = m_positions[last];
+        m_orientations[slot] = m_orientations[last];
+        m_velocities[slot] = m_velocities[last];
+        m_animIDs[slot] = m_animIDs[last];
+        m_animTimes[slot] = m_animTimes[last];
+        m_skinIDs[slot] = m_skinIDs[last];
+        m_radii[slot] = m_radii[last];
+        m_heights[slot] = m_heights[last];
+        m_actors[slot] = m_actors[last];
+        m_slots[lastHandle] = slot;
+    }
+    m_handles.pop_back();
+    m_positions.pop_back();
+    m_orientations.pop_back();
+    m_velocities.pop_back();
+    m_animIDs.pop_back();
+    m_animTimes.pop_back();
+    m_skinIDs.pop_back();
+    m_radii.pop_back();
+    m_heights.pop_back();
+    m_actors.pop_back();
+}
+
+void ActorStore::clear()
+{
+    m_handles.clear();
+    m_slots.clear();
+    m_freeHandles.clear();
+    m_positions.clear();
+    m_orientations.clear();
+    m_velocities.clear();
+    m_animIDs.clear();
+    m_animTimes.clear();
+    m_skinIDs.clear();
+    m_radii.clear();
+    m_heights.clear();
+    m_actors.clear();
+    clearAnimations();
+}
+
+bool ActorStore::contains(uint32_t handle) const
+{
+    return (handle < (uint32_t)m_slots.count()) && (m_slots[handle] != InvalidHandle);
+}
+
+uint32_t ActorStore::slot(uint32_t handle) const
+{
+    Q_ASSERT(contains(handle));
+    return m_slots[handle];
+}
+
+uint32_t ActorStore::handleAt(uint32_t slot) const
+{
+    return m_handles.value(slot, InvalidHandle);
+}
+
+WLDCharActor * ActorStore::actor(uint32_t handle) const
+{
+    return contains(handle) ? m_actors[m_slots[handle]] : NULL;
+}
+
+vec3 & ActorStore::position(uint32_t handle)
+{
+    return m_positions[slot(handle)];
+}
+
+vec3 & ActorStore::orientation(uint32_t handle)
+{
+    return m_orientations[slot(handle)];
+}
+
+vec3 & ActorStore::velocity(uint32_t handle)
+{
+    return m_velocities[slot(handle)];
+}
+
+uint32_t & ActorStore::animationID(uint32_t handle)
+{
+    return m_animIDs[slot(handle)];
+}
+
+float & ActorStore::animationTime(uint32_t handle)
+{
+    return m_animTimes[slot(handle)];
+}
+
+uint32_t & ActorStore::skinID(uint32_t handle)
+{
+    return m_skinIDs[slot(handle)];
+}
+
+float & ActorStore::radius(uint32_t handle)
+{
+    return m_radii[slot(handle)];
+}
+
+float & ActorStore::height(uint32_t handle)
+{
+    return m_heights[slot(handle)];
+}
+
+const vec3 * ActorStore::positions() const
+{
+    return m_positions.constData();
+}
+
+const vec3 * ActorStore::orientations() const
+{
+    return m_orientations.constData();
+}
+
+const vec3 * ActorStore::velocities() const
+{
+    return m_velocities.constData();
+}
+
+const uint32_t * ActorStore::animationIDs() const
+{
+    return m_animIDs.constData();
+}
+
+const float * ActorStore::animationTimes() const
+{
+    return m_animTimes.constData();
+}
+
+const uint32_t * ActorStore::skinIDs() const
+{
+    return m_skinIDs.constData();
+}
+
+const float * ActorStore::radii() const
+{
+    return m_radii.constData();
+}
+
+const float * ActorStore::heights() const
+{
+    return m_heights.constData();
+}
+
+uint32_t ActorStore::animationID(WLDAnimation *anim)
+{
+    if(!anim)
+        return 0;
+    QHash<WLDAnimation *, uint32_t>::const_iterator it = m_animLookup.constFind(anim);
+    if(it != m_animLookup.constEnd())
+        return it.value();
+    uint32_t animID = m_animations.count();
+    m_animations.append(anim);
+    m_animDurations.append((float)anim->duration());
+    m_animLookup.insert(anim, animID);
+    return animID;
+}
+
+WLDAnimation * ActorStore::animation(uint32_t animID) const
+{
+    return m_animations.value(animID, NULL);
+}
+
+/*!
+  \brief Forget the animations known to the store, e.g. when the character
+  packs that own them are deleted. Actors are left without an animation.
+  */
+void ActorStore::clearAnimations()
+{
+    m_animations.clear();
+    m_animDurations.clear();
+    m_animLookup.clear();
+    // Animation ID 0 means no animation.
+    m_animations.append(NULL);
+    m_animDurations.append(0.0f);
+    m_animIDs.fill(0);
+    m_animTimes.fill(0.0f);
+}
+
+void ActorStore::updateMovement(float dt)
+{
+    // The player's movement is handled by Zone (collisions), its velocity
+    // in the store is always zero.
+    const uint32_t n = m_handles.count();
+    vec3 *pos = m_positions.data();
+    const vec3 *vel = m_velocities.constData();
+    for(uint32_t i = 0; i < n; i++)
+        pos[i] = pos[i] + (vel[i] * dt);
+}
+
+void ActorStore::updateAnimations(float dt)
+{
+    const uint32_t n = m_handles.count();
+    const uint32_t *animIDs = m_animIDs.constData();
+    const float *durations = m_animDurations.constData();
+    float *times = m_animTimes.data();
+    for(uint32_t i = 0; i < n; i++)
+    {
+        // Keep the time within the animation's duration to preserve precision.
+        float duration = durations[animIDs[i]];
+        float t = times[i] + dt;
+        if(duration > 0.0f)
+            t = fmodf(t, duration);
+        times[i] = t;
+    }
+}
+
+void ActorStore::findVisible(const Frustum &frustum, QVector<uint32_t> &handles)
+{
+    // Positions are at the actors' feet, find the centers of their spheres.
+    const uint32_t n = m_handles.count();
+    m_centers.resize(n);
+    const vec3 *pos = m_positions.constData();
+    const float *heights = m_heights.constData();
+    vec3 *centers = m_centers.data();
+    for(uint32_t i = 0; i < n; i++)
+        centers[i] = vec3(pos[i].x, pos[i].y, pos[i].z + (heights[i] * 0.5f));
+    
+    // Test the actors' bounding spheres against the frustum, writing visible
+    // slots at the end of the list and then replacing them by handles.
+    uint32_t start = handles.count();
+    handles.resize(start + n);
+    uint32_t *visible = handles.data() + start;
+    uint32_t found = frustum.findVisible(centers, m_radii.constData(), n, visible);
+    for(uint32_t i = 0; i < found; i++)
+        visible[i] = m_handles[visible[i]];
+    handles.resize(start + found);
+}
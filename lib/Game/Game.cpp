@@ -17,16 +17,21 @@
 #include <QFile>
 #include <QTextStream>
 #include <QFileInfo>
+#include <QThread>
 #include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/ActorStore.h"
 #include "EQuilibre/Game/Fragments.h"
 #include "EQuilibre/Game/PFSArchive.h"
 #include "EQuilibre/Game/StreamReader.h"
 #include "EQuilibre/Game/WLDActor.h"
 #include "EQuilibre/Game/WLDData.h"
 #include "EQuilibre/Game/WLDModel.h"
+#include "EQuilibre/Game/WLDSkeleton.h"
 #include "EQuilibre/Game/WLDMaterial.h"
 #include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/CommandQueue.h"
 #include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/MeshPool.h"
 #include "EQuilibre/Render/RenderContext.h"
 #include "EQuilibre/Render/RenderProgram.h"
 
@@ -34,6 +39,8 @@ const int Game::MOVEMENT_TICKS_PER_SEC = 60;
 
 Game::Game()
 {
+    m_actors = new ActorStore();
+    m_meshPool = new MeshPool();
     m_player = new WLDCharActor(this);
     m_zone = NULL;
     m_sky = NULL;
@@ -44,6 +51,10 @@ Game::Game()
     m_showObjects = true;
     m_showFog = false;
     m_cullObjects = true;
+    m_usePVS = true;
+    m_occlusionCulling = false;
+    m_cullThreadCount = QThread::idealThreadCount();
+    m_objectCellSize = 0.0f;
     m_showSoundTriggers = false;
     m_frustumIsFrozen = false;
     m_drawCapsule = false;
@@ -58,6 +69,8 @@ Game::~Game()
 {
     clear(NULL);
     delete m_player;
+    delete m_actors;
+    delete m_meshPool;
 }
 
 void Game::clear(RenderContext *renderCtx)
@@ -91,6 +104,9 @@ void Game::clear(RenderContext *renderCtx)
     }
     m_objectPacks.clear();
     m_charPacks.clear();
+    // The store refers to animations owned by the character packs.
+    m_actors->clearAnimations();
+    m_meshPool->clear(renderCtx);
     if(renderCtx)
     {
         renderCtx->destroyStat(m_updateStat);
@@ -106,6 +122,10 @@ void Game::clearZone(RenderContext *renderCtx)
         delete m_zone;
         m_zone = NULL;
     }
+    
+    // Close the holes left by the zone's meshes in the pool before the next
+    // zone is loaded.
+    m_meshPool->defragment(renderCtx);
 }
 
 bool Game::showZone() const
@@ -148,6 +168,52 @@ void Game::setCullObjects(bool enabled)
     m_cullObjects = enabled;
 }
 
+bool Game::usePVS() const
+{
+    return m_usePVS;
+}
+
+void Game::setUsePVS(bool enabled)
+{
+    m_usePVS = enabled;
+}
+
+bool Game::occlusionCulling() const
+{
+    return m_occlusionCulling;
+}
+
+void Game::setOcclusionCulling(bool enabled)
+{
+    m_occlusionCulling = enabled;
+}
+
+int Game::cullThreadCount() const
+{
+    return m_cullThreadCount;
+}
+
+void Game::setCullThreadCount(int count)
+{
+    m_cullThreadCount = qMax(count, 1);
+}
+
+/*!
+  \brief Size of the cells used to merge zone objects into batches. Larger
+  cells mean fewer packets but coarser culling. Batches are not instanced, so
+  they only save draws when instancing is not supported. Zero (the default)
+  disables batching. The size is used when loading a zone.
+  */
+float Game::objectCellSize() const
+{
+    return m_objectCellSize;
+}
+
+void Game::setObjectCellSize(float size)
+{
+    m_objectCellSize = qMax(size, 0.0f);
+}
+
 bool Game::allowMultiJumps() const
 {
     return m_allowMultiJumps;
@@ -202,6 +268,16 @@ WLDCharActor *  Game::player() const
     return m_player;   
 }
 
+ActorStore * Game::actorStore() const
+{
+    return m_actors;
+}
+
+MeshPool * Game::meshPool() const
+{
+    return m_meshPool;
+}
+
 Zone * Game::zone() const
 {
     return m_zone;
@@ -347,7 +423,7 @@ ObjectPack * Game::loadObjects(QString archivePath, QString wldName)
         wldName = baseName + ".wld";
     }
     
-    ObjectPack *objPack = new ObjectPack();
+    ObjectPack *objPack = new ObjectPack(m_meshPool);
     if(!objPack->load(archivePath, wldName))
     {
         delete objPack;
@@ -367,7 +443,7 @@ CharacterPack * Game::loadCharacters(QString archivePath, QString wldName, bool
         wldName = baseName + ".wld";
     }
     
-    CharacterPack *charPack = new CharacterPack();
+    CharacterPack *charPack = new CharacterPack(m_meshPool);
     if(!charPack->load(archivePath, wldName))
     {
         delete charPack;
@@ -440,11 +516,11 @@ MeshData * Game::loadBuiltinSTLMesh(QString path)
         {
             Vertex v;
             reader.unpackArray("f", 3, &v.position);
-            v.normal = normal;
-            v.texCoords = vec3();
-            v.color = defaultColorABGR;
+            v.packNormal(normal);
+            v.packTexCoords(vec2());
+            v.layer = 0;
             v.bone = 0;
-            v.padding[0] = 0;
+            v.color = defaultColorABGR;
             vertices.append(v);
             indices.append((i * 3) + j);
         }
@@ -453,10 +529,10 @@ MeshData * Game::loadBuiltinSTLMesh(QString path)
     return data;
 }
 
-void Game::drawBuiltinObject(MeshData *object, RenderContext *renderCtx,
-                             RenderProgram *prog)
+void Game::queueBuiltinObject(MeshData *object, RenderContext *renderCtx,
+                              CommandQueue &queue, uint64_t key)
 {
-    if(!object || !renderCtx || !prog)
+    if(!object || !renderCtx)
     {
         return;
     }
@@ -465,20 +541,21 @@ void Game::drawBuiltinObject(MeshData *object, RenderContext *renderCtx,
     {
         m_builtinObjects->upload(renderCtx);
     }
-    m_builtinObjects->matGroups.clear();
-    m_builtinObjects->addMaterialGroups(object);
-    prog->beginDrawMesh(m_builtinObjects, m_builtinMats);
-    prog->drawMesh();
-    prog->endDrawMesh();
+    DrawPacket packet;
+    packet.meshBuf = m_builtinObjects;
+    packet.materials = m_builtinMats;
+    packet.transform = queue.addTransform(renderCtx->matrix(RenderContext::ModelView));
+    queue.addGroups(packet, object);
+    queue.add(key, packet);
 }
 
-void Game::drawPlayer(RenderContext *renderCtx, RenderProgram *prog)
+void Game::queuePlayer(RenderContext *renderCtx, CommandQueue &queue, uint64_t key)
 {
     if(m_player->cameraDistance() > m_minDistanceToShowCharacter)
     {
         if(m_player->model())
         {
-            m_player->draw(renderCtx, prog);
+            m_player->queue(renderCtx, queue, key);
         }
         if(m_capsule && m_drawCapsule)
         {
@@ -492,7 +569,7 @@ void Game::drawPlayer(RenderContext *renderCtx, RenderProgram *prog)
             renderCtx->translate(loc.x, loc.y, loc.z + offsetZ);
             renderCtx->rotate(-m_player->lookOrient().z + 90.0f, 0.0, 0.0, 1.0);
             renderCtx->scale(scaleXY, scaleXY, scaleZ);
-            drawBuiltinObject(m_capsule, renderCtx, prog);
+            queueBuiltinObject(m_capsule, renderCtx, queue, key);
             renderCtx->popMatrix();
         }
     }
@@ -504,6 +581,8 @@ void Game::update(RenderContext *renderCtx, double currentTime,
     if(!m_updateStat)
         m_updateStat = renderCtx->createStat("Update (ms)", FrameStat::CPUTime);
     m_updateStat->beginTime();
+    m_actors->updateMovement(sinceLastUpdate);
+    m_actors->updateAnimations(sinceLastUpdate);
     if(m_zone)
         m_zone->update(renderCtx, currentTime, sinceLastUpdate);
     m_updateStat->endTime();
@@ -511,11 +590,13 @@ void Game::update(RenderContext *renderCtx, double currentTime,
 
 ////////////////////////////////////////////////////////////////////////////////
 
-ObjectPack::ObjectPack()
+ObjectPack::ObjectPack(MeshPool *pool)
 {
     m_archive = NULL;
     m_wld = NULL;
-    m_meshBuf = NULL;
+    m_pool = pool;
+    m_imported = false;
+    m_uploaded = false;
 }
 
 ObjectPack::~ObjectPack()
@@ -528,22 +609,22 @@ const QMap<QString, WLDMesh *> & ObjectPack::models() const
     return m_models;
 }
 
-MeshBuffer * ObjectPack::buffer() const
+bool ObjectPack::uploaded() const
 {
-    return m_meshBuf;
+    return m_uploaded;
 }
 
 void ObjectPack::clear(RenderContext *renderCtx)
 {
+    Q_UNUSED(renderCtx);
+    foreach(uint32_t handle, m_handles)
+        m_pool->remove(handle);
+    m_handles.clear();
+    m_imported = false;
+    m_uploaded = false;
     foreach(WLDMesh *model, m_models)
         delete model;
     m_models.clear();
-    if(m_meshBuf)
-    {
-        m_meshBuf->clear(renderCtx);
-        delete m_meshBuf;
-        m_meshBuf = NULL;
-    }
     delete m_wld;
     m_wld = NULL;
     delete m_archive;
@@ -584,36 +665,55 @@ bool ObjectPack::load(QString archivePath, QString wldName)
     return true;
 }
 
-MeshBuffer * ObjectPack::upload(RenderContext *renderCtx)
+/*!
+  \brief Import each mesh into a staging buffer and move it to the mesh pool.
+  The vertices and indices of the meshes stay in memory until the pack is
+  uploaded.
+  */
+void ObjectPack::import(RenderContext *renderCtx)
 {
-    // Import vertices and indices for each mesh.
-    m_meshBuf = new MeshBuffer();
+    if(m_imported)
+        return;
     foreach(WLDMesh *mesh, m_models.values())
     {
         MaterialArray *materials = mesh->palette()->array();
         materials->uploadArray(renderCtx);
-        MeshData *meshData = mesh->importFrom(m_meshBuf);
+        MeshBuffer staging;
+        MeshData *meshData = mesh->importFrom(&staging);
         meshData->updateTexCoords(materials, true);
+        mesh->importLODs(&staging);
+        m_handles.append(m_pool->add(&staging));
     }
-    
-    // Create the GPU buffers.
-    m_meshBuf->upload(renderCtx);
-    m_meshBuf->clearVertices();
-    m_meshBuf->clearIndices();
-    return m_meshBuf;
+    m_imported = true;
+}
+
+/*!
+  \brief Upload the parts of the pool's buffers that changed, importing the
+  meshes first if needed. The pool frees their vertices and indices afterwards.
+  */
+void ObjectPack::upload(RenderContext *renderCtx)
+{
+    if(m_uploaded)
+        return;
+    import(renderCtx);
+    m_pool->upload(renderCtx);
+    m_uploaded = true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-CharacterPack::CharacterPack()
+CharacterPack::CharacterPack(MeshPool *pool)
 {
     m_archive = NULL;
     m_wld = NULL;
+    m_tracks = new TrackRegistry();
+    m_pool = pool;
 }
 
 CharacterPack::~CharacterPack()
 {
     clear(NULL);
+    delete m_tracks;
 }
 
 const QMap<QString, WLDModel *> CharacterPack::models() const
@@ -623,18 +723,17 @@ const QMap<QString, WLDModel *> CharacterPack::models() const
 
 void CharacterPack::clear(RenderContext *renderCtx)
 {
+    Q_UNUSED(renderCtx);
+    foreach(uint32_t handle, m_handles)
+        m_pool->remove(handle);
+    m_handles.clear();
     foreach(WLDModel *model, m_models)
     {
-        MeshBuffer *meshBuf = model->buffer();
-        if(meshBuf)
-        {
-            meshBuf->clear(renderCtx);
-            delete meshBuf;
-        }
         delete model->skeleton();
         delete model;
     }
     m_models.clear();
+    m_tracks->clear();
     delete m_wld;
     delete m_archive;
     m_wld = 0;
@@ -660,8 +759,10 @@ bool CharacterPack::load(QString archivePath, QString wldName)
 
 void CharacterPack::importSkeletons(WLDData *wld)
 {
-    // XXX add a actorName+animName -> WLDAnimation map that contains all animations in the pack (no duplicate).
-    // Makes it easier to free the resources even if some animations are shared between actors.
+    // share the frames of identical tracks between bones and actors
+    WLDFragmentArray<TrackFragment> tracks = wld->table()->byKind<TrackFragment>();
+    for(uint32_t i = 0; i < tracks.count(); i++)
+        tracks[i]->m_def = m_tracks->intern(tracks[i]->m_def);
     
     // import skeletons which contain the pose animation
     WLDFragmentArray<HierSpriteDefFragment> skelDefs = wld->table()->byKind<HierSpriteDefFragment>();
@@ -676,7 +777,6 @@ void CharacterPack::importSkeletons(WLDData *wld)
     }
 
     // import other animations
-    WLDFragmentArray<TrackFragment> tracks = wld->table()->byKind<TrackFragment>();
     for(uint32_t i = 0; i < tracks.count(); i++)
     {
         TrackFragment *track = tracks[i];
@@ -687,7 +787,7 @@ void CharacterPack::importSkeletons(WLDData *wld)
             continue;
         WLDSkeleton *skel = model->skeleton();
         if(skel && track->m_def)
-            skel->addTrack(animName, track->m_def);
+            skel->addTrack(animName, track);
     }
 }
 
@@ -827,19 +927,21 @@ void CharacterPack::upload(RenderContext *renderCtx, WLDModel *model)
     // Import materials.
     MaterialArray *materials = model->mainMesh()->palette()->createArray();
     materials->uploadArray(renderCtx);
+    foreach(WLDModelSkin *skin, model->skins())
+        skin->updateMaterialMap();
 
-    // Import mesh geometry.
-    MeshBuffer *meshBuf = new MeshBuffer();
-    model->setBuffer(meshBuf);
+    // Import the geometry of all parts together, so that the model can be
+    // drawn from a single buffer of the pool.
+    MeshBuffer staging;
     foreach(WLDMesh *mesh, model->meshes())
     {
-        mesh->importFrom(meshBuf);
+        mesh->importFrom(&staging);
         mesh->data()->updateTexCoords(materials, true);
+        mesh->importLODs(&staging);
     }
-
-    // Create the GPU buffers.
-    meshBuf->upload(renderCtx);
-
-    // Free the memory used for indices. We need to keep the vertices around for software skinning.
-    meshBuf->clearIndices();
+    // Software skinning needs the vertices to stay in memory.
+    uint32_t handle = m_pool->add(&staging, true);
+    m_handles.append(handle);
+    model->setBuffer(m_pool->allocation(handle).buffer);
+    m_pool->upload(renderCtx);
 }
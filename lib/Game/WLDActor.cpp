@@ -16,10 +16,12 @@
 
 #include <math.h>
 #include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/ActorStore.h"
 #include "EQuilibre/Game/WLDModel.h"
 #include "EQuilibre/Game/WLDMaterial.h"
 #include "EQuilibre/Game/Fragments.h"
 #include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Render/CommandQueue.h"
 #include "EQuilibre/Render/Material.h"
 #include "EQuilibre/Render/RenderContext.h"
 #include "EQuilibre/Render/RenderProgram.h"
@@ -88,6 +90,11 @@ const matrix4 & WLDStaticActor::modelMatrix() const
     return m_modelMatrix;
 }
 
+const vec3 & WLDStaticActor::scale() const
+{
+    return m_scale;
+}
+
 const BufferSegment & WLDStaticActor::colorSegment() const
 {
     return m_colorSegment;
@@ -113,12 +120,209 @@ void WLDStaticActor::importColorData(MeshBuffer *meshBuf)
 {
     if(!m_frag || !m_frag->m_lighting || !m_frag->m_lighting->m_def)
         return;
+    // The mesh's vertices were reordered when importing it.
     const QVector<QRgb> &colors = m_frag->m_lighting->m_def->m_colors;
+    const QVector<uint32_t> &order = m_mesh->vertexOrder();
     m_colorSegment.offset = meshBuf->colors.count();
     m_colorSegment.count = colors.count();
     m_colorSegment.elementSize = sizeof(uint32_t);
     for(int i = 0; i < m_colorSegment.count; i++)
-        meshBuf->colors.append(colors[i]);
+        meshBuf->colors.append(colors.value((i < order.count()) ? order[i] : i));
+}
+
+/*!
+  \brief Append the vertices of the actor's mesh to the buffer, transformed to
+  zone space and using the actor's lighting colors if it has any. The mesh's
+  vertices must still be in its buffer.
+  */
+void WLDStaticActor::importVertexData(MeshBuffer *meshBuf) const
+{
+    MeshData *meshData = m_mesh->data();
+    const Vertex *src = meshData->buffer->vertices.constData() + meshData->vertexSegment.offset;
+    uint32_t count = meshData->vertexSegment.count;
+    const QVector<QRgb> *colors = NULL;
+    if(m_frag && m_frag->m_lighting && m_frag->m_lighting->m_def)
+        colors = &m_frag->m_lighting->m_def->m_colors;
+    const QVector<uint32_t> &order = m_mesh->vertexOrder();
+    
+    // Normals are transformed by the inverse transpose of the model matrix,
+    // which is the model matrix applied to the normal divided by the square
+    // of the scale.
+    vec3 normalScale;
+    normalScale.x = (m_scale.x != 0.0f) ? (1.0f / (m_scale.x * m_scale.x)) : 1.0f;
+    normalScale.y = (m_scale.y != 0.0f) ? (1.0f / (m_scale.y * m_scale.y)) : 1.0f;
+    normalScale.z = (m_scale.z != 0.0f) ? (1.0f / (m_scale.z * m_scale.z)) : 1.0f;
+    vec3 origin = m_modelMatrix.map(vec3(0.0f, 0.0f, 0.0f));
+    for(uint32_t i = 0; i < count; i++)
+    {
+        Vertex v = src[i];
+        vec3 n = v.unpackNormal();
+        n = vec3(n.x * normalScale.x, n.y * normalScale.y, n.z * normalScale.z);
+        v.position = m_modelMatrix.map(v.position);
+        v.packNormal(m_modelMatrix.map(n) - origin);
+        if(colors)
+            v.color = colors->value((i < (uint32_t)order.count()) ? order[i] : i, v.color);
+        meshBuf->vertices.append(v);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t WLDBatchActor::NoCell = 0xffffffff;
+
+WLDBatchActor::WLDBatchActor() : WLDActor(Kind)
+{
+}
+
+WLDBatchActor::~WLDBatchActor()
+{
+}
+
+const QVector<WLDStaticActor *> & WLDBatchActor::objects() const
+{
+    return m_objects;
+}
+
+const QVector<WLDBatchPart> & WLDBatchActor::parts() const
+{
+    return m_parts;
+}
+
+void WLDBatchActor::addObject(WLDStaticActor *actor)
+{
+    if(m_objects.isEmpty())
+        m_boundsAA = actor->boundsAA();
+    else
+        m_boundsAA.extendTo(actor->boundsAA());
+    m_location = m_boundsAA.center();
+    m_objects.append(actor);
+    
+    const vec3 &scale = actor->scale();
+    float maxScale = qMax(qMax(fabs(scale.x), fabs(scale.y)), fabs(scale.z));
+    for(int i = 0; i < m_parts.count(); i++)
+    {
+        WLDBatchPart &part = m_parts[i];
+        if(part.mesh == actor->mesh())
+        {
+            part.objects.append(actor);
+            part.bounds.extendTo(actor->boundsAA());
+            part.scale = qMax(part.scale, maxScale);
+            return;
+        }
+    }
+    WLDBatchPart part;
+    part.mesh = actor->mesh();
+    part.objects.append(actor);
+    part.bounds = actor->boundsAA();
+    part.scale = maxScale;
+    m_parts.append(part);
+}
+
+/*!
+  \brief Append the merged vertices and indices of the batch to the buffer.
+  The vertices and indices of the objects' meshes must still be in their
+  buffer. The material groups of each level of detail are kept contiguous so
+  that a level is drawn with one range per material.
+  */
+void WLDBatchActor::importFrom(MeshBuffer *meshBuf)
+{
+    for(int p = 0; p < m_parts.count(); p++)
+    {
+        WLDBatchPart &part = m_parts[p];
+        MeshData *meshData = part.mesh->data();
+        const MeshBuffer *src = meshData->buffer;
+        uint32_t vertexCount = meshData->vertexSegment.count;
+        uint32_t objectCount = part.objects.count();
+        BufferSegment vertexLoc;
+        vertexLoc.offset = meshBuf->vertices.count();
+        vertexLoc.count = vertexCount * objectCount;
+        vertexLoc.elementSize = sizeof(Vertex);
+        foreach(WLDStaticActor *actor, part.objects)
+            actor->importVertexData(meshBuf);
+        
+        part.lods.clear();
+        for(uint32_t level = 0; level < part.mesh->lodCount(); level++)
+        {
+            const MeshData *lodData = part.mesh->lod(level);
+            MeshData *batchData = meshBuf->createMesh(lodData->groupCount);
+            batchData->vertexSegment = vertexLoc;
+            batchData->indexSegment.offset = meshBuf->indices.count();
+            batchData->indexSegment.elementSize = sizeof(uint32_t);
+            for(uint32_t i = 0; i < lodData->groupCount; i++)
+            {
+                const MaterialGroup &mg = lodData->matGroups[i];
+                const uint32_t *indices = src->indices.constData() +
+                        lodData->indexSegment.offset + mg.offset;
+                MaterialGroup &batchGroup = batchData->matGroups[i];
+                batchGroup = mg;
+                batchGroup.offset = meshBuf->indices.count() - batchData->indexSegment.offset;
+                batchGroup.count = mg.count * objectCount;
+                for(uint32_t j = 0; j < objectCount; j++)
+                {
+                    uint32_t base = vertexLoc.offset + (j * vertexCount) -
+                            lodData->vertexSegment.offset;
+                    for(uint32_t k = 0; k < mg.count; k++)
+                        meshBuf->indices.append(indices[k] + base);
+                }
+            }
+            batchData->indexSegment.count = meshBuf->indices.count() -
+                    batchData->indexSegment.offset;
+            part.lods.append(batchData);
+        }
+    }
+}
+
+/*!
+  \brief Assign objects to the cells of a grid, based on the center of their
+  bounds, and return the number of cells. Objects that are larger than a cell
+  or alone in their cell are not assigned any (NoCell), as merging them would
+  not save any draw. Cells are numbered in the order their first object is
+  found. A cell size of zero or less disables batching.
+  */
+uint32_t WLDBatchActor::findCells(const AABox *bounds, uint32_t count, float cellSize,
+                                  uint32_t *cells)
+{
+    for(uint32_t i = 0; i < count; i++)
+        cells[i] = NoCell;
+    if(cellSize <= 0.0f)
+        return 0;
+    
+    // Key each object by the coordinates of its cell, 21 bits per axis.
+    QVector<uint64_t> keys(count);
+    QHash<uint64_t, uint32_t> cellObjects;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const AABox &bb = bounds[i];
+        vec3 size = bb.high - bb.low;
+        if(qMax(qMax(size.x, size.y), size.z) > cellSize)
+            continue;
+        vec3 center = bb.center();
+        uint64_t key = 0;
+        float coords[3] = {center.x, center.y, center.z};
+        for(int j = 0; j < 3; j++)
+        {
+            int64_t c = (int64_t)floor(coords[j] / cellSize) + (1 << 20);
+            key = (key << 21) | (uint64_t)(qBound((int64_t)0, c, (int64_t)((1 << 21) - 1)));
+        }
+        keys[i] = key;
+        cellObjects[key]++;
+        cells[i] = 0;
+    }
+    
+    QHash<uint64_t, uint32_t> cellIDs;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if((cells[i] == NoCell) || (cellObjects.value(keys[i]) < 2))
+        {
+            cells[i] = NoCell;
+            continue;
+        }
+        QHash<uint64_t, uint32_t>::iterator it = cellIDs.find(keys[i]);
+        if(it == cellIDs.end())
+            it = cellIDs.insert(keys[i], cellIDs.count());
+        cells[i] = it.value();
+    }
+    return cellIDs.count();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -126,16 +330,14 @@ void WLDStaticActor::importColorData(MeshBuffer *meshBuf)
 WLDCharActor::WLDCharActor(Game *game) : WLDActor(Kind)
 {
     m_game = game;
+    m_store = game->actorStore();
+    m_handle = m_store->create(this);
     m_zone = NULL;
     m_model = NULL;
-    m_materialMap = NULL;
-    m_animation = NULL;
     m_idleAnim = NULL;
     m_walkingAnim = NULL;
     m_runningAnim = NULL;
     m_jumpingAnim = NULL;
-    m_location = vec3(0.0, 0.0, 0.0);
-    m_rotation = vec3(0.0, 0.0, 0.0);
     m_scale = vec3(1.0, 1.0, 1.0);
     m_walkSpeed = 10.0f;
     m_runSpeed = 25.0f;
@@ -147,17 +349,16 @@ WLDCharActor::WLDCharActor(Game *game) : WLDActor(Kind)
     m_wantsToJump = false;
     m_jumping = false;
     m_jumpTime = 0.0f;
-    m_animTime = 0.0f;
-    m_startAnimationTime = 0.0f;
-    m_palName = "00";
     m_shape = NULL;
     m_capsuleHeight = 6.0;
     m_capsuleRadius = 1.0;
+    m_store->radius(m_handle) = m_capsuleHeight * 0.5f;
+    m_store->height(m_handle) = m_capsuleHeight;
 }
 
 WLDCharActor::~WLDCharActor()
 {
-    delete m_materialMap;
+    m_store->destroy(m_handle);
     if(m_shape && m_zone->collisionWorld())
     {
         NewtonReleaseCollision(m_zone->collisionWorld(), m_shape);
@@ -169,6 +370,16 @@ Game * WLDCharActor::game() const
     return m_game;
 }
 
+uint32_t WLDCharActor::handle() const
+{
+    return m_handle;
+}
+
+const vec3 & WLDCharActor::location() const
+{
+    return m_store->position(m_handle);
+}
+
 Zone * WLDCharActor::zone() const
 {
     return m_zone;
@@ -183,15 +394,9 @@ void WLDCharActor::setModel(WLDModel *newModel)
 {
     if(newModel != m_model)
     {
-        if(newModel && !m_materialMap)
-        {
-            m_materialMap = new MaterialMap();
-        }
         if(newModel)
         {
-            WLDMaterialPalette *pal = newModel->mainMesh()->palette();
-            m_materialMap->clear();
-            m_materialMap->resize(pal->materialSlots().size());
+            m_store->skinID(m_handle) = 0;
             m_model = newModel;
             m_idleAnim = findAnimation("P01");
             m_walkingAnim = findAnimation("L01");
@@ -319,47 +524,38 @@ void WLDCharActor::setHasCamera(bool camera)
     m_hasCamera = camera;
 }
 
-MaterialMap * WLDCharActor::materialMap() const
-{
-    return m_materialMap;
-}
-
 WLDAnimation * WLDCharActor::animation() const
 {
-    return m_animation;   
+    return m_store->animation(m_store->animationID(m_handle));
 }
 
 void WLDCharActor::setAnimation(WLDAnimation *newAnim)
 {
-    m_animation = newAnim;
+    m_store->animationID(m_handle) = m_store->animationID(newAnim);
 }
 
 double WLDCharActor::animTime() const
 {
-    return m_animTime;
+    return m_store->animationTime(m_handle);
 }
 
 void WLDCharActor::setAnimTime(double newTime)
 {
-    m_animTime = newTime;
-}
-
-QString WLDCharActor::paletteName() const
-{
-    return m_palName;
-}
-
-void WLDCharActor::setPaletteName(QString palName)
-{
-    m_palName = palName;
+    // Wrap the time around to keep its precision as a float.
+    WLDAnimation *anim = animation();
+    double duration = anim ? anim->duration() : 0.0;
+    if(duration > 0.0)
+        newTime = fmod(newTime, duration);
+    m_store->animationTime(m_handle) = (float)newTime;
 }
 
 bool WLDCharActor::addEquip(WLDCharActor::EquipSlot slot, WLDMesh *mesh, MaterialArray *materials)
 {
     QString name = slotName(slot);
-    if(name.isEmpty() || !m_animation)
+    WLDSkeleton *skel = m_model ? m_model->skeleton() : NULL;
+    if(name.isEmpty() || !skel)
         return false;
-    int trackIndex = m_animation->findTrack(name);
+    int trackIndex = skel->findBone(name);
     if(trackIndex < 0)
         return false;
     ActorEquip eq;
@@ -388,9 +584,14 @@ QString WLDCharActor::slotName(EquipSlot slot)
     return QString::null;
 }
 
+uint32_t WLDCharActor::skinID() const
+{
+    return m_store->skinID(m_handle);
+}
+
 void WLDCharActor::setSkin(uint32_t skinID)
 {
-    m_model->mainMesh()->palette()->makeSkinMap(skinID, m_materialMap);
+    m_store->skinID(m_handle) = skinID;
 }
 
 WLDAnimation * WLDCharActor::findAnimation(QString animName)
@@ -402,51 +603,132 @@ WLDAnimation * WLDCharActor::findAnimation(QString animName)
     return m_model->skeleton()->animations().value(animName);
 }
 
-void WLDCharActor::draw(RenderContext *renderCtx, RenderProgram *prog)
+uint32_t WLDCharActor::animate(BonePalette *bones, uint32_t &boneCount) const
 {
-    if(!m_model)
-        return;
-    WLDModelSkin *skin = m_model->skins().value(m_palName);
-    if(!skin)
-        return;
-    QVector<BoneTransform> bones;
-    if(m_animation)
-        bones = m_animation->transformationsAtTime(m_animTime);
+    // Write the bone transformations to the frame's shared palette.
+    WLDAnimation *anim = animation();
+    boneCount = anim ? anim->boneCount() : 0;
+    uint32_t boneBase = bones->allocate(boneCount);
+    if(boneCount > 0)
+        anim->transformationsAtTime(animTime(), bones->bones(boneBase));
+    return boneBase;
+}
 
+void WLDCharActor::applyTransform(RenderContext *renderCtx) const
+{
+    const vec3 &location = m_store->position(m_handle);
+    const vec3 &rotation = m_store->orientation(m_handle);
     float offsetZ = (m_capsuleHeight * 0.5f);
-    renderCtx->pushMatrix();
-    renderCtx->translate(m_location.x, m_location.y, m_location.z + offsetZ);
-    renderCtx->rotate(m_rotation.x, 1.0, 0.0, 0.0);
-    renderCtx->rotate(m_rotation.y, 0.0, 1.0, 0.0);
-    renderCtx->rotate(m_rotation.z, 0.0, 0.0, 1.0);
+    renderCtx->translate(location.x, location.y, location.z + offsetZ);
+    renderCtx->rotate(rotation.x, 1.0, 0.0, 0.0);
+    renderCtx->rotate(rotation.y, 0.0, 1.0, 0.0);
+    renderCtx->rotate(rotation.z, 0.0, 0.0, 1.0);
     // XXX Find a better way to handle the orientation of the player.
     if(m_hasCamera)
         renderCtx->rotate(-m_lookOrientZ + 90.0f, 0.0, 0.0, 1.0);
     renderCtx->scale(m_scale.x, m_scale.y, m_scale.z);
-    
+}
+
+void WLDCharActor::drawEquip(RenderContext *renderCtx, RenderProgram *prog,
+                             const BonePalette *bones, uint32_t boneBase, uint32_t boneCount)
+{
     // XXX drawEquip method to allow skinned equipment (e.g. bow, epics)
-    skin->draw(prog, bones, m_materialMap);
     foreach(ActorEquip eq, m_equip)
     {
         renderCtx->pushMatrix();
-        BoneTransform bone = bones.value(eq.TrackID);
+        BoneTransform bone;
+        if((eq.TrackID >= 0) && ((uint32_t)eq.TrackID < boneCount))
+            bone = bones->transform(boneBase + eq.TrackID);
         renderCtx->translate(bone.location.toVector3D());
         renderCtx->rotate(bone.rotation);
-        MeshBuffer *meshBuf = eq.Mesh->data()->buffer;
-        meshBuf->matGroups.clear();
-        meshBuf->addMaterialGroups(eq.Mesh->data());
-        prog->beginDrawMesh(meshBuf, eq.Materials);
+        MeshData *meshData = eq.Mesh->data();
+        prog->beginDrawMesh(meshData->buffer, meshData->ranges(), meshData->groupCount,
+                            eq.Materials);
         prog->drawMesh();
         prog->endDrawMesh();
         renderCtx->popMatrix();
     }
+}
+
+void WLDCharActor::queueEquip(RenderContext *renderCtx, CommandQueue &queue, uint64_t key,
+                              const BonePalette *bones, uint32_t boneBase, uint32_t boneCount)
+{
+    foreach(ActorEquip eq, m_equip)
+    {
+        renderCtx->pushMatrix();
+        BoneTransform bone;
+        if((eq.TrackID >= 0) && ((uint32_t)eq.TrackID < boneCount))
+            bone = bones->transform(boneBase + eq.TrackID);
+        renderCtx->translate(bone.location.toVector3D());
+        renderCtx->rotate(bone.rotation);
+        DrawPacket packet;
+        packet.meshBuf = eq.Mesh->data()->buffer;
+        packet.materials = eq.Materials;
+        packet.transform = queue.addTransform(renderCtx->matrix(RenderContext::ModelView));
+        queue.addGroups(packet, eq.Mesh->data());
+        queue.add(key, packet);
+        renderCtx->popMatrix();
+    }
+}
+
+void WLDCharActor::draw(RenderContext *renderCtx, RenderProgram *prog)
+{
+    if(!m_model)
+        return;
+    WLDModelSkin *skin = m_model->skin(m_store->skinID(m_handle));
+    if(!skin)
+        return;
+    
+    BonePalette *bones = renderCtx->bonePalette();
+    uint32_t boneCount = 0;
+    uint32_t boneBase = animate(bones, boneCount);
+    renderCtx->pushMatrix();
+    applyTransform(renderCtx);
+    skin->draw(prog, bones, boneBase, boneCount, skin->materialMap());
+    drawEquip(renderCtx, prog, bones, boneBase, boneCount);
+    renderCtx->popMatrix();
+}
+
+/*!
+  \brief Record packets that draw the character and its equipment with the
+  given sort key.
+  */
+void WLDCharActor::queue(RenderContext *renderCtx, CommandQueue &queue, uint64_t key)
+{
+    if(!m_model)
+        return;
+    WLDModelSkin *skin = m_model->skin(m_store->skinID(m_handle));
+    if(!skin)
+        return;
+    
+    BonePalette *bones = renderCtx->bonePalette();
+    uint32_t boneCount = 0;
+    uint32_t boneBase = animate(bones, boneCount);
+    renderCtx->pushMatrix();
+    applyTransform(renderCtx);
+    const matrix4 &modelView = renderCtx->matrix(RenderContext::ModelView);
+    uint32_t transform = queue.addTransform(modelView);
+    float lodScale = WLDMesh::lodScale(skin->boundsAA(), modelView,
+                                       renderCtx->matrix(RenderContext::Projection));
+    skin->queue(queue, key, transform, bones, boneBase, boneCount, skin->materialMap(), lodScale);
+    queueEquip(renderCtx, queue, key, bones, boneBase, boneCount);
     renderCtx->popMatrix();
 }
 
 void WLDCharActor::interpolateState(double alpha)
 {
-    m_location = (m_currentState.position * alpha) +
+    m_store->position(m_handle) = (m_currentState.position * alpha) +
         (m_previousState.position * (1.0 - alpha));
+    updateBounds();
+}
+
+void WLDCharActor::updateBounds()
+{
+    // The actor's location is at the bottom of its collision capsule.
+    const vec3 &pos = location();
+    m_boundsAA.low = vec3(pos.x - m_capsuleRadius, pos.y - m_capsuleRadius, pos.z);
+    m_boundsAA.high = vec3(pos.x + m_capsuleRadius, pos.y + m_capsuleRadius,
+                           pos.z + m_capsuleHeight);
 }
 
 void WLDCharActor::updatePosition(double dt)
@@ -508,7 +790,7 @@ void WLDCharActor::calculateViewFrustum(Frustum &frustum) const
     camPos = viewMat.map(camPos);
     const float eyeLevel = 0.8;
     vec3 eyePos(0.0, 0.0, m_capsuleHeight * eyeLevel);
-    vec3 eye = m_location + eyePos + camPos;
+    vec3 eye = location() + eyePos + camPos;
     frustum.setEye(eye);
     frustum.setFocus(eye + viewMat.map(vec3(0.0, 1.0, 0.0)));
     frustum.setUp(vec3(0.0, 0.0, 1.0));
@@ -519,7 +801,7 @@ void WLDCharActor::update(double currentTime)
 {
     if(m_model)
     {
-        WLDAnimation *oldAnimation = m_animation;
+        WLDAnimation *oldAnimation = animation();
         WLDAnimation *newAnimation = oldAnimation;
         if(m_jumping)
         {
@@ -543,12 +825,12 @@ void WLDCharActor::update(double currentTime)
             newAnimation = m_idleAnim;
         }
         
+        // The actor store advances the time of the current animation.
         if(oldAnimation != newAnimation)
         {
-            m_animation = newAnimation;
-            m_startAnimationTime = currentTime;
+            setAnimation(newAnimation);
+            m_store->animationTime(m_handle) = 0.0f;
         }
-        m_animTime = (currentTime - m_startAnimationTime);
     }
 }
 
@@ -557,10 +839,11 @@ void WLDCharActor::enteredZone(Zone *newZone, const vec3 &initialPos)
     Q_ASSERT(!m_shape && !m_zone);
     m_shape = NewtonCreateCapsule(newZone->collisionWorld(),
                                   m_capsuleRadius, m_capsuleHeight, 0, NULL);
-    m_location = initialPos;
+    m_store->position(m_handle) = initialPos;
     m_hasCamera = true;
     m_currentState.position = m_previousState.position = initialPos;
     m_zone = newZone;
+    updateBounds();
 }
 
 void WLDCharActor::leftZone(Zone *oldZone)
@@ -620,6 +903,7 @@ OctreeIndex::OctreeIndex(AABox bounds, int maxDepth)
     AABox cubeBounds(vec3(cubeLow, cubeLow, cubeLow), vec3(cubeHigh, cubeHigh, cubeHigh));
     m_root = new Octree(cubeBounds, this);
     m_maxDepth = maxDepth;
+    m_removed = 0;
 }
 
 OctreeIndex::~OctreeIndex()
@@ -627,26 +911,124 @@ OctreeIndex::~OctreeIndex()
     delete m_root;
 }
 
+int OctreeIndex::count() const
+{
+    return m_entries.count();
+}
+
+bool OctreeIndex::contains(WLDActor *actor) const
+{
+    return m_entries.contains(actor);
+}
+
+Octree * OctreeIndex::octant(WLDActor *actor) const
+{
+    QHash<WLDActor *, Entry>::const_iterator it = m_entries.find(actor);
+    return (it != m_entries.end()) ? it.value().octant : NULL;
+}
+
 Octree * OctreeIndex::add(WLDActor *actor)
+{
+    Q_ASSERT(!m_entries.contains(actor));
+    Entry &entry = m_entries[actor];
+    entry.moved = false;
+    insert(actor, entry);
+    return entry.octant;
+}
+
+void OctreeIndex::remove(WLDActor *actor)
+{
+    QHash<WLDActor *, Entry>::iterator it = m_entries.find(actor);
+    if(it == m_entries.end())
+        return;
+    detach(it.value());
+    m_entries.erase(it);
+}
+
+void OctreeIndex::move(WLDActor *actor)
+{
+    // Only queue the actor, update() will re-insert all moved actors at once.
+    QHash<WLDActor *, Entry>::iterator it = m_entries.find(actor);
+    if((it == m_entries.end()) || it.value().moved)
+        return;
+    it.value().moved = true;
+    m_moved.append(actor);
+}
+
+void OctreeIndex::update()
+{
+    foreach(WLDActor *actor, m_moved)
+    {
+        // The actor might have been removed after it was moved.
+        QHash<WLDActor *, Entry>::iterator it = m_entries.find(actor);
+        if(it == m_entries.end())
+            continue;
+        Entry &entry = it.value();
+        entry.moved = false;
+        if(entry.octant && entry.octant->looseBounds().contains(actor->boundsAA()))
+            continue;
+        detach(entry);
+        insert(actor, entry);
+    }
+    m_moved.clear();
+    
+    // Delete empty octants once enough actors have left theirs.
+    if(m_removed > qMax(64, m_entries.count() / 4))
+        compact();
+}
+
+void OctreeIndex::compact()
+{
+    m_root->prune();
+    m_removed = 0;
+}
+
+void OctreeIndex::insert(WLDActor *actor, Entry &entry)
 {
     AABox actorBounds = actor->boundsAA();
     int x = 0, y = 0, z = 0, depth = 0;
     findIdealInsertion(actorBounds, x, y, z, depth);
     Octree *octant = findBestFittingOctant(x, y, z, depth);
-#ifndef NDEBUG
-    vec3 actorCenter = actorBounds.center();
-    AABox octantSBounds = octant->strictBounds();
-    AABox octantLBounds = octant->looseBounds();
-    Q_ASSERT(octantSBounds.contains(actorCenter));
-    Q_ASSERT(octantLBounds.contains(actorBounds));
-#endif
-    octant->actors().append(actor);
-    return octant;
+    if(octant->looseBounds().contains(actorBounds))
+    {
+        entry.octant = octant;
+        entry.index = octant->actors().count();
+        octant->actors().append(actor);
+    }
+    else
+    {
+        // The actor is (at least partly) outside of the tree.
+        entry.octant = NULL;
+        entry.index = m_outside.count();
+        m_outside.append(actor);
+    }
+}
+
+void OctreeIndex::detach(Entry &entry)
+{
+    // Replace the actor by the last one in the list to keep removal O(1).
+    QVector<WLDActor *> &actors = entry.octant ? entry.octant->actors() : m_outside;
+    Q_ASSERT(entry.index < actors.count());
+    WLDActor *last = actors.last();
+    actors[entry.index] = last;
+    actors.pop_back();
+    if(entry.index < actors.count())
+        m_entries[last].index = entry.index;
+    if(entry.octant)
+        m_removed++;
+    entry.octant = NULL;
+    entry.index = -1;
 }
 
 void OctreeIndex::findVisible(const Frustum &f, OctreeCallback callback, void *user, bool cull)
 {
+    update();
     findVisible(f, m_root, callback, user, cull);
+    foreach(WLDActor *actor, m_outside)
+    {
+        if(!cull || (f.containsAABox(actor->boundsAA()) != OUTSIDE))
+            (*callback)(actor, user);
+    }
 }
 
 void OctreeIndex::findVisible(const Frustum &f, Octree *octant, OctreeCallback callback, void *user, bool cull)
@@ -668,7 +1050,13 @@ void OctreeIndex::findVisible(const Frustum &f, Octree *octant, OctreeCallback c
 
 void OctreeIndex::findVisible(const Sphere &s, OctreeCallback callback, void *user, bool cull)
 {
+    update();
     findVisible(s, m_root, callback, user, cull);
+    foreach(WLDActor *actor, m_outside)
+    {
+        if(!cull || (s.containsAABox(actor->boundsAA()) != OUTSIDE))
+            (*callback)(actor, user);
+    }
 }
 
 void OctreeIndex::findVisible(const Sphere &s, Octree *octant, OctreeCallback callback, void *user, bool cull)
@@ -690,38 +1078,33 @@ void OctreeIndex::findVisible(const Sphere &s, Octree *octant, OctreeCallback ca
 
 void OctreeIndex::findIdealInsertion(AABox bb, int &x, int &y, int &z, int &depth)
 {
-    // Determine the maximum depth at which the bounds fit the octant.
+    // Determine the maximum depth at which the bounds fit the octant's
+    // loose bounds, i.e. the octant's half-size is at least the bounds' radius.
     AABox sb = m_root->strictBounds();
-    float sbRadius = (sb.high.x - sb.low.x);
+    float sbRadius = (sb.high.x - sb.low.x) * 0.5f;
     vec3 bbExtent = (bb.high - bb.low) * 0.5f;
     float bbRadius = qMax(bbExtent.x, qMax(bbExtent.y, bbExtent.z));
     depth = 0;
-    while(true)
+    while((depth < m_maxDepth) && ((sbRadius * 0.5f) >= bbRadius))
     {
         sbRadius *= 0.5f;
-        if(sbRadius < bbRadius)
-            break;
         depth++;
     }
-    depth--;
-    sbRadius *= 2.0f;
     
-    // Get the index of the node at this depth.
+    // Get the index of the node at this depth. Actors that moved outside of
+    // the tree are clamped to the nearest node.
     vec3 bbCenter = bb.center() - sb.low;
     vec3 sbSize = (sb.high - sb.low);
     int scale = 1 << depth;
-    x = (int)floor((scale * bbCenter.x) / sbSize.x);
-    y = (int)floor((scale * bbCenter.y) / sbSize.y);
-    z = (int)floor((scale * bbCenter.z) / sbSize.z);
-    Q_ASSERT(x >= 0 && x < scale);
-    Q_ASSERT(y >= 0 && y < scale);
-    Q_ASSERT(z >= 0 && z < scale);
+    x = qBound(0, (int)floor((scale * bbCenter.x) / sbSize.x), scale - 1);
+    y = qBound(0, (int)floor((scale * bbCenter.y) / sbSize.y), scale - 1);
+    z = qBound(0, (int)floor((scale * bbCenter.z) / sbSize.z), scale - 1);
 }
 
 Octree * OctreeIndex::findBestFittingOctant(int x, int y, int z, int depth)
 {
     Octree *octant = m_root;
-    int highBit = 1 << (depth - 1);
+    int highBit = (depth > 0) ? (1 << (depth - 1)) : 0;
     for(int i = 0; i < qMin(depth, m_maxDepth); i++)
     {
         // Determine the octant at this depth using the index's current high bit.
@@ -781,6 +1164,30 @@ QVector<WLDActor *> & Octree::actors()
     return m_actors;
 }
 
+/*!
+  \brief Delete the child octants which hold no actor.
+  \return true if this octant is now empty.
+  */
+bool Octree::prune()
+{
+    bool empty = m_actors.isEmpty();
+    for(int i = 0; i < 8; i++)
+    {
+        if(!m_children[i])
+            continue;
+        if(m_children[i]->prune())
+        {
+            delete m_children[i];
+            m_children[i] = NULL;
+        }
+        else
+        {
+            empty = false;
+        }
+    }
+    return empty;
+}
+
 Octree *Octree::child(int index) const
 {
     return ((index >= 0) && (index < 8)) ? m_children[index] : NULL;
@@ -821,3 +1228,257 @@ Octree * Octree::createChild(int index)
         m_children[index] = octant;
     return octant;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+LinearOctree::LinearOctree(int maxDepth)
+{
+    // Morton codes of the deepest octants must fit in 32 bits.
+    m_maxDepth = qMax(0, qMin(maxDepth, 10));
+}
+
+const AABox & LinearOctree::bounds() const
+{
+    return m_bounds;
+}
+
+uint32_t LinearOctree::actorCount() const
+{
+    return m_actors.count();
+}
+
+uint32_t LinearOctree::nodeCount() const
+{
+    return m_nodes.count();
+}
+
+WLDActor * LinearOctree::actor(uint32_t index) const
+{
+    return m_actors.value(index);
+}
+
+AABox LinearOctree::actorBounds(uint32_t index) const
+{
+    return m_actorBounds.at(index);
+}
+
+const LinearOctreeNode * LinearOctree::nodes() const
+{
+    return m_nodes.constData();
+}
+
+void LinearOctree::clear()
+{
+    m_nodes.clear();
+    m_actors.clear();
+    m_actorBounds.clear();
+    m_bounds = AABox();
+}
+
+static uint32_t spreadBits(uint32_t v)
+{
+    // Insert two zero bits between each of the ten low bits.
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+uint32_t LinearOctree::mortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+}
+
+bool LinearOctree::Entry::operator<(const Entry &e) const
+{
+    // Sorting by code then depth puts the actors in depth-first order.
+    if(code != e.code)
+        return code < e.code;
+    return depth < e.depth;
+}
+
+void LinearOctree::build(const QVector<WLDActor *> &actors)
+{
+    clear();
+    if(actors.count() == 0)
+        return;
+    
+    // Compute the cube that contains all actors.
+    AABox bounds = actors[0]->boundsAA();
+    foreach(WLDActor *actor, actors)
+        bounds.extendTo(actor->boundsAA());
+    float cubeLow = qMin(bounds.low.x, qMin(bounds.low.y, bounds.low.z));
+    float cubeHigh = qMax(bounds.high.x, qMax(bounds.high.y, bounds.high.z));
+    m_bounds = AABox(vec3(cubeLow, cubeLow, cubeLow), vec3(cubeHigh, cubeHigh, cubeHigh));
+    float size = qMax(cubeHigh - cubeLow, 1e-3f);
+    
+    // Find the deepest octant whose loose bounds contain each actor.
+    QVector<Entry> entries(actors.count());
+    uint32_t maxCell = (1 << m_maxDepth) - 1;
+    for(int i = 0; i < actors.count(); i++)
+    {
+        const AABox &bb = actors[i]->boundsAA();
+        vec3 extent = (bb.high - bb.low) * 0.5f;
+        float radius = qMax(extent.x, qMax(extent.y, extent.z));
+        // The loose bounds of an octant at depth d extend half an octant
+        // (size / 2^(d+1)) around it.
+        int depth = 0;
+        while((depth < m_maxDepth) && ((size / (4 << depth)) >= radius))
+            depth++;
+        vec3 center = bb.center() - m_bounds.low;
+        uint32_t cell[3];
+        float coords[3] = {center.x, center.y, center.z};
+        for(int j = 0; j < 3; j++)
+        {
+            int c = (int)floor((coords[j] / size) * (1 << depth));
+            c = qMax(0, qMin(c, (1 << depth) - 1));
+            // Express the octant in deepest-level coordinates.
+            cell[j] = qMin((uint32_t)c << (m_maxDepth - depth), maxCell);
+        }
+        entries[i].code = mortonCode(cell[0], cell[1], cell[2]);
+        entries[i].depth = depth;
+        entries[i].actor = actors[i];
+    }
+    qSort(entries.begin(), entries.end());
+    
+    // Store the actors and their bounds in depth-first order.
+    int count = entries.count();
+    m_actors.resize(count);
+    m_actorBounds.resize(count);
+    for(int i = 0; i < count; i++)
+    {
+        m_actors[i] = entries[i].actor;
+        m_actorBounds.set(i, entries[i].actor->boundsAA());
+    }
+    buildNode(entries, 0, 0, count);
+}
+
+void LinearOctree::buildNode(const QVector<Entry> &entries, uint32_t depth,
+                             uint32_t begin, uint32_t end)
+{
+    uint32_t nodeIndex = m_nodes.count();
+    m_nodes.append(LinearOctreeNode());
+    
+    // The node's own actors come first, followed by the actors of each child.
+    uint32_t ownEnd = begin;
+    while((ownEnd < end) && (entries[ownEnd].depth == depth))
+        ownEnd++;
+    uint32_t shift = 3 * (m_maxDepth - depth - 1);
+    uint32_t childBegin = ownEnd;
+    while(childBegin < end)
+    {
+        uint32_t childIndex = (entries[childBegin].code >> shift) & 7;
+        uint32_t childEnd = childBegin + 1;
+        while((childEnd < end) && (((entries[childEnd].code >> shift) & 7) == childIndex))
+            childEnd++;
+        buildNode(entries, depth + 1, childBegin, childEnd);
+        childBegin = childEnd;
+    }
+    
+    LinearOctreeNode &node = m_nodes[nodeIndex];
+    node.bounds = actorBounds(begin);
+    for(uint32_t i = begin + 1; i < end; i++)
+        node.bounds.extendTo(actorBounds(i));
+    node.firstActor = begin;
+    node.actorCount = ownEnd - begin;
+    node.subtreeEnd = end;
+    node.skip = m_nodes.count();
+}
+
+uint32_t LinearOctree::findVisible(const Frustum &f, uint32_t *visible, bool cull) const
+{
+    return findVisibleIn(f, 0, m_nodes.count(), visible, cull);
+}
+
+uint32_t LinearOctree::findVisible(const Sphere &s, uint32_t *visible, bool cull) const
+{
+    return findVisibleIn(s, 0, m_nodes.count(), visible, cull);
+}
+
+uint32_t LinearOctree::findVisible(const Frustum &f, uint32_t firstNode, uint32_t lastNode,
+                                   uint32_t *visible, bool cull) const
+{
+    return findVisibleIn(f, firstNode, lastNode, visible, cull);
+}
+
+/*!
+  \brief Split the tree into node ranges that can be culled independently:
+  the root node on its own, then the subtree of each of its children. The
+  first node of each range is written, followed by nodeCount(). The actors
+  of each range are contiguous and start at the first node's firstActor.
+  */
+void LinearOctree::findSubtrees(QVector<uint32_t> &ranges) const
+{
+    ranges.clear();
+    uint32_t nodeCount = m_nodes.count();
+    if(nodeCount == 0)
+        return;
+    ranges.append(0);
+    uint32_t i = 1;
+    while(i < nodeCount)
+    {
+        ranges.append(i);
+        i = m_nodes[i].skip;
+    }
+    ranges.append(nodeCount);
+}
+
+static uint32_t findVisibleActors(const Frustum &f, const AABoxArray &bounds,
+                                  uint32_t first, uint32_t count, uint32_t *visible)
+{
+    return f.findVisible(bounds, first, count, visible);
+}
+
+static uint32_t findVisibleActors(const Sphere &s, const AABoxArray &bounds,
+                                  uint32_t first, uint32_t count, uint32_t *visible)
+{
+    uint32_t found = 0;
+    for(uint32_t i = first; i < (first + count); i++)
+    {
+        if(s.containsAABox(bounds.at(i)) != OUTSIDE)
+            visible[found++] = i;
+    }
+    return found;
+}
+
+template<typename T>
+uint32_t LinearOctree::findVisibleIn(const T &volume, uint32_t firstNode, uint32_t lastNode,
+                                     uint32_t *visible, bool cull) const
+{
+    uint32_t found = 0;
+    const LinearOctreeNode *nodes = m_nodes.constData();
+    uint32_t i = firstNode;
+    while(i < lastNode)
+    {
+        const LinearOctreeNode &node = nodes[i];
+        TestResult r = cull ? volume.containsAABox(node.bounds) : INSIDE;
+        if(r == OUTSIDE)
+        {
+            i = node.skip;
+        }
+        else if((r == INSIDE) && (node.skip <= lastNode))
+        {
+            // The whole subtree is visible, no need to visit its nodes.
+            for(uint32_t j = node.firstActor; j < node.subtreeEnd; j++)
+                visible[found++] = j;
+            i = node.skip;
+        }
+        else if(r == INSIDE)
+        {
+            // Part of the subtree is outside of the range, only take the
+            // node's own actors.
+            for(uint32_t j = node.firstActor; j < (node.firstActor + node.actorCount); j++)
+                visible[found++] = j;
+            i++;
+        }
+        else
+        {
+            found += findVisibleActors(volume, m_actorBounds, node.firstActor,
+                                       node.actorCount, visible + found);
+            i++;
+        }
+    }
+    return found;
+}
@@ -14,6 +14,7 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
+#include <cfloat>
 #include <QImage>
 #include <QRegExp>
 #include "EQuilibre/Game/WLDModel.h"
@@ -21,9 +22,12 @@
 #include "EQuilibre/Game/Fragments.h"
 #include "EQuilibre/Game/WLDSkeleton.h"
 #include "EQuilibre/Game/PFSArchive.h"
+#include "EQuilibre/Render/CommandQueue.h"
 #include "EQuilibre/Render/RenderContext.h"
 #include "EQuilibre/Render/RenderProgram.h"
 #include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/MeshSimplifier.h"
+#include "EQuilibre/Render/VertexCache.h"
 
 using namespace std;
 
@@ -71,6 +75,11 @@ WLDModelSkin * WLDModel::skin() const
     return m_skin;
 }
 
+WLDModelSkin * WLDModel::skin(uint32_t skinID) const
+{
+    return m_skinsByID.value(skinID, NULL);
+}
+
 void WLDModel::setSkeleton(WLDSkeleton *skeleton)
 {
     m_skel = skeleton;
@@ -85,6 +94,10 @@ WLDModelSkin * WLDModel::newSkin(QString name)
 {
     WLDModelSkin *skin = new WLDModelSkin(name, this);
     m_skins.insert(name, skin);
+    uint32_t skinID = skin->skinID();
+    if(skinID >= (uint32_t)m_skinsByID.count())
+        m_skinsByID.resize(skinID + 1);
+    m_skinsByID[skinID] = skin;
     return skin;
 }
 
@@ -118,6 +131,14 @@ QList<MeshDefFragment *> WLDModel::listMeshes(ActorDefFragment *def)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+const uint32_t WLDMesh::MaxLODs = 4;
+/** Largest error allowed on screen, about one pixel at 1000 pixels high. */
+const float WLDMesh::LODThreshold = 0.002f;
+/** Largest error of a level of detail, relative to the radius of the mesh. */
+static const float LODMaxError = 0.05f;
+/** Levels of detail must have at most this fraction of the previous level's triangles. */
+static const float LODMinReduction = 0.8f;
+
 WLDMesh::WLDMesh(MeshDefFragment *meshDef, uint32_t partID)
 {
     Q_ASSERT(meshDef != NULL);
@@ -145,6 +166,31 @@ void WLDMesh::setData(MeshData *mesh)
     m_data = mesh;
 }
 
+/*!
+  \brief Buffer that holds the mesh's vertices and indices, usually a buffer
+  shared with other meshes in a mesh pool.
+  */
+MeshBuffer * WLDMesh::buffer() const
+{
+    return m_data ? m_data->buffer : NULL;
+}
+
+/*!
+  \brief Location of the mesh's first vertex in its buffer.
+  */
+uint32_t WLDMesh::baseVertex() const
+{
+    return m_data ? m_data->vertexSegment.offset : 0;
+}
+
+/*!
+  \brief Location of the mesh's first index in its buffer.
+  */
+uint32_t WLDMesh::indexOffset() const
+{
+    return m_data ? m_data->indexSegment.offset : 0;
+}
+
 MeshDefFragment * WLDMesh::def() const
 {
     return m_meshDef;
@@ -165,6 +211,73 @@ const AABox & WLDMesh::boundsAA() const
     return m_boundsAA;
 }
 
+/*!
+  \brief Original index of each vertex in the mesh's buffer, since vertices are
+  reordered when the mesh is imported.
+  */
+const QVector<uint32_t> & WLDMesh::vertexOrder() const
+{
+    return m_vertexOrder;
+}
+
+uint32_t WLDMesh::lodCount() const
+{
+    return qMax(m_lods.count(), 1);
+}
+
+/*!
+  \brief Geometry of the given level of detail, 0 being the full mesh.
+  */
+MeshData * WLDMesh::lod(uint32_t level) const
+{
+    return (level < (uint32_t)m_lods.count()) ? m_lods[level] : m_data;
+}
+
+/*!
+  \brief Simplification error of the given level of detail, in mesh units.
+  */
+float WLDMesh::lodError(uint32_t level) const
+{
+    return (level < (uint32_t)m_lodErrors.count()) ? m_lodErrors[level] : 0.0f;
+}
+
+/*!
+  \brief Select the coarsest level of detail whose error, once projected on
+  the screen with the scale returned by @ref lodScale, is below LODThreshold.
+  */
+uint32_t WLDMesh::selectLOD(float lodScale) const
+{
+    uint32_t level = 0;
+    for(int i = 1; i < m_lods.count(); i++)
+    {
+        if((m_lodErrors[i] * lodScale) > LODThreshold)
+            break;
+        level = i;
+    }
+    return level;
+}
+
+/*!
+  \brief Factor that converts lengths in model space to normalized device
+  coordinates, for a model with the given bounds seen from its nearest point.
+  */
+float WLDMesh::lodScale(const AABox &bounds, const matrix4 &modelView,
+                        const matrix4 &projection)
+{
+    const vec4 *columns = modelView.columns();
+    float scale = sqrtf((columns[0].x * columns[0].x) + (columns[0].y * columns[0].y) +
+                        (columns[0].z * columns[0].z));
+    vec3 center = modelView.map(bounds.center());
+    float radius = sqrtf((bounds.high - bounds.low).lengthSquared()) * 0.5f * scale;
+    float distance = sqrtf(center.lengthSquared()) - radius;
+    
+    // Always use the full mesh when the camera is close to or inside the model.
+    const float minDistance = 1.0f;
+    if(distance < minDistance)
+        return FLT_MAX;
+    return scale * projection.columns()[1].y / distance;
+}
+
 WLDMaterialPalette * WLDMesh::importPalette(PFSArchive *archive)
 {
     m_palette = new WLDMaterialPalette(archive);
@@ -179,9 +292,74 @@ MeshData * WLDMesh::importFrom(MeshBuffer *meshBuf, uint32_t paletteOffset)
     importVertexData(meshBuf, meshData->vertexSegment);
     importIndexData(meshBuf, meshData->indexSegment, meshData->vertexSegment,
                     0, (uint32_t)m_meshDef->m_indices.count());
+    
+    // The triangle order of WLD meshes is arbitrary, reorder triangles and
+    // vertices for the GPU's vertex cache.
+    VertexCacheOptimizer optimizer;
+    optimizer.optimizeMesh(meshData, m_vertexOrder);
     return meshData;
 }
 
+/*!
+  \brief Create simplified versions of the imported mesh in the same buffer.
+  Each level of detail has about half the triangles of the previous one and
+  shares the mesh's vertices. Levels that would not remove enough triangles
+  or would be too far from the original shape are not created.
+  */
+void WLDMesh::importLODs(MeshBuffer *meshBuf)
+{
+    m_lods.clear();
+    m_lodErrors.clear();
+    if(!m_data)
+        return;
+    m_lods.append(m_data);
+    m_lodErrors.append(0.0f);
+    
+    // Indices of the full mesh, relative to its first vertex.
+    const BufferSegment vertexLoc = m_data->vertexSegment;
+    const BufferSegment indexLoc = m_data->indexSegment;
+    QVector<uint32_t> baseIndices(indexLoc.count);
+    for(uint32_t i = 0; i < indexLoc.count; i++)
+        baseIndices[i] = meshBuf->indices[indexLoc.offset + i] - vertexLoc.offset;
+    
+    const Vertex *vertices = meshBuf->vertices.constData() + vertexLoc.offset;
+    uint32_t groupCount = m_data->groupCount;
+    float radius = sqrtf((m_boundsAA.high - m_boundsAA.low).lengthSquared()) * 0.5f;
+    MeshSimplifier simplifier;
+    VertexCacheOptimizer optimizer;
+    QVector<uint32_t> lodIndices;
+    QVector<MaterialGroup> lodGroups(groupCount);
+    uint32_t previousCount = indexLoc.count;
+    for(uint32_t level = 1; level < MaxLODs; level++)
+    {
+        uint32_t target = ((indexLoc.count >> level) / 3) * 3;
+        uint32_t count = simplifier.simplify(vertices, vertexLoc.count, baseIndices.constData(),
+                                             m_data->matGroups, groupCount, target,
+                                             radius * LODMaxError, lodIndices,
+                                             lodGroups.data());
+        if((count == 0) || (count > (previousCount * LODMinReduction)))
+            break;
+        
+        MeshData *lodData = meshBuf->createMesh(groupCount);
+        lodData->vertexSegment = vertexLoc;
+        lodData->indexSegment.offset = meshBuf->indices.count();
+        lodData->indexSegment.count = count;
+        lodData->indexSegment.elementSize = sizeof(uint32_t);
+        for(uint32_t i = 0; i < groupCount; i++)
+        {
+            const MaterialGroup &mg(lodGroups[i]);
+            optimizer.optimizeTriangles(lodIndices.data() + mg.offset, mg.count,
+                                        0, vertexLoc.count);
+            lodData->matGroups[i] = mg;
+        }
+        for(uint32_t i = 0; i < count; i++)
+            meshBuf->indices.push_back(lodIndices[i] + vertexLoc.offset);
+        m_lods.append(lodData);
+        m_lodErrors.append(simplifier.error());
+        previousCount = count;
+    }
+}
+
 void WLDMesh::importVertexData(MeshBuffer *buffer, BufferSegment &dataLoc)
 {
     // Update the location of the mesh in the buffer.
@@ -195,21 +373,28 @@ void WLDMesh::importVertexData(MeshBuffer *buffer, BufferSegment &dataLoc)
     // Load vertices, texCoords, normals, faces.
     bool hasColors = m_meshDef->m_colors.count() > 0;
     uint32_t defaultColorABGR = 0xbfffffff; // A=0.75, B=1, G=1, R=1
+    uint32_t clampedTexCoords = 0;
     for(uint32_t i = 0; i < vertexCount; i++)
     {
         Vertex v;
         v.position = m_meshDef->m_vertices.value(i) + m_meshDef->m_center;
-        v.normal = m_meshDef->m_normals.value(i);
-        v.texCoords = vec3(m_meshDef->m_texCoords.value(i), 0.0f);
-        v.color = hasColors ? m_meshDef->m_colors.value(i) : defaultColorABGR;
+        v.packNormal(m_meshDef->m_normals.value(i));
+        if(!v.packTexCoords(m_meshDef->m_texCoords.value(i)))
+            clampedTexCoords++;
+        v.layer = 0;
         v.bone = 0;
+        v.color = hasColors ? m_meshDef->m_colors.value(i) : defaultColorABGR;
         vertices.append(v);
     }
+    if(clampedTexCoords > 0)
+        fprintf(stderr, "Warning: %u texture coordinates out of range in mesh '%s', clamped\n",
+                clampedTexCoords, m_meshDef->name().toLatin1().constData());
     
     // Load bone indices.
     foreach(vec2us g, m_meshDef->m_vertexPieces)
     {
         uint16_t count = g.first, pieceID = g.second;
+        Q_ASSERT(pieceID < Vertex::MaxBones);
         for(uint32_t i = 0; i < count; i++, vertexIndex++)
             vertices[vertexIndex].bone = pieceID;
     }
@@ -305,7 +490,9 @@ MeshBuffer * WLDMesh::combine(const QVector<WLDMesh *> &meshes)
 WLDModelSkin::WLDModelSkin(QString name, WLDModel *model)
 {
     m_name = name;
+    m_skinID = name.toUInt();
     m_model = model;
+    m_materialMap = NULL;
     WLDModelSkin *defaultSkin = model->skin();
     if(defaultSkin)
     {
@@ -321,6 +508,7 @@ WLDModelSkin::WLDModelSkin(QString name, WLDModel *model)
 
 WLDModelSkin::~WLDModelSkin()
 {
+    delete m_materialMap;
 }
 
 QString WLDModelSkin::name() const
@@ -328,6 +516,30 @@ QString WLDModelSkin::name() const
     return m_name;
 }
 
+uint32_t WLDModelSkin::skinID() const
+{
+    return m_skinID;
+}
+
+MaterialMap * WLDModelSkin::materialMap() const
+{
+    return m_materialMap;
+}
+
+/*!
+  \brief Map the model's material slots to the materials of this skin. This
+  needs the palette's material array to have been created.
+  */
+void WLDModelSkin::updateMaterialMap()
+{
+    WLDMaterialPalette *pal = m_model->mainMesh()->palette();
+    if(!m_materialMap)
+        m_materialMap = new MaterialMap();
+    m_materialMap->clear();
+    m_materialMap->resize(pal->materialSlots().size());
+    pal->makeSkinMap(m_skinID, m_materialMap);
+}
+
 const AABox & WLDModelSkin::boundsAA() const
 {
     return m_boundsAA;
@@ -399,35 +611,91 @@ void WLDModelSkin::updateBounds()
     }
 }
 
-void WLDModelSkin::draw(RenderProgram *prog, const QVector<BoneTransform> &bones,
-                        MaterialMap *materialMap)
+MaterialArray * WLDModelSkin::beginDraw(RenderProgram *prog, MaterialMap *materialMap)
 {
     MeshBuffer *meshBuf = m_model->buffer();
     if(!meshBuf)
-        return;
+        return NULL;
 
     // Gather material groups from all the mesh parts we want to draw.
-    meshBuf->matGroups.clear();
+    m_drawGroups.resize(0);
     foreach(WLDMesh *mesh, m_parts)
-        meshBuf->addMaterialGroups(mesh->data());
+    {
+        MeshData *meshData = mesh->data();
+        const MaterialGroup *ranges = meshData->ranges();
+        for(uint32_t i = 0; i < meshData->groupCount; i++)
+            m_drawGroups.append(ranges[i]);
+    }
     
     // Map the slot indices to material indices if requested.
     MaterialArray *materials = m_model->mainMesh()->palette()->array();
     if(materialMap)
     {
-        for(size_t i = 0; i < meshBuf->matGroups.size(); i++)
+        for(int i = 0; i < m_drawGroups.count(); i++)
         {
-            MaterialGroup &mg(meshBuf->matGroups[i]);
+            MaterialGroup &mg(m_drawGroups[i]);
             mg.matID = materialMap->mappingAt(mg.matID);
         }
         prog->setMaterialMap(materials, materialMap);
     }
+    return materials;
+}
+
+void WLDModelSkin::draw(RenderProgram *prog, const BonePalette *bones, uint32_t boneBase,
+                        uint32_t boneCount, MaterialMap *materialMap)
+{
+    MaterialArray *materials = beginDraw(prog, materialMap);
+    if(!materials)
+        return;
 
     // Draw all the material groups in one draw call.
-    prog->beginDrawMesh(meshBuf, materials, bones.constData(), bones.size());
+    prog->beginDrawMesh(m_model->buffer(), m_drawGroups.constData(), m_drawGroups.count(),
+                        materials, bones, boneBase, boneCount);
     prog->drawMesh();
     prog->endDrawMesh();
     
     if(materialMap)
         prog->setMaterialMap(NULL);
 }
+
+/*!
+  \brief Record a packet that draws the skin with the given transformation
+  (index in the queue) and bones. Each part is drawn with the level of detail
+  selected with lodScale.
+  */
+void WLDModelSkin::queue(CommandQueue &queue, uint64_t key, uint32_t transform,
+                         const BonePalette *bones, uint32_t boneBase,
+                         uint32_t boneCount, MaterialMap *materialMap, float lodScale)
+{
+    MeshBuffer *meshBuf = m_model->buffer();
+    if(!meshBuf)
+        return;
+    
+    DrawPacket packet;
+    packet.meshBuf = meshBuf;
+    packet.materials = m_model->mainMesh()->palette()->array();
+    packet.materialMap = materialMap;
+    packet.bones = bones;
+    packet.boneBase = boneBase;
+    packet.boneCount = boneCount;
+    packet.transform = transform;
+    foreach(WLDMesh *mesh, m_parts)
+    {
+        MeshData *meshData = mesh->lod(mesh->selectLOD(lodScale));
+        if(!materialMap)
+        {
+            queue.addGroups(packet, meshData);
+            continue;
+        }
+        
+        // Map the slot indices to material indices.
+        const MaterialGroup *ranges = meshData->ranges();
+        for(uint32_t i = 0; i < meshData->groupCount; i++)
+        {
+            MaterialGroup mg = ranges[i];
+            mg.matID = materialMap->mappingAt(mg.matID);
+            queue.addGroups(packet, &mg, 1);
+        }
+    }
+    queue.add(key, packet);
+}
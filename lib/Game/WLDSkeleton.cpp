@@ -17,17 +17,37 @@
 #include <cmath>
 #include "EQuilibre/Game/WLDSkeleton.h"
 #include "EQuilibre/Game/Fragments.h"
+#include "EQuilibre/Render/SIMDMath.h"
+
+static const double AnimationFPS = 10.0;
 
 WLDSkeleton::WLDSkeleton(HierSpriteDefFragment *def, QObject *parent) : QObject(parent)
 {
     m_def = def;
     QVector<TrackDefFragment *> tracks;
-    foreach(SkeletonNode node, def->m_tree)
-        tracks.append(node.track->m_def);
-    m_pose = new WLDAnimation("POS", tracks, this, this);
+    for(int i = 0; i < def->m_tree.count(); i++)
+    {
+        // strip character name from track name
+        TrackFragment *track = def->m_tree[i].track;
+        QString boneName = track->name().mid(3);
+        tracks.append(track->m_def);
+        m_boneNames.append(boneName);
+        if(!m_boneIndices.contains(boneName))
+            m_boneIndices.insert(boneName, i);
+    }
+    m_pose = new WLDAnimation("POS", tracks, this);
     m_animations.insert(m_pose->name(), m_pose);
 }
 
+WLDSkeleton::~WLDSkeleton()
+{
+    foreach(WLDAnimation *anim, m_animations)
+    {
+        if(!anim->deref())
+            delete anim;
+    }
+}
+
 WLDAnimation *WLDSkeleton::pose() const
 {
     return m_pose;
@@ -43,15 +63,79 @@ const QMap<QString, WLDAnimation *> & WLDSkeleton::animations() const
     return m_animations;
 }
 
-void WLDSkeleton::addTrack(QString animName, TrackDefFragment *track)
+const QVector<QString> & WLDSkeleton::boneNames() const
+{
+    return m_boneNames;
+}
+
+/*!
+  \brief Return the index of the bone with the given name (without the actor
+  name), or -1 if there is no such bone.
+  */
+int WLDSkeleton::boneIndex(QString boneName) const
+{
+    return m_boneIndices.value(boneName, -1);
+}
+
+/*!
+  \brief Return the index of the first bone whose name contains the given
+  string, or -1 if there is no such bone.
+  */
+int WLDSkeleton::findBone(QString name) const
+{
+    for(int i = 0; i < m_boneNames.count(); i++)
+    {
+        if(m_boneNames[i].contains(name))
+            return i;
+    }
+    return -1;
+}
+
+/*!
+  \brief Return, for each of our bones, the index of the bone with the same
+  name in the given skeleton (or -1). The map is only computed once per skeleton.
+  */
+const QVector<int> & WLDSkeleton::boneMapFrom(WLDSkeleton *skel)
+{
+    QMap<WLDSkeleton *, QVector<int> >::iterator it = m_boneMaps.find(skel);
+    if(it == m_boneMaps.end())
+    {
+        QVector<int> boneMap(m_boneNames.count());
+        for(int i = 0; i < m_boneNames.count(); i++)
+            boneMap[i] = skel->boneIndex(m_boneNames[i]);
+        it = m_boneMaps.insert(skel, boneMap);
+    }
+    return it.value();
+}
+
+bool WLDSkeleton::hasSameLayout(WLDSkeleton *skel)
+{
+    const QVector<int> &boneMap = boneMapFrom(skel);
+    if(skel->boneNames().count() != boneMap.count())
+        return false;
+    const QVector<SkeletonNode> &ourTree = tree();
+    const QVector<SkeletonNode> &theirTree = skel->tree();
+    for(int i = 0; i < boneMap.count(); i++)
+    {
+        if((boneMap[i] != i) || (ourTree[i].children != theirTree[i].children))
+            return false;
+    }
+    return true;
+}
+
+void WLDSkeleton::addTrack(QString animName, TrackFragment *track)
 {
+    // strip animation name and character name from track name
+    int boneID = boneIndex(track->name().mid(6));
+    if(boneID < 0)
+        return;
     WLDAnimation *anim = m_animations.value(animName);
     if(!anim)
     {
-        anim = m_pose->copy(animName, this);
+        anim = m_pose->copy(animName);
         m_animations.insert(animName, anim);
     }
-    anim->replaceTrack(track);
+    anim->setTrack(boneID, track->m_def);
 }
 
 void WLDSkeleton::copyAnimationsFrom(WLDSkeleton *skel)
@@ -63,6 +147,11 @@ void WLDSkeleton::copyAnimationsFrom(WLDSkeleton *skel)
     }
 }
 
+/*!
+  \brief Import an animation from another skeleton. The animation is shared
+  when both skeletons have the same layout. Otherwise the animation is copied,
+  taking the tracks of bones that have the same name in both skeletons.
+  */
 WLDAnimation * WLDSkeleton::copyFrom(WLDSkeleton *skel, QString animName)
 {
     if(!skel || skel == this)
@@ -70,22 +159,41 @@ WLDAnimation * WLDSkeleton::copyFrom(WLDSkeleton *skel, QString animName)
     WLDAnimation *anim = skel->animations().value(animName);
     if(!anim)
         return 0;
-    WLDAnimation *anim2 = m_pose->copy(animName, this);
-    foreach(TrackDefFragment *trackDef, anim->tracks())
-        anim2->replaceTrack(trackDef);
-    m_animations.insert(anim2->name(), anim2);
+    WLDAnimation *anim2 = m_animations.value(animName);
+    if(anim2 == m_pose)
+        return m_pose;
+    else if(anim2 && !anim2->deref())
+        delete anim2;
+    if(hasSameLayout(skel))
+    {
+        anim2 = anim;
+        anim2->ref();
+    }
+    else
+    {
+        const QVector<int> &boneMap = boneMapFrom(skel);
+        anim2 = m_pose->copy(animName);
+        for(int i = 0; i < boneMap.count(); i++)
+        {
+            if(boneMap[i] >= 0)
+                anim2->setTrack(i, anim->tracks()[boneMap[i]]);
+        }
+    }
+    m_animations.insert(animName, anim2);
     return anim2;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 WLDAnimation::WLDAnimation(QString name, QVector<TrackDefFragment *> tracks,
-                           WLDSkeleton *skel, QObject *parent) : QObject(parent)
+                           WLDSkeleton *skel)
 {
     m_name = name;
     m_tracks = tracks;
+    m_tree = skel->tree();
     m_skel = skel;
     m_frameCount = 0;
+    m_refCount = 1;
     foreach(TrackDefFragment *track, tracks)
         m_frameCount = std::max(m_frameCount, (uint32_t)track->m_frames.count());
 }
@@ -105,73 +213,190 @@ WLDSkeleton * WLDAnimation::skeleton() const
     return m_skel;
 }
 
-int WLDAnimation::findTrack(QString name) const
+void WLDAnimation::ref()
 {
-    for(int i = 0; i < m_tracks.count(); i++)
-    {
-        QString trackName = m_tracks[i]->name();
-        if(trackName.contains(name))
-            return i;
-    }
-    return -1;
+    m_refCount++;
 }
 
-void WLDAnimation::replaceTrack(TrackDefFragment *track)
+/*!
+  \brief Release a reference to the animation. Returns false when the
+  animation is not referenced anymore and can be deleted.
+  */
+bool WLDAnimation::deref()
 {
-    // strip animation name and character name from track name
-    QString trackName = track->name().mid(6);
-    for(int i = 0; i < m_tracks.count(); i++)
-    {
-        // strip character name from track name
-        if(m_tracks[i]->name().mid(3) == trackName)
-        {
-            m_tracks[i] = track;
-            m_frameCount = std::max(m_frameCount, (uint32_t)track->m_frames.count());
-            break;
-        }
-    }
+    m_refCount--;
+    return m_refCount > 0;
+}
+
+void WLDAnimation::setTrack(int boneID, TrackDefFragment *track)
+{
+    if((boneID < 0) || (boneID >= m_tracks.count()) || !track)
+        return;
+    m_tracks[boneID] = track;
+    m_frameCount = std::max(m_frameCount, (uint32_t)track->m_frames.count());
+}
+
+WLDAnimation * WLDAnimation::copy(QString newName) const
+{
+    return new WLDAnimation(newName, m_tracks, m_skel);
+}
+
+uint32_t WLDAnimation::boneCount() const
+{
+    return m_tracks.count();
 }
 
-WLDAnimation * WLDAnimation::copy(QString newName, QObject *parent) const
+double WLDAnimation::duration() const
 {
-    return new WLDAnimation(newName, m_tracks, m_skel, parent);
+    return m_frameCount / AnimationFPS;
 }
 
-QVector<BoneTransform> WLDAnimation::transformationsAtTime(double t) const
+/*!
+  \brief Compute the bone transformations at time t and write them as dual
+  quaternions (two vec4 per bone) to the given array, which must be able to
+  hold boneCount() bones.
+  */
+void WLDAnimation::transformationsAtTime(double t, vec4 *dualQuats) const
 {
-    const double fps = 10.0;
-    double dur = m_frameCount / fps;
-    return transformationsAtFrame(fmod(fmod(t, dur) * fps, m_frameCount));
+    transformationsAtFrame(fmod(fmod(t, duration()) * AnimationFPS, m_frameCount), dualQuats);
 }
 
-QVector<BoneTransform> WLDAnimation::transformationsAtFrame(double f) const
+void WLDAnimation::transformationsAtFrame(double f, vec4 *dualQuats) const
 {
-    BoneTransform initTrans;
-    initTrans.location = QVector3D();
-    initTrans.rotation = QQuaternion();
-    QVector<BoneTransform> trans;
-    trans.resize(m_tracks.count());
-    transformPiece(trans, m_skel->tree(), 0, f, initTrans);
-    return trans;
+    if(m_tracks.count() > 0)
+        transformPiece(dualQuats, 0, f, quat(), vec3());
 }
 
-void WLDAnimation::transformPiece(QVector<BoneTransform> &transforms, const QVector<SkeletonNode> &tree,
-    uint32_t pieceID, double f, BoneTransform parentTrans) const
+void WLDAnimation::transformPiece(vec4 *dualQuats, uint32_t pieceID, double f,
+                                  const quat &parentRot, const vec3 &parentLoc) const
 {
-    SkeletonNode piece = tree.value(pieceID);
+    const SkeletonNode &piece = m_tree[pieceID];
     TrackDefFragment *track = m_tracks[pieceID];
-    BoneTransform pieceTrans = interpolate(track, f);
-    BoneTransform effTrans;
-    effTrans.location = parentTrans.map(pieceTrans.location);
-    effTrans.rotation = parentTrans.rotation * pieceTrans.rotation;
-    transforms[pieceID] = effTrans;
+    quat rot;
+    vec3 loc;
+    interpolate(track, f, rot, loc);
+    vec3 effLoc = parentRot.rotate(loc);
+    effLoc.x += parentLoc.x;
+    effLoc.y += parentLoc.y;
+    effLoc.z += parentLoc.z;
+    quat effRot = parentRot * rot;
+    dualquat::fromRotationTranslation(effRot, effLoc).store(dualQuats[pieceID * 2],
+                                                            dualQuats[pieceID * 2 + 1]);
     foreach(uint32_t childID, piece.children)
-        transformPiece(transforms, tree, childID, f, effTrans);
+        transformPiece(dualQuats, childID, f, effRot, effLoc);
 }
 
-BoneTransform WLDAnimation::interpolate(TrackDefFragment *t, double f) const
+void WLDAnimation::interpolate(TrackDefFragment *t, double f, quat &rot, vec3 &loc) const
 {
     int i = qRound(floor(f));
-    //int next = prev + 1;
-    return BoneTransform::interpolate(t->frame(i), t->frame(i + 1), f - i);
+    float c = (float)(f - i);
+    BoneTransform a = t->frame(i), b = t->frame(i + 1);
+    rot = quat::slerpFast(quat(a.rotation), quat(b.rotation), c);
+    loc.x = (float)(a.location.x() + (b.location.x() - a.location.x()) * c);
+    loc.y = (float)(a.location.y() + (b.location.y() - a.location.y()) * c);
+    loc.z = (float)(a.location.z() + (b.location.z() - a.location.z()) * c);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrackRegistry::TrackRegistry()
+{
+    m_duplicates = 0;
+}
+
+uint32_t TrackRegistry::count() const
+{
+    return m_tracks.count();
+}
+
+uint32_t TrackRegistry::duplicates() const
+{
+    return m_duplicates;
+}
+
+void TrackRegistry::clear()
+{
+    m_tracks.clear();
+    m_canonical.clear();
+    m_duplicates = 0;
+}
+
+/*!
+  \brief Return the registered track that has the same frames as the given
+  track, or register the track if there is none. The frames of a duplicate
+  track are released since they are not used anymore.
+  */
+TrackDefFragment * TrackRegistry::intern(TrackDefFragment *track)
+{
+    if(!track)
+        return track;
+    TrackDefFragment *canonical = m_canonical.value(track);
+    if(canonical)
+        return canonical;
+    uint32_t hash = hashFrames(track->m_frames);
+    QMultiHash<uint32_t, TrackDefFragment *>::const_iterator it = m_tracks.constFind(hash);
+    for(; (it != m_tracks.constEnd()) && (it.key() == hash); ++it)
+    {
+        TrackDefFragment *existing = it.value();
+        if(existing == track)
+            return track;
+        if(sameFrames(existing, track))
+        {
+            track->m_frames.clear();
+            m_canonical.insert(track, existing);
+            m_duplicates++;
+            return existing;
+        }
+    }
+    m_tracks.insert(hash, track);
+    return track;
+}
+
+static inline uint32_t hashFloat(uint32_t hash, float val)
+{
+    union { float f; uint32_t u; } bits;
+    bits.f = val;
+    return (hash ^ bits.u) * 16777619u;
+}
+
+/*!
+  \brief Compute a hash of the content of an animation track (FNV-1 on the
+  bits of each frame's location and rotation).
+  */
+uint32_t TrackRegistry::hashFrames(const QVector<BoneTransform> &frames)
+{
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (uint32_t)frames.count()) * 16777619u;
+    foreach(BoneTransform frame, frames)
+    {
+        hash = hashFloat(hash, frame.location.x());
+        hash = hashFloat(hash, frame.location.y());
+        hash = hashFloat(hash, frame.location.z());
+        hash = hashFloat(hash, frame.rotation.scalar());
+        hash = hashFloat(hash, frame.rotation.x());
+        hash = hashFloat(hash, frame.rotation.y());
+        hash = hashFloat(hash, frame.rotation.z());
+    }
+    return hash;
+}
+
+bool TrackRegistry::sameFrames(const TrackDefFragment *a, const TrackDefFragment *b)
+{
+    if((a->m_flags != b->m_flags) || (a->m_frames.count() != b->m_frames.count()))
+        return false;
+    for(int i = 0; i < a->m_frames.count(); i++)
+    {
+        const BoneTransform &fa = a->m_frames[i];
+        const BoneTransform &fb = b->m_frames[i];
+        // compare exactly, to be consistent with the hash
+        if((fa.location.x() != fb.location.x()) ||
+           (fa.location.y() != fb.location.y()) ||
+           (fa.location.z() != fb.location.z()) ||
+           (fa.rotation.scalar() != fb.rotation.scalar()) ||
+           (fa.rotation.x() != fb.rotation.x()) ||
+           (fa.rotation.y() != fb.rotation.y()) ||
+           (fa.rotation.z() != fb.rotation.z()))
+            return false;
+    }
+    return true;
 }
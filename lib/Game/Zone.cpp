@@ -14,9 +14,15 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
+#include <cmath>
 #include <QFileInfo>
 #include <QImage>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QVarLengthArray>
 #include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Game/ActorStore.h"
 #include "EQuilibre/Game/Game.h"
 #include "EQuilibre/Game/PFSArchive.h"
 #include "EQuilibre/Game/WLDData.h"
@@ -30,6 +36,119 @@
 #include "EQuilibre/Render/RenderProgram.h"
 #include "EQuilibre/Render/Material.h"
 #include "EQuilibre/Render/FrameStat.h"
+#include "EQuilibre/Render/OcclusionBuffer.h"
+#include "EQuilibre/Render/SIMDMath.h"
+
+static Sphere boundingSphere(const AABox &bb)
+{
+    vec3 extent = (bb.high - bb.low) * 0.5f;
+    return Sphere(bb.center(), sqrt(extent.lengthSquared()));
+}
+
+/*!
+  \brief Part of the culling work of a frame, which can run on any thread.
+  Each job writes to its own list so that no locking is needed, and the
+  lists are merged in job order so that the results are deterministic.
+  */
+class CullJob : public QRunnable
+{
+public:
+    enum Kind
+    {
+        Chunks,
+        Objects,
+        Characters
+    };
+    
+    CullJob(Kind kind, uint32_t first, uint32_t last)
+    {
+        this->kind = kind;
+        this->first = first;
+        this->last = last;
+        frustum = NULL;
+        terrain = NULL;
+        objectTree = NULL;
+        zone = NULL;
+        store = NULL;
+        visible = NULL;
+        found = 0;
+        usePVS = false;
+        cull = true;
+        setAutoDelete(false);
+    }
+    
+    virtual void run()
+    {
+        if(kind == Chunks)
+            terrain->cullChunks(*frustum, usePVS, first, last);
+        else if(kind == Objects)
+            runObjects();
+        else if(kind == Characters)
+            runCharacters();
+    }
+    
+    void runObjects()
+    {
+        found = objectTree->findVisible(*frustum, first, last, visible, cull);
+        if(!usePVS)
+            return;
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < found; i++)
+        {
+            if(terrain->isRegionVisible((*actorRegions)[visible[i]]))
+                visible[kept++] = visible[i];
+        }
+        found = kept;
+    }
+    
+    void runCharacters()
+    {
+        characters.clear();
+        handles.clear();
+        if(cull)
+        {
+            store->findVisible(*frustum, handles);
+        }
+        else
+        {
+            for(uint32_t i = 0; i < store->count(); i++)
+                handles.append(store->handleAt(i));
+        }
+        
+        // The store holds every character, only keep the ones in this zone.
+        foreach(uint32_t handle, handles)
+        {
+            WLDCharActor *actor = store->actor(handle);
+            if(!actor || (actor->zone() != zone))
+                continue;
+            if(usePVS)
+            {
+                Sphere s = boundingSphere(actor->boundsAA());
+                if(!terrain->isRegionVisible(terrain->findContainingRegion(s)))
+                    continue;
+            }
+            characters.append(actor);
+        }
+    }
+    
+    Kind kind;
+    /** Range of chunk words (chunks) or octree nodes (objects) to cull. */
+    uint32_t first;
+    uint32_t last;
+    const Frustum *frustum;
+    ZoneTerrain *terrain;
+    LinearOctree *objectTree;
+    const QVector<uint32_t> *actorRegions;
+    Zone *zone;
+    ActorStore *store;
+    QVector<uint32_t> handles;
+    /** Where to write visible object indices, which is part of an array shared with other jobs. */
+    uint32_t *visible;
+    uint32_t found;
+    QVector<WLDCharActor *> characters;
+    bool usePVS;
+    bool cull;
+};
 
 Zone::Zone(Game *game)
 {
@@ -42,6 +161,19 @@ Zone::Zone(Game *game)
     m_actorTree = NULL;
     m_collisionChecksStat = NULL;
     m_collisionChecks = 0;
+    m_occlusion = NULL;
+    m_occlusionStat = NULL;
+    m_occludedStat = NULL;
+    m_cullPool = NULL;
+    m_cullThreadCount = 0;
+    m_cullStat = NULL;
+    m_cullThreadsStat = NULL;
+    m_queueStat = NULL;
+    m_drawStat = NULL;
+    m_drawStatGPU = NULL;
+    m_packetsStat = NULL;
+    m_batchesStat = NULL;
+    m_trianglesStat = NULL;
     m_collisionWorld = NewtonCreate();
     m_movementAheadTime = 0.0f;
 }
@@ -49,6 +181,8 @@ Zone::Zone(Game *game)
 Zone::~Zone()
 {
     clear(NULL);
+    delete m_occlusion;
+    delete m_cullPool;
     NewtonDestroy(m_collisionWorld);
 }
 
@@ -72,11 +206,16 @@ QList<CharacterPack *> Zone::characterPacks() const
     return m_charPacks;
 }
 
-OctreeIndex * Zone::actorIndex() const
+LinearOctree * Zone::actorIndex() const
 {
     return m_actorTree;
 }
 
+const QVector<WLDCharActor *> & Zone::visibleCharacters() const
+{
+    return m_visibleCharacters;
+}
+
 NewtonWorld * Zone::collisionWorld()
 {
     return m_collisionWorld;
@@ -130,13 +269,28 @@ bool Zone::load(QString path, QString name)
         return false;
     }
     
-    m_actorTree = new OctreeIndex(m_objects->bounds(), 8);
-    m_objects->addTo(m_actorTree);
-    
     // Load the zone's light sources.
     if(!importLightSources(m_mainArchive))
         return false;
     
+    // Index objects and light sources for culling.
+    QVector<WLDActor *> actors;
+    m_objects->addTo(actors);
+    foreach(WLDLightActor *light, m_lights)
+        actors.append(light);
+    m_actorTree = new LinearOctree(8);
+    m_actorTree->build(actors);
+    m_visibleActors.resize(m_actorTree->actorCount());
+    
+    // Find the region each actor is in, to cull them using the region PVS.
+    // Actors that span several regions are never culled that way.
+    m_actorRegions.resize(m_actorTree->actorCount());
+    for(uint32_t i = 0; i < m_actorTree->actorCount(); i++)
+    {
+        Sphere s = boundingSphere(m_actorTree->actorBounds(i));
+        m_actorRegions[i] = m_terrain->findContainingRegion(s);
+    }
+    
     // Load the zone's characters.
     QString charPath = QString("%1/%2_chr.s3d").arg(path).arg(name);
     QString charFile = QString("%1_chr.wld").arg(name);
@@ -167,7 +321,6 @@ bool Zone::importLightSources(PFSArchive *archive)
     {
         WLDLightActor *actor = new WLDLightActor(lightFrags[i], ID++);
         m_lights.append(actor);
-        m_actorTree->add(actor);
     }
     delete wld;
     return true;
@@ -192,6 +345,8 @@ void Zone::clear(RenderContext *renderCtx)
     m_lights.clear();
     m_charPacks.clear();
     m_soundTriggers.clear();
+    // The store refers to animations owned by the character packs.
+    m_game->actorStore()->clearAnimations();
     if(m_objects)
     {
         m_objects->clear(renderCtx);
@@ -208,23 +363,42 @@ void Zone::clear(RenderContext *renderCtx)
     delete m_mainWld;
     delete m_mainArchive;
     m_actorTree = NULL;
+    foreach(CullJob *job, m_cullJobs)
+        delete job;
+    m_cullJobs.clear();
+    m_cullThreadCount = 0;
+    m_visibleActors.clear();
+    m_actorRegions.clear();
+    m_visibleCharacters.clear();
     m_mainWld = 0;
     m_mainArchive = 0;
     if(renderCtx)
     {
         renderCtx->destroyStat(m_collisionChecksStat);
+        renderCtx->destroyStat(m_occlusionStat);
+        renderCtx->destroyStat(m_occludedStat);
+        renderCtx->destroyStat(m_cullStat);
+        renderCtx->destroyStat(m_cullThreadsStat);
+        renderCtx->destroyStat(m_queueStat);
+        renderCtx->destroyStat(m_drawStat);
+        renderCtx->destroyStat(m_drawStatGPU);
+        renderCtx->destroyStat(m_packetsStat);
+        renderCtx->destroyStat(m_batchesStat);
+        renderCtx->destroyStat(m_trianglesStat);
         m_collisionChecksStat = NULL;
+        m_occlusionStat = NULL;
+        m_occludedStat = NULL;
+        m_cullStat = NULL;
+        m_cullThreadsStat = NULL;
+        m_queueStat = NULL;
+        m_drawStat = NULL;
+        m_drawStatGPU = NULL;
+        m_packetsStat = NULL;
+        m_batchesStat = NULL;
+        m_trianglesStat = NULL;
     }
 }
 
-void Zone::frustumCullingCallback(WLDActor *actor, void *user)
-{
-    Zone *z = (Zone *)user;
-    WLDStaticActor *staticActor = actor->cast<WLDStaticActor>();
-    if(staticActor && staticActor->frag())
-        z->objects()->visibleObjects().append(staticActor);
-}
-
 void Zone::update(RenderContext *renderCtx, double currentTime,
                   double sinceLastUpdate)
 {
@@ -234,29 +408,27 @@ void Zone::update(RenderContext *renderCtx, double currentTime,
     if(!m_collisionChecksStat)
         m_collisionChecksStat = renderCtx->createStat("Collision checks",
                                                       FrameStat::Counter);
+    if(!m_cullStat)
+        m_cullStat = renderCtx->createStat("Cull (ms)", FrameStat::CPUTime);
+    if(!m_cullThreadsStat)
+        m_cullThreadsStat = renderCtx->createStat("Cull threads", FrameStat::Counter);
     m_collisionChecks = 0;
     m_frustum = renderCtx->viewFrustum();
     m_player->calculateViewFrustum(m_frustum);
     if(m_terrain)
-    {
         m_terrain->update(currentTime);
-        m_terrain->resetVisible();
-    }
     if(m_objects)
-    {
         m_objects->update(currentTime);
-        m_objects->resetVisible();
-    }
     
-    // Build a list of visible actors.
     Frustum &realFrustum(m_game->frustumIsFrozen() ? m_frozenFrustum : m_frustum);
-    m_terrain->resetVisible();
-    m_actorTree->findVisible(realFrustum, frustumCullingCallback, this,
-                             m_game->cullObjects());
-    if(m_terrain->findCurrentRegion(realFrustum.eye()))
-        m_terrain->showNearbyRegions(realFrustum);
-    else
-        m_terrain->showAllRegions(realFrustum);
+    m_cullStat->beginTime();
+    cull(realFrustum);
+    m_cullStat->endTime();
+    m_cullThreadsStat->setCurrent(m_cullThreadCount);
+    
+    // Remove the objects and characters hidden behind the terrain.
+    if(m_game->occlusionCulling())
+        cullOccluded(renderCtx, realFrustum);
     
     updateMovement(sinceLastUpdate);
     
@@ -265,6 +437,171 @@ void Zone::update(RenderContext *renderCtx, double currentTime,
     m_collisionChecksStat->setCurrent(m_collisionChecks);
 }
 
+/*!
+  \brief Find the terrain chunks, objects and characters that can be seen
+  through the frustum. The work is split into jobs (ranges of chunks, top-level
+  subtrees of the object octree and the character index) which are run on
+  Game::cullThreadCount() threads.
+  */
+void Zone::cull(const Frustum &frustum)
+{
+    if(!m_terrain)
+        return;
+    m_terrain->resetVisible();
+    if(m_objects)
+        m_objects->resetVisible();
+    
+    // Use the PVS of the current region if any.
+    m_terrain->findCurrentRegion(frustum.eye());
+    bool usePVS = m_game->usePVS() && (m_terrain->currentRegion() != 0);
+    int threadCount = m_game->cullThreadCount();
+    if(m_cullJobs.isEmpty() || (threadCount != m_cullThreadCount))
+        createCullJobs(threadCount);
+    foreach(CullJob *job, m_cullJobs)
+    {
+        job->frustum = &frustum;
+        job->usePVS = usePVS;
+        job->cull = m_game->cullObjects();
+    }
+    if(m_cullPool)
+    {
+        foreach(CullJob *job, m_cullJobs)
+            m_cullPool->start(job);
+        m_cullPool->waitForDone();
+    }
+    else
+    {
+        foreach(CullJob *job, m_cullJobs)
+            job->run();
+    }
+    
+    // Merge the visible lists in job order.
+    m_terrain->showCulledChunks();
+    m_visibleCharacters.clear();
+    foreach(CullJob *job, m_cullJobs)
+    {
+        if(job->kind == CullJob::Objects)
+        {
+            for(uint32_t i = 0; i < job->found; i++)
+            {
+                WLDActor *actor = m_actorTree->actor(job->visible[i]);
+                WLDStaticActor *staticActor = actor->cast<WLDStaticActor>();
+                WLDBatchActor *batch = actor->cast<WLDBatchActor>();
+                if(staticActor && staticActor->frag())
+                    m_objects->visibleObjects().append(staticActor);
+                else if(batch)
+                    m_objects->visibleBatches().append(batch);
+            }
+        }
+        else if(job->kind == CullJob::Characters)
+        {
+            m_visibleCharacters += job->characters;
+        }
+    }
+}
+
+void Zone::createCullJobs(int threadCount)
+{
+    foreach(CullJob *job, m_cullJobs)
+        delete job;
+    m_cullJobs.clear();
+    delete m_cullPool;
+    m_cullPool = NULL;
+    m_cullThreadCount = threadCount;
+    if(threadCount > 1)
+    {
+        m_cullPool = new QThreadPool();
+        m_cullPool->setMaxThreadCount(threadCount);
+    }
+    
+    // Chunks are split into as many ranges of bitset words as threads.
+    uint32_t wordCount = m_terrain->chunkWordCount();
+    uint32_t chunkJobs = qMin((uint32_t)threadCount, wordCount);
+    for(uint32_t i = 0; i < chunkJobs; i++)
+    {
+        CullJob *job = new CullJob(CullJob::Chunks, (wordCount * i) / chunkJobs,
+                                   (wordCount * (i + 1)) / chunkJobs);
+        job->terrain = m_terrain;
+        m_cullJobs.append(job);
+    }
+    
+    // Each subtree of the object octree writes its visible objects to the
+    // part of m_visibleActors that holds the subtree's actors.
+    if(m_actorTree && m_objects)
+    {
+        QVector<uint32_t> ranges;
+        m_actorTree->findSubtrees(ranges);
+        const LinearOctreeNode *nodes = m_actorTree->nodes();
+        for(int i = 0; (i + 1) < ranges.count(); i++)
+        {
+            CullJob *job = new CullJob(CullJob::Objects, ranges[i], ranges[i + 1]);
+            job->terrain = m_terrain;
+            job->objectTree = m_actorTree;
+            job->actorRegions = &m_actorRegions;
+            job->visible = m_visibleActors.data() + nodes[ranges[i]].firstActor;
+            m_cullJobs.append(job);
+        }
+    }
+    
+    // Characters move around and are culled from the actor store instead.
+    CullJob *job = new CullJob(CullJob::Characters, 0, 0);
+    job->terrain = m_terrain;
+    job->zone = this;
+    job->store = m_game->actorStore();
+    m_cullJobs.append(job);
+}
+
+void Zone::cullOccluded(RenderContext *renderCtx, const Frustum &frustum)
+{
+    if(!m_occlusionStat)
+        m_occlusionStat = renderCtx->createStat("Occlusion CPU (ms)", FrameStat::CPUTime);
+    if(!m_occludedStat)
+        m_occludedStat = renderCtx->createStat("Occluded objects", FrameStat::Counter);
+    if(!m_occlusion)
+    {
+        m_occlusion = new OcclusionBuffer();
+        m_occlusion->setThreadCount(QThread::idealThreadCount());
+    }
+    m_occlusionStat->beginTime();
+    
+    // Rasterize the nearest visible regions into the occlusion buffer.
+    matrix4 viewProj = frustum.projection() * frustum.camera();
+    m_occlusion->clear(viewProj);
+    m_terrain->addOccluders(*m_occlusion, frustum.eye(), 4096);
+    m_occlusion->rasterize();
+    
+    int occluded = 0;
+    QVector<WLDStaticActor *> &objects = m_objects->visibleObjects();
+    int kept = 0;
+    foreach(WLDStaticActor *actor, objects)
+    {
+        if(!m_occlusion->isOccluded(actor->boundsAA()))
+            objects[kept++] = actor;
+    }
+    occluded += objects.count() - kept;
+    objects.resize(kept);
+    QVector<WLDBatchActor *> &batches = m_objects->visibleBatches();
+    kept = 0;
+    foreach(WLDBatchActor *batch, batches)
+    {
+        if(!m_occlusion->isOccluded(batch->boundsAA()))
+            batches[kept++] = batch;
+    }
+    occluded += batches.count() - kept;
+    batches.resize(kept);
+    kept = 0;
+    foreach(WLDCharActor *actor, m_visibleCharacters)
+    {
+        if(!m_occlusion->isOccluded(actor->boundsAA()))
+            m_visibleCharacters[kept++] = actor;
+    }
+    occluded += m_visibleCharacters.count() - kept;
+    m_visibleCharacters.resize(kept);
+    
+    m_occlusionStat->endTime();
+    m_occludedStat->setCurrent(occluded);
+}
+
 void Zone::acceptPlayer(WLDCharActor *player, const vec3 &initialPos)
 {
     m_player = player;
@@ -365,21 +702,50 @@ void Zone::draw(RenderContext *renderCtx, RenderProgram *prog)
     fogParams.density = m_game->fogDensity();
     prog->setFogParams(fogParams);
     
-    // Draw the sky first.
-    ZoneSky *sky = m_game->sky();
-    if(sky)
-        sky->draw(renderCtx, prog, this);
+    if(!m_queueStat)
+        m_queueStat = renderCtx->createStat("Queue (ms)", FrameStat::CPUTime);
+    if(!m_drawStat)
+        m_drawStat = renderCtx->createStat("Draw CPU (ms)", FrameStat::CPUTime);
+    if(!m_drawStatGPU)
+        m_drawStatGPU = renderCtx->createStat("Draw GPU (ms)", FrameStat::GPUTime);
+    if(!m_packetsStat)
+        m_packetsStat = renderCtx->createStat("Draw packets", FrameStat::Counter);
+    if(!m_batchesStat)
+        m_batchesStat = renderCtx->createStat("Draw batches", FrameStat::Counter);
+    if(!m_trianglesStat)
+        m_trianglesStat = renderCtx->createStat("Triangles", FrameStat::Counter);
     
     renderCtx->pushMatrix();
     renderCtx->multiplyMatrix(m_frustum.camera());
-
-    // Draw the zone's static objects.
-    if(m_game->showObjects() && m_objects)
-        m_objects->draw(renderCtx, prog);
-
-    // Draw the zone's terrain.
+    
+    // Record what the sky, terrain, objects and characters have to draw.
+    m_queueStat->beginTime();
+    m_commands.clear();
+    ZoneSky *sky = m_game->sky();
+    if(sky)
+        sky->queue(renderCtx, m_commands, this);
     if(m_game->showZone() && m_terrain)
-        m_terrain->draw(renderCtx, prog);
+        m_terrain->queue(renderCtx, m_commands);
+    if(m_game->showObjects() && m_objects)
+        m_objects->queue(renderCtx, m_commands, m_frustum);
+    vec3 toPlayer = m_player->location() - m_frustum.eye();
+    uint32_t playerDepth = RenderQueue::quantizeDepth(sqrtf(toPlayer.lengthSquared()),
+                                                      m_frustum.farPlane());
+    m_game->queuePlayer(renderCtx, m_commands,
+                        RenderQueue::makeKey(RenderQueue::OpaquePass, CharacterSource,
+                                             0, 0, playerDepth));
+    m_queueStat->endTime();
+    
+    // Sort the packets and draw them in batches.
+    m_drawStat->beginTime();
+    m_drawStatGPU->beginTime();
+    ProgramBackend backend(renderCtx, prog);
+    m_commands.execute(&backend);
+    m_drawStatGPU->endTime();
+    m_drawStat->endTime();
+    m_packetsStat->setCurrent(m_commands.packetCount());
+    m_batchesStat->setCurrent(m_commands.batchCount());
+    m_trianglesStat->setCurrent(m_commands.triangleCount());
     
     // draw sound trigger volumes
     if(m_game->showSoundTriggers())
@@ -398,9 +764,6 @@ void Zone::draw(RenderContext *renderCtx, RenderProgram *prog)
         //    prog->drawBox(actor->boundsAA);
     }
     
-    // Draw the character.
-    m_game->drawPlayer(renderCtx, prog);
-    
     renderCtx->popMatrix();
 }
 
@@ -434,6 +797,616 @@ ZoneInfo::ZoneInfo()
 
 ////////////////////////////////////////////////////////////////////////////////
 
+const uint32_t RegionTree::LeafBit = 0x80000000;
+
+RegionTree::RegionTree()
+{
+    m_root = LeafBit;
+}
+
+uint32_t RegionTree::nodeCount() const
+{
+    return m_nodes.count();
+}
+
+const RegionTreeFlatNode * RegionTree::nodes() const
+{
+    return m_nodes.constData();
+}
+
+static uint32_t leafOrNode(const QVector<RegionTreeNode> &nodes, uint32_t nodeIdx)
+{
+    // Empty children (zero) and leaves both become leaf references.
+    if(nodeIdx == 0)
+        return RegionTree::LeafBit;
+    uint32_t regionID = nodes[nodeIdx - 1].regionID;
+    return regionID ? (RegionTree::LeafBit | regionID) : 0;
+}
+
+/*!
+  \brief Repack the fragment's nodes (1-based, with leaves stored as nodes)
+  so that only inner nodes remain, in depth-first order.
+  */
+void RegionTree::build(const QVector<RegionTreeNode> &nodes)
+{
+    m_nodes.clear();
+    m_root = LeafBit;
+    if(nodes.count() == 0)
+        return;
+    m_root = leafOrNode(nodes, 1);
+    if(m_root & LeafBit)
+        return;
+    
+    // Each stack entry is a source node index and the location of the
+    // reference to patch once the node has been given its new index.
+    QVector<QPair<uint32_t, int> > stack;
+    stack.append(qMakePair(1u, -1));
+    while(!stack.isEmpty())
+    {
+        QPair<uint32_t, int> entry = stack.last();
+        stack.pop_back();
+        const RegionTreeNode &src = nodes[entry.first - 1];
+        uint32_t newIdx = m_nodes.count();
+        if(entry.second >= 0)
+            m_nodes[entry.second / 2].children[entry.second % 2] = newIdx;
+        
+        RegionTreeFlatNode node;
+        node.plane[0] = src.normal.x;
+        node.plane[1] = src.normal.y;
+        node.plane[2] = src.normal.z;
+        node.plane[3] = src.distance;
+        node.padding[0] = node.padding[1] = 0;
+        uint32_t childIdx[2] = {src.left, src.right};
+        for(int i = 0; i < 2; i++)
+        {
+            node.children[i] = leafOrNode(nodes, childIdx[i]);
+            Q_ASSERT((childIdx[i] <= (uint32_t)nodes.count()) && (childIdx[i] != entry.first));
+        }
+        m_nodes.append(node);
+        
+        // Visit the front child first so that it directly follows its parent.
+        for(int i = 1; i >= 0; i--)
+        {
+            if(!(node.children[i] & LeafBit))
+                stack.append(qMakePair(childIdx[i], (int)(newIdx * 2 + i)));
+        }
+    }
+}
+
+void RegionTree::clear()
+{
+    m_nodes.clear();
+    m_root = LeafBit;
+}
+
+uint32_t RegionTree::findRegion(const vec3 &pos) const
+{
+    const RegionTreeFlatNode *nodes = m_nodes.constData();
+    uint32_t ref = m_root;
+    while(!(ref & LeafBit))
+    {
+        const float *p = nodes[ref].plane;
+        float distance = (p[0] * pos.x) + (p[1] * pos.y) + (p[2] * pos.z) + p[3];
+        ref = nodes[ref].children[distance < 0.0f];
+    }
+    return ref & ~LeafBit;
+}
+
+/*!
+  \brief Range of points reaching a node of the region tree.
+  */
+struct RegionPacket
+{
+    uint32_t ref;
+    uint32_t begin;
+    uint32_t end;
+};
+
+/*!
+  \brief Find the region of each point. All points are classified in a single
+  traversal of the tree: the points reaching a node are split in two groups
+  using the node's plane and each group continues down its side of the tree.
+  The point indices are shuffled in 'scratch', which the caller can keep
+  between calls to avoid allocating it every time.
+  */
+void RegionTree::findRegions(const vec3 *points, uint32_t count, uint32_t *regions,
+                             QVector<uint32_t> &scratch) const
+{
+    if(count == 0)
+        return;
+    scratch.resize(count);
+    uint32_t *idx = scratch.data();
+    for(uint32_t i = 0; i < count; i++)
+        idx[i] = i;
+    
+    QVarLengthArray<RegionPacket, 64> stack;
+    RegionPacket root = {m_root, 0, count};
+    stack.append(root);
+    const RegionTreeFlatNode *nodes = m_nodes.constData();
+    while(stack.count() > 0)
+    {
+        RegionPacket packet = stack[stack.count() - 1];
+        stack.resize(stack.count() - 1);
+        if(packet.ref & LeafBit)
+        {
+            uint32_t regionID = packet.ref & ~LeafBit;
+            for(uint32_t i = packet.begin; i < packet.end; i++)
+                regions[idx[i]] = regionID;
+            continue;
+        }
+        
+        // Move the points in front of the plane to the start of the packet,
+        // classifying them four at a time.
+        const RegionTreeFlatNode &node = nodes[packet.ref];
+        float4 nx = float4::splat(node.plane[0]), ny = float4::splat(node.plane[1]);
+        float4 nz = float4::splat(node.plane[2]), nd = float4::splat(node.plane[3]);
+        float4 zero = float4::splat(0.0f);
+        uint32_t front = packet.begin, i = packet.begin;
+        for(; (i + 4) <= packet.end; i += 4)
+        {
+            const vec3 &p0 = points[idx[i]], &p1 = points[idx[i + 1]];
+            const vec3 &p2 = points[idx[i + 2]], &p3 = points[idx[i + 3]];
+            float4 d = (nx * float4(p0.x, p1.x, p2.x, p3.x))
+                     + (ny * float4(p0.y, p1.y, p2.y, p3.y))
+                     + (nz * float4(p0.z, p1.z, p2.z, p3.z)) + nd;
+            int backMask = float4::lessThan(d, zero);
+            for(int j = 0; j < 4; j++)
+            {
+                if(!(backMask & (1 << j)))
+                    qSwap(idx[front++], idx[i + j]);
+            }
+        }
+        for(; i < packet.end; i++)
+        {
+            const vec3 &p = points[idx[i]];
+            float distance = (node.plane[0] * p.x) + (node.plane[1] * p.y)
+                           + (node.plane[2] * p.z) + node.plane[3];
+            if(distance >= 0.0f)
+                qSwap(idx[front++], idx[i]);
+        }
+        
+        RegionPacket backPacket = {node.children[1], front, packet.end};
+        RegionPacket frontPacket = {node.children[0], packet.begin, front};
+        if(backPacket.begin < backPacket.end)
+            stack.append(backPacket);
+        if(frontPacket.begin < frontPacket.end)
+            stack.append(frontPacket);
+    }
+}
+
+/*!
+  \brief Find the regions that intersect the sphere.
+  \return Number of region IDs written to 'regions'.
+  */
+uint32_t RegionTree::findRegions(const Sphere &s, uint32_t *regions, uint32_t maxRegions) const
+{
+    uint32_t found = 0;
+    QVarLengthArray<uint32_t, 64> stack;
+    stack.append(m_root);
+    const RegionTreeFlatNode *nodes = m_nodes.constData();
+    while((stack.count() > 0) && (found < maxRegions))
+    {
+        uint32_t ref = stack[stack.count() - 1];
+        stack.resize(stack.count() - 1);
+        if(ref & LeafBit)
+        {
+            if(ref != LeafBit)
+                regions[found++] = ref & ~LeafBit;
+            continue;
+        }
+        const float *p = nodes[ref].plane;
+        float distance = (p[0] * s.pos.x) + (p[1] * s.pos.y) + (p[2] * s.pos.z) + p[3];
+        // Push the back child first so that the front side is visited first.
+        if((distance <= 0.0f) || (s.radius >= distance))
+            stack.append(nodes[ref].children[1]);
+        if((distance >= 0.0f) || (s.radius >= -distance))
+            stack.append(nodes[ref].children[0]);
+    }
+    return found;
+}
+
+/*!
+  \brief Find the region that fully contains the sphere.
+  \return Region ID, or zero if the sphere is in several regions.
+  */
+uint32_t RegionTree::findContainingRegion(const Sphere &s) const
+{
+    const RegionTreeFlatNode *nodes = m_nodes.constData();
+    uint32_t ref = m_root;
+    while(!(ref & LeafBit))
+    {
+        const float *p = nodes[ref].plane;
+        float distance = (p[0] * s.pos.x) + (p[1] * s.pos.y) + (p[2] * s.pos.z) + p[3];
+        if(distance >= s.radius)
+            ref = nodes[ref].children[0];
+        else if(distance <= -s.radius)
+            ref = nodes[ref].children[1];
+        else
+            return 0;
+    }
+    return ref & ~LeafBit;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RegionPVS::RegionPVS()
+{
+    m_regionCount = 0;
+    m_wordCount = 0;
+}
+
+uint32_t RegionPVS::regionCount() const
+{
+    return m_regionCount;
+}
+
+uint32_t RegionPVS::wordCount() const
+{
+    return m_wordCount;
+}
+
+const uint32_t * RegionPVS::bits(uint32_t regionID) const
+{
+    Q_ASSERT(regionID <= m_regionCount);
+    return m_bits.constData() + (regionID * m_wordCount);
+}
+
+bool RegionPVS::isVisible(uint32_t fromRegion, uint32_t toRegion) const
+{
+    if((fromRegion == 0) || (toRegion == 0))
+        return true;
+    const uint32_t *fromBits = bits(fromRegion);
+    return (fromBits[toRegion / 32] & (1u << (toRegion % 32))) != 0;
+}
+
+void RegionPVS::build(WLDData *wld)
+{
+    WLDFragmentArray<RegionFragment> regions = wld->table()->byKind<RegionFragment>();
+    m_regionCount = regions.count();
+    m_wordCount = (m_regionCount + 32) / 32;
+    m_bits.fill(0, (m_regionCount + 1) * m_wordCount);
+    for(uint32_t i = 1; i <= m_regionCount; i++)
+    {
+        uint32_t *regionBits = m_bits.data() + (i * m_wordCount);
+        const QVector<uint16_t> &nearby = regions[i - 1]->m_nearbyRegions;
+        if(nearby.count() == 0)
+        {
+            // Without a nearby list, assume that every region can be seen.
+            for(uint32_t j = 1; j <= m_regionCount; j++)
+                regionBits[j / 32] |= (1u << (j % 32));
+            continue;
+        }
+        regionBits[i / 32] |= (1u << (i % 32));
+        foreach(uint16_t regionID, nearby)
+        {
+            if((regionID > 0) && (regionID <= m_regionCount))
+                regionBits[regionID / 32] |= (1u << (regionID % 32));
+        }
+    }
+}
+
+void RegionPVS::clear()
+{
+    m_regionCount = 0;
+    m_wordCount = 0;
+    m_bits.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t lowestBit(uint32_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    uint32_t index = 0;
+    while(!(bits & 1))
+    {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+const uint32_t TerrainChunks::NoChunk = 0xffffffff;
+const uint32_t TerrainChunks::DefaultTargetTriangles = 2048;
+const float TerrainChunks::DefaultMaxSize = 512.0f;
+
+TerrainChunks::TerrainChunks()
+{
+    m_regionCount = 0;
+    m_wordCount = 0;
+    m_targetTriangles = DefaultTargetTriangles;
+    m_maxSize = DefaultMaxSize;
+}
+
+uint32_t TerrainChunks::count() const
+{
+    return m_chunks.count();
+}
+
+const TerrainChunk & TerrainChunks::chunk(uint32_t chunkID) const
+{
+    return m_chunks[chunkID];
+}
+
+const uint32_t * TerrainChunks::regions() const
+{
+    return m_regions.constData();
+}
+
+/*!
+  \brief Chunk the region belongs to, or NoChunk if the region has no triangles.
+  */
+uint32_t TerrainChunks::chunkOf(uint32_t regionID) const
+{
+    return (regionID <= m_regionCount) ? m_regionChunks[regionID] : NoChunk;
+}
+
+uint32_t TerrainChunks::wordCount() const
+{
+    return m_wordCount;
+}
+
+const uint32_t * TerrainChunks::loadedBits() const
+{
+    return m_loadedBits.constData();
+}
+
+/*!
+  \brief Chunks that contain at least one region visible from the region.
+  buildPVS() must have been called.
+  */
+const uint32_t * TerrainChunks::pvsBits(uint32_t regionID) const
+{
+    Q_ASSERT((regionID > 0) && (regionID <= m_regionCount));
+    return m_pvsBits.constData() + (regionID * m_wordCount);
+}
+
+static float largestExtent(const AABox &b)
+{
+    vec3 extent = b.high - b.low;
+    return qMax(extent.x, qMax(extent.y, extent.z));
+}
+
+/*!
+  \brief Cluster the regions into chunks. 'triangleCounts' and 'regionBounds'
+  are indexed by region ID, regions without triangles are left out.
+  The result only depends on the inputs, so the same zone always gets the
+  same chunks.
+  */
+void TerrainChunks::build(const RegionTree &tree, const AABoxArray &regionBounds,
+                          const uint32_t *triangleCounts, uint32_t regionCount,
+                          uint32_t targetTriangles, float maxSize)
+{
+    clear();
+    m_regionCount = regionCount;
+    m_targetTriangles = targetTriangles;
+    m_maxSize = maxSize;
+    m_regionChunks.fill(NoChunk, regionCount + 1);
+    
+    // Sum the triangles and bounds of each subtree. Children come after their
+    // parent in the flat node array, so the nodes are visited backwards.
+    const RegionTreeFlatNode *nodes = tree.nodes();
+    uint32_t nodeCount = tree.nodeCount();
+    QVector<uint32_t> nodeTriangles(nodeCount, 0);
+    QVector<AABox> nodeBounds(nodeCount);
+    for(int32_t i = (int32_t)nodeCount - 1; i >= 0; i--)
+    {
+        for(int j = 0; j < 2; j++)
+        {
+            uint32_t ref = nodes[i].children[j];
+            uint32_t triangles = 0;
+            AABox bounds;
+            if(ref & RegionTree::LeafBit)
+            {
+                uint32_t regionID = ref & ~RegionTree::LeafBit;
+                if((regionID == 0) || (regionID > regionCount))
+                    continue;
+                triangles = triangleCounts[regionID];
+                bounds = regionBounds.at(regionID);
+            }
+            else
+            {
+                triangles = nodeTriangles[ref];
+                bounds = nodeBounds[ref];
+            }
+            if(triangles == 0)
+                continue;
+            if(nodeTriangles[i] == 0)
+                nodeBounds[i] = bounds;
+            else
+                nodeBounds[i].extendTo(bounds);
+            nodeTriangles[i] += triangles;
+        }
+    }
+    
+    // Walk the tree front side first, splitting it into units: subtrees that
+    // fit in a chunk, or single regions. Consecutive units are neighbours in
+    // the tree and are packed together while the chunk stays small enough.
+    QVector<uint8_t> assigned(regionCount + 1, 0);
+    QVector<uint32_t> unitRegions;
+    QVector<uint32_t> chunkRegions;
+    uint32_t chunkTriangles = 0;
+    AABox chunkBounds;
+    QVector<uint32_t> stack, subtreeStack;
+    if(nodeCount > 0)
+        stack.append(0);
+    while(!stack.isEmpty())
+    {
+        uint32_t ref = stack.last();
+        stack.pop_back();
+        uint32_t unitTriangles = 0;
+        AABox unitBounds;
+        unitRegions.resize(0);
+        if(ref & RegionTree::LeafBit)
+        {
+            uint32_t regionID = ref & ~RegionTree::LeafBit;
+            if((regionID == 0) || (regionID > regionCount) || (triangleCounts[regionID] == 0))
+                continue;
+            unitRegions.append(regionID);
+            unitTriangles = triangleCounts[regionID];
+            unitBounds = regionBounds.at(regionID);
+        }
+        else if((nodeTriangles[ref] == 0) || (nodeTriangles[ref] > targetTriangles)
+                || (largestExtent(nodeBounds[ref]) > maxSize))
+        {
+            // Too big for one chunk, visit the front side first.
+            if(nodeTriangles[ref] > 0)
+            {
+                stack.append(nodes[ref].children[1]);
+                stack.append(nodes[ref].children[0]);
+            }
+            continue;
+        }
+        else
+        {
+            // Gather the regions of the subtree in the same front-first order.
+            subtreeStack.resize(0);
+            subtreeStack.append(ref);
+            while(!subtreeStack.isEmpty())
+            {
+                uint32_t subRef = subtreeStack.last();
+                subtreeStack.pop_back();
+                if(subRef & RegionTree::LeafBit)
+                {
+                    uint32_t regionID = subRef & ~RegionTree::LeafBit;
+                    if((regionID > 0) && (regionID <= regionCount) && (triangleCounts[regionID] > 0))
+                        unitRegions.append(regionID);
+                    continue;
+                }
+                subtreeStack.append(nodes[subRef].children[1]);
+                subtreeStack.append(nodes[subRef].children[0]);
+            }
+            unitTriangles = nodeTriangles[ref];
+            unitBounds = nodeBounds[ref];
+        }
+        
+        // A region referenced by several leaves only goes to the first chunk.
+        int kept = 0;
+        for(int i = 0; i < unitRegions.count(); i++)
+        {
+            uint32_t regionID = unitRegions[i];
+            if(!assigned[regionID])
+            {
+                assigned[regionID] = 1;
+                unitRegions[kept++] = regionID;
+            }
+        }
+        if(kept < unitRegions.count())
+        {
+            unitRegions.resize(kept);
+            unitTriangles = 0;
+            for(int i = 0; i < kept; i++)
+            {
+                uint32_t regionID = unitRegions[i];
+                if(i == 0)
+                    unitBounds = regionBounds.at(regionID);
+                else
+                    unitBounds.extendTo(regionBounds.at(regionID));
+                unitTriangles += triangleCounts[regionID];
+            }
+        }
+        if(unitRegions.isEmpty())
+            continue;
+        
+        if(!chunkRegions.isEmpty())
+        {
+            AABox merged = chunkBounds;
+            merged.extendTo(unitBounds);
+            if(((chunkTriangles + unitTriangles) > targetTriangles)
+                || (largestExtent(merged) > maxSize))
+            {
+                addRegions(chunkRegions.constData(), chunkRegions.count(),
+                           chunkTriangles, chunkBounds);
+                chunkRegions.resize(0);
+            }
+        }
+        if(chunkRegions.isEmpty())
+        {
+            chunkTriangles = 0;
+            chunkBounds = unitBounds;
+        }
+        else
+        {
+            chunkBounds.extendTo(unitBounds);
+        }
+        chunkRegions += unitRegions;
+        chunkTriangles += unitTriangles;
+    }
+    if(!chunkRegions.isEmpty())
+        addRegions(chunkRegions.constData(), chunkRegions.count(), chunkTriangles, chunkBounds);
+    
+    // Regions that are not in the tree still need to be drawn.
+    for(uint32_t i = 1; i <= regionCount; i++)
+    {
+        if((triangleCounts[i] > 0) && (m_regionChunks[i] == NoChunk))
+            addRegions(&i, 1, triangleCounts[i], regionBounds.at(i));
+    }
+    
+    m_wordCount = (m_chunks.count() + 31) / 32;
+    m_loadedBits.fill(0, m_wordCount);
+    for(int i = 0; i < m_chunks.count(); i++)
+        m_loadedBits[i / 32] |= (1u << (i % 32));
+}
+
+void TerrainChunks::addRegions(const uint32_t *regionIDs, uint32_t count,
+                               uint32_t triangles, const AABox &bounds)
+{
+    TerrainChunk chunk;
+    chunk.bounds = bounds;
+    chunk.firstRegion = m_regions.count();
+    chunk.regionCount = count;
+    chunk.triangleCount = triangles;
+    uint32_t chunkID = m_chunks.count();
+    for(uint32_t i = 0; i < count; i++)
+    {
+        m_regions.append(regionIDs[i]);
+        m_regionChunks[regionIDs[i]] = chunkID;
+    }
+    m_chunks.append(chunk);
+}
+
+/*!
+  \brief Build the chunk PVS of each region from the region PVS: a chunk is
+  visible from a region if any of its regions is.
+  */
+void TerrainChunks::buildPVS(const uint32_t *regionBits, uint32_t regionWordCount)
+{
+    m_pvsBits.fill(0, (m_regionCount + 1) * m_wordCount);
+    for(uint32_t i = 1; i <= m_regionCount; i++)
+    {
+        const uint32_t *fromBits = regionBits + (i * regionWordCount);
+        uint32_t *chunkBits = m_pvsBits.data() + (i * m_wordCount);
+        for(uint32_t j = 0; j < regionWordCount; j++)
+        {
+            uint32_t bits = fromBits[j];
+            while(bits)
+            {
+                uint32_t regionID = (j * 32) + lowestBit(bits);
+                bits &= (bits - 1);
+                uint32_t chunkID = chunkOf(regionID);
+                if(chunkID != NoChunk)
+                    chunkBits[chunkID / 32] |= (1u << (chunkID % 32));
+            }
+        }
+    }
+}
+
+void TerrainChunks::clear()
+{
+    m_chunks.clear();
+    m_regions.clear();
+    m_regionChunks.clear();
+    m_loadedBits.clear();
+    m_pvsBits.clear();
+    m_regionCount = 0;
+    m_wordCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 ZoneTerrain::ZoneTerrain(Zone *zone)
 {
     m_zone = zone;
@@ -441,11 +1414,10 @@ ZoneTerrain::ZoneTerrain(Zone *zone)
     m_currentRegion = 0;
     m_uploaded = false;
     m_zoneWld = NULL;
-    m_regionTree = NULL;
+    m_regionTree.clear();
     m_zoneBuffer = NULL;
     m_palette = NULL;
-    m_zoneStat = NULL;
-    m_zoneStatGPU = NULL;
+    m_hasTransparent = false;
 }
 
 ZoneTerrain::~ZoneTerrain()
@@ -463,6 +1435,63 @@ uint32_t ZoneTerrain::currentRegion() const
     return m_currentRegion;
 }
 
+const RegionTree & ZoneTerrain::regionTree() const
+{
+    return m_regionTree;
+}
+
+const RegionPVS & ZoneTerrain::pvs() const
+{
+    return m_pvs;
+}
+
+const TerrainChunks & ZoneTerrain::chunks() const
+{
+    return m_chunks;
+}
+
+MeshBuffer * ZoneTerrain::buffer() const
+{
+    return m_zoneBuffer;
+}
+
+uint32_t ZoneTerrain::regionCount() const
+{
+    return m_regionCount;
+}
+
+/*!
+  \brief Actor that draws the given region, or NULL if the region has no mesh.
+  Region IDs start at 1.
+  */
+WLDStaticActor * ZoneTerrain::regionActor(uint32_t regionID) const
+{
+    return ((regionID > 0) && (regionID <= m_regionCount)) ? m_regionActors[regionID] : NULL;
+}
+
+uint32_t ZoneTerrain::chunkWordCount() const
+{
+    return m_chunks.wordCount();
+}
+
+uint32_t ZoneTerrain::visibleChunkCount() const
+{
+    return m_visibleChunks.count();
+}
+
+const QVector<uint32_t> & ZoneTerrain::visibleChunks() const
+{
+    return m_visibleChunks;
+}
+
+/*!
+  \brief Determine whether the region can be seen from the current region.
+  */
+bool ZoneTerrain::isRegionVisible(uint32_t regionID) const
+{
+    return m_pvs.isVisible(m_currentRegion, regionID);
+}
+
 void ZoneTerrain::clear(RenderContext *renderCtx)
 {
     for(uint32_t i = 1; i <= m_regionCount; i++)
@@ -480,11 +1509,21 @@ void ZoneTerrain::clear(RenderContext *renderCtx)
         }
     }
     m_regionActors.clear();
+    m_regionBounds.clear();
+    m_pvs.clear();
+    m_chunks.clear();
+    m_chunkBounds.clear();
+    m_visibleBits.clear();
+    m_visibleChunks.clear();
+    m_chunkGroups.clear();
+    m_chunkFirstGroups.clear();
     m_regionShapes.clear();
-    m_visibleRegions.clear();
+    m_occluderVertices.clear();
+    m_occluderOffsets.clear();
+    m_occluderCounts.clear();
     m_regionCount = 0;
     m_currentRegion = 0;
-    m_regionTree = NULL;
+    m_regionTree.clear();
     
     if(m_zoneBuffer)
     {
@@ -495,14 +1534,7 @@ void ZoneTerrain::clear(RenderContext *renderCtx)
     
     delete m_palette;
     m_palette = NULL;
-    
-    if(renderCtx)
-    {
-        renderCtx->destroyStat(m_zoneStat);
-        renderCtx->destroyStat(m_zoneStatGPU);
-        m_zoneStat = NULL;
-        m_zoneStatGPU = NULL;
-    }
+    m_hasTransparent = false;
     m_zoneWld = NULL;
 }
 
@@ -515,17 +1547,21 @@ bool ZoneTerrain::load(PFSArchive *archive, WLDData *wld)
     WLDFragmentArray<RegionTreeFragment> regionTrees = wld->table()->byKind<RegionTreeFragment>();
     if(regionTrees.count() != 1)
         return false;
-    m_regionTree = regionTrees[0];
+    m_regionTree.build(regionTrees[0]->m_nodes);
     WLDFragmentArray<RegionFragment> regionDefs = wld->table()->byKind<RegionFragment>();
     if(regionDefs.count() == 0)
         return false;
     m_regionCount = regionDefs.count();
+    m_pvs.build(wld);
     m_regionActors.resize(m_regionCount + 1, NULL);
+    m_regionBounds.resize(m_regionCount + 1);
     m_regionShapes.resize(m_regionCount + 1, NULL);
-    m_visibleRegions.reserve(m_regionCount);
+    m_occluderOffsets.fill(0, m_regionCount + 1);
+    m_occluderCounts.fill(0, m_regionCount + 1);
     
     // Load zone regions as model parts, computing the zone's bounding box.
     m_zoneBounds = AABox();
+    QVector<uint32_t> regionTriangles(m_regionCount + 1, 0);
     WLDFragmentArray<MeshDefFragment> meshDefs = wld->table()->byKind<MeshDefFragment>();
     for(uint32_t i = 0; i < meshDefs.count(); i++)
     {
@@ -542,7 +1578,37 @@ bool ZoneTerrain::load(PFSArchive *archive, WLDData *wld)
         m_zoneBounds.extendTo(meshPart->boundsAA());
         // XXX stop using WLDStaticActor for zone regions?
         m_regionActors[regionID] = new WLDStaticActor(NULL, meshPart);
+        m_regionBounds.set(regionID, meshPart->boundsAA());
+        regionTriangles[regionID] = meshDef->m_indices.count() / 3;
+        importOccluders(meshDef, regionID);
+    }
+    
+    // Cluster the regions into chunks, which are culled and drawn instead of
+    // regions. Chunk bounds are tested 32 at a time against the PVS.
+    m_chunks.build(m_regionTree, m_regionBounds, regionTriangles.constData(),
+                   m_regionCount, TerrainChunks::DefaultTargetTriangles,
+                   TerrainChunks::DefaultMaxSize);
+    m_chunks.buildPVS(m_pvs.bits(0), m_pvs.wordCount());
+    uint32_t chunkCount = m_chunks.count(), maxTriangles = 0;
+    m_chunkBounds.resize(m_chunks.wordCount() * 32);
+    for(uint32_t i = 0; i < chunkCount; i++)
+    {
+        const TerrainChunk &chunk = m_chunks.chunk(i);
+        m_chunkBounds.set(i, chunk.bounds);
+        maxTriangles = qMax(maxTriangles, chunk.triangleCount);
     }
+    m_visibleBits.resize(m_chunks.wordCount());
+    m_visibleChunks.reserve(chunkCount);
+    uint32_t chunkRegions = chunkCount ? (m_chunks.chunk(chunkCount - 1).firstRegion +
+                                          m_chunks.chunk(chunkCount - 1).regionCount) : 0;
+    uint32_t totalTriangles = 0;
+    for(uint32_t i = 1; i <= m_regionCount; i++)
+        totalTriangles += regionTriangles[i];
+    qDebug("Terrain: %d regions, %d with triangles, %d chunks "
+           "(%.1f regions and %.0f triangles per chunk, at most %d)",
+           m_regionCount, chunkRegions, chunkCount,
+           chunkRegions / (float)qMax(chunkCount, 1u),
+           totalTriangles / (float)qMax(chunkCount, 1u), maxTriangles);
     vec3 padding(1.0, 1.0, 1.0);
     m_zoneBounds.low = m_zoneBounds.low - padding;
     m_zoneBounds.high = m_zoneBounds.high + padding;
@@ -559,61 +1625,75 @@ bool ZoneTerrain::load(PFSArchive *archive, WLDData *wld)
     m_palette->createArray();
     m_palette->createMap();
     
-    // Import vertices and indices for each mesh.
+    // Import vertices and indices for each mesh, chunk by chunk so that the
+    // regions of a chunk stay next to each other once grouped by material.
     m_zoneBuffer = new MeshBuffer();
+    const uint32_t *regions = m_chunks.regions();
+    for(uint32_t i = 0; i < chunkRegions; i++)
+        m_regionActors[regions[i]]->mesh()->importFrom(m_zoneBuffer);
     for(uint32_t i = 1; i <= m_regionCount; i++)
     {
         WLDStaticActor *actor = m_regionActors[i];
-        if(actor)
+        if(actor && (m_chunks.chunkOf(i) == TerrainChunks::NoChunk))
             actor->mesh()->importFrom(m_zoneBuffer);
     }
     
     return true;
 }
 
-void ZoneTerrain::showAllRegions(const Frustum &frustum)
+void ZoneTerrain::showAllChunks(const Frustum &frustum)
 {
-    for(uint32_t i = 0; i < m_regionCount; i++)
+    cullChunks(frustum, false, 0, chunkWordCount());
+    showCulledChunks();
+}
+
+void ZoneTerrain::showNearbyChunks(const Frustum &frustum)
+{
+    cullChunks(frustum, true, 0, chunkWordCount());
+    showCulledChunks();
+}
+
+/*!
+  \brief Find the chunks in the frustum whose ID is in the range
+  [firstWord * 32, lastWord * 32). With usePVS only the chunks in the PVS of
+  the current region are tested. Disjoint ranges can be culled in parallel;
+  showCulledChunks() then shows all the chunks found.
+  */
+void ZoneTerrain::cullChunks(const Frustum &frustum, bool usePVS,
+                             uint32_t firstWord, uint32_t lastWord)
+{
+    uint32_t *visibleBits = &m_visibleBits[0];
+    if(usePVS && (m_currentRegion == 0))
     {
-        WLDStaticActor *actor = m_regionActors[i];
-        if(actor)
-        {
-            if(frustum.containsAABox(actor->boundsAA()) != OUTSIDE)
-                m_visibleRegions.push_back(actor);
-        }
+        for(uint32_t i = firstWord; i < lastWord; i++)
+            visibleBits[i] = 0;
+        return;
     }
+    const uint32_t *mask = usePVS ? m_chunks.pvsBits(m_currentRegion) : m_chunks.loadedBits();
+    frustum.findVisibleBits(m_chunkBounds, mask, firstWord, lastWord, visibleBits);
 }
 
-void ZoneTerrain::showNearbyRegions(const Frustum &frustum)
+void ZoneTerrain::showCulledChunks()
 {
-    if(m_currentRegion == 0)
-        return;
-    WLDFragmentArray<RegionFragment> regions = m_zoneWld->table()->byKind<RegionFragment>();
-    RegionFragment *region = regions[m_currentRegion - 1];
-    uint32_t count = region->m_nearbyRegions.count();
-    for(uint32_t i = 0; i < count; i++)
+    uint32_t wordCount = chunkWordCount();
+    for(uint32_t i = 0; i < wordCount; i++)
     {
-        uint32_t regionID = region->m_nearbyRegions[i];
-        Q_ASSERT(regionID <= m_regionCount);
-        WLDStaticActor *actor = m_regionActors[regionID];
-        if(actor)
+        uint32_t bits = m_visibleBits[i];
+        while(bits)
         {
-            if(frustum.containsAABox(actor->boundsAA()) != OUTSIDE)
-                m_visibleRegions.push_back(actor);
+            m_visibleChunks.append((i * 32) + lowestBit(bits));
+            bits &= (bits - 1);
         }
     }
 }
 
-void ZoneTerrain::showCurrentRegion(const Frustum &frustum)
+void ZoneTerrain::showCurrentChunk(const Frustum &frustum)
 {
-    if(m_currentRegion == 0)
+    uint32_t chunkID = m_chunks.chunkOf(m_currentRegion);
+    if((m_currentRegion == 0) || (chunkID == TerrainChunks::NoChunk))
         return;
-    WLDStaticActor *actor = m_regionActors[m_currentRegion];
-    if(actor)
-    {
-        if(frustum.containsAABox(actor->boundsAA()) != OUTSIDE)
-            m_visibleRegions.push_back(actor);
-    }
+    if(frustum.containsAABox(m_chunks.chunk(chunkID).bounds) != OUTSIDE)
+        m_visibleChunks.append(chunkID);
 }
 
 uint32_t ZoneTerrain::findNearbyRegionShapes(NewtonCollision **firstRegion,
@@ -657,24 +1737,17 @@ uint32_t ZoneTerrain::findAllRegionShapes(NewtonCollision **firstRegion,
 
 uint32_t ZoneTerrain::findCurrentRegion(const vec3 &cameraPos)
 {
-    return (m_currentRegion = findRegion(cameraPos, m_regionTree->m_nodes.constData(), 1));
+    return (m_currentRegion = findRegion(cameraPos));
 }
 
-uint32_t ZoneTerrain::findRegion(const vec3 &pos, const RegionTreeNode *nodes, uint32_t nodeIdx)
+uint32_t ZoneTerrain::findRegion(const vec3 &pos) const
 {
-    if(nodeIdx == 0)
-        return 0;
-    const RegionTreeNode &node = nodes[nodeIdx-1];
-    if(node.regionID == 0)
-    {
-        float distance = vec3::dot(node.normal, pos) + node.distance;
-        return findRegion(pos, nodes, (distance >= 0.0f) ? node.left : node.right);
-    }
-    else
-    {
-        // Leaf node.
-        return node.regionID;
-    }
+    return m_regionTree.findRegion(pos);
+}
+
+uint32_t ZoneTerrain::findContainingRegion(const Sphere &s) const
+{
+    return m_regionTree.findContainingRegion(s);
 }
 
 /**
@@ -689,46 +1762,16 @@ uint32_t ZoneTerrain::findRegionShapes(Sphere sphere,
                                        NewtonCollision **regions,
                                        uint32_t maxRegions)
 {
+    QVarLengthArray<uint32_t, 128> regionIDs(maxRegions);
+    uint32_t count = m_regionTree.findRegions(sphere, regionIDs.data(), maxRegions);
     uint32_t found = 0;
-    findRegionShapes(sphere, m_regionTree->m_nodes.constData(), 1,
-                     regions, maxRegions, found);
-    return found;
-}
-
-/**
- * @brief Add all regions that intersect the sphere to the region list.
- *
- * @param sphere Sphere to intersect.
- * @param nodes List of nodes that make the region BSP tree.
- * @param nodeIdx Current node to test for intersection.
- * @param regions Array to copy the intersecting regions to.
- * @param maxRegions Maximum number of regions to return in @ref regions.
- * @param found Number of intersection regions found so far.
- */
-void ZoneTerrain::findRegionShapes(const Sphere &sphere,
-                                   const RegionTreeNode *nodes,
-                                   uint32_t nodeIdx,
-                                   NewtonCollision **regions,
-                                   uint32_t maxRegions, uint32_t &found)
-{
-    if((nodeIdx == 0) || (maxRegions == found))
-        return;
-    const RegionTreeNode &node = nodes[nodeIdx-1];
-    if(node.regionID == 0)
-    {
-        float distance = vec3::dot(node.normal, sphere.pos) + node.distance;
-        if((distance >= 0.0f) || (sphere.radius >= -distance))
-            findRegionShapes(sphere, nodes, node.left, regions, maxRegions, found);
-        if((distance <= 0.0f) || (sphere.radius >= distance))
-            findRegionShapes(sphere, nodes, node.right, regions, maxRegions, found);
-    }
-    else
+    for(uint32_t i = 0; i < count; i++)
     {
-        // Leaf node.
-        NewtonCollision *shape = loadRegionShape(node.regionID);
+        NewtonCollision *shape = loadRegionShape(regionIDs[i]);
         if(shape)
             regions[found++] = shape;
     }
+    return found;
 }
 
 NewtonCollision * ZoneTerrain::loadRegionShape(uint32_t regionID)
@@ -778,9 +1821,113 @@ NewtonCollision * ZoneTerrain::loadRegionShape(uint32_t regionID)
     return shape;
 }
 
+void ZoneTerrain::importOccluders(MeshDefFragment *meshDef, uint32_t regionID)
+{
+    // Only keep large triangles that can't be seen through, small ones
+    // would cost more to rasterize than they could save.
+    const float minArea = 32.0f;
+    const QVector<vec3> &vertices = meshDef->m_vertices;
+    const QVector<uint16_t> &indices = meshDef->m_indices;
+    const QVector<uint16_t> &flags = meshDef->m_polygonFlags;
+    m_occluderOffsets[regionID] = m_occluderVertices.count() / 3;
+    for(int i = 0; (i + 2) < indices.count(); i += 3)
+    {
+        uint16_t polyFlags = flags.value(i / 3);
+        if(polyFlags & MeshDefFragment::POLY_WALK_THROUGH)
+            continue;
+        vec3 a = vertices.value(indices[i]) + meshDef->m_center;
+        vec3 b = vertices.value(indices[i + 1]) + meshDef->m_center;
+        vec3 c = vertices.value(indices[i + 2]) + meshDef->m_center;
+        vec3 n = vec3::cross(b - a, c - a);
+        if((0.5f * sqrt(n.lengthSquared())) < minArea)
+            continue;
+        m_occluderVertices.append(a);
+        m_occluderVertices.append(b);
+        m_occluderVertices.append(c);
+    }
+    m_occluderCounts[regionID] = (m_occluderVertices.count() / 3) - m_occluderOffsets[regionID];
+}
+
+uint32_t ZoneTerrain::addOccluders(OcclusionBuffer &buffer, const vec3 &eye,
+                                   uint32_t maxTriangles)
+{
+    // Nearer regions are more likely to hide things, add them first.
+    m_occluderRegions.resize(0);
+    const uint32_t *regions = m_chunks.regions();
+    foreach(uint32_t chunkID, m_visibleChunks)
+    {
+        const TerrainChunk &chunk = m_chunks.chunk(chunkID);
+        for(uint32_t i = 0; i < chunk.regionCount; i++)
+        {
+            uint32_t regionID = regions[chunk.firstRegion + i];
+            if(m_occluderCounts.value(regionID) == 0)
+                continue;
+            AABox bb = m_regionBounds.at(regionID);
+            vec3 nearest(qBound(bb.low.x, eye.x, bb.high.x),
+                         qBound(bb.low.y, eye.y, bb.high.y),
+                         qBound(bb.low.z, eye.z, bb.high.z));
+            float distance = (nearest - eye).lengthSquared();
+            m_occluderRegions.append(qMakePair(distance, regionID));
+        }
+    }
+    qSort(m_occluderRegions.begin(), m_occluderRegions.end());
+    
+    uint32_t added = 0;
+    for(int i = 0; (i < m_occluderRegions.count()) && (added < maxTriangles); i++)
+    {
+        uint32_t regionID = m_occluderRegions[i].second;
+        uint32_t count = qMin(m_occluderCounts[regionID], maxTriangles - added);
+        const vec3 *vertices = m_occluderVertices.constData() + (m_occluderOffsets[regionID] * 3);
+        buffer.addOccluder(vertices, count);
+        added += count;
+    }
+    return added;
+}
+
 void ZoneTerrain::resetVisible()
 {
-    m_visibleRegions.clear();
+    m_visibleChunks.resize(0);
+}
+
+static bool groupOffsetLessThan(const MaterialGroup &a, const MaterialGroup &b)
+{
+    return a.offset < b.offset;
+}
+
+/*!
+  \brief Gather the material groups of each chunk's regions, merging the
+  groups whose indices follow each other in the buffer.
+  */
+void ZoneTerrain::createChunkGroups()
+{
+    m_chunkGroups.clear();
+    m_chunkFirstGroups.clear();
+    QVector<MaterialGroup> groups;
+    const uint32_t *regions = m_chunks.regions();
+    for(uint32_t i = 0; i < m_chunks.count(); i++)
+    {
+        const TerrainChunk &chunk = m_chunks.chunk(i);
+        groups.resize(0);
+        for(uint32_t j = 0; j < chunk.regionCount; j++)
+        {
+            MeshData *meshData = m_regionActors[regions[chunk.firstRegion + j]]->mesh()->data();
+            const MaterialGroup *ranges = meshData->ranges();
+            for(uint32_t k = 0; k < meshData->groupCount; k++)
+                groups.append(ranges[k]);
+        }
+        qSort(groups.begin(), groups.end(), groupOffsetLessThan);
+        m_chunkFirstGroups.append(m_chunkGroups.count());
+        for(int j = 0; j < groups.count(); j++)
+        {
+            const MaterialGroup &mg = groups[j];
+            if((j > 0) && (mg.matID == m_chunkGroups.last().matID) &&
+                (mg.offset == (m_chunkGroups.last().offset + m_chunkGroups.last().count)))
+                m_chunkGroups.last().count += mg.count;
+            else
+                m_chunkGroups.append(mg);
+        }
+    }
+    m_chunkFirstGroups.append(m_chunkGroups.count());
 }
 
 void ZoneTerrain::upload(RenderContext *renderCtx)
@@ -793,6 +1940,18 @@ void ZoneTerrain::upload(RenderContext *renderCtx)
     // Upload the materials as a texture array, assigning z coordinates to materials.
     MaterialArray *materials = m_palette->array();
     materials->uploadArray(renderCtx);
+    m_hasTransparent = false;
+    foreach(Material *mat, materials->materials())
+    {
+        if(mat && !mat->isOpaque())
+            m_hasTransparent = true;
+    }
+    
+    // Lay out the indices of all regions material by material, so that the
+    // visible regions that use a material can be drawn with few ranges.
+    m_zoneBuffer->groupIndicesByMaterial(materials);
+    createChunkGroups();
+    m_visibleGroups.reserve(m_chunkGroups.count());
     
     // Import vertices and indices for each mesh.
     for(uint32_t i = 1; i <= m_regionCount; i++)
@@ -817,40 +1976,56 @@ void ZoneTerrain::update(double currentTime)
     m_palette->animate(currentTime);
 }
 
-void ZoneTerrain::draw(RenderContext *renderCtx, RenderProgram *prog)
+/*!
+  \brief Record packets for the visible part of the terrain. The terrain is
+  drawn as one big mesh, so its opaque part is queued before other opaque
+  packets (it hides most of them) and its transparent part as the farthest
+  transparent packet.
+  */
+void ZoneTerrain::queue(RenderContext *renderCtx, CommandQueue &queue)
 {
-    // draw geometry
-    if(!m_zoneStat)
-        m_zoneStat = renderCtx->createStat("Zone CPU (ms)", FrameStat::CPUTime);
-    if(!m_zoneStatGPU)
-        m_zoneStatGPU = renderCtx->createStat("Zone GPU (ms)", FrameStat::GPUTime);
-    m_zoneStat->beginTime();
-    m_zoneStatGPU->beginTime();
-    
     // Create a GPU buffer for the zone's vertices and indices if needed.
     if(!m_uploaded)
         upload(renderCtx);
+    if(m_visibleChunks.isEmpty())
+        return;
     
-    // Import material groups from the visible parts.
-    m_zoneBuffer->matGroups.clear();
-    uint32_t visibleRegions = m_visibleRegions.size();
-    for(uint32_t i = 0; i < visibleRegions; i++)
+    MaterialArray *materials = m_palette->array();
+    uint32_t texture = materials->arrayTexture();
+    uint32_t transform = queue.addTransform(renderCtx->matrix(RenderContext::ModelView));
+    for(int pass = RenderQueue::OpaquePass; pass <= RenderQueue::TransparentPass; pass++)
     {
-        WLDStaticActor *staticActor = m_visibleRegions[i];
-        if(staticActor)
-            m_zoneBuffer->addMaterialGroups(staticActor->mesh()->data());
+        bool opaque = (pass == RenderQueue::OpaquePass);
+        if(!opaque && !m_hasTransparent)
+            break;
+        
+        // Gather the material groups of the visible chunks drawn in this pass.
+        // Chunks are laid out material by material, so sorting the groups
+        // merges those of neighbouring chunks.
+        m_visibleGroups.resize(0);
+        foreach(uint32_t chunkID, m_visibleChunks)
+        {
+            uint32_t first = m_chunkFirstGroups[chunkID];
+            uint32_t last = m_chunkFirstGroups[chunkID + 1];
+            for(uint32_t j = first; j < last; j++)
+            {
+                const MaterialGroup &mg = m_chunkGroups[j];
+                Material *mat = materials->material(mg.matID);
+                if(mat && (mat->isOpaque() == opaque))
+                    m_visibleGroups.append(mg);
+            }
+        }
+        
+        DrawPacket packet;
+        packet.meshBuf = m_zoneBuffer;
+        packet.materials = materials;
+        packet.materialMap = m_palette->map();
+        packet.transform = transform;
+        queue.addSortedGroups(packet, m_visibleGroups.constData(), m_visibleGroups.count());
+        uint32_t depth = opaque ? 0 : ((1 << RenderQueue::DepthBits) - 1);
+        queue.add(RenderQueue::makeKey((RenderQueue::Pass)pass, TerrainSource,
+                                       texture, 0, depth), packet);
     }
-    
-    // Draw the visible parts as one big mesh.
-    MaterialArray *materials = m_palette->array();
-    prog->setMaterialMap(materials, m_palette->map());
-    prog->beginDrawMesh(m_zoneBuffer, materials);
-    prog->drawMesh();
-    prog->endDrawMesh();
-    prog->setMaterialMap(NULL);
-    
-    m_zoneStatGPU->endTime();
-    m_zoneStat->endTime();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -861,9 +2036,11 @@ ZoneObjects::ZoneObjects(Zone *zone)
     m_bounds = zone->terrain()->bounds();
     m_pack = NULL;
     m_objDefWld = 0;
-    m_objectsStat = NULL;
-    m_objectsStatGPU = NULL;
+    m_batchBuf = NULL;
+    m_colorBuf = NULL;
     m_drawnObjectsStat = NULL;
+    m_reducedObjectsStat = NULL;
+    m_drawnBatchesStat = NULL;
 }
 
 ZoneObjects::~ZoneObjects()
@@ -886,11 +2063,39 @@ QVector<WLDStaticActor *> & ZoneObjects::visibleObjects()
     return m_visibleObjects;
 }
 
+const QVector<WLDBatchActor *> & ZoneObjects::batches() const
+{
+    return m_batches;
+}
+
+QVector<WLDBatchActor *> & ZoneObjects::visibleBatches()
+{
+    return m_visibleBatches;
+}
+
 void ZoneObjects::clear(RenderContext *renderCtx)
 {
     foreach(WLDActor *actor, m_objects)
         delete actor;
+    foreach(WLDBatchActor *batch, m_batches)
+        delete batch;
     m_objects.clear();
+    m_singleObjects.clear();
+    m_batches.clear();
+    m_visibleObjects.clear();
+    m_visibleBatches.clear();
+    if(m_batchBuf)
+    {
+        m_batchBuf->clear(renderCtx);
+        delete m_batchBuf;
+        m_batchBuf = NULL;
+    }
+    if(m_colorBuf)
+    {
+        m_colorBuf->clear(renderCtx);
+        delete m_colorBuf;
+        m_colorBuf = NULL;
+    }
     if(m_pack)
     {
         m_pack->clear(renderCtx);
@@ -899,14 +2104,16 @@ void ZoneObjects::clear(RenderContext *renderCtx)
     }
     delete m_objDefWld;
     m_objDefWld = NULL;
+    m_meshIDs.clear();
+    m_meshPasses.clear();
     if(renderCtx)
     {
-        renderCtx->destroyStat(m_objectsStat);
-        renderCtx->destroyStat(m_objectsStatGPU);
         renderCtx->destroyStat(m_drawnObjectsStat);
-        m_objectsStat = NULL;
-        m_objectsStatGPU = NULL;
+        renderCtx->destroyStat(m_reducedObjectsStat);
+        renderCtx->destroyStat(m_drawnBatchesStat);
         m_drawnObjectsStat = NULL;
+        m_reducedObjectsStat = NULL;
+        m_drawnBatchesStat = NULL;
     }
 }
 
@@ -918,7 +2125,7 @@ bool ZoneObjects::load(QString path, QString name, PFSArchive *mainArchive)
     
     QString objMeshPath = QString("%1/%2_obj.s3d").arg(path).arg(name);
     QString objMeshFile = QString("%1_obj.wld").arg(name);
-    m_pack = new ObjectPack();
+    m_pack = new ObjectPack(m_zone->game()->meshPool());
     if(!m_pack->load(objMeshPath, objMeshFile))
     {
         delete m_pack;
@@ -926,6 +2133,7 @@ bool ZoneObjects::load(QString path, QString name, PFSArchive *mainArchive)
         return false;
     }
     importActors();
+    createBatches(m_zone->game()->objectCellSize());
     return true;
 }
 
@@ -952,34 +2160,109 @@ void ZoneObjects::importActors()
     }
 }
 
-void ZoneObjects::addTo(OctreeIndex *tree)
+/*!
+  \brief Merge objects that are in the same cell of a grid into batches. The
+  other objects are culled and drawn one by one. The meshes of the batches are
+  created when uploading the objects.
+  */
+void ZoneObjects::createBatches(float cellSize)
 {
+    foreach(WLDBatchActor *batch, m_batches)
+        delete batch;
+    m_batches.clear();
+    m_singleObjects.clear();
+    
+    // Objects without a fragment are never drawn, leave them out of batches.
+    QVector<WLDStaticActor *> candidates;
+    QVector<AABox> bounds;
     foreach(WLDStaticActor *actor, m_objects)
-        tree->add(actor);   
+    {
+        if(actor->frag())
+        {
+            candidates.append(actor);
+            bounds.append(actor->boundsAA());
+        }
+        else
+        {
+            m_singleObjects.append(actor);
+        }
+    }
+    QVector<uint32_t> cells(candidates.count());
+    uint32_t cellCount = WLDBatchActor::findCells(bounds.constData(), bounds.count(),
+                                                  cellSize, cells.data());
+    m_batches.resize(cellCount);
+    for(uint32_t i = 0; i < cellCount; i++)
+        m_batches[i] = new WLDBatchActor();
+    for(int i = 0; i < candidates.count(); i++)
+    {
+        if(cells[i] == WLDBatchActor::NoCell)
+            m_singleObjects.append(candidates[i]);
+        else
+            m_batches[cells[i]]->addObject(candidates[i]);
+    }
+}
+
+void ZoneObjects::addTo(QVector<WLDActor *> &actors)
+{
+    foreach(WLDStaticActor *actor, m_singleObjects)
+        actors.append(actor);
+    foreach(WLDBatchActor *batch, m_batches)
+        actors.append(batch);
 }
 
 void ZoneObjects::resetVisible()
 {
     m_visibleObjects.clear();
+    m_visibleBatches.clear();
 }
 
 void ZoneObjects::upload(RenderContext *renderCtx)
 {
-    // Copy objects' lighting colors to a GPU buffer.
-    MeshBuffer *meshBuf = m_pack->upload(renderCtx);
-    foreach(WLDStaticActor *actor, m_objects)
-        actor->importColorData(meshBuf);
-    meshBuf->colorBufferSize = meshBuf->colors.count() * sizeof(uint32_t);
-    if(meshBuf->colorBufferSize > 0)
+    // Merge the objects of each batch into one buffer, using the vertices and
+    // indices of the object meshes before the mesh pool frees them.
+    m_pack->import(renderCtx);
+    if(!m_batches.isEmpty())
     {
-        meshBuf->colorBuffer = renderCtx->createBuffer(meshBuf->colors.constData(), meshBuf->colorBufferSize);
-        meshBuf->clearColors();
+        m_batchBuf = new MeshBuffer();
+        foreach(WLDBatchActor *batch, m_batches)
+            batch->importFrom(m_batchBuf);
+        m_batchBuf->upload(renderCtx);
+        m_batchBuf->clearVertices();
+        m_batchBuf->clearIndices();
+    }
+    m_pack->upload(renderCtx);
+    
+    // Copy the lighting colors of the other objects to a GPU buffer owned by
+    // the zone, which is bound when drawing them.
+    m_colorBuf = new MeshBuffer();
+    foreach(WLDStaticActor *actor, m_singleObjects)
+        actor->importColorData(m_colorBuf);
+    m_colorBuf->colorBufferSize = m_colorBuf->colors.count() * sizeof(uint32_t);
+    if(m_colorBuf->colorBufferSize > 0)
+    {
+        m_colorBuf->colorBuffer = renderCtx->createBuffer(m_colorBuf->colors.constData(),
+                                                          m_colorBuf->colorBufferSize);
+        m_colorBuf->clearColors();
+    }
+    
+    // Give each mesh an ID and find out which passes it is drawn in.
+    m_meshIDs.clear();
+    m_meshPasses.clear();
+    foreach(WLDMesh *mesh, m_pack->models().values())
+    {
+        MaterialArray *materials = mesh->palette()->array();
+        MeshData *meshData = mesh->data();
+        uint32_t passes = 0;
+        for(uint32_t i = 0; i < meshData->groupCount; i++)
+        {
+            Material *mat = materials->material(meshData->matGroups[i].matID);
+            if(mat)
+                passes |= 1 << (mat->isOpaque() ? RenderQueue::OpaquePass
+                                                : RenderQueue::TransparentPass);
+        }
+        m_meshIDs.insert(mesh, m_meshPasses.count());
+        m_meshPasses.append(passes);
     }
-}
-
-static bool zoneActorGroupLessThan(const WLDStaticActor *a, const WLDStaticActor *b)
-{
-    return a->mesh()->def() < b->mesh()->def();
 }
 
 void ZoneObjects::update(double currentTime)
@@ -988,61 +2271,118 @@ void ZoneObjects::update(double currentTime)
         mesh->palette()->animate(currentTime);
 }
 
-void ZoneObjects::draw(RenderContext *renderCtx, RenderProgram *prog)
+/*!
+  \brief Record packets for the visible objects, one for the opaque part and
+  one for the transparent part of each object. Visible batches are recorded
+  the same way, with one pair of packets for each of their meshes.
+  */
+void ZoneObjects::queue(RenderContext *renderCtx, CommandQueue &queue,
+                        const Frustum &frustum)
 {
-    if(!m_objectsStat)
-        m_objectsStat = renderCtx->createStat("Objects CPU (ms)", FrameStat::CPUTime);
-    if(!m_objectsStatGPU)
-        m_objectsStatGPU = renderCtx->createStat("Objects GPU (ms)", FrameStat::GPUTime);
-    m_objectsStat->beginTime();
-    m_objectsStatGPU->beginTime();
-    
     // Create a GPU buffer for the objects' vertices and indices if needed.
-    if(m_pack->buffer() == NULL)
+    if(!m_pack->uploaded())
         upload(renderCtx);
     
-    // Sort the list of visible objects by mesh.
-    qSort(m_visibleObjects.begin(), m_visibleObjects.end(), zoneActorGroupLessThan);
-    
-    // Draw one batch of objects (beginDraw/endDraw) per mesh.
-    int meshCount = 0;
-    WLDMesh *previousMesh = NULL;
-    MeshBuffer *meshBuf = m_pack->buffer();
-    foreach(WLDActor *actor, m_visibleObjects)
+    const vec3 &eye = frustum.eye();
+    float maxDistance = frustum.farPlane();
+    const matrix4 &projection = renderCtx->matrix(RenderContext::Projection);
+    uint32_t visibleCount = m_visibleObjects.count(), reducedCount = 0;
+    for(uint32_t i = 0; i < visibleCount; i++)
     {
-        WLDStaticActor *staticActor = actor->cast<WLDStaticActor>();
-        if(!staticActor)
-            continue;
-        WLDMesh *currentMesh = staticActor->mesh();
-        if(currentMesh != previousMesh)
-        {
-            if(previousMesh)
-                prog->endDrawMesh();
-            meshBuf->matGroups.clear();
-            meshBuf->addMaterialGroups(currentMesh->data());
-            MaterialArray *materials = currentMesh->palette()->array();
-            prog->setMaterialMap(materials, currentMesh->palette()->map());
-            prog->beginDrawMesh(meshBuf, materials);
-            previousMesh = currentMesh;
-            meshCount++;
-        }
+        WLDStaticActor *staticActor = m_visibleObjects[i];
+        WLDMesh *mesh = staticActor->mesh();
+        uint32_t meshID = m_meshIDs.value(mesh);
+        uint32_t passes = m_meshPasses[meshID];
+        MaterialArray *materials = mesh->palette()->array();
+        uint32_t texture = materials->arrayTexture();
+        vec3 toObject = staticActor->boundsAA().center() - eye;
+        uint32_t depth = RenderQueue::quantizeDepth(sqrtf(toObject.lengthSquared()),
+                                                    maxDistance);
         
-        // Draw the zone object.
-        // XXX Batch again (list of matrices and color segments).
         renderCtx->pushMatrix();
         renderCtx->multiplyMatrix(staticActor->modelMatrix());
-        matrix4 mvMatrix = renderCtx->matrix(RenderContext::ModelView);
-        prog->drawMeshBatch(&mvMatrix, &staticActor->colorSegment(), 1);
+        const matrix4 &modelView = renderCtx->matrix(RenderContext::ModelView);
+        uint32_t transform = queue.addTransform(modelView);
+        uint32_t level = mesh->selectLOD(WLDMesh::lodScale(mesh->boundsAA(), modelView,
+                                                           projection));
         renderCtx->popMatrix();
+        
+        // Objects drawn with the same level of detail can be batched together.
+        MeshData *meshData = mesh->lod(level);
+        uint32_t group = (meshID * WLDMesh::MaxLODs) + level;
+        if(level > 0)
+            reducedCount++;
+        for(int pass = RenderQueue::OpaquePass; pass <= RenderQueue::TransparentPass; pass++)
+        {
+            if(!(passes & (1 << pass)))
+                continue;
+            DrawPacket packet;
+            packet.meshBuf = meshData->buffer;
+            packet.materials = materials;
+            packet.materialMap = mesh->palette()->map();
+            packet.transform = transform;
+            packet.colorBuffer = m_colorBuf->colorBuffer;
+            packet.colors = staticActor->colorSegment();
+            packet.state = DrawPacket::InstanceColors;
+            queue.addGroups(packet, meshData, materials, pass == RenderQueue::OpaquePass);
+            queue.add(RenderQueue::makeKey((RenderQueue::Pass)pass, ObjectSource,
+                                           texture, group, depth), packet);
+        }
+    }
+    
+    // Batches are already in zone space and use the camera transform.
+    uint32_t batchedCount = 0;
+    if(!m_visibleBatches.isEmpty())
+    {
+        const matrix4 &camera = renderCtx->matrix(RenderContext::ModelView);
+        uint32_t transform = queue.addTransform(camera);
+        foreach(WLDBatchActor *batch, m_visibleBatches)
+        {
+            vec3 toBatch = batch->boundsAA().center() - eye;
+            uint32_t depth = RenderQueue::quantizeDepth(sqrtf(toBatch.lengthSquared()),
+                                                        maxDistance);
+            foreach(const WLDBatchPart &part, batch->parts())
+            {
+                WLDMesh *mesh = part.mesh;
+                uint32_t meshID = m_meshIDs.value(mesh);
+                uint32_t passes = m_meshPasses[meshID];
+                MaterialArray *materials = mesh->palette()->array();
+                uint32_t texture = materials->arrayTexture();
+                float lodScale = WLDMesh::lodScale(part.bounds, camera, projection);
+                uint32_t level = mesh->selectLOD(lodScale * part.scale);
+                MeshData *meshData = part.lods.value(level);
+                if(!meshData)
+                    continue;
+                uint32_t group = (meshID * WLDMesh::MaxLODs) + level;
+                batchedCount += part.objects.count();
+                if(level > 0)
+                    reducedCount += part.objects.count();
+                for(int pass = RenderQueue::OpaquePass; pass <= RenderQueue::TransparentPass; pass++)
+                {
+                    if(!(passes & (1 << pass)))
+                        continue;
+                    DrawPacket packet;
+                    packet.meshBuf = m_batchBuf;
+                    packet.materials = materials;
+                    packet.materialMap = mesh->palette()->map();
+                    packet.transform = transform;
+                    queue.addGroups(packet, meshData, materials, pass == RenderQueue::OpaquePass);
+                    queue.add(RenderQueue::makeKey((RenderQueue::Pass)pass, ObjectSource,
+                                                   texture, group, depth), packet);
+                }
+            }
+        }
     }
-    if(previousMesh)
-        prog->endDrawMesh();
     
     if(m_drawnObjectsStat == NULL)
         m_drawnObjectsStat = renderCtx->createStat("Objects", FrameStat::Counter);
-    m_drawnObjectsStat->setCurrent(m_visibleObjects.count());
-    m_objectsStatGPU->endTime();
-    m_objectsStat->endTime();
+    m_drawnObjectsStat->setCurrent(visibleCount + batchedCount);
+    if(m_drawnBatchesStat == NULL)
+        m_drawnBatchesStat = renderCtx->createStat("Object batches", FrameStat::Counter);
+    m_drawnBatchesStat->setCurrent(m_visibleBatches.count());
+    if(m_reducedObjectsStat == NULL)
+        m_reducedObjectsStat = renderCtx->createStat("Objects (LOD)", FrameStat::Counter);
+    m_reducedObjectsStat->setCurrent(reducedCount);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1170,7 +2510,7 @@ bool ZoneSky::upload(RenderContext *renderCtx)
     return true;
 }
 
-void ZoneSky::draw(RenderContext *renderCtx, RenderProgram *prog, Zone *zone)
+void ZoneSky::queue(RenderContext *renderCtx, CommandQueue &queue, Zone *zone)
 {
     uint32_t skyID = zone->info().skyID;
     if(!skyID || (skyID > m_skyDefs.size()) || !upload(renderCtx))
@@ -1184,20 +2524,16 @@ void ZoneSky::draw(RenderContext *renderCtx, RenderProgram *prog, Zone *zone)
     vec3 focus = viewMat2.map(vec3(0.0, 1.0, 0.0));
     matrix4 viewMat = matrix4::lookAt(vec3(0.0, 0.0, 0.0), focus, vec3(0.0, 0.0, 1.0));
     
-    renderCtx->setDepthWrite(false);
-    
-    // Import material groups from the visible layer.
-    m_skyBuffer->matGroups.clear();
+    // Draw the visible layers without writing to the depth buffer.
+    DrawPacket packet;
+    packet.meshBuf = m_skyBuffer;
+    packet.materials = m_skyMaterials;
+    packet.transform = queue.addTransform(viewMat);
+    packet.state = DrawPacket::NoDepthWrite;
     const SkyDef &def = m_skyDefs[skyID - 1];
     if(def.secondLayer)
-        m_skyBuffer->addMaterialGroups(def.secondLayer->data());
+        queue.addGroups(packet, def.secondLayer->data());
     if(def.mainLayer)
-        m_skyBuffer->addMaterialGroups(def.mainLayer->data());
-    
-    // Draw the visible layer.
-    prog->beginDrawMesh(m_skyBuffer, m_skyMaterials);
-    prog->drawMeshBatch(&viewMat, NULL, 1);
-    prog->endDrawMesh();
-    
-    renderCtx->setDepthWrite(true);
+        queue.addGroups(packet, def.mainLayer->data());
+    queue.add(RenderQueue::makeKey(RenderQueue::SkyPass, SkySource, 0, skyID, 0), packet);
 }
@@ -0,0 +1,415 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include "EQuilibre/Render/CommandQueue.h"
+#include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/RenderContext.h"
+#include "EQuilibre/Render/RenderProgram.h"
+
+DrawPacket::DrawPacket()
+{
+    meshBuf = NULL;
+    materials = NULL;
+    materialMap = NULL;
+    bones = NULL;
+    boneBase = 0;
+    boneCount = 0;
+    firstGroup = 0;
+    groupCount = 0;
+    transform = 0;
+    colorBuffer = 0;
+    state = DefaultState;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RenderBackend::~RenderBackend()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ProgramBackend::ProgramBackend(RenderContext *renderCtx, RenderProgram *prog)
+{
+    m_renderCtx = renderCtx;
+    m_prog = prog;
+}
+
+void ProgramBackend::setState(uint32_t state)
+{
+    m_renderCtx->setDepthWrite(!(state & DrawPacket::NoDepthWrite));
+}
+
+void ProgramBackend::setMaterialMap(MaterialArray *materials, MaterialMap *materialMap)
+{
+    m_prog->setMaterialMap(materials, materialMap);
+}
+
+void ProgramBackend::beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                                   uint32_t groupCount, MaterialArray *materials,
+                                   const BonePalette *bones, uint32_t boneBase,
+                                   uint32_t boneCount)
+{
+    m_prog->beginDrawMesh(meshBuf, groups, groupCount, materials, bones, boneBase,
+                          boneCount);
+}
+
+void ProgramBackend::drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                                   const BufferSegment *colorSegments,
+                                   uint32_t instances)
+{
+    m_prog->drawMeshBatch(mvMatrices, colorBuffer, colorSegments, instances);
+}
+
+void ProgramBackend::drawSkinnedMeshBatch(const matrix4 *mvMatrices,
+                                          const uint32_t *boneBases,
+                                          uint32_t instances)
+{
+    m_prog->drawSkinnedMeshBatch(mvMatrices, boneBases, instances);
+}
+
+void ProgramBackend::endDrawMesh()
+{
+    m_prog->endDrawMesh();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+NullBackend::NullBackend()
+{
+    reset();
+    drawnOrigins.reserve(1024);
+}
+
+void NullBackend::reset()
+{
+    meshes = 0;
+    batches = 0;
+    instances = 0;
+    groups = 0;
+    drawCalls = 0;
+    stateChanges = 0;
+    materialMapChanges = 0;
+    drawnOrigins.resize(0);
+    m_groupCount = 0;
+}
+
+void NullBackend::setState(uint32_t state)
+{
+    stateChanges++;
+}
+
+void NullBackend::setMaterialMap(MaterialArray *materials, MaterialMap *materialMap)
+{
+    materialMapChanges++;
+}
+
+void NullBackend::beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                                uint32_t groupCount, MaterialArray *materials,
+                                const BonePalette *bones, uint32_t boneBase,
+                                uint32_t boneCount)
+{
+    m_groupCount = groupCount;
+    meshes++;
+}
+
+void NullBackend::drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                                const BufferSegment *colorSegments,
+                                uint32_t count)
+{
+    batches++;
+    instances += count;
+    groups += m_groupCount * count;
+    drawCalls += m_groupCount;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const vec4 &origin = mvMatrices[i].columns()[3];
+        drawnOrigins.append(vec3(origin.x, origin.y, origin.z));
+    }
+}
+
+void NullBackend::drawSkinnedMeshBatch(const matrix4 *mvMatrices,
+                                       const uint32_t *boneBases,
+                                       uint32_t count)
+{
+    drawMeshBatch(mvMatrices, 0, NULL, count);
+}
+
+void NullBackend::endDrawMesh()
+{
+    m_groupCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CommandQueue::CommandQueue()
+{
+    // Reserving memory also keeps it around when the queue is cleared.
+    m_packets.reserve(1024);
+    m_groups.reserve(4096);
+    m_transforms.reserve(1024);
+    m_groupOrder.reserve(4096);
+    m_groupScratch.reserve(4096);
+    m_batchCount = 0;
+    m_triangleCount = 0;
+}
+
+uint32_t CommandQueue::packetCount() const
+{
+    return m_packets.count();
+}
+
+const DrawPacket * CommandQueue::packets() const
+{
+    return m_packets.constData();
+}
+
+const matrix4 & CommandQueue::transform(uint32_t index) const
+{
+    return m_transforms[index];
+}
+
+const MaterialGroup * CommandQueue::groups(const DrawPacket &packet) const
+{
+    return m_groups.constData() + packet.firstGroup;
+}
+
+/*!
+  \brief Number of batches drawn by the last call to @ref execute.
+  */
+uint32_t CommandQueue::batchCount() const
+{
+    return m_batchCount;
+}
+
+/*!
+  \brief Number of triangles drawn by the last call to @ref execute, counting
+  each instance.
+  */
+uint32_t CommandQueue::triangleCount() const
+{
+    return m_triangleCount;
+}
+
+FrameArena & CommandQueue::arena()
+{
+    return m_arena;
+}
+
+uint32_t CommandQueue::addTransform(const matrix4 &mvMatrix)
+{
+    uint32_t index = m_transforms.count();
+    m_transforms.append(mvMatrix);
+    return index;
+}
+
+/*!
+  \brief Append material groups to the packet's range. The groups of a packet
+  have to be added before those of the next packet.
+  */
+void CommandQueue::addGroups(DrawPacket &packet, const MaterialGroup *groups, uint32_t count)
+{
+    if(packet.groupCount == 0)
+        packet.firstGroup = m_groups.count();
+    Q_ASSERT((packet.firstGroup + packet.groupCount) == (uint32_t)m_groups.count());
+    for(uint32_t i = 0; i < count; i++)
+        m_groups.append(groups[i]);
+    packet.groupCount += count;
+}
+
+void CommandQueue::addGroups(DrawPacket &packet, MeshData *mesh)
+{
+    addGroups(packet, mesh->ranges(), mesh->groupCount);
+}
+
+/*!
+  \brief Append the material groups of the mesh that are either opaque or
+  transparent to the packet's range. Groups without a material are skipped.
+  */
+void CommandQueue::addGroups(DrawPacket &packet, MeshData *mesh,
+                             MaterialArray *materials, bool opaque)
+{
+    if(packet.groupCount == 0)
+        packet.firstGroup = m_groups.count();
+    Q_ASSERT((packet.firstGroup + packet.groupCount) == (uint32_t)m_groups.count());
+    const MaterialGroup *ranges = mesh->ranges();
+    for(uint32_t i = 0; i < mesh->groupCount; i++)
+    {
+        Material *mat = materials->material(ranges[i].matID);
+        if(!mat || (mat->isOpaque() != opaque))
+            continue;
+        m_groups.append(ranges[i]);
+        packet.groupCount++;
+    }
+}
+
+/*!
+  \brief Append material groups to the packet's range, sorted by offset.
+  Adjacent groups that use the same material are merged, so that groups from
+  meshes laid out next to each other in the buffer are drawn as one range.
+  */
+void CommandQueue::addSortedGroups(DrawPacket &packet, const MaterialGroup *groups,
+                                   uint32_t count)
+{
+    if(count == 0)
+        return;
+    m_groupOrder.resize(count);
+    m_groupScratch.resize(count);
+    RenderItem *order = m_groupOrder.data();
+    for(uint32_t i = 0; i < count; i++)
+    {
+        order[i].key = groups[i].offset;
+        order[i].source = 0;
+        order[i].index = i;
+    }
+    RenderQueue::radixSort(order, m_groupScratch.data(), count);
+    
+    MaterialGroup merged = groups[order[0].index];
+    for(uint32_t i = 1; i < count; i++)
+    {
+        const MaterialGroup &mg = groups[order[i].index];
+        if((mg.matID == merged.matID) && (mg.offset == (merged.offset + merged.count)))
+        {
+            merged.count += mg.count;
+        }
+        else
+        {
+            addGroups(packet, &merged, 1);
+            merged = mg;
+        }
+    }
+    addGroups(packet, &merged, 1);
+}
+
+void CommandQueue::add(uint64_t key, const DrawPacket &packet)
+{
+    // Packets without anything to draw are dropped.
+    if(!packet.meshBuf || !packet.materials || (packet.groupCount == 0))
+        return;
+    m_order.add(key, 0, m_packets.count());
+    m_packets.append(packet);
+}
+
+void CommandQueue::clear()
+{
+    m_order.clear();
+    m_packets.resize(0);
+    m_groups.resize(0);
+    m_transforms.resize(0);
+    m_arena.reset();
+}
+
+bool CommandQueue::canMerge(const DrawPacket &a, const DrawPacket &b) const
+{
+    if((a.meshBuf != b.meshBuf) || (a.materials != b.materials) ||
+       (a.materialMap != b.materialMap) || (a.bones != b.bones) ||
+       (a.boneCount != b.boneCount) || (a.state != b.state) ||
+       (a.colorBuffer != b.colorBuffer) || (a.groupCount != b.groupCount))
+        return false;
+    if(a.firstGroup == b.firstGroup)
+        return true;
+    const MaterialGroup *groupsA = m_groups.constData() + a.firstGroup;
+    const MaterialGroup *groupsB = m_groups.constData() + b.firstGroup;
+    for(uint32_t i = 0; i < a.groupCount; i++)
+    {
+        if((groupsA[i].offset != groupsB[i].offset) ||
+           (groupsA[i].count != groupsB[i].count) ||
+           (groupsA[i].matID != groupsB[i].matID))
+            return false;
+    }
+    return true;
+}
+
+/*!
+  \brief Sort the packets by key and draw them with the backend, one batch for
+  each run of packets that can be merged.
+  */
+void CommandQueue::execute(RenderBackend *backend)
+{
+    m_order.sort();
+    const RenderItem *items = m_order.items();
+    uint32_t count = m_order.count();
+    uint32_t currentState = DrawPacket::DefaultState;
+    MaterialArray *currentMaterials = NULL;
+    MaterialMap *currentMap = NULL;
+    m_batchCount = 0;
+    m_triangleCount = 0;
+    
+    // Per-instance data of the batches, laid out in draw order.
+    matrix4 *batchTransforms = m_arena.allocate<matrix4>(count);
+    BufferSegment *batchColors = m_arena.allocate<BufferSegment>(count);
+    uint32_t *batchBones = m_arena.allocate<uint32_t>(count);
+    uint32_t start = 0;
+    while(start < count)
+    {
+        const DrawPacket &first = m_packets[items[start].index];
+        uint32_t end = start + 1;
+        while((end < count) && canMerge(first, m_packets[items[end].index]))
+            end++;
+        
+        if(first.state != currentState)
+        {
+            backend->setState(first.state);
+            currentState = first.state;
+        }
+        if((first.materialMap != currentMap) ||
+           (first.materialMap && (first.materials != currentMaterials)))
+        {
+            backend->setMaterialMap(first.materials, first.materialMap);
+            currentMap = first.materialMap;
+        }
+        currentMaterials = first.materials;
+        
+        // Gather the per-instance data of the batch.
+        for(uint32_t i = start; i < end; i++)
+        {
+            const DrawPacket &packet = m_packets[items[i].index];
+            batchTransforms[i] = m_transforms[packet.transform];
+            batchColors[i] = packet.colors;
+            batchBones[i] = packet.boneBase;
+        }
+        
+        // Draw the batch.
+        backend->beginDrawMesh(first.meshBuf, groups(first), first.groupCount,
+                               first.materials, first.bones, first.boneBase,
+                               first.boneCount);
+        if(first.bones && (first.boneCount > 0))
+        {
+            backend->drawSkinnedMeshBatch(batchTransforms + start, batchBones + start,
+                                          end - start);
+        }
+        else
+        {
+            const BufferSegment *colors = NULL;
+            if(first.state & DrawPacket::InstanceColors)
+                colors = batchColors + start;
+            backend->drawMeshBatch(batchTransforms + start, first.colorBuffer, colors,
+                                   end - start);
+        }
+        backend->endDrawMesh();
+        m_batchCount++;
+        const MaterialGroup *batchGroups = groups(first);
+        for(uint32_t i = 0; i < first.groupCount; i++)
+            m_triangleCount += (batchGroups[i].count / 3) * (end - start);
+        start = end;
+    }
+    
+    // Leave the backend in its default state.
+    if(currentState != DrawPacket::DefaultState)
+        backend->setState(DrawPacket::DefaultState);
+    if(currentMap)
+        backend->setMaterialMap(NULL, NULL);
+}
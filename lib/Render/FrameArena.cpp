@@ -0,0 +1,116 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include "EQuilibre/Render/FrameArena.h"
+
+const size_t FrameArena::Alignment = 16;
+
+static uint8_t * alignPointer(uint8_t *p, size_t alignment)
+{
+    return (uint8_t *)(((size_t)p + alignment - 1) & ~(alignment - 1));
+}
+
+FrameArena::FrameArena(size_t capacity)
+{
+    m_block = m_data = NULL;
+    m_capacity = 0;
+    m_used = 0;
+    m_overflow = NULL;
+    m_overflowSize = 0;
+    m_overflows = 0;
+    if(capacity > 0)
+    {
+        m_block = new uint8_t[capacity + Alignment];
+        m_data = alignPointer(m_block, Alignment);
+        m_capacity = capacity;
+    }
+}
+
+FrameArena::~FrameArena()
+{
+    reset();
+    delete [] m_block;
+}
+
+size_t FrameArena::capacity() const
+{
+    return m_capacity;
+}
+
+size_t FrameArena::used() const
+{
+    return m_used + m_overflowSize;
+}
+
+/*!
+  \brief Number of allocations that did not fit in the arena since it was
+  created. Each of them was a heap allocation.
+  */
+uint32_t FrameArena::overflows() const
+{
+    return m_overflows;
+}
+
+/*!
+  \brief Allocate memory aligned on 16 bytes, valid until the next reset.
+  */
+void * FrameArena::allocate(size_t size)
+{
+    size = (size + Alignment - 1) & ~(Alignment - 1);
+    if((m_used + size) <= m_capacity)
+    {
+        void *p = m_data + m_used;
+        m_used += size;
+        return p;
+    }
+    
+    // Chain a new block to the overflow list. The header keeps the data aligned.
+    uint8_t *block = new uint8_t[Alignment + size + Alignment];
+    uint8_t *header = alignPointer(block, Alignment);
+    *(uint8_t **)header = m_overflow;
+    *((uint8_t **)header + 1) = block;
+    m_overflow = header;
+    m_overflowSize += size;
+    m_overflows++;
+    return header + Alignment;
+}
+
+/*!
+  \brief Release everything allocated since the last reset. If some
+  allocations overflowed, the arena grows so that they fit next time.
+  */
+void FrameArena::reset()
+{
+    if(m_overflow)
+    {
+        size_t needed = m_used + m_overflowSize;
+        while(m_overflow)
+        {
+            uint8_t *header = m_overflow;
+            m_overflow = *(uint8_t **)header;
+            delete [] *((uint8_t **)header + 1);
+        }
+        m_overflowSize = 0;
+        
+        // Leave some room for the next frames to need a bit more.
+        delete [] m_block;
+        m_capacity = needed + (needed / 2);
+        m_block = new uint8_t[m_capacity + Alignment];
+        m_data = alignPointer(m_block, Alignment);
+    }
+    m_used = 0;
+}
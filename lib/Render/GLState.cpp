@@ -0,0 +1,560 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cstring>
+#include <GL/glew.h>
+#include "EQuilibre/Render/GLState.h"
+
+/** Value of the state that was not set through GLState. */
+static const uint32_t Unknown = 0xffffffff;
+
+/** Uniforms at higher locations are not cached. */
+static const int MaxCachedLocations = 1024;
+
+enum UniformType
+{
+    UniformInt = 1,
+    UniformFloat,
+    UniformVec2,
+    UniformVec3,
+    UniformVec4,
+    UniformMatrix4
+};
+
+GLDevice::~GLDevice()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+GLState::GLState(GLDevice *device)
+{
+    m_device = device;
+    m_shadowing = true;
+    m_vertexArraysEnabled = true;
+    m_calls = 0;
+    m_redundantCalls = 0;
+    m_vertexArray = Unknown;
+    invalidate();
+}
+
+GLDevice * GLState::device() const
+{
+    return m_device;
+}
+
+bool GLState::shadowing() const
+{
+    return m_shadowing;
+}
+
+/*!
+  \brief Disabling shadowing makes every call reach the device, which is useful
+  to compare the cost of the redundant calls. The state is still tracked.
+  */
+void GLState::setShadowing(bool enabled)
+{
+    m_shadowing = enabled;
+}
+
+/*!
+  \brief Whether programs can record the layout of their vertices in vertex
+  array objects.
+  */
+bool GLState::hasVertexArrays() const
+{
+    return m_vertexArraysEnabled && m_device->hasVertexArrays();
+}
+
+void GLState::setVertexArraysEnabled(bool enabled)
+{
+    m_vertexArraysEnabled = enabled;
+}
+
+uint32_t GLState::calls() const
+{
+    return m_calls;
+}
+
+uint32_t GLState::redundantCalls() const
+{
+    return m_redundantCalls;
+}
+
+void GLState::resetCounters()
+{
+    m_calls = 0;
+    m_redundantCalls = 0;
+}
+
+/*!
+  \brief Forget the bindings, which other code using the context may have
+  changed. This has to be called before drawing a frame.
+  */
+void GLState::invalidate()
+{
+    saveVertexArray();
+    m_program = Unknown;
+    m_programUniforms = NULL;
+    m_arrayBuffer = Unknown;
+    m_vertexArray = Unknown;
+    m_arrayState.elementBuffer = Unknown;
+    m_arrayState.enabledAttribs = 0;
+    m_arrayState.knownAttribs = 0;
+    m_vertexArrays.remove(0);
+    m_activeTexture = Unknown;
+    m_textures.clear();
+    m_blending = -1;
+    m_depthWrite = -1;
+}
+
+/*!
+  \brief Restore the default bindings, so that other code can use the context
+  after a frame was drawn.
+  */
+void GLState::reset()
+{
+    bindVertexArray(0);
+    bindBuffer(GL_ARRAY_BUFFER, 0);
+    bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    QVector<TextureBinding> textures = m_textures;
+    foreach(TextureBinding binding, textures)
+    {
+        if(binding.texture == 0)
+            continue;
+        activeTexture(binding.unit);
+        bindTexture(binding.target, 0);
+    }
+    activeTexture(GL_TEXTURE0);
+    useProgram(0);
+}
+
+/*!
+  \brief Count a call that is either dropped or made to the device.
+  */
+bool GLState::redundant(bool sameState)
+{
+    if(m_shadowing && sameState)
+    {
+        m_redundantCalls++;
+        return true;
+    }
+    m_calls++;
+    return false;
+}
+
+uint32_t GLState::program() const
+{
+    return (m_program != Unknown) ? m_program : 0;
+}
+
+void GLState::useProgram(uint32_t program)
+{
+    if(redundant(m_program == program))
+        return;
+    m_device->useProgram(program);
+    m_program = program;
+    m_programUniforms = (program != 0) ? &m_uniforms[program] : NULL;
+}
+
+/*!
+  \brief Forget the uniform values of a deleted program, since its name can
+  be reused.
+  */
+void GLState::programDeleted(uint32_t program)
+{
+    if(m_program == program)
+    {
+        m_program = Unknown;
+        m_programUniforms = NULL;
+    }
+    m_uniforms.remove(program);
+}
+
+bool GLState::uniformChanged(int location, uint32_t type, const void *data, uint32_t words)
+{
+    if(location < 0)
+        return false;
+    
+    // Large arrays such as the material slot map are not cached. Forget any
+    // value cached for the location, since it is no longer current.
+    if(!m_programUniforms || (location >= MaxCachedLocations))
+        return true;
+    QVector<UniformValue> &values = *m_programUniforms;
+    if(words > 16)
+    {
+        if(location < values.count())
+            values[location].size = 0;
+        return true;
+    }
+    if(location >= values.count())
+    {
+        UniformValue unset;
+        memset(&unset, 0, sizeof(UniformValue));
+        while(values.count() <= location)
+            values.append(unset);
+    }
+    UniformValue &value = values[location];
+    size_t size = words * sizeof(uint32_t);
+    if((value.type == type) && (value.size == words) && (memcmp(value.data, data, size) == 0))
+        return false;
+    value.type = type;
+    value.size = words;
+    memcpy(value.data, data, size);
+    return true;
+}
+
+void GLState::uniform1i(int location, int32_t value)
+{
+    if(redundant(!uniformChanged(location, UniformInt, &value, 1)))
+        return;
+    m_device->uniform1i(location, value);
+}
+
+void GLState::uniform1f(int location, float value)
+{
+    if(redundant(!uniformChanged(location, UniformFloat, &value, 1)))
+        return;
+    m_device->uniform1f(location, value);
+}
+
+void GLState::uniform2f(int location, float x, float y)
+{
+    float values[2] = {x, y};
+    if(redundant(!uniformChanged(location, UniformVec2, values, 2)))
+        return;
+    m_device->uniform2f(location, x, y);
+}
+
+void GLState::uniform3fv(int location, int count, const float *values)
+{
+    if(redundant(!uniformChanged(location, UniformVec3, values, count * 3)))
+        return;
+    m_device->uniform3fv(location, count, values);
+}
+
+void GLState::uniform4fv(int location, int count, const float *values)
+{
+    if(redundant(!uniformChanged(location, UniformVec4, values, count * 4)))
+        return;
+    m_device->uniform4fv(location, count, values);
+}
+
+void GLState::uniformMatrix4fv(int location, int count, const float *values)
+{
+    if(redundant(!uniformChanged(location, UniformMatrix4, values, count * 16)))
+        return;
+    m_device->uniformMatrix4fv(location, count, values);
+}
+
+void GLState::bindBuffer(uint32_t target, buffer_t buffer)
+{
+    // The element buffer binding is part of the vertex array state.
+    if(target == GL_ELEMENT_ARRAY_BUFFER)
+    {
+        if(redundant(m_arrayState.elementBuffer == buffer))
+            return;
+        m_arrayState.elementBuffer = buffer;
+    }
+    else if(target == GL_ARRAY_BUFFER)
+    {
+        if(redundant(m_arrayBuffer == buffer))
+            return;
+        m_arrayBuffer = buffer;
+    }
+    else
+    {
+        m_calls++;
+    }
+    m_device->bindBuffer(target, buffer);
+}
+
+void GLState::bufferData(uint32_t target, size_t size, const void *data, uint32_t usage)
+{
+    m_calls++;
+    m_device->bufferData(target, size, data, usage);
+}
+
+void GLState::bufferSubData(uint32_t target, size_t offset, size_t size, const void *data)
+{
+    m_calls++;
+    m_device->bufferSubData(target, offset, size, data);
+}
+
+void GLState::getBufferSubData(uint32_t target, size_t offset, size_t size, void *data)
+{
+    m_calls++;
+    m_device->getBufferSubData(target, offset, size, data);
+}
+
+/*!
+  \brief Deleting a buffer unbinds it from the context and from the current
+  vertex array. Other vertex arrays still refer to it, but their binding is
+  forgotten since the name can be reused.
+  */
+void GLState::buffersDeleted(const buffer_t *buffers, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        buffer_t buffer = buffers[i];
+        if(buffer == 0)
+            continue;
+        if(m_arrayBuffer == buffer)
+            m_arrayBuffer = 0;
+        if(m_arrayState.elementBuffer == buffer)
+            m_arrayState.elementBuffer = 0;
+        QHash<uint32_t, VertexArrayState>::iterator it;
+        for(it = m_vertexArrays.begin(); it != m_vertexArrays.end(); ++it)
+        {
+            if(it.value().elementBuffer == buffer)
+                it.value().elementBuffer = Unknown;
+        }
+    }
+}
+
+uint32_t GLState::createVertexArray()
+{
+    m_calls++;
+    uint32_t vertexArray = m_device->createVertexArray();
+    VertexArrayState state;
+    state.elementBuffer = 0;
+    state.enabledAttribs = 0;
+    state.knownAttribs = 0xffffffff;
+    m_vertexArrays.insert(vertexArray, state);
+    return vertexArray;
+}
+
+void GLState::deleteVertexArray(uint32_t vertexArray)
+{
+    if(vertexArray == 0)
+        return;
+    m_calls++;
+    m_device->deleteVertexArray(vertexArray);
+    m_vertexArrays.remove(vertexArray);
+    
+    // Deleting the current vertex array binds the default one.
+    if(m_vertexArray == vertexArray)
+    {
+        m_vertexArray = 0;
+        loadVertexArray(0);
+    }
+}
+
+void GLState::bindVertexArray(uint32_t vertexArray)
+{
+    if(!m_device->hasVertexArrays())
+    {
+        // Only the default vertex array exists.
+        Q_ASSERT(vertexArray == 0);
+        if(m_vertexArray == Unknown)
+        {
+            m_vertexArray = 0;
+            loadVertexArray(0);
+        }
+        return;
+    }
+    if(redundant(m_vertexArray == vertexArray))
+        return;
+    m_device->bindVertexArray(vertexArray);
+    saveVertexArray();
+    m_vertexArray = vertexArray;
+    loadVertexArray(vertexArray);
+}
+
+void GLState::saveVertexArray()
+{
+    if(m_vertexArray != Unknown)
+        m_vertexArrays.insert(m_vertexArray, m_arrayState);
+}
+
+void GLState::loadVertexArray(uint32_t vertexArray)
+{
+    QHash<uint32_t, VertexArrayState>::const_iterator it = m_vertexArrays.constFind(vertexArray);
+    if(it != m_vertexArrays.constEnd())
+    {
+        m_arrayState = it.value();
+    }
+    else
+    {
+        m_arrayState.elementBuffer = Unknown;
+        m_arrayState.enabledAttribs = 0;
+        m_arrayState.knownAttribs = 0;
+    }
+}
+
+void GLState::setAttribArray(uint32_t index, bool enabled)
+{
+    uint32_t bit = (index < 32) ? (1u << index) : 0;
+    bool known = (m_arrayState.knownAttribs & bit) != 0;
+    bool current = (m_arrayState.enabledAttribs & bit) != 0;
+    if(redundant(known && (current == enabled)))
+        return;
+    m_arrayState.knownAttribs |= bit;
+    if(enabled)
+    {
+        m_arrayState.enabledAttribs |= bit;
+        m_device->enableVertexAttribArray(index);
+    }
+    else
+    {
+        m_arrayState.enabledAttribs &= ~bit;
+        m_device->disableVertexAttribArray(index);
+    }
+}
+
+void GLState::enableVertexAttribArray(uint32_t index)
+{
+    setAttribArray(index, true);
+}
+
+void GLState::disableVertexAttribArray(uint32_t index)
+{
+    setAttribArray(index, false);
+}
+
+void GLState::vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                  bool normalized, int stride, const void *pointer)
+{
+    m_calls++;
+    m_device->vertexAttribPointer(index, size, type, normalized, stride, pointer);
+}
+
+void GLState::vertexAttribDivisor(uint32_t index, uint32_t divisor)
+{
+    m_calls++;
+    m_device->vertexAttribDivisor(index, divisor);
+}
+
+void GLState::activeTexture(uint32_t unit)
+{
+    if(redundant(m_activeTexture == unit))
+        return;
+    m_device->activeTexture(unit);
+    m_activeTexture = unit;
+}
+
+/*!
+  \brief Bind a texture to the active texture unit.
+  \return true if the texture was bound, false if it already was.
+  */
+bool GLState::bindTexture(uint32_t target, texture_t texture)
+{
+    TextureBinding *binding = NULL;
+    if(m_activeTexture != Unknown)
+    {
+        for(int i = 0; i < m_textures.count(); i++)
+        {
+            TextureBinding &b = m_textures[i];
+            if((b.unit == m_activeTexture) && (b.target == target))
+            {
+                binding = &b;
+                break;
+            }
+        }
+        if(!binding)
+        {
+            TextureBinding b;
+            b.unit = m_activeTexture;
+            b.target = target;
+            b.texture = Unknown;
+            m_textures.append(b);
+            binding = &m_textures.last();
+        }
+    }
+    if(redundant(binding && (binding->texture == texture)))
+        return false;
+    m_device->bindTexture(target, texture);
+    if(binding)
+        binding->texture = texture;
+    return true;
+}
+
+/*!
+  \brief Deleting a texture unbinds it from all texture units.
+  */
+void GLState::textureDeleted(texture_t texture)
+{
+    if(texture == 0)
+        return;
+    for(int i = 0; i < m_textures.count(); i++)
+    {
+        if(m_textures[i].texture == texture)
+            m_textures[i].texture = 0;
+    }
+}
+
+/*!
+  \brief Enable or disable alpha blending.
+  */
+void GLState::setBlending(bool enabled)
+{
+    int value = enabled ? 1 : 0;
+    if(redundant(m_blending == value))
+        return;
+    if(enabled)
+    {
+        m_device->enable(GL_BLEND);
+        m_device->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        m_calls++;
+    }
+    else
+    {
+        m_device->disable(GL_BLEND);
+    }
+    m_blending = value;
+}
+
+void GLState::setDepthWrite(bool write)
+{
+    int value = write ? 1 : 0;
+    if(redundant(m_depthWrite == value))
+        return;
+    m_device->depthMask(write);
+    m_depthWrite = value;
+}
+
+void GLState::drawArrays(uint32_t mode, int first, int count)
+{
+    m_calls++;
+    m_device->drawArrays(mode, first, count);
+}
+
+void GLState::drawArraysInstanced(uint32_t mode, int first, int count, int instances)
+{
+    m_calls++;
+    m_device->drawArraysInstanced(mode, first, count, instances);
+}
+
+void GLState::drawElements(uint32_t mode, int count, uint32_t type, const void *indices)
+{
+    m_calls++;
+    m_device->drawElements(mode, count, type, indices);
+}
+
+void GLState::drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                    const void *indices, int instances)
+{
+    m_calls++;
+    m_device->drawElementsInstanced(mode, count, type, indices, instances);
+}
+
+void GLState::multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                const void * const *indices, int drawCount)
+{
+    m_calls++;
+    m_device->multiDrawElements(mode, counts, type, indices, drawCount);
+}
@@ -0,0 +1,174 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <GL/glew.h>
+#include "EQuilibre/Render/GLState.h"
+
+bool GLDeviceGL2::hasVertexArrays() const
+{
+    return GLEW_ARB_vertex_array_object || GLEW_VERSION_3_0;
+}
+
+void GLDeviceGL2::useProgram(uint32_t program)
+{
+    glUseProgram(program);
+}
+
+void GLDeviceGL2::bindBuffer(uint32_t target, buffer_t buffer)
+{
+    glBindBuffer(target, buffer);
+}
+
+void GLDeviceGL2::bufferData(uint32_t target, size_t size, const void *data, uint32_t usage)
+{
+    glBufferData(target, size, data, usage);
+}
+
+void GLDeviceGL2::bufferSubData(uint32_t target, size_t offset, size_t size, const void *data)
+{
+    glBufferSubData(target, offset, size, data);
+}
+
+void GLDeviceGL2::getBufferSubData(uint32_t target, size_t offset, size_t size, void *data)
+{
+    glGetBufferSubData(target, offset, size, data);
+}
+
+uint32_t GLDeviceGL2::createVertexArray()
+{
+    GLuint vertexArray = 0;
+    glGenVertexArrays(1, &vertexArray);
+    return vertexArray;
+}
+
+void GLDeviceGL2::deleteVertexArray(uint32_t vertexArray)
+{
+    glDeleteVertexArrays(1, &vertexArray);
+}
+
+void GLDeviceGL2::bindVertexArray(uint32_t vertexArray)
+{
+    glBindVertexArray(vertexArray);
+}
+
+void GLDeviceGL2::enableVertexAttribArray(uint32_t index)
+{
+    glEnableVertexAttribArray(index);
+}
+
+void GLDeviceGL2::disableVertexAttribArray(uint32_t index)
+{
+    glDisableVertexAttribArray(index);
+}
+
+void GLDeviceGL2::vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                      bool normalized, int stride, const void *pointer)
+{
+    glVertexAttribPointer(index, size, type, normalized ? GL_TRUE : GL_FALSE, stride, pointer);
+}
+
+void GLDeviceGL2::vertexAttribDivisor(uint32_t index, uint32_t divisor)
+{
+    glVertexAttribDivisorARB(index, divisor);
+}
+
+void GLDeviceGL2::activeTexture(uint32_t unit)
+{
+    glActiveTexture(unit);
+}
+
+void GLDeviceGL2::bindTexture(uint32_t target, texture_t texture)
+{
+    glBindTexture(target, texture);
+}
+
+void GLDeviceGL2::enable(uint32_t cap)
+{
+    glEnable(cap);
+}
+
+void GLDeviceGL2::disable(uint32_t cap)
+{
+    glDisable(cap);
+}
+
+void GLDeviceGL2::blendFunc(uint32_t src, uint32_t dst)
+{
+    glBlendFunc(src, dst);
+}
+
+void GLDeviceGL2::depthMask(bool write)
+{
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+}
+
+void GLDeviceGL2::uniform1i(int location, int32_t value)
+{
+    glUniform1i(location, value);
+}
+
+void GLDeviceGL2::uniform1f(int location, float value)
+{
+    glUniform1f(location, value);
+}
+
+void GLDeviceGL2::uniform2f(int location, float x, float y)
+{
+    glUniform2f(location, x, y);
+}
+
+void GLDeviceGL2::uniform3fv(int location, int count, const float *values)
+{
+    glUniform3fv(location, count, values);
+}
+
+void GLDeviceGL2::uniform4fv(int location, int count, const float *values)
+{
+    glUniform4fv(location, count, values);
+}
+
+void GLDeviceGL2::uniformMatrix4fv(int location, int count, const float *values)
+{
+    glUniformMatrix4fv(location, count, GL_FALSE, values);
+}
+
+void GLDeviceGL2::drawArrays(uint32_t mode, int first, int count)
+{
+    glDrawArrays(mode, first, count);
+}
+
+void GLDeviceGL2::drawArraysInstanced(uint32_t mode, int first, int count, int instances)
+{
+    glDrawArraysInstancedARB(mode, first, count, instances);
+}
+
+void GLDeviceGL2::drawElements(uint32_t mode, int count, uint32_t type, const void *indices)
+{
+    glDrawElements(mode, count, type, indices);
+}
+
+void GLDeviceGL2::drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                        const void *indices, int instances)
+{
+    glDrawElementsInstancedARB(mode, count, type, indices, instances);
+}
+
+void GLDeviceGL2::multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                    const void * const *indices, int drawCount)
+{
+    glMultiDrawElements(mode, counts, type, (const GLvoid **)indices, drawCount);
+}
@@ -16,6 +16,7 @@
 
 #include <cmath>
 #include "EQuilibre/Render/Geometry.h"
+#include "EQuilibre/Render/SIMDMath.h"
 
 using namespace std;
 
@@ -41,6 +42,11 @@ const vec3 & Plane::n() const
     return m_n;
 }
 
+float Plane::offset() const
+{
+    return m_dot_minus_n_p;
+}
+
 float Plane::distance(vec3 v) const
 {
     return vec3::dot(m_n, v) + m_dot_minus_n_p;
@@ -170,6 +176,89 @@ void AABox::scaleCenter(float s)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+uint32_t AABoxArray::count() const
+{
+    return m_lowX.count();
+}
+
+AABox AABoxArray::at(uint32_t index) const
+{
+    return AABox(vec3(m_lowX[index], m_lowY[index], m_lowZ[index]),
+                 vec3(m_highX[index], m_highY[index], m_highZ[index]));
+}
+
+void AABoxArray::set(uint32_t index, const AABox &b)
+{
+    m_lowX[index] = b.low.x;
+    m_lowY[index] = b.low.y;
+    m_lowZ[index] = b.low.z;
+    m_highX[index] = b.high.x;
+    m_highY[index] = b.high.y;
+    m_highZ[index] = b.high.z;
+}
+
+void AABoxArray::append(const AABox &b)
+{
+    m_lowX.append(b.low.x);
+    m_lowY.append(b.low.y);
+    m_lowZ.append(b.low.z);
+    m_highX.append(b.high.x);
+    m_highY.append(b.high.y);
+    m_highZ.append(b.high.z);
+}
+
+void AABoxArray::resize(uint32_t count)
+{
+    m_lowX.resize(count);
+    m_lowY.resize(count);
+    m_lowZ.resize(count);
+    m_highX.resize(count);
+    m_highY.resize(count);
+    m_highZ.resize(count);
+}
+
+void AABoxArray::clear()
+{
+    m_lowX.clear();
+    m_lowY.clear();
+    m_lowZ.clear();
+    m_highX.clear();
+    m_highY.clear();
+    m_highZ.clear();
+}
+
+const float * AABoxArray::lowX() const
+{
+    return m_lowX.constData();
+}
+
+const float * AABoxArray::lowY() const
+{
+    return m_lowY.constData();
+}
+
+const float * AABoxArray::lowZ() const
+{
+    return m_lowZ.constData();
+}
+
+const float * AABoxArray::highX() const
+{
+    return m_highX.constData();
+}
+
+const float * AABoxArray::highY() const
+{
+    return m_highY.constData();
+}
+
+const float * AABoxArray::highZ() const
+{
+    return m_highZ.constData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 Sphere::Sphere()
 {
     radius = 0.0;
@@ -195,17 +284,15 @@ TestResult Sphere::containsPoint(vec3 v) const
 
 TestResult Sphere::containsAABox(const AABox &b) const
 {
-    if(intersectsAABox(b))
-        return INTERSECTING;
-    
-    if(!b.contains(pos))
+    if(!intersectsAABox(b))
         return OUTSIDE;
     
-    // Either the box is inside the sphere or the sphere is inside the box.
-    // The one with the larger extent contains the other.
-    vec3 boxExtent = b.high - b.low;
-    float boxMaxExtent = qMax(boxExtent.x, qMax(boxExtent.y, boxExtent.z));
-    return (boxMaxExtent > (radius * 2.0)) ? INTERSECTING : INSIDE;
+    // The box is inside the sphere if its farthest corner is.
+    float dx = qMax(pos.x - b.low.x, b.high.x - pos.x);
+    float dy = qMax(pos.y - b.low.y, b.high.y - pos.y);
+    float dz = qMax(pos.z - b.low.z, b.high.z - pos.z);
+    float d = (dx * dx) + (dy * dy) + (dz * dz);
+    return (d <= (radius * radius)) ? INSIDE : INTERSECTING;
 }
 
 bool Sphere::intersectsAABox(const AABox &b) const
@@ -214,15 +301,15 @@ bool Sphere::intersectsAABox(const AABox &b) const
     float d = 0;
     float e;
     e = qMax(b.low.x - pos.x, 0.0f) + qMax(pos.x - b.high.x, 0.0f);
-    if(e <= radius)
+    if(e > radius)
         return false;
     d += (e * e);
     e = qMax(b.low.y - pos.y, 0.0f) + qMax(pos.y - b.high.y, 0.0f);
-    if(e <= radius)
+    if(e > radius)
         return false;
     d += (e * e);
     e = qMax(b.low.z - pos.z, 0.0f) + qMax(pos.z - b.high.z, 0.0f);
-    if(e <= radius)
+    if(e > radius)
         return false;
     d += (e * e);
     return d <= (radius * radius);
@@ -415,3 +502,220 @@ TestResult Frustum::containsAABox(const AABox &b) const
     }
     return result;
 }
+
+/*!
+  \brief Classify four boxes against the frustum planes, like containsAABox.
+  Bit i of the masks is set when box i is outside the frustum or intersects
+  its boundary.
+  */
+static void classifyBoxes4(const Plane *planes, const float4 *low, const float4 *high,
+                           uint32_t &outsideMask, uint32_t &intersectMask)
+{
+    const float4 zero = float4::splat(0.0f);
+    int outside = 0, intersect = 0;
+    for(int i = 0; i < 6; i++)
+    {
+        const vec3 &n = planes[i].n();
+        float4 nx = float4::splat(n.x), ny = float4::splat(n.y), nz = float4::splat(n.z);
+        float4 offset = float4::splat(planes[i].offset());
+        // Positive vertex: the corner farthest along the normal.
+        float4 posDist = nx * ((n.x > 0) ? high[0] : low[0])
+                       + ny * ((n.y > 0) ? high[1] : low[1])
+                       + nz * ((n.z > 0) ? high[2] : low[2]);
+        float4 negDist = nx * ((n.x < 0) ? high[0] : low[0])
+                       + ny * ((n.y < 0) ? high[1] : low[1])
+                       + nz * ((n.z < 0) ? high[2] : low[2]);
+        outside |= float4::lessThan(posDist + offset, zero);
+        intersect |= float4::lessThan(negDist + offset, zero);
+    }
+    outsideMask = outside;
+    intersectMask = intersect & ~outside;
+}
+
+static uint8_t testResultFromMasks(uint32_t outsideMask, uint32_t intersectMask, int i)
+{
+    if(outsideMask & (1 << i))
+        return OUTSIDE;
+    return (intersectMask & (1 << i)) ? INTERSECTING : INSIDE;
+}
+
+/*!
+  \brief Test the four boxes starting at 'first' against the frustum.
+  */
+void Frustum::containsAABoxes4(const AABoxArray &boxes, uint32_t first,
+                               uint32_t &outsideMask, uint32_t &intersectMask) const
+{
+    float4 low[3], high[3];
+    low[0] = float4::load(boxes.lowX() + first);
+    low[1] = float4::load(boxes.lowY() + first);
+    low[2] = float4::load(boxes.lowZ() + first);
+    high[0] = float4::load(boxes.highX() + first);
+    high[1] = float4::load(boxes.highY() + first);
+    high[2] = float4::load(boxes.highZ() + first);
+    classifyBoxes4(m_planes, low, high, outsideMask, intersectMask);
+}
+
+/*!
+  \brief Test 'count' boxes starting at 'first' against the frustum and write
+  the result (a TestResult) for each box.
+  */
+void Frustum::containsAABoxes(const AABoxArray &boxes, uint32_t first,
+                              uint32_t count, uint8_t *results) const
+{
+    uint32_t i = 0;
+    for(; (i + 4) <= count; i += 4)
+    {
+        uint32_t outsideMask = 0, intersectMask = 0;
+        containsAABoxes4(boxes, first + i, outsideMask, intersectMask);
+        for(int j = 0; j < 4; j++)
+            results[i + j] = testResultFromMasks(outsideMask, intersectMask, j);
+    }
+    for(; i < count; i++)
+        results[i] = containsAABox(boxes.at(first + i));
+}
+
+/*!
+  \brief Test 'count' boxes starting at 'first' against the frustum and write
+  the indices of the boxes that are not outside. Return the number of indices.
+  */
+uint32_t Frustum::findVisible(const AABoxArray &boxes, uint32_t first,
+                              uint32_t count, uint32_t *visible) const
+{
+    uint32_t found = 0;
+    uint32_t i = 0;
+    for(; (i + 4) <= count; i += 4)
+    {
+        uint32_t outsideMask = 0, intersectMask = 0;
+        containsAABoxes4(boxes, first + i, outsideMask, intersectMask);
+        for(int j = 0; j < 4; j++)
+        {
+            if(!(outsideMask & (1 << j)))
+                visible[found++] = first + i + j;
+        }
+    }
+    for(; i < count; i++)
+    {
+        if(containsAABox(boxes.at(first + i)) != OUTSIDE)
+            visible[found++] = first + i;
+    }
+    return found;
+}
+
+/*!
+  \brief Test the boxes with the given indices against the frustum and write
+  the indices of the boxes that are not outside. Return the number of indices.
+  */
+uint32_t Frustum::findVisibleIndexed(const AABoxArray &boxes, const uint32_t *indices,
+                                     uint32_t count, uint32_t *visible) const
+{
+    const float *lx = boxes.lowX(), *ly = boxes.lowY(), *lz = boxes.lowZ();
+    const float *hx = boxes.highX(), *hy = boxes.highY(), *hz = boxes.highZ();
+    uint32_t found = 0;
+    uint32_t i = 0;
+    for(; (i + 4) <= count; i += 4)
+    {
+        const uint32_t *idx = indices + i;
+        float4 low[3], high[3];
+        low[0] = float4(lx[idx[0]], lx[idx[1]], lx[idx[2]], lx[idx[3]]);
+        low[1] = float4(ly[idx[0]], ly[idx[1]], ly[idx[2]], ly[idx[3]]);
+        low[2] = float4(lz[idx[0]], lz[idx[1]], lz[idx[2]], lz[idx[3]]);
+        high[0] = float4(hx[idx[0]], hx[idx[1]], hx[idx[2]], hx[idx[3]]);
+        high[1] = float4(hy[idx[0]], hy[idx[1]], hy[idx[2]], hy[idx[3]]);
+        high[2] = float4(hz[idx[0]], hz[idx[1]], hz[idx[2]], hz[idx[3]]);
+        uint32_t outsideMask = 0, intersectMask = 0;
+        classifyBoxes4(m_planes, low, high, outsideMask, intersectMask);
+        for(int j = 0; j < 4; j++)
+        {
+            if(!(outsideMask & (1 << j)))
+                visible[found++] = idx[j];
+        }
+    }
+    for(; i < count; i++)
+    {
+        if(containsAABox(boxes.at(indices[i])) != OUTSIDE)
+            visible[found++] = indices[i];
+    }
+    return found;
+}
+
+/*!
+  \brief Test the boxes whose bit is set in 'mask' against the frustum, 32
+  boxes per word, and set the bits of the boxes that are not outside in
+  'visibleBits'. Only the words in [firstWord, lastWord) are processed, so
+  that disjoint ranges can be culled in parallel. Words of the mask that are
+  zero are skipped. The array must hold at least (lastWord * 32) boxes.
+  */
+void Frustum::findVisibleBits(const AABoxArray &boxes, const uint32_t *mask,
+                              uint32_t firstWord, uint32_t lastWord,
+                              uint32_t *visibleBits) const
+{
+    Q_ASSERT(boxes.count() >= (lastWord * 32));
+    for(uint32_t i = firstWord; i < lastWord; i++)
+    {
+        uint32_t word = mask[i];
+        if(word == 0)
+        {
+            visibleBits[i] = 0;
+            continue;
+        }
+        uint32_t outsideBits = 0;
+        for(uint32_t j = 0; j < 32; j += 4)
+        {
+            if(!(word & (0xf << j)))
+            {
+                outsideBits |= (0xf << j);
+                continue;
+            }
+            uint32_t outsideMask = 0, intersectMask = 0;
+            containsAABoxes4(boxes, (i * 32) + j, outsideMask, intersectMask);
+            outsideBits |= (outsideMask << j);
+        }
+        visibleBits[i] = word & ~outsideBits;
+    }
+}
+
+/*!
+  \brief Test 'count' spheres against the frustum and write the indices of the
+  spheres that are not outside. Return the number of indices.
+  */
+uint32_t Frustum::findVisible(const vec3 *centers, const float *radii,
+                              uint32_t count, uint32_t *visible) const
+{
+    uint32_t found = 0;
+    uint32_t i = 0;
+    for(; (i + 4) <= count; i += 4)
+    {
+        const vec3 *c = centers + i;
+        float4 x(c[0].x, c[1].x, c[2].x, c[3].x);
+        float4 y(c[0].y, c[1].y, c[2].y, c[3].y);
+        float4 z(c[0].z, c[1].z, c[2].z, c[3].z);
+        float4 minusRadius = -float4::load(radii + i);
+        int outside = 0;
+        for(int j = 0; j < 6; j++)
+        {
+            const vec3 &n = m_planes[j].n();
+            float4 dist = x * n.x + y * n.y + z * n.z + float4::splat(m_planes[j].offset());
+            outside |= float4::lessThan(dist, minusRadius);
+        }
+        for(int j = 0; j < 4; j++)
+        {
+            if(!(outside & (1 << j)))
+                visible[found++] = i + j;
+        }
+    }
+    for(; i < count; i++)
+    {
+        bool inside = true;
+        for(int j = 0; j < 6; j++)
+        {
+            if(m_planes[j].distance(centers[i]) < -radii[i])
+            {
+                inside = false;
+                break;
+            }
+        }
+        if(inside)
+            visible[found++] = i;
+    }
+    return found;
+}
@@ -304,3 +304,24 @@ void BoneTransform::toDualQuaternion(vec4 &d0, vec4 &d1) const
     d1.z = 0.5f * (tran.x() * d0.y - tran.y() * d0.x + tran.z() * d0.w);
     d1.w = -0.5f * (tran.x() * d0.x + tran.y() * d0.y + tran.z() * d0.z);
 }
+
+BoneTransform BoneTransform::fromDualQuaternion(const vec4 &d0, const vec4 &d1)
+{
+    // t = 2 * d1 * conjugate(d0)
+    BoneTransform t;
+    t.rotation = QQuaternion(d0.w, d0.x, d0.y, d0.z);
+    t.location = QVector4D(2.0f * (d0.w * d1.x - d1.w * d0.x + d0.y * d1.z - d0.z * d1.y),
+                           2.0f * (d0.w * d1.y - d1.w * d0.y + d0.z * d1.x - d0.x * d1.z),
+                           2.0f * (d0.w * d1.z - d1.w * d0.z + d0.x * d1.y - d0.y * d1.x),
+                           1.0f);
+    return t;
+}
+
+vec3 BoneTransform::mapDualQuaternion(const vec4 &d0, const vec4 &d1, const vec3 &v)
+{
+    // Same computation as the skinning vertex shaders.
+    vec3 r(d0.x, d0.y, d0.z), e(d1.x, d1.y, d1.z);
+    vec3 rotated = v + vec3::cross(r, vec3::cross(r, v) + v * d0.w) * 2.0f;
+    vec3 trans = ((e * d0.w) - (r * d1.w) + vec3::cross(r, e)) * 2.0f;
+    return rotated + trans;
+}
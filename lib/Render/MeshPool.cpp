@@ -0,0 +1,582 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cstring>
+#include <QtAlgorithms>
+#include "EQuilibre/Render/MeshPool.h"
+#include "EQuilibre/Render/Vertex.h"
+#include "EQuilibre/Render/RenderContext.h"
+
+const uint32_t MeshPool::DefaultVertexCapacity = 65536;
+const uint32_t MeshPool::DefaultIndexCapacity = 262144;
+const uint32_t MeshPool::InvalidHandle = 0xffffffff;
+
+static const uint32_t NoOffset = 0xffffffff;
+
+static int findRange(const QVector<MeshRange> &ranges, uint32_t count)
+{
+    for(int i = 0; i < ranges.count(); i++)
+    {
+        if(ranges[i].count >= count)
+            return i;
+    }
+    return -1;
+}
+
+/*!
+  \brief Take count elements from the first free range that is large enough.
+  */
+static uint32_t allocateRange(QVector<MeshRange> &ranges, uint32_t count)
+{
+    if(count == 0)
+        return 0;
+    int i = findRange(ranges, count);
+    if(i < 0)
+        return NoOffset;
+    MeshRange &range = ranges[i];
+    uint32_t offset = range.offset;
+    range.offset += count;
+    range.count -= count;
+    if(range.count == 0)
+        ranges.remove(i);
+    return offset;
+}
+
+/*!
+  \brief Give elements back to the free list, merging them with the free
+  ranges right before and after them.
+  */
+static void freeRange(QVector<MeshRange> &ranges, uint32_t offset, uint32_t count)
+{
+    if(count == 0)
+        return;
+    int i = 0;
+    while((i < ranges.count()) && (ranges[i].offset < offset))
+        i++;
+    bool mergePrev = (i > 0) && ((ranges[i - 1].offset + ranges[i - 1].count) == offset);
+    bool mergeNext = (i < ranges.count()) && ((offset + count) == ranges[i].offset);
+    if(mergePrev && mergeNext)
+    {
+        ranges[i - 1].count += count + ranges[i].count;
+        ranges.remove(i);
+    }
+    else if(mergePrev)
+    {
+        ranges[i - 1].count += count;
+    }
+    else if(mergeNext)
+    {
+        ranges[i].offset = offset;
+        ranges[i].count += count;
+    }
+    else
+    {
+        MeshRange range;
+        range.offset = offset;
+        range.count = count;
+        ranges.insert(i, range);
+    }
+}
+
+static void extendRange(MeshRange &range, uint32_t offset, uint32_t count)
+{
+    if(count == 0)
+        return;
+    if(range.count == 0)
+    {
+        range.offset = offset;
+        range.count = count;
+        return;
+    }
+    uint32_t end = qMax(range.offset + range.count, offset + count);
+    range.offset = qMin(range.offset, offset);
+    range.count = end - range.offset;
+}
+
+static bool isCompact(const QVector<MeshRange> &ranges, uint32_t capacity)
+{
+    if(ranges.isEmpty())
+        return true;
+    return (ranges.count() == 1) && ((ranges[0].offset + ranges[0].count) == capacity);
+}
+
+struct MeshMove
+{
+    uint32_t offset;
+    uint32_t handle;
+};
+
+static bool meshMoveLessThan(const MeshMove &a, const MeshMove &b)
+{
+    return a.offset < b.offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MeshAllocation::MeshAllocation()
+{
+    buffer = NULL;
+    baseVertex = 0;
+    vertexCount = 0;
+    indexOffset = 0;
+    indexCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MeshPool::MeshPool(uint32_t vertexCapacity, uint32_t indexCapacity)
+{
+    m_vertexCapacity = vertexCapacity;
+    m_indexCapacity = indexCapacity;
+}
+
+MeshPool::~MeshPool()
+{
+    clear(NULL);
+}
+
+uint32_t MeshPool::vertexCapacity() const
+{
+    return m_vertexCapacity;
+}
+
+uint32_t MeshPool::indexCapacity() const
+{
+    return m_indexCapacity;
+}
+
+uint32_t MeshPool::bufferCount() const
+{
+    return m_pages.count();
+}
+
+MeshBuffer * MeshPool::buffer(uint32_t index) const
+{
+    return (index < (uint32_t)m_pages.count()) ? m_pages[index].buffer : NULL;
+}
+
+uint32_t MeshPool::allocationCount() const
+{
+    return m_allocations.count() - m_freeHandles.count();
+}
+
+uint32_t MeshPool::usedVertices() const
+{
+    uint32_t used = 0;
+    foreach(const MeshAllocation &alloc, m_allocations)
+        used += alloc.vertexCount;
+    return used;
+}
+
+uint32_t MeshPool::usedIndices() const
+{
+    uint32_t used = 0;
+    foreach(const MeshAllocation &alloc, m_allocations)
+        used += alloc.indexCount;
+    return used;
+}
+
+/*!
+  \brief Number of free vertex and index ranges in all buffers. A compact
+  pool has at most two per buffer, at the end of the buffer.
+  */
+uint32_t MeshPool::freeRangeCount() const
+{
+    uint32_t count = 0;
+    foreach(const MeshPoolPage &page, m_pages)
+        count += page.freeVertices.count() + page.freeIndices.count();
+    return count;
+}
+
+bool MeshPool::contains(uint32_t handle) const
+{
+    return (handle < (uint32_t)m_allocations.count()) && m_allocations[handle].buffer;
+}
+
+const MeshAllocation & MeshPool::allocation(uint32_t handle) const
+{
+    Q_ASSERT(contains(handle));
+    return m_allocations[handle];
+}
+
+/*!
+  \brief Copy the vertices and indices of the staging buffer to one of the
+  pool's buffers and move its meshes there. The staging buffer's indices must
+  be relative to its first vertex, as they are after importing meshes into a
+  new buffer. The staging buffer no longer owns any mesh afterwards.
+  Allocations that keep their geometry in memory are placed in other buffers
+  than those that don't.
+  \return Handle to the allocation, valid until it is removed.
+  */
+uint32_t MeshPool::add(MeshBuffer *staging, bool keepGeometry)
+{
+    uint32_t vertexCount = staging->vertices.count();
+    uint32_t indexCount = staging->indices.count();
+    int pageIndex = findPage(vertexCount, indexCount, keepGeometry);
+    if(pageIndex < 0)
+        pageIndex = createPage(qMax(m_vertexCapacity, vertexCount),
+                               qMax(m_indexCapacity, indexCount), keepGeometry);
+    MeshPoolPage &page = m_pages[pageIndex];
+    MeshBuffer *buffer = page.buffer;
+    
+    // The buffer's geometry may have been freed when it was last uploaded.
+    // Only the new allocation needs to be in memory to be uploaded.
+    if((uint32_t)buffer->vertices.count() < page.vertexCapacity)
+        buffer->vertices.resize(page.vertexCapacity);
+    if((uint32_t)buffer->indices.count() < page.indexCapacity)
+        buffer->indices.resize(page.indexCapacity);
+    
+    MeshAllocation alloc;
+    alloc.buffer = buffer;
+    alloc.baseVertex = allocateRange(page.freeVertices, vertexCount);
+    alloc.vertexCount = vertexCount;
+    alloc.indexOffset = allocateRange(page.freeIndices, indexCount);
+    alloc.indexCount = indexCount;
+    Q_ASSERT((alloc.baseVertex != NoOffset) && (alloc.indexOffset != NoOffset));
+    
+    // Copy the geometry, making the indices point to the allocated vertices.
+    if(vertexCount > 0)
+        memcpy(buffer->vertices.data() + alloc.baseVertex, staging->vertices.constData(),
+               vertexCount * sizeof(Vertex));
+    const uint32_t *src = staging->indices.constData();
+    uint32_t *dst = buffer->indices.data() + alloc.indexOffset;
+    for(uint32_t i = 0; i < indexCount; i++)
+        dst[i] = src[i] + alloc.baseVertex;
+    extendRange(page.dirtyVertices, alloc.baseVertex, vertexCount);
+    extendRange(page.dirtyIndices, alloc.indexOffset, indexCount);
+    
+    // Move the meshes to the pool's buffer.
+    foreach(MeshData *mesh, staging->meshes)
+    {
+        mesh->buffer = buffer;
+        mesh->vertexSegment.offset += alloc.baseVertex;
+        mesh->indexSegment.offset += alloc.indexOffset;
+        mesh->firstRange = MeshData::NoRange;
+        buffer->meshes.append(mesh);
+        alloc.meshes.append(mesh);
+    }
+    staging->meshes.clear();
+    staging->ranges.clear();
+    page.allocations++;
+    page.dirtyRanges = true;
+    
+    uint32_t handle;
+    if(m_freeHandles.count() > 0)
+    {
+        handle = m_freeHandles.last();
+        m_freeHandles.pop_back();
+        m_allocations[handle] = alloc;
+    }
+    else
+    {
+        handle = m_allocations.count();
+        m_allocations.append(alloc);
+    }
+    return handle;
+}
+
+/*!
+  \brief Delete the meshes of the allocation and free its space.
+  */
+void MeshPool::remove(uint32_t handle)
+{
+    if(!contains(handle))
+        return;
+    MeshAllocation &alloc = m_allocations[handle];
+    MeshPoolPage &page = m_pages[pageOf(alloc.buffer)];
+    foreach(MeshData *mesh, alloc.meshes)
+    {
+        int i = page.buffer->meshes.indexOf(mesh);
+        if(i >= 0)
+            page.buffer->meshes.remove(i);
+        delete mesh;
+    }
+    freeRange(page.freeVertices, alloc.baseVertex, alloc.vertexCount);
+    freeRange(page.freeIndices, alloc.indexOffset, alloc.indexCount);
+    page.allocations--;
+    invalidateRanges(page);
+    alloc = MeshAllocation();
+    m_freeHandles.append(handle);
+}
+
+/*!
+  \brief Move the allocations of each buffer to its start so that its free
+  space is in one piece, and release the buffers that are no longer used.
+  This is meant to be done between zones, since the moved ranges have to be
+  uploaded again. They are uploaded right away if a context is given, since
+  the meshes left in the pool now refer to the new offsets. Buffers whose
+  geometry was freed are read back from the GPU, which needs a context.
+  */
+void MeshPool::defragment(RenderContext *renderCtx)
+{
+    for(int i = m_pages.count() - 1; i >= 0; i--)
+    {
+        MeshPoolPage &page = m_pages[i];
+        if(page.allocations == 0)
+        {
+            page.buffer->clear(renderCtx);
+            delete page.buffer;
+            m_pages.remove(i);
+        }
+        else if(!isCompact(page.freeVertices, page.vertexCapacity) ||
+                !isCompact(page.freeIndices, page.indexCapacity))
+        {
+            if(!page.inMemory)
+            {
+                if(!renderCtx)
+                    continue;
+                readPage(renderCtx, page);
+            }
+            compactPage(page);
+        }
+    }
+    if(renderCtx)
+        upload(renderCtx);
+}
+
+/*!
+  \brief Create the GPU buffers of new pool buffers, at their full capacity,
+  and upload the parts of the buffers that changed.
+  */
+void MeshPool::upload(RenderContext *renderCtx)
+{
+    for(int i = 0; i < m_pages.count(); i++)
+        uploadPage(renderCtx, m_pages[i]);
+}
+
+void MeshPool::clear(RenderContext *renderCtx)
+{
+    foreach(const MeshPoolPage &page, m_pages)
+    {
+        page.buffer->clear(renderCtx);
+        delete page.buffer;
+    }
+    m_pages.clear();
+    m_allocations.clear();
+    m_freeHandles.clear();
+}
+
+int MeshPool::findPage(uint32_t vertexCount, uint32_t indexCount, bool keepGeometry) const
+{
+    for(int i = 0; i < m_pages.count(); i++)
+    {
+        const MeshPoolPage &page = m_pages[i];
+        if(page.keepGeometry != keepGeometry)
+            continue;
+        if(((vertexCount == 0) || (findRange(page.freeVertices, vertexCount) >= 0)) &&
+           ((indexCount == 0) || (findRange(page.freeIndices, indexCount) >= 0)))
+            return i;
+    }
+    return -1;
+}
+
+int MeshPool::pageOf(const MeshBuffer *buffer) const
+{
+    for(int i = 0; i < m_pages.count(); i++)
+    {
+        if(m_pages[i].buffer == buffer)
+            return i;
+    }
+    return -1;
+}
+
+/*!
+  \brief Create a buffer that can hold the given number of vertices and
+  indices. The default capacity keeps indices small enough to be uploaded as
+  16-bit integers.
+  */
+int MeshPool::createPage(uint32_t vertexCapacity, uint32_t indexCapacity, bool keepGeometry)
+{
+    MeshPoolPage page;
+    page.buffer = new MeshBuffer();
+    page.buffer->vertices.resize(vertexCapacity);
+    page.buffer->indices.resize(indexCapacity);
+    page.buffer->indexSize = MeshBuffer::indexSizeFor(vertexCapacity);
+    page.vertexCapacity = vertexCapacity;
+    page.indexCapacity = indexCapacity;
+    page.allocations = 0;
+    freeRange(page.freeVertices, 0, vertexCapacity);
+    freeRange(page.freeIndices, 0, indexCapacity);
+    page.dirtyVertices.offset = page.dirtyVertices.count = 0;
+    page.dirtyIndices.offset = page.dirtyIndices.count = 0;
+    page.dirtyRanges = false;
+    page.keepGeometry = keepGeometry;
+    page.inMemory = true;
+    m_pages.append(page);
+    return m_pages.count() - 1;
+}
+
+/*!
+  \brief Upload the parts of the buffer that changed, then free its vertices
+  and indices from memory unless they have to be kept there.
+  */
+void MeshPool::uploadPage(RenderContext *renderCtx, MeshPoolPage &page)
+{
+    MeshBuffer *buffer = page.buffer;
+    if(page.dirtyRanges)
+    {
+        buffer->buildRanges();
+        page.dirtyRanges = false;
+    }
+    if(buffer->vertexBuffer == 0)
+    {
+        buffer->vertexBufferSize = page.vertexCapacity * sizeof(Vertex);
+        buffer->vertexBuffer = renderCtx->createBuffer(NULL, buffer->vertexBufferSize);
+        buffer->indexBufferSize = page.indexCapacity * buffer->indexSize;
+        buffer->indexBuffer = renderCtx->createBuffer(NULL, buffer->indexBufferSize);
+    }
+    
+    const MeshRange &vertices = page.dirtyVertices;
+    renderCtx->updateBuffer(buffer->vertexBuffer, vertices.offset * sizeof(Vertex),
+                            buffer->vertices.constData() + vertices.offset,
+                            vertices.count * sizeof(Vertex));
+    const MeshRange &indices = page.dirtyIndices;
+    const uint32_t *src = buffer->indices.constData() + indices.offset;
+    if(buffer->indexSize == sizeof(uint16_t))
+    {
+        m_packedIndices.resize(indices.count);
+        uint16_t *packed = m_packedIndices.data();
+        for(uint32_t j = 0; j < indices.count; j++)
+            packed[j] = (uint16_t)src[j];
+        renderCtx->updateBuffer(buffer->indexBuffer, indices.offset * sizeof(uint16_t),
+                                packed, indices.count * sizeof(uint16_t));
+    }
+    else
+    {
+        renderCtx->updateBuffer(buffer->indexBuffer, indices.offset * sizeof(uint32_t),
+                                src, indices.count * sizeof(uint32_t));
+    }
+    page.dirtyVertices.count = 0;
+    page.dirtyIndices.count = 0;
+    
+    if(!page.keepGeometry)
+    {
+        buffer->clearVertices();
+        buffer->clearIndices();
+        page.inMemory = false;
+    }
+}
+
+/*!
+  \brief Read the vertices and indices of a buffer whose geometry was freed
+  back from the GPU, after uploading the parts that were only in memory.
+  */
+void MeshPool::readPage(RenderContext *renderCtx, MeshPoolPage &page)
+{
+    uploadPage(renderCtx, page);
+    MeshBuffer *buffer = page.buffer;
+    buffer->vertices.resize(page.vertexCapacity);
+    buffer->indices.resize(page.indexCapacity);
+    renderCtx->readBuffer(buffer->vertexBuffer, 0, buffer->vertices.data(),
+                          page.vertexCapacity * sizeof(Vertex));
+    if(buffer->indexSize == sizeof(uint16_t))
+    {
+        m_packedIndices.resize(page.indexCapacity);
+        renderCtx->readBuffer(buffer->indexBuffer, 0, m_packedIndices.data(),
+                              page.indexCapacity * sizeof(uint16_t));
+        const uint16_t *packed = m_packedIndices.constData();
+        uint32_t *dst = buffer->indices.data();
+        for(uint32_t i = 0; i < page.indexCapacity; i++)
+            dst[i] = packed[i];
+    }
+    else
+    {
+        renderCtx->readBuffer(buffer->indexBuffer, 0, buffer->indices.data(),
+                              page.indexCapacity * sizeof(uint32_t));
+    }
+    page.inMemory = true;
+}
+
+/*!
+  \brief Slide the allocations of the buffer down so that there is no free
+  space between them, in offset order. The indices are moved the same way
+  and rebased on the new location of their vertices.
+  */
+void MeshPool::compactPage(MeshPoolPage &page)
+{
+    QVector<MeshMove> vertexMoves, indexMoves;
+    for(int i = 0; i < m_allocations.count(); i++)
+    {
+        const MeshAllocation &alloc = m_allocations[i];
+        if(alloc.buffer != page.buffer)
+            continue;
+        MeshMove move;
+        move.handle = i;
+        move.offset = alloc.baseVertex;
+        vertexMoves.append(move);
+        move.offset = alloc.indexOffset;
+        indexMoves.append(move);
+    }
+    qSort(vertexMoves.begin(), vertexMoves.end(), meshMoveLessThan);
+    qSort(indexMoves.begin(), indexMoves.end(), meshMoveLessThan);
+    
+    // The new base vertex of each allocation, indexed by handle.
+    QVector<uint32_t> newBases(m_allocations.count(), 0);
+    Vertex *vertices = page.buffer->vertices.data();
+    uint32_t vertexEnd = 0;
+    foreach(const MeshMove &move, vertexMoves)
+    {
+        const MeshAllocation &alloc = m_allocations[move.handle];
+        if(alloc.baseVertex != vertexEnd)
+        {
+            memmove(vertices + vertexEnd, vertices + alloc.baseVertex,
+                    alloc.vertexCount * sizeof(Vertex));
+            extendRange(page.dirtyVertices, vertexEnd, alloc.vertexCount);
+        }
+        newBases[move.handle] = vertexEnd;
+        vertexEnd += alloc.vertexCount;
+    }
+    
+    uint32_t *indices = page.buffer->indices.data();
+    uint32_t indexEnd = 0;
+    foreach(const MeshMove &move, indexMoves)
+    {
+        MeshAllocation &alloc = m_allocations[move.handle];
+        uint32_t oldBase = alloc.baseVertex, newBase = newBases[move.handle];
+        if((alloc.indexOffset != indexEnd) || (oldBase != newBase))
+        {
+            // Indices only move down, so they can be copied in order.
+            const uint32_t *src = indices + alloc.indexOffset;
+            uint32_t *dst = indices + indexEnd;
+            for(uint32_t i = 0; i < alloc.indexCount; i++)
+                dst[i] = src[i] - oldBase + newBase;
+            extendRange(page.dirtyIndices, indexEnd, alloc.indexCount);
+        }
+        foreach(MeshData *mesh, alloc.meshes)
+        {
+            mesh->vertexSegment.offset = mesh->vertexSegment.offset - oldBase + newBase;
+            mesh->indexSegment.offset = mesh->indexSegment.offset - alloc.indexOffset + indexEnd;
+        }
+        alloc.baseVertex = newBase;
+        alloc.indexOffset = indexEnd;
+        indexEnd += alloc.indexCount;
+    }
+    
+    page.freeVertices.clear();
+    page.freeIndices.clear();
+    freeRange(page.freeVertices, vertexEnd, page.vertexCapacity - vertexEnd);
+    freeRange(page.freeIndices, indexEnd, page.indexCapacity - indexEnd);
+    invalidateRanges(page);
+}
+
+void MeshPool::invalidateRanges(MeshPoolPage &page)
+{
+    page.buffer->ranges.clear();
+    foreach(MeshData *mesh, page.buffer->meshes)
+        mesh->firstRange = MeshData::NoRange;
+    page.dirtyRanges = true;
+}
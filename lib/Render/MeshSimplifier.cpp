@@ -0,0 +1,514 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cmath>
+#include <cstring>
+#include "EQuilibre/Render/MeshSimplifier.h"
+#include "EQuilibre/Render/Vertex.h"
+
+/** Number of coefficients of a symmetric 4x4 quadric matrix. */
+static const uint32_t QuadricSize = 10;
+static const uint32_t MaxPasses = 64;
+
+static void addPlane(double *q, double a, double b, double c, double d)
+{
+    q[0] += a * a;
+    q[1] += a * b;
+    q[2] += a * c;
+    q[3] += a * d;
+    q[4] += b * b;
+    q[5] += b * c;
+    q[6] += b * d;
+    q[7] += c * c;
+    q[8] += c * d;
+    q[9] += d * d;
+}
+
+/*!
+  \brief Sum of the squared distances of the point to the quadric's planes.
+  */
+static double evaluateQuadric(const double *q, const vec3 &p)
+{
+    double x = p.x, y = p.y, z = p.z;
+    double e = (q[0] * x * x) + (2.0 * q[1] * x * y) + (2.0 * q[2] * x * z) + (2.0 * q[3] * x)
+             + (q[4] * y * y) + (2.0 * q[5] * y * z) + (2.0 * q[6] * y)
+             + (q[7] * z * z) + (2.0 * q[8] * z) + q[9];
+    return qMax(e, 0.0);
+}
+
+static uint64_t edgeKey(uint32_t a, uint32_t b)
+{
+    return (a < b) ? (((uint64_t)a << 32) | b) : (((uint64_t)b << 32) | a);
+}
+
+/** Positions closer than this fraction of the mesh's extent are welded. */
+static const float WeldTolerance = 1e-5f;
+
+/*!
+  \brief Position snapped to a grid, so that vertices that are almost at the
+  same position (e.g.\ at the poles of a sphere) compare equal.
+  */
+struct WeldKey
+{
+    int64_t x, y, z;
+    uint32_t vertex;
+    
+    bool operator<(const WeldKey &other) const
+    {
+        if(x != other.x)
+            return x < other.x;
+        if(y != other.y)
+            return y < other.y;
+        if(z != other.z)
+            return z < other.z;
+        return vertex < other.vertex;
+    }
+    
+    bool samePosition(const WeldKey &other) const
+    {
+        return (x == other.x) && (y == other.y) && (z == other.z);
+    }
+};
+
+bool MeshSimplifier::Collapse::operator<(const Collapse &other) const
+{
+    return cost < other.cost;
+}
+
+MeshSimplifier::MeshSimplifier()
+{
+    m_error = 0.0f;
+}
+
+/*!
+  \brief Error of the last simplification, in mesh units. This bounds the
+  distance between the moved vertices and the planes of the triangles they
+  were part of.
+  */
+float MeshSimplifier::error() const
+{
+    return m_error;
+}
+
+/*!
+  \brief Remove triangles from the mesh until it has at most targetIndexCount
+  indices, or until removing more would cause an error above maxError.
+  Indices are relative to the first vertex and the groups' offsets to the
+  first index. The remaining triangles are written to dstIndices, grouped
+  like the source ones and described by dstGroups (groupCount entries).
+  \return Number of indices in the simplified mesh.
+  */
+uint32_t MeshSimplifier::simplify(const Vertex *vertices, uint32_t vertexCount,
+                                  const uint32_t *indices, const MaterialGroup *groups,
+                                  uint32_t groupCount, uint32_t targetIndexCount,
+                                  float maxError, QVector<uint32_t> &dstIndices,
+                                  MaterialGroup *dstGroups)
+{
+    m_error = 0.0f;
+    m_triangles.resize(0);
+    m_triGroups.resize(0);
+    for(uint32_t i = 0; i < groupCount; i++)
+    {
+        const uint32_t *groupIndices = indices + groups[i].offset;
+        for(uint32_t j = 0; (j + 2) < groups[i].count; j += 3)
+        {
+            Q_ASSERT(groupIndices[j] < vertexCount);
+            Q_ASSERT(groupIndices[j + 1] < vertexCount);
+            Q_ASSERT(groupIndices[j + 2] < vertexCount);
+            m_triangles.append(groupIndices[j]);
+            m_triangles.append(groupIndices[j + 1]);
+            m_triangles.append(groupIndices[j + 2]);
+            m_triGroups.append(i);
+        }
+    }
+    
+    classifyVertices(vertices, vertexCount);
+    computeQuadrics(vertices, vertexCount);
+    m_remap.resize(vertexCount);
+    for(uint32_t i = 0; i < vertexCount; i++)
+        m_remap[i] = i;
+    m_touched.resize(vertexCount);
+    
+    double maxCost = (double)maxError * (double)maxError, cost = 0.0;
+    for(uint32_t pass = 0; pass < MaxPasses; pass++)
+    {
+        uint32_t triangleCount = m_triangles.count() / 3;
+        if((triangleCount * 3) <= targetIndexCount)
+            break;
+        
+        // Find the cheapest collapse of each edge.
+        buildAdjacency(vertexCount);
+        m_collapses.resize(0);
+        const uint32_t *triangles = m_triangles.constData();
+        for(uint32_t i = 0; i < triangleCount; i++)
+        {
+            for(uint32_t j = 0; j < 3; j++)
+            {
+                uint32_t a = triangles[(i * 3) + j];
+                uint32_t b = triangles[(i * 3) + ((j + 1) % 3)];
+                Collapse c;
+                c.cost = -1.0f;
+                if(canCollapse(vertices, a, b))
+                {
+                    c.from = a;
+                    c.to = b;
+                    c.cost = collapseCost(vertices, a, b);
+                }
+                if(canCollapse(vertices, b, a))
+                {
+                    float costBA = collapseCost(vertices, b, a);
+                    if((c.cost < 0.0f) || (costBA < c.cost))
+                    {
+                        c.from = b;
+                        c.to = a;
+                        c.cost = costBA;
+                    }
+                }
+                if(c.cost >= 0.0f)
+                    m_collapses.append(c);
+            }
+        }
+        qSort(m_collapses.begin(), m_collapses.end());
+        
+        // Collapse the cheapest edges whose neighbourhoods do not overlap, so
+        // that the adjacency information stays valid during the pass. Only
+        // part of the mesh is simplified in one pass so that the edges whose
+        // cost changes get a chance to be reconsidered.
+        uint32_t toRemove = qMin(triangleCount - (targetIndexCount / 3),
+                                 qMax(triangleCount / 8, 1u));
+        uint32_t removed = 0, collapsed = 0;
+        memset(m_touched.data(), 0, vertexCount);
+        foreach(const Collapse &c, m_collapses)
+        {
+            if(c.cost > maxCost)
+                break;
+            if(m_touched[c.from] || m_touched[c.to])
+                continue;
+            if(collapseFlips(vertices, c.from, c.to))
+                continue;
+            removed += collapse(c.from, c.to);
+            collapsed++;
+            cost = qMax(cost, (double)c.cost);
+            if(removed >= toRemove)
+                break;
+        }
+        if(collapsed == 0)
+            break;
+        removeDegenerate();
+        findEdges();
+    }
+    m_error = (float)sqrt(cost);
+    
+    // Write the remaining triangles, group by group.
+    dstIndices.resize(0);
+    uint32_t triangleCount = m_triangles.count() / 3;
+    for(uint32_t i = 0; i < groupCount; i++)
+    {
+        MaterialGroup &mg(dstGroups[i]);
+        mg = groups[i];
+        mg.offset = dstIndices.count();
+        for(uint32_t j = 0; j < triangleCount; j++)
+        {
+            if(m_triGroups[j] != i)
+                continue;
+            dstIndices.append(m_triangles[(j * 3) + 0]);
+            dstIndices.append(m_triangles[(j * 3) + 1]);
+            dstIndices.append(m_triangles[(j * 3) + 2]);
+        }
+        mg.count = dstIndices.count() - mg.offset;
+    }
+    return dstIndices.count();
+}
+
+/*!
+  \brief Find out which vertices can be removed. Vertices that share their
+  position with other vertices (texture seams), that are used by several
+  material groups or that are on non-manifold edges are locked. Vertices on
+  an open border can only be collapsed along it, unless they are corners.
+  */
+void MeshSimplifier::classifyVertices(const Vertex *vertices, uint32_t vertexCount)
+{
+    // Weld vertices that have the same position.
+    float extent = 0.0f;
+    for(uint32_t i = 0; i < vertexCount; i++)
+    {
+        const vec3 &pos = vertices[i].position;
+        extent = qMax(extent, qMax(fabsf(pos.x), qMax(fabsf(pos.y), fabsf(pos.z))));
+    }
+    double gridScale = (extent > 0.0f) ? (1.0 / (extent * WeldTolerance)) : 1.0;
+    QVector<WeldKey> keys(vertexCount);
+    for(uint32_t i = 0; i < vertexCount; i++)
+    {
+        const vec3 &pos = vertices[i].position;
+        keys[i].x = (int64_t)floor((pos.x * gridScale) + 0.5);
+        keys[i].y = (int64_t)floor((pos.y * gridScale) + 0.5);
+        keys[i].z = (int64_t)floor((pos.z * gridScale) + 0.5);
+        keys[i].vertex = i;
+    }
+    qSort(keys.begin(), keys.end());
+    m_welded.resize(vertexCount);
+    m_kinds.fill(Manifold, vertexCount);
+    for(uint32_t i = 0; i < vertexCount; )
+    {
+        uint32_t end = i + 1;
+        while((end < vertexCount) && keys[end].samePosition(keys[i]))
+            end++;
+        for(uint32_t j = i; j < end; j++)
+        {
+            m_welded[keys[j].vertex] = keys[i].vertex;
+            if((end - i) > 1)
+                m_kinds[keys[j].vertex] = Locked;
+        }
+        i = end;
+    }
+    
+    // Lock vertices shared by several groups.
+    QVector<uint32_t> vertexGroups(vertexCount, 0xffffffff);
+    uint32_t triangleCount = m_triangles.count() / 3;
+    for(uint32_t i = 0; i < (triangleCount * 3); i++)
+    {
+        uint32_t v = m_triangles[i], group = m_triGroups[i / 3];
+        if(vertexGroups[v] == 0xffffffff)
+            vertexGroups[v] = group;
+        else if(vertexGroups[v] != group)
+            m_kinds[v] = Locked;
+    }
+    
+    // Count the border edges of each vertex.
+    findEdges();
+    QVector<uint32_t> borderCounts(vertexCount, 0);
+    for(int i = 0; i < m_edges.count(); )
+    {
+        uint64_t key = m_edges[i];
+        int end = i + 1;
+        while((end < m_edges.count()) && (m_edges[end] == key))
+            end++;
+        uint32_t a = (uint32_t)(key >> 32), b = (uint32_t)(key & 0xffffffff);
+        if((end - i) == 1)
+        {
+            borderCounts[a]++;
+            borderCounts[b]++;
+        }
+        else if((end - i) > 2)
+        {
+            m_kinds[a] = Locked;
+            m_kinds[b] = Locked;
+        }
+        i = end;
+    }
+    for(uint32_t i = 0; i < vertexCount; i++)
+    {
+        if(m_kinds[i] == Locked)
+            continue;
+        uint32_t borders = borderCounts[m_welded[i]];
+        if(borders == 2)
+            m_kinds[i] = Border;
+        else if(borders != 0)
+            m_kinds[i] = Locked;
+    }
+}
+
+/*!
+  \brief List the edges of the triangles (between welded vertices) and find
+  the border edges, which only belong to one triangle.
+  */
+void MeshSimplifier::findEdges()
+{
+    m_edges.resize(0);
+    uint32_t indexCount = m_triangles.count();
+    for(uint32_t i = 0; i < indexCount; i += 3)
+    {
+        for(uint32_t j = 0; j < 3; j++)
+        {
+            uint32_t a = m_welded[m_triangles[i + j]];
+            uint32_t b = m_welded[m_triangles[i + ((j + 1) % 3)]];
+            m_edges.append(edgeKey(a, b));
+        }
+    }
+    qSort(m_edges.begin(), m_edges.end());
+    
+    m_borderEdges.resize(0);
+    for(int i = 0; i < m_edges.count(); )
+    {
+        int end = i + 1;
+        while((end < m_edges.count()) && (m_edges[end] == m_edges[i]))
+            end++;
+        if((end - i) == 1)
+            m_borderEdges.append(m_edges[i]);
+        i = end;
+    }
+}
+
+bool MeshSimplifier::isBorderEdge(uint32_t a, uint32_t b) const
+{
+    uint64_t key = edgeKey(m_welded[a], m_welded[b]);
+    QVector<uint64_t>::const_iterator it = qBinaryFind(m_borderEdges.begin(),
+                                                       m_borderEdges.end(), key);
+    return it != m_borderEdges.end();
+}
+
+/*!
+  \brief Sum the planes of the triangles around each vertex. Border edges add
+  a plane perpendicular to their triangle so that borders keep their shape.
+  */
+void MeshSimplifier::computeQuadrics(const Vertex *vertices, uint32_t vertexCount)
+{
+    m_quadrics.fill(0.0, vertexCount * QuadricSize);
+    double *quadrics = m_quadrics.data();
+    uint32_t indexCount = m_triangles.count();
+    for(uint32_t i = 0; i < indexCount; i += 3)
+    {
+        const uint32_t *tri = m_triangles.constData() + i;
+        vec3 p[3] = {vertices[tri[0]].position, vertices[tri[1]].position,
+                     vertices[tri[2]].position};
+        vec3 n = vec3::cross(p[1] - p[0], p[2] - p[0]);
+        if(n.lengthSquared() == 0.0f)
+            continue;
+        n = n.normalized();
+        float d = -vec3::dot(n, p[0]);
+        for(uint32_t j = 0; j < 3; j++)
+            addPlane(quadrics + (tri[j] * QuadricSize), n.x, n.y, n.z, d);
+        
+        for(uint32_t j = 0; j < 3; j++)
+        {
+            uint32_t a = tri[j], b = tri[(j + 1) % 3];
+            if(!isBorderEdge(a, b))
+                continue;
+            vec3 edgeNormal = vec3::cross(p[(j + 1) % 3] - p[j], n);
+            if(edgeNormal.lengthSquared() == 0.0f)
+                continue;
+            edgeNormal = edgeNormal.normalized();
+            float edgeD = -vec3::dot(edgeNormal, p[j]);
+            addPlane(quadrics + (a * QuadricSize), edgeNormal.x, edgeNormal.y,
+                     edgeNormal.z, edgeD);
+            addPlane(quadrics + (b * QuadricSize), edgeNormal.x, edgeNormal.y,
+                     edgeNormal.z, edgeD);
+        }
+    }
+}
+
+void MeshSimplifier::buildAdjacency(uint32_t vertexCount)
+{
+    uint32_t indexCount = m_triangles.count();
+    m_adjOffsets.fill(0, vertexCount + 1);
+    for(uint32_t i = 0; i < indexCount; i++)
+        m_adjOffsets[m_triangles[i] + 1]++;
+    for(uint32_t i = 0; i < vertexCount; i++)
+        m_adjOffsets[i + 1] += m_adjOffsets[i];
+    m_adjTriangles.resize(indexCount);
+    QVector<uint32_t> fill(m_adjOffsets);
+    for(uint32_t i = 0; i < indexCount; i++)
+        m_adjTriangles[fill[m_triangles[i]]++] = i / 3;
+}
+
+bool MeshSimplifier::canCollapse(const Vertex *vertices, uint32_t from, uint32_t to) const
+{
+    if((from == to) || (m_kinds[from] == Locked))
+        return false;
+    if(vertices[from].bone != vertices[to].bone)
+        return false;
+    if((m_kinds[from] == Border) && !isBorderEdge(from, to))
+        return false;
+    return true;
+}
+
+float MeshSimplifier::collapseCost(const Vertex *vertices, uint32_t from, uint32_t to) const
+{
+    const vec3 &p = vertices[to].position;
+    const double *quadrics = m_quadrics.constData();
+    return (float)(evaluateQuadric(quadrics + (from * QuadricSize), p) +
+                   evaluateQuadric(quadrics + (to * QuadricSize), p));
+}
+
+/*!
+  \brief Determine whether moving a vertex would flip or flatten one of the
+  triangles around it that are not removed by the collapse.
+  */
+bool MeshSimplifier::collapseFlips(const Vertex *vertices, uint32_t from, uint32_t to) const
+{
+    const uint32_t *triangles = m_triangles.constData();
+    for(uint32_t i = m_adjOffsets[from]; i < m_adjOffsets[from + 1]; i++)
+    {
+        const uint32_t *tri = triangles + (m_adjTriangles[i] * 3);
+        if((tri[0] == to) || (tri[1] == to) || (tri[2] == to))
+            continue;
+        vec3 p[3], q[3];
+        for(uint32_t j = 0; j < 3; j++)
+        {
+            p[j] = vertices[tri[j]].position;
+            q[j] = (tri[j] == from) ? vertices[to].position : p[j];
+        }
+        vec3 oldNormal = vec3::cross(p[1] - p[0], p[2] - p[0]);
+        vec3 newNormal = vec3::cross(q[1] - q[0], q[2] - q[0]);
+        if(vec3::dot(oldNormal, newNormal) <= 0.0f)
+            return true;
+    }
+    return false;
+}
+
+/*!
+  \brief Collapse a vertex onto another and mark the vertices around it as
+  touched for the rest of the pass.
+  \return Number of triangles removed by the collapse.
+  */
+uint32_t MeshSimplifier::collapse(uint32_t from, uint32_t to)
+{
+    double *quadrics = m_quadrics.data();
+    for(uint32_t i = 0; i < QuadricSize; i++)
+        quadrics[(to * QuadricSize) + i] += quadrics[(from * QuadricSize) + i];
+    m_remap[from] = to;
+    
+    uint32_t removed = 0;
+    const uint32_t *triangles = m_triangles.constData();
+    for(uint32_t i = m_adjOffsets[from]; i < m_adjOffsets[from + 1]; i++)
+    {
+        const uint32_t *tri = triangles + (m_adjTriangles[i] * 3);
+        if((tri[0] == to) || (tri[1] == to) || (tri[2] == to))
+            removed++;
+        for(uint32_t j = 0; j < 3; j++)
+            m_touched[tri[j]] = 1;
+    }
+    m_touched[from] = m_touched[to] = 1;
+    return removed;
+}
+
+/*!
+  \brief Apply the collapses of the pass to the triangles and remove those
+  that became degenerate.
+  */
+void MeshSimplifier::removeDegenerate()
+{
+    uint32_t triangleCount = m_triangles.count() / 3, kept = 0;
+    uint32_t *triangles = m_triangles.data();
+    for(uint32_t i = 0; i < triangleCount; i++)
+    {
+        uint32_t a = m_remap[triangles[(i * 3) + 0]];
+        uint32_t b = m_remap[triangles[(i * 3) + 1]];
+        uint32_t c = m_remap[triangles[(i * 3) + 2]];
+        if((a == b) || (b == c) || (a == c))
+            continue;
+        triangles[(kept * 3) + 0] = a;
+        triangles[(kept * 3) + 1] = b;
+        triangles[(kept * 3) + 2] = c;
+        m_triGroups[kept] = m_triGroups[i];
+        kept++;
+    }
+    m_triangles.resize(kept * 3);
+    m_triGroups.resize(kept);
+    for(int i = 0; i < m_remap.count(); i++)
+        m_remap[i] = i;
+}
@@ -0,0 +1,484 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <math.h>
+#include <QRunnable>
+#include <QThreadPool>
+#include "EQuilibre/Render/OcclusionBuffer.h"
+#include "EQuilibre/Render/SIMDMath.h"
+
+const int OcclusionBuffer::TileWidth = 64;
+const int OcclusionBuffer::TileHeight = 32;
+const int OcclusionBuffer::BlockSize = 8;
+
+/** One for each lane whose bit is set in the index, zero otherwise. */
+static const float4 LaneMasks[16] =
+{
+    float4(0.0f, 0.0f, 0.0f, 0.0f), float4(1.0f, 0.0f, 0.0f, 0.0f),
+    float4(0.0f, 1.0f, 0.0f, 0.0f), float4(1.0f, 1.0f, 0.0f, 0.0f),
+    float4(0.0f, 0.0f, 1.0f, 0.0f), float4(1.0f, 0.0f, 1.0f, 0.0f),
+    float4(0.0f, 1.0f, 1.0f, 0.0f), float4(1.0f, 1.0f, 1.0f, 0.0f),
+    float4(0.0f, 0.0f, 0.0f, 1.0f), float4(1.0f, 0.0f, 0.0f, 1.0f),
+    float4(0.0f, 1.0f, 0.0f, 1.0f), float4(1.0f, 1.0f, 0.0f, 1.0f),
+    float4(0.0f, 0.0f, 1.0f, 1.0f), float4(1.0f, 0.0f, 1.0f, 1.0f),
+    float4(0.0f, 1.0f, 1.0f, 1.0f), float4(1.0f, 1.0f, 1.0f, 1.0f)
+};
+
+/*!
+  \brief Rasterizes a range of tiles of an occlusion buffer.
+  */
+class OcclusionTileJob : public QRunnable
+{
+public:
+    OcclusionTileJob(OcclusionBuffer *buffer, int first, int last)
+    {
+        m_buffer = buffer;
+        m_first = first;
+        m_last = last;
+        setAutoDelete(false);
+    }
+
+    virtual void run()
+    {
+        m_buffer->rasterizeTiles(m_first, m_last);
+    }
+
+private:
+    OcclusionBuffer *m_buffer;
+    int m_first;
+    int m_last;
+};
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+{
+    // Tiles are made of whole blocks, so round the size up to a block.
+    m_width = qMax((width + BlockSize - 1) / BlockSize, 1) * BlockSize;
+    m_height = qMax((height + BlockSize - 1) / BlockSize, 1) * BlockSize;
+    m_tilesX = (m_width + TileWidth - 1) / TileWidth;
+    m_tilesY = (m_height + TileHeight - 1) / TileHeight;
+    m_threadCount = 1;
+    m_pool = NULL;
+    m_depth.fill(0.0f, m_width * m_height);
+    m_blockDepth.fill(0.0f, (m_width / BlockSize) * (m_height / BlockSize));
+    m_bins.resize(m_tilesX * m_tilesY);
+    for(int i = 0; i < m_bins.count(); i++)
+        m_bins[i].reserve(256);
+    m_triangles.reserve(1024);
+    m_rasterTime = 0.0;
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+    delete m_pool;
+    foreach(OcclusionTileJob *job, m_jobs)
+        delete job;
+}
+
+int OcclusionBuffer::width() const
+{
+    return m_width;
+}
+
+int OcclusionBuffer::height() const
+{
+    return m_height;
+}
+
+int OcclusionBuffer::threadCount() const
+{
+    return m_threadCount;
+}
+
+void OcclusionBuffer::setThreadCount(int count)
+{
+    count = qBound(1, count, m_tilesX * m_tilesY);
+    if(count == m_threadCount)
+        return;
+    m_threadCount = count;
+    foreach(OcclusionTileJob *job, m_jobs)
+        delete job;
+    m_jobs.clear();
+    delete m_pool;
+    m_pool = NULL;
+    if(count == 1)
+        return;
+    
+    // Split the tiles into contiguous ranges, a few per thread so that
+    // threads that get cheap tiles can pick up more work.
+    int tileCount = m_tilesX * m_tilesY;
+    int jobCount = qMin(count * 2, tileCount);
+    for(int i = 0; i < jobCount; i++)
+    {
+        int first = (tileCount * i) / jobCount;
+        int last = (tileCount * (i + 1)) / jobCount;
+        m_jobs.append(new OcclusionTileJob(this, first, last));
+    }
+    m_pool = new QThreadPool();
+    m_pool->setMaxThreadCount(count);
+}
+
+const float * OcclusionBuffer::depth() const
+{
+    return m_depth.constData();
+}
+
+const float * OcclusionBuffer::blockDepth() const
+{
+    return m_blockDepth.constData();
+}
+
+uint32_t OcclusionBuffer::triangleCount() const
+{
+    return m_triangles.count();
+}
+
+double OcclusionBuffer::rasterTime() const
+{
+    return m_rasterTime;
+}
+
+void OcclusionBuffer::clear(const matrix4 &viewProj)
+{
+    const vec4 *columns = viewProj.columns();
+    for(int i = 0; i < 4; i++)
+        m_viewProj[i] = columns[i];
+    m_triangles.resize(0);
+    for(int i = 0; i < m_bins.count(); i++)
+        m_bins[i].resize(0);
+    float *depth = m_depth.data();
+    for(int i = 0; i < m_depth.count(); i++)
+        depth[i] = 0.0f;
+    float *blockDepth = m_blockDepth.data();
+    for(int i = 0; i < m_blockDepth.count(); i++)
+        blockDepth[i] = 0.0f;
+    m_rasterTime = 0.0;
+}
+
+bool OcclusionBuffer::project(const vec3 &v, vec4 &clip) const
+{
+    const vec4 *c = m_viewProj;
+    clip.x = c[0].x * v.x + c[1].x * v.y + c[2].x * v.z + c[3].x;
+    clip.y = c[0].y * v.x + c[1].y * v.y + c[2].y * v.z + c[3].y;
+    clip.z = c[0].z * v.x + c[1].z * v.y + c[2].z * v.z + c[3].z;
+    clip.w = c[0].w * v.x + c[1].w * v.y + c[2].w * v.z + c[3].w;
+    return (clip.z + clip.w) >= 0.0f;
+}
+
+void OcclusionBuffer::addOccluder(const vec3 *triangles, uint32_t triangleCount)
+{
+    for(uint32_t i = 0; i < triangleCount; i++)
+    {
+        const vec3 *v = triangles + (i * 3);
+        vec4 clip[3];
+        int inFront = 0;
+        for(int j = 0; j < 3; j++)
+        {
+            if(project(v[j], clip[j]))
+                inFront++;
+        }
+        if(inFront == 3)
+        {
+            addTriangle(clip);
+            continue;
+        }
+        else if(inFront == 0)
+        {
+            continue;
+        }
+        
+        // Clip the triangle against the near plane, which gives a triangle
+        // or a quad.
+        vec4 poly[4];
+        int polySize = 0;
+        for(int j = 0; j < 3; j++)
+        {
+            const vec4 &a = clip[j];
+            const vec4 &b = clip[(j + 1) % 3];
+            float da = a.z + a.w, db = b.z + b.w;
+            if(da >= 0.0f)
+                poly[polySize++] = a;
+            if((da >= 0.0f) != (db >= 0.0f))
+            {
+                float t = da / (da - db);
+                vec4 &v = poly[polySize++];
+                v.x = a.x + (b.x - a.x) * t;
+                v.y = a.y + (b.y - a.y) * t;
+                v.z = a.z + (b.z - a.z) * t;
+                v.w = a.w + (b.w - a.w) * t;
+            }
+        }
+        for(int j = 2; j < polySize; j++)
+        {
+            vec4 tri[3] = {poly[0], poly[j - 1], poly[j]};
+            addTriangle(tri);
+        }
+    }
+}
+
+void OcclusionBuffer::addTriangle(const vec4 *clip)
+{
+    OccluderTriangle t;
+    float minX = m_width, maxX = 0.0f, minY = m_height, maxY = 0.0f;
+    for(int i = 0; i < 3; i++)
+    {
+        // w is positive since the vertex is in front of the near plane.
+        float invW = 1.0f / clip[i].w;
+        t.x[i] = (clip[i].x * invW * 0.5f + 0.5f) * m_width;
+        t.y[i] = (0.5f - clip[i].y * invW * 0.5f) * m_height;
+        t.invW[i] = invW;
+        minX = qMin(minX, t.x[i]);
+        maxX = qMax(maxX, t.x[i]);
+        minY = qMin(minY, t.y[i]);
+        maxY = qMax(maxY, t.y[i]);
+    }
+    
+    // Skip triangles that are off-screen or have no area.
+    if((maxX <= 0.0f) || (minX >= m_width) || (maxY <= 0.0f) || (minY >= m_height))
+        return;
+    float area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) -
+                 (t.y[1] - t.y[0]) * (t.x[2] - t.x[0]);
+    if(fabs(area) < 1e-6f)
+        return;
+    
+    int tx0 = (int)qMax(minX, 0.0f) / TileWidth;
+    int tx1 = qMin((int)qMin(maxX, (float)m_width) / TileWidth, m_tilesX - 1);
+    int ty0 = (int)qMax(minY, 0.0f) / TileHeight;
+    int ty1 = qMin((int)qMin(maxY, (float)m_height) / TileHeight, m_tilesY - 1);
+    uint32_t index = m_triangles.count();
+    m_triangles.append(t);
+    for(int ty = ty0; ty <= ty1; ty++)
+    {
+        for(int tx = tx0; tx <= tx1; tx++)
+            m_bins[(ty * m_tilesX) + tx].append(index);
+    }
+}
+
+void OcclusionBuffer::rasterize()
+{
+    double start = currentTime();
+    if(m_pool && (m_triangles.count() > 0))
+    {
+        foreach(OcclusionTileJob *job, m_jobs)
+            m_pool->start(job);
+        m_pool->waitForDone();
+    }
+    else
+    {
+        rasterizeTiles(0, m_tilesX * m_tilesY);
+    }
+    m_rasterTime = currentTime() - start;
+}
+
+void OcclusionBuffer::rasterizeTiles(int first, int last)
+{
+    const OccluderTriangle *triangles = m_triangles.constData();
+    for(int i = first; i < last; i++)
+    {
+        const QVector<uint32_t> &bin = m_bins[i];
+        if(bin.count() == 0)
+            continue;
+        int x0 = (i % m_tilesX) * TileWidth;
+        int y0 = (i / m_tilesX) * TileHeight;
+        int x1 = qMin(x0 + TileWidth, m_width);
+        int y1 = qMin(y0 + TileHeight, m_height);
+        for(int j = 0; j < bin.count(); j++)
+            rasterizeTriangle(triangles[bin[j]], x0, y0, x1, y1);
+        updateBlocks(x0, y0, x1, y1);
+    }
+}
+
+void OcclusionBuffer::rasterizeTriangle(const OccluderTriangle &t, int x0, int y0, int x1, int y1)
+{
+    // Make the winding consistent so that inside pixels have positive edge
+    // values, since occluders are drawn whichever side they face.
+    int ib = 1, ic = 2;
+    float area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) -
+                 (t.y[1] - t.y[0]) * (t.x[2] - t.x[0]);
+    if(area < 0.0f)
+        qSwap(ib, ic);
+    float vx[3] = {t.x[0], t.x[ib], t.x[ic]};
+    float vy[3] = {t.y[0], t.y[ib], t.y[ic]};
+    float vz[3] = {t.invW[0], t.invW[ib], t.invW[ic]};
+    
+    // Bounding box of the triangle, clipped to the tile before converting
+    // since clipped vertices can be far off-screen.
+    float minX = qMin(vx[0], qMin(vx[1], vx[2]));
+    float maxX = qMax(vx[0], qMax(vx[1], vx[2]));
+    float minY = qMin(vy[0], qMin(vy[1], vy[2]));
+    float maxY = qMax(vy[0], qMax(vy[1], vy[2]));
+    int px0 = (int)floor(qMax(minX, (float)x0));
+    int px1 = (int)ceil(qMin(maxX, (float)(x1 - 1)));
+    int py0 = (int)floor(qMax(minY, (float)y0));
+    int py1 = (int)ceil(qMin(maxY, (float)(y1 - 1)));
+    if((px0 > px1) || (py0 > py1))
+        return;
+    
+    // Edge functions e(x, y) = a * x + b * y + c and the plane of 1/w, which
+    // is linear in screen space. Clipped vertices can be far off-screen, so
+    // set them up in double precision relative to the first pixel center.
+    double ox = px0 + 0.5, oy = py0 + 0.5;
+    float ea[3], eb[3], ec[3];
+    for(int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        ea[i] = vy[i] - vy[j];
+        eb[i] = vx[j] - vx[i];
+        ec[i] = (float)(((double)vy[i] - vy[j]) * (ox - vx[i]) +
+                        ((double)vx[j] - vx[i]) * (oy - vy[i]));
+    }
+    double x10 = (double)vx[1] - vx[0], y10 = (double)vy[1] - vy[0];
+    double x20 = (double)vx[2] - vx[0], y20 = (double)vy[2] - vy[0];
+    double z10 = (double)vz[1] - vz[0], z20 = (double)vz[2] - vz[0];
+    double invArea = 1.0 / ((x10 * y20) - (y10 * x20));
+    double dzdx = ((z10 * y20) - (z20 * y10)) * invArea;
+    double dzdy = ((z20 * x10) - (z10 * x20)) * invArea;
+    float z0 = (float)(vz[0] + (dzdx * (ox - vx[0])) + (dzdy * (oy - vy[0])));
+    
+    float4 zero = float4::splat(0.0f);
+    float4 a0 = float4::splat(ea[0]), a1 = float4::splat(ea[1]), a2 = float4::splat(ea[2]);
+    float4 dz = float4::splat((float)dzdx);
+    float4 offsets(0.0f, 1.0f, 2.0f, 3.0f);
+    float z[4];
+    for(int y = py0; y <= py1; y++)
+    {
+        float fy = (float)(y - py0);
+        float4 r0 = float4::splat(eb[0] * fy + ec[0]);
+        float4 r1 = float4::splat(eb[1] * fy + ec[1]);
+        float4 r2 = float4::splat(eb[2] * fy + ec[2]);
+        float4 rz = float4::splat((float)dzdy * fy + z0);
+        
+        // Find the span of the row inside all three edges, rounded outwards
+        // since the edge tests below are exact.
+        float spanStart = 0.0f, spanEnd = (float)(px1 - px0);
+        for(int i = 0; i < 3; i++)
+        {
+            float e = eb[i] * fy + ec[i];
+            if(ea[i] > 0.0f)
+                spanStart = qMax(spanStart, -e / ea[i]);
+            else if(ea[i] < 0.0f)
+                spanEnd = qMin(spanEnd, -e / ea[i]);
+            else if(e < 0.0f)
+                spanEnd = -1.0f;
+        }
+        if(spanStart > spanEnd)
+            continue;
+        int xStart = px0 + qMax((int)spanStart - 1, 0);
+        int xEnd = px0 + qMin((int)spanEnd + 1, px1 - px0);
+        float *row = m_depth.data() + (y * m_width);
+        for(int x = xStart; x <= xEnd; x += 4)
+        {
+            float4 fx = float4::splat((float)(x - px0)) + offsets;
+            int outside = float4::lessThan(a0 * fx + r0, zero) |
+                          float4::lessThan(a1 * fx + r1, zero) |
+                          float4::lessThan(a2 * fx + r2, zero);
+            int lanes = qMin(xEnd - x + 1, 4);
+            int inside = ~outside & ((1 << lanes) - 1);
+            if(!inside)
+                continue;
+            if(lanes == 4)
+            {
+                // Zero is the farthest depth, so masked lanes keep their value.
+                float4 depth = (dz * fx + rz) * LaneMasks[inside];
+                float4::max(float4::load(row + x), depth).store(row + x);
+                continue;
+            }
+            (dz * fx + rz).store(z);
+            for(int i = 0; i < lanes; i++)
+            {
+                if((inside & (1 << i)) && (z[i] > row[x + i]))
+                    row[x + i] = z[i];
+            }
+        }
+    }
+}
+
+void OcclusionBuffer::updateBlocks(int x0, int y0, int x1, int y1)
+{
+    int blocksX = m_width / BlockSize;
+    for(int by = y0; by < y1; by += BlockSize)
+    {
+        for(int bx = x0; bx < x1; bx += BlockSize)
+        {
+            const float *block = m_depth.constData() + (by * m_width) + bx;
+            float farthest = block[0];
+            for(int y = 0; y < BlockSize; y++)
+            {
+                const float *row = block + (y * m_width);
+                for(int x = 0; x < BlockSize; x++)
+                    farthest = qMin(farthest, row[x]);
+            }
+            m_blockDepth[((by / BlockSize) * blocksX) + (bx / BlockSize)] = farthest;
+        }
+    }
+}
+
+bool OcclusionBuffer::isOccluded(const AABox &bounds) const
+{
+    // Find the screen rectangle covered by the box and its nearest depth.
+    float minX = m_width, maxX = 0.0f, minY = m_height, maxY = 0.0f, nearest = 0.0f;
+    for(int i = 0; i < 8; i++)
+    {
+        vec3 corner((i & 1) ? bounds.high.x : bounds.low.x,
+                    (i & 2) ? bounds.high.y : bounds.low.y,
+                    (i & 4) ? bounds.high.z : bounds.low.z);
+        vec4 clip;
+        if(!project(corner, clip))
+            return false; // The box crosses the near plane.
+        float invW = 1.0f / clip.w;
+        float x = (clip.x * invW * 0.5f + 0.5f) * m_width;
+        float y = (0.5f - clip.y * invW * 0.5f) * m_height;
+        minX = qMin(minX, x);
+        maxX = qMax(maxX, x);
+        minY = qMin(minY, y);
+        maxY = qMax(maxY, y);
+        nearest = qMax(nearest, invW);
+    }
+    int x0 = (int)floor(qMax(minX, 0.0f));
+    int x1 = (int)floor(qMin(maxX, (float)(m_width - 1)));
+    int y0 = (int)floor(qMax(minY, 0.0f));
+    int y1 = (int)floor(qMin(maxY, (float)(m_height - 1)));
+    if((x0 > x1) || (y0 > y1))
+        return false;
+    
+    // Blocks whose farthest depth is nearer than the box hide it entirely,
+    // otherwise look at the pixels of the block that the box covers.
+    int blocksX = m_width / BlockSize;
+    const float *depth = m_depth.constData();
+    const float *blockDepth = m_blockDepth.constData();
+    for(int by = y0 / BlockSize; by <= y1 / BlockSize; by++)
+    {
+        for(int bx = x0 / BlockSize; bx <= x1 / BlockSize; bx++)
+        {
+            if(nearest < blockDepth[(by * blocksX) + bx])
+                continue;
+            int px0 = qMax(x0, bx * BlockSize);
+            int px1 = qMin(x1, (bx * BlockSize) + BlockSize - 1);
+            int py0 = qMax(y0, by * BlockSize);
+            int py1 = qMin(y1, (by * BlockSize) + BlockSize - 1);
+            for(int y = py0; y <= py1; y++)
+            {
+                const float *row = depth + (y * m_width);
+                for(int x = px0; x <= px1; x++)
+                {
+                    if(nearest >= row[x])
+                        return false;
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -26,6 +26,7 @@
 #include "EQuilibre/Render/RenderProgram.h"
 #include "EQuilibre/Render/Material.h"
 #include "EQuilibre/Render/FrameStat.h"
+#include "EQuilibre/Render/GLState.h"
 
 class RenderContextPrivate
 {
@@ -39,13 +40,17 @@ public:
     matrix4 matrix[2];
     std::vector<matrix4> matrixStack[2];
     RenderProgram *programs[3];
-    uint32_t currentProgram;
+    GLDevice *device;
+    bool ownsDevice;
+    GLState *state;
+    BonePalette bonePalette;
     QVector<FrameStat *> stats;
     int gpuTimers;
     FrameStat *frameStat;
     FrameStat *clearStat;
     FrameStat *drawCallsStat;
     FrameStat *textureBindsStat;
+    FrameStat *glCallsStat;
 };
 
 RenderContextPrivate::RenderContextPrivate()
@@ -53,12 +58,15 @@ RenderContextPrivate::RenderContextPrivate()
     matrixMode = RenderContext::ModelView;
     for(int i = 0; i < 3; i++)
         programs[i] = NULL;
-    currentProgram = 0;
+    device = NULL;
+    ownsDevice = false;
+    state = NULL;
     gpuTimers = 0;
     frameStat = NULL;
     clearStat = NULL;
     drawCallsStat = NULL;
     textureBindsStat = NULL;
+    glCallsStat = NULL;
 }
 
 bool RenderContextPrivate::initShader(RenderContext::Shader shader, QString vertexFile, QString fragmentFile)
@@ -75,9 +83,16 @@ bool RenderContextPrivate::initShader(RenderContext::Shader shader, QString vert
 
 ////////////////////////////////////////////////////////////////////////////////
 
-RenderContext::RenderContext()
+/*!
+  \brief Create a context that makes its GL calls through the device, or
+  through GLEW when no device is given.
+  */
+RenderContext::RenderContext(GLDevice *device)
 {
     d = new RenderContextPrivate();
+    d->ownsDevice = (device == NULL);
+    d->device = device ? device : new GLDeviceGL2();
+    d->state = new GLState(d->device);
     d->matrix[(int)RenderContext::ModelView].setIdentity();
     d->matrix[(int)RenderContext::Projection].setIdentity();
     d->programs[(int)BasicShader] = new RenderProgram(this);
@@ -85,6 +100,7 @@ RenderContext::RenderContext()
     d->programs[(int)SkinningTextureShader] = new TextureSkinningProgram(this);
     d->drawCallsStat = createStat("Draw calls", FrameStat::Counter);
     d->textureBindsStat = createStat("Texture binds", FrameStat::Counter);
+    d->glCallsStat = createStat("GL calls", FrameStat::Counter);
     d->frameStat = createStat("Frame (ms)", FrameStat::WallTime);
     d->clearStat = createStat("Clear (ms)", FrameStat::WallTime);
 }
@@ -93,11 +109,15 @@ RenderContext::~RenderContext()
 {
     destroyStat(d->clearStat);
     destroyStat(d->frameStat);
+    destroyStat(d->glCallsStat);
     destroyStat(d->textureBindsStat);
     destroyStat(d->drawCallsStat);
     delete d->programs[(int)BasicShader];
     delete d->programs[(int)SkinningUniformShader];
     delete d->programs[(int)SkinningTextureShader];
+    delete d->state;
+    if(d->ownsDevice)
+        delete d->device;
     delete d;
 }
 
@@ -111,12 +131,12 @@ RenderProgram * RenderContext::programByID(Shader shaderID) const
 
 void RenderContext::setCurrentProgram(RenderProgram *prog)
 {
-    uint32_t name = prog ? prog->program() : 0;
-    if(d->currentProgram != name)
-    {
-        glUseProgram(name);
-        d->currentProgram = name;
-    }
+    d->state->useProgram(prog ? prog->program() : 0);
+}
+
+GLState * RenderContext::state() const
+{
+    return d->state;
 }
 
 void RenderContext::setMatrixMode(RenderContext::MatrixMode newMode)
@@ -127,7 +147,8 @@ void RenderContext::setMatrixMode(RenderContext::MatrixMode newMode)
 bool RenderContext::beginFrame(const vec4 &clearColor)
 {
     d->frameStat->beginTime();
-    d->currentProgram = 0;
+    d->state->invalidate();
+    d->bonePalette.clear();
     RenderProgram *prog = programByID(BasicShader);
     bool shaderLoaded = prog && prog->loaded();
     glPushAttrib(GL_ENABLE_BIT);
@@ -170,7 +191,9 @@ void RenderContext::endFrame()
     // Reset state.
     setMatrixMode(ModelView);
     popMatrix();
-    setCurrentProgram(NULL);
+    d->state->reset();
+    d->glCallsStat->setCurrent(d->state->calls());
+    d->state->resetCounters();
     glPopAttrib();
     glCullFace(GL_BACK);
 
@@ -200,7 +223,12 @@ void RenderContext::setupViewport(int w, int h)
 
 void RenderContext::setDepthWrite(bool write)
 {
-    glDepthMask(write);
+    d->state->setDepthWrite(write);
+}
+
+BonePalette * RenderContext::bonePalette()
+{
+    return &d->bonePalette;
 }
 
 void RenderContext::loadIdentity()
@@ -373,7 +401,7 @@ texture_t RenderContext::loadTextures(const QImage *images, size_t count,
     GLuint target = GL_TEXTURE_2D_ARRAY;
     texture_t texID = 0;
     glGenTextures(1, &texID);
-    glBindTexture(target, texID);
+    d->state->bindTexture(target, texID);
     
     // Figure out what's the maximum texture dimensions of the images.
     int maxWidth = 0, maxHeight = 0;
@@ -464,34 +492,68 @@ texture_t RenderContext::loadTextures(const QImage *images, size_t count,
     glTexParameterf(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
     if(useGenMipmaps)
         glGenerateMipmapEXT(GL_TEXTURE_2D_ARRAY);
-    glBindTexture(target, 0);
+    d->state->bindTexture(target, 0);
     return texID;
 }
 
 void RenderContext::freeTexture(texture_t tex)
 {
     if(tex != 0)
+    {
         glDeleteTextures(1, &tex);
+        d->state->textureDeleted(tex);
+    }
 }
 
 buffer_t RenderContext::createBuffer(const void *data, size_t size)
 {
     buffer_t buffer;
     glGenBuffers(1, &buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    d->state->bindBuffer(GL_ARRAY_BUFFER, buffer);
+    d->state->bufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    d->state->bindBuffer(GL_ARRAY_BUFFER, 0);
     return buffer;
 }
 
+/*!
+  \brief Overwrite part of a buffer created with @ref createBuffer. Passing NULL
+  data to createBuffer allocates a buffer that is filled this way.
+  */
+void RenderContext::updateBuffer(buffer_t buffer, size_t offset, const void *data, size_t size)
+{
+    if(!buffer || !size)
+        return;
+    d->state->bindBuffer(GL_ARRAY_BUFFER, buffer);
+    d->state->bufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+    d->state->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*!
+  \brief Copy part of a buffer created with @ref createBuffer back to memory.
+  */
+void RenderContext::readBuffer(buffer_t buffer, size_t offset, void *data, size_t size)
+{
+    if(!buffer || !size)
+        return;
+    d->state->bindBuffer(GL_ARRAY_BUFFER, buffer);
+    d->state->getBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+    d->state->bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void RenderContext::freeBuffers(buffer_t *buffers, int count)
 {
     if(!buffers)
         return;
     glDeleteBuffers(count, buffers);
+    d->state->buffersDeleted(buffers, count);
     memset(buffers, 0, sizeof(buffer_t) * count);
 }
 
+void RenderContext::freeVertexArray(uint32_t vertexArray)
+{
+    d->state->deleteVertexArray(vertexArray);
+}
+
 void RenderContext::init()
 {
     d->initShader(BasicShader, "vertex.glsl", "fragment.glsl");
@@ -14,10 +14,16 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
+#include <cstring>
 #include <GL/glew.h>
 #include "EQuilibre/Render/RenderProgram.h"
 #include "EQuilibre/Render/RenderContext.h"
+#include "EQuilibre/Render/GLState.h"
 #include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/SIMDMath.h"
+
+/** Maximum number of ranges drawn with one glMultiDrawElements call. */
+static const uint32_t MaxDrawRanges = 64;
 
 static const ShaderSymbolInfo Uniforms[] =
 {
@@ -33,6 +39,7 @@ static const ShaderSymbolInfo Uniforms[] =
     {U_FOG_END, "u_fogEnd"},
     {U_FOG_DENSITY, "u_fogDensity"},
     {U_FOG_COLOR, "u_fogColor"},
+    {U_INSTANCED, "u_instanced"},
     {0, NULL}
 };
 
@@ -44,12 +51,15 @@ static const ShaderSymbolInfo Attributes[] =
     {A_COLOR, "a_color"},
     {A_BONE_INDEX, "a_boneIndex"},
     {A_MODEL_VIEW_0, "a_modelViewMatrix"},
+    {A_BONE_BASE, "a_boneBase"},
+    {A_TEX_LAYER, "a_texLayer"},
     {0, NULL}
 };
 
 RenderProgram::RenderProgram(RenderContext *renderCtx)
 {
     m_renderCtx = renderCtx;
+    m_state = renderCtx->state();
     m_program = 0;
     m_vertexShader = 0;
     m_fragmentShader = 0;
@@ -59,11 +69,16 @@ RenderProgram::RenderProgram(RenderContext *renderCtx)
         m_uniform[i] = -1;
     m_drawCalls = 0;
     m_textureBinds = 0;
+    m_instanceCount = 0;
+    m_supportsInstancing = false;
+    m_instanceBuffer = 0;
+    m_lightingMode = NoLighting;
     m_projectionSent = false;
-    m_blendingEnabled = m_currentMatNeedsBlending = false;
-    m_bones = new vec4[MAX_TRANSFORMS * 2];
+    m_currentMatNeedsBlending = false;
     m_cube = NULL;
     m_cubeMats = NULL;
+    m_skinnedFirst = 0;
+    m_skinnedCount = 0;
     createCube();
     m_meshData.clear();
 }
@@ -72,16 +87,23 @@ RenderProgram::~RenderProgram()
 {
     delete m_cubeMats;
     delete m_cube;
-    delete [] m_bones;
 
     if(current())
-        glUseProgram(0);
+        m_state->useProgram(0);
+    if(m_instanceBuffer != 0)
+    {
+        glDeleteBuffers(1, &m_instanceBuffer);
+        m_state->buffersDeleted(&m_instanceBuffer, 1);
+    }
     if(m_vertexShader != 0)
         glDeleteShader(m_vertexShader);
     if(m_fragmentShader != 0)
         glDeleteShader(m_fragmentShader);
     if(m_program != 0)
+    {
         glDeleteProgram(m_program);
+        m_state->programDeleted(m_program);
+    }
 }
 
 bool RenderProgram::loaded() const
@@ -103,9 +125,7 @@ bool RenderProgram::load(QString vertexFile, QString fragmentFile)
 
 bool RenderProgram::current() const
 {
-    uint32_t currentProg = 0;
-    glGetIntegerv(GL_CURRENT_PROGRAM, (int32_t *)&currentProg);
-    return (currentProg != 0) && (currentProg == m_program);
+    return (m_program != 0) && (m_state->program() == m_program);
 }
 
 uint32_t RenderProgram::program() const
@@ -132,6 +152,10 @@ void RenderProgram::resetFrameStats()
 
 bool RenderProgram::init()
 {
+    m_supportsInstancing = GLEW_ARB_draw_instanced && GLEW_ARB_instanced_arrays &&
+        (m_uniform[U_INSTANCED] >= 0) && (m_attr[A_MODEL_VIEW_0] >= 0);
+    if(m_supportsInstancing)
+        glGenBuffers(1, &m_instanceBuffer);
     return true;
 }
 
@@ -234,14 +258,14 @@ void RenderProgram::setModelViewMatrix(const matrix4 &modelView)
     //const vec4 *columns = t.columns();
     //for(int i = 0; i < 4; i++)
     //    glVertexAttrib4fv(m_attr[A_MODEL_VIEW_0] + i, (const GLfloat *)&columns[i]);
-    glUniformMatrix4fv(m_uniform[U_MODELVIEW_MATRIX],
-            1, GL_FALSE, (const GLfloat *)modelView.columns());
+    m_state->uniformMatrix4fv(m_uniform[U_MODELVIEW_MATRIX], 1,
+                              (const float *)modelView.columns());
 }
 
 void RenderProgram::setProjectionMatrix(const matrix4 &projection)
 {
-    glUniformMatrix4fv(m_uniform[U_PROJECTION_MATRIX],
-        1, GL_FALSE, (const GLfloat *)projection.columns());
+    m_state->uniformMatrix4fv(m_uniform[U_PROJECTION_MATRIX], 1,
+                              (const float *)projection.columns());
 }
 
 void RenderProgram::setMaterialMap(MaterialArray *materials, MaterialMap *materialMap)
@@ -252,50 +276,32 @@ void RenderProgram::setMaterialMap(MaterialArray *materials, MaterialMap *materi
     {
         vec3 textureMap[MAX_MATERIAL_SLOTS];
         materialMap->fillTextureMap(materials, textureMap, MAX_MATERIAL_SLOTS);
-        glUniform3fv(m_uniform[U_MAT_SLOT_MAP], MAX_MATERIAL_SLOTS, (const GLfloat *)textureMap);
-        glUniform1i(m_uniform[U_MAT_SLOT_MAP_ENABLED], 1);
+        m_state->uniform3fv(m_uniform[U_MAT_SLOT_MAP], MAX_MATERIAL_SLOTS, (const float *)textureMap);
+        m_state->uniform1i(m_uniform[U_MAT_SLOT_MAP_ENABLED], 1);
     }
     else
     {
-        glUniform1i(m_uniform[U_MAT_SLOT_MAP_ENABLED], 0);
-    }
-}
-
-void RenderProgram::setBoneTransforms(const BoneTransform *transforms, int count)
-{
-    for(int i = 0; i < MAX_TRANSFORMS; i++)
-    {
-        if(transforms && (i < count))
-        {
-            QVector4D loc = transforms[i].location;
-            QQuaternion rot = transforms[i].rotation;
-            m_bones[i * 2 + 0] = vec4(loc.x(), loc.y(), loc.z(), 1.0);
-            m_bones[i * 2 + 1] = vec4(rot.x(), rot.y(), rot.z(), rot.scalar());
-        }
-        else
-        {
-            m_bones[i * 2 + 0] = vec4(0.0, 0.0, 0.0, 1.0);
-            m_bones[i * 2 + 1] = vec4(0.0, 0.0, 0.0, 1.0);
-        }
+        m_state->uniform1i(m_uniform[U_MAT_SLOT_MAP_ENABLED], 0);
     }
 }
 
 void RenderProgram::setAmbientLight(vec4 lightColor)
 {
-    glUniform4fv(m_uniform[U_AMBIENT_LIGHT], 1, (const GLfloat *)&lightColor);
+    m_state->uniform4fv(m_uniform[U_AMBIENT_LIGHT], 1, (const float *)&lightColor);
 }
 
 void RenderProgram::setLightingMode(RenderProgram::LightingMode newMode)
 {
-    glUniform1i(m_uniform[U_LIGHTING_MODE], newMode);
+    m_state->uniform1i(m_uniform[U_LIGHTING_MODE], newMode);
+    m_lightingMode = newMode;
 }
 
 void RenderProgram::setFogParams(const FogParams &fogParams)
 {
-    glUniform1f(m_uniform[U_FOG_START], fogParams.start);
-    glUniform1f(m_uniform[U_FOG_END], fogParams.end);
-    glUniform1f(m_uniform[U_FOG_DENSITY], fogParams.density);
-    glUniform4fv(m_uniform[U_FOG_COLOR], 1, (const GLfloat *)&fogParams.color);
+    m_state->uniform1f(m_uniform[U_FOG_START], fogParams.start);
+    m_state->uniform1f(m_uniform[U_FOG_END], fogParams.end);
+    m_state->uniform1f(m_uniform[U_FOG_DENSITY], fogParams.density);
+    m_state->uniform4fv(m_uniform[U_FOG_COLOR], 1, (const float *)&fogParams.color);
 }
 
 void RenderProgram::beginApplyMaterial(MaterialArray *array, Material *m)
@@ -305,155 +311,216 @@ void RenderProgram::beginApplyMaterial(MaterialArray *array, Material *m)
     GLuint target = GL_TEXTURE_2D_ARRAY;
     if(m->texture() != 0)
     {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(target, m->texture());
-        glUniform1i(m_uniform[U_MAT_TEXTURE], 0);
-        glUniform1i(m_uniform[U_MAT_HAS_TEXTURE], 1);
-        m_textureBinds++;
+        m_state->activeTexture(GL_TEXTURE0);
+        if(m_state->bindTexture(target, m->texture()))
+            m_textureBinds++;
+        m_state->uniform1i(m_uniform[U_MAT_TEXTURE], 0);
+        m_state->uniform1i(m_uniform[U_MAT_HAS_TEXTURE], 1);
     }
     else
     {
-        glUniform1i(m_uniform[U_MAT_HAS_TEXTURE], 0);
+        m_state->uniform1i(m_uniform[U_MAT_HAS_TEXTURE], 0);
     }
     m_currentMatNeedsBlending = !m->isOpaque();
 }
 
 void RenderProgram::endApplyMaterial(MaterialArray *array, Material *m)
 {
-    //GLuint target = (map->arrayTexture() != 0) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
-    GLuint target = GL_TEXTURE_2D_ARRAY;
-    if(m->texture() != 0)
-    {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(target, 0);
-    }
+    // The texture stays bound, in case the next material uses it too.
+    // Textures are unbound at the end of the frame.
     m_currentMatNeedsBlending = false;
 }
 
 void RenderProgram::enableVertexAttribute(int attr, int index)
 {
     if(m_attr[attr] >= 0)
-        glEnableVertexAttribArray(m_attr[attr] + index);
+        m_state->enableVertexAttribArray(m_attr[attr] + index);
 }
 
 void RenderProgram::disableVertexAttribute(int attr, int index)
 {
     if(m_attr[attr] >= 0)
-        glDisableVertexAttribArray(m_attr[attr] + index);
+        m_state->disableVertexAttribArray(m_attr[attr] + index);
 }
 
 void RenderProgram::uploadVertexAttributes(const MeshBuffer *meshBuf)
 {
-    const Vertex *vd = meshBuf->vertices.constData();
-    const uint8_t *posPointer = (const uint8_t *)&vd->position;
-    const uint8_t *normalPointer = (const uint8_t *)&vd->normal;
-    const uint8_t *texCoordsPointer = (const uint8_t *)&vd->texCoords;
-    const uint8_t *colorPointer = (const uint8_t *)&vd->color;
-    const uint8_t *bonePointer = (const uint8_t *)&vd->bone;
+    // Vertices in client memory are used when no buffer is bound.
+    const uint8_t *base = (const uint8_t *)meshBuf->vertices.constData();
     if(meshBuf->vertexBuffer != 0)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
-        posPointer = 0;
-        normalPointer = posPointer + sizeof(vec3);
-        texCoordsPointer = normalPointer + sizeof(vec3);
-        colorPointer = texCoordsPointer + sizeof(vec3);
-        bonePointer = colorPointer + sizeof(uint32_t);
-    }
-    glVertexAttribPointer(m_attr[A_POSITION], 3, GL_FLOAT, GL_FALSE,
-        sizeof(Vertex), posPointer);
+        base = NULL;
+    m_state->bindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
+    // Integer attributes are converted to floats as they are and decoded by
+    // the shaders, see Vertex.
+    m_state->vertexAttribPointer(m_attr[A_POSITION], 3, GL_FLOAT, false,
+        sizeof(Vertex), base + offsetof(Vertex, position));
     if(m_attr[A_NORMAL] >= 0)
-        glVertexAttribPointer(m_attr[A_NORMAL], 3, GL_FLOAT, GL_FALSE,
-            sizeof(Vertex), normalPointer);
+        m_state->vertexAttribPointer(m_attr[A_NORMAL], 2, GL_BYTE, false,
+            sizeof(Vertex), base + offsetof(Vertex, normal));
     if(m_attr[A_TEX_COORDS] >= 0)
-        glVertexAttribPointer(m_attr[A_TEX_COORDS], 3, GL_FLOAT, GL_FALSE,
-            sizeof(Vertex), texCoordsPointer);
+        m_state->vertexAttribPointer(m_attr[A_TEX_COORDS], 2, GL_SHORT, false,
+            sizeof(Vertex), base + offsetof(Vertex, texCoords));
+    if(m_attr[A_TEX_LAYER] >= 0)
+        m_state->vertexAttribPointer(m_attr[A_TEX_LAYER], 1, GL_UNSIGNED_BYTE, false,
+            sizeof(Vertex), base + offsetof(Vertex, layer));
     if(m_attr[A_COLOR] >= 0)
-        glVertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, GL_TRUE,
-            sizeof(Vertex), colorPointer);
+        m_state->vertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, true,
+            sizeof(Vertex), base + offsetof(Vertex, color));
     if(m_attr[A_BONE_INDEX] >= 0)
-        glVertexAttribPointer(m_attr[A_BONE_INDEX], 1, GL_INT, GL_FALSE,
-            sizeof(Vertex), bonePointer);
-    if(meshBuf->vertexBuffer != 0)
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        m_state->vertexAttribPointer(m_attr[A_BONE_INDEX], 1, GL_UNSIGNED_BYTE, false,
+            sizeof(Vertex), base + offsetof(Vertex, bone));
+}
+
+/*!
+  \brief Return the vertex array object that holds the layout of the buffer's
+  vertices for this program, creating it the first time the buffer is drawn.
+  */
+uint32_t RenderProgram::vertexArray(const MeshBuffer *meshBuf)
+{
+    // Discard the vertex array if the buffer was uploaded again since.
+    QVector<VertexArray> &arrays = meshBuf->vertexArrays;
+    for(int i = 0; i < arrays.count(); i++)
+    {
+        const VertexArray &va = arrays[i];
+        if(va.program != m_program)
+            continue;
+        if((va.vertexBuffer == meshBuf->vertexBuffer) &&
+           (va.indexBuffer == meshBuf->indexBuffer))
+            return va.name;
+        m_state->deleteVertexArray(va.name);
+        arrays.remove(i);
+        break;
+    }
+    
+    VertexArray va;
+    va.program = m_program;
+    va.name = m_state->createVertexArray();
+    va.vertexBuffer = meshBuf->vertexBuffer;
+    va.indexBuffer = meshBuf->indexBuffer;
+    m_state->bindVertexArray(va.name);
+    m_state->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuf->indexBuffer);
+    enableVertexAttribute(A_POSITION);
+    enableVertexAttribute(A_NORMAL);
+    enableVertexAttribute(A_TEX_COORDS);
+    enableVertexAttribute(A_TEX_LAYER);
+    uploadVertexAttributes(meshBuf);
+    arrays.append(va);
+    return va.name;
 }
 
 void RenderProgram::beginDrawMesh(const MeshBuffer *meshBuf, MaterialArray *materials,
-                                     const BoneTransform *bones, uint32_t boneCount)
+                                  const BonePalette *bones, uint32_t boneBase,
+                                  uint32_t boneCount)
+{
+    if(!meshBuf)
+        return;
+    beginDrawMesh(meshBuf, meshBuf->matGroups.constData(), meshBuf->matGroups.count(),
+                  materials, bones, boneBase, boneCount);
+}
+
+void RenderProgram::beginDrawMesh(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                                  uint32_t groupCount, MaterialArray *materials,
+                                  const BonePalette *bones, uint32_t boneBase,
+                                  uint32_t boneCount)
 {
     if(m_meshData.pending || !meshBuf)
         return;
     // XXX make the caller pass this structure to be reentrant
     m_meshData.pending = true;
     m_meshData.meshBuf = meshBuf;
+    m_meshData.groups = groups;
+    m_meshData.groupCount = groupCount;
     m_meshData.materials = materials;
     m_meshData.bones = bones;
+    m_meshData.boneBase = boneBase;
     m_meshData.boneCount = boneCount;
     if(!m_projectionSent)
     {
         setProjectionMatrix(m_renderCtx->matrix(RenderContext::Projection));
         m_projectionSent = true;
     }
-    enableVertexAttribute(A_POSITION);
-    enableVertexAttribute(A_NORMAL);
-    enableVertexAttribute(A_TEX_COORDS);
-    if(bones && (boneCount > 0))
+    
+    // Buffers keep the layout of their vertices in a vertex array object.
+    if(m_state->hasVertexArrays() && (meshBuf->vertexBuffer != 0))
     {
-        enableVertexAttribute(A_BONE_INDEX);
-        setBoneTransforms(bones, boneCount);
+        m_meshData.vertexArray = vertexArray(meshBuf);
+        m_state->bindVertexArray(m_meshData.vertexArray);
+    }
+    else
+    {
+        m_state->bindVertexArray(0);
+        m_state->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuf->indexBuffer);
+        enableVertexAttribute(A_POSITION);
+        enableVertexAttribute(A_NORMAL);
+        enableVertexAttribute(A_TEX_COORDS);
+        enableVertexAttribute(A_TEX_LAYER);
     }
+    if(bones && (boneCount > 0))
+        enableVertexAttribute(A_BONE_INDEX);
     if(meshBuf->indexBuffer != 0)
     {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuf->indexBuffer);
+        m_meshData.indexSize = meshBuf->indexSize;
         m_meshData.haveIndices = true;
     }
     else if(meshBuf->indices.count() > 0)
     {
-        m_meshData.indices = meshBuf->indices.constData();
+        m_meshData.indices = (const uint8_t *)meshBuf->indices.constData();
+        m_meshData.indexSize = sizeof(uint32_t);
         m_meshData.haveIndices = true;
     }
+    m_meshData.indexType = (m_meshData.indexSize == sizeof(uint16_t)) ? GL_UNSIGNED_SHORT
+                                                                     : GL_UNSIGNED_INT;
     if(bones && (boneCount > 0))
         beginSkinMesh();
-    uploadVertexAttributes(meshBuf);
+    if(m_meshData.vertexArray == 0)
+        uploadVertexAttributes(meshBuf);
 }
 
 void RenderProgram::drawMesh()
 {
-    drawMeshBatch(&m_renderCtx->matrix(RenderContext::ModelView), NULL, 1);
+    drawMeshBatch(&m_renderCtx->matrix(RenderContext::ModelView), 0, NULL, 1);
 }
 
-void RenderProgram::drawMeshBatch(const matrix4 *mvMatrices, const BufferSegment *colorSegments, uint32_t instances)
+void RenderProgram::drawMeshBatch(const matrix4 *mvMatrices, buffer_t colorBuffer,
+                                  const BufferSegment *colorSegments, uint32_t instances)
 {
     // No material - nothing is drawn.
     if(!m_meshData.pending || !m_meshData.materials)
         return;
 
-    // Get a Material pointer for each material group.
-    const MeshBuffer *meshBuf = m_meshData.meshBuf;
-    QVector<MaterialGroup> groups;
-    QVector<Material *> groupMats;
-    for(int i = 0; i < meshBuf->matGroups.count(); i++)
+    // Draw all instances with one call per material group if we can. Instances
+    // have their own color buffer, which can't be passed as an instance
+    // attribute, but it is only used by the vertex color debug modes. Skinning
+    // programs need a palette offset per instance (see drawSkinnedMeshBatch).
+    bool instanced = m_supportsInstancing && (instances > 1) &&
+        (m_instanceCount == 0) && (m_attr[A_BONE_BASE] < 0) &&
+        (!colorSegments || !needsVertexColors());
+    if(instanced)
     {
-        uint32_t matID = meshBuf->matGroups[i].matID;
-        Material *mat = m_meshData.materials->material(matID);
-        // Skip meshes that don't have a material.
-        if(!mat)
-            continue;
-        groups.append(meshBuf->matGroups[i]);
-        groupMats.append(mat);
+        beginInstances(mvMatrices, NULL, instances);
+        colorSegments = NULL;
+        instances = 1;
     }
 
     // Check whether all materials use the same texture (array) or not.
+    // Groups without a material are not drawn.
+    const MaterialGroup *groups = m_meshData.groups;
+    uint32_t groupCount = m_meshData.groupCount;
+    MaterialArray *materials = m_meshData.materials;
     Material *arrayMat = NULL;
-    if(groups.count() > 0)
+    for(uint32_t i = 0; i < groupCount; i++)
     {
-        arrayMat = groupMats[0];
-        for(int i = 1; i < groupMats.count(); i++)
+        Material *mat = materials->material(groups[i].matID);
+        if(!mat)
+            continue;
+        if(!arrayMat)
         {
-            if(arrayMat->texture() != groupMats[i]->texture())
-            {
-                arrayMat = NULL;
-                break;
-            }
+            arrayMat = mat;
+        }
+        else if(arrayMat->texture() != mat->texture())
+        {
+            arrayMat = NULL;
+            break;
         }
     }
     
@@ -461,61 +528,67 @@ void RenderProgram::drawMeshBatch(const matrix4 *mvMatrices, const BufferSegment
     if(arrayMat != NULL)
     {
         // If all material groups use the same texture we can render them together.
-        beginApplyMaterial(m_meshData.materials, arrayMat);
+        beginApplyMaterial(materials, arrayMat);
         for(uint32_t i = 0; i < instances; i++)
         {
             setModelViewMatrix(mvMatrices[i]);
             
             // Bind any color attribute if needed.
-            bindColorBuffer(colorSegments, i, enabledColor);
+            bindColorBuffer(colorBuffer, colorSegments, i, enabledColor);
 
             // Assume groups are sorted by offset and merge as many as possible.
-            MaterialGroup merged;
-            merged.offset = groups[0].offset;
-            merged.count = groups[0].count;
-            for(int j = 1; j < groups.count(); j++)
-            {
-                uint32_t mergedEnd = merged.offset + merged.count;
-                if(groups[j].offset == mergedEnd)
-                {
-                    merged.count += groups[j].count;
-                }
-                else
-                {
-                    drawMaterialGroup(merged);
-                    merged.offset = groups[j].offset;
-                    merged.count = groups[j].count;
-                }
-            }
-            drawMaterialGroup(merged);
+            drawMaterialGroups(groups, groupCount);
         }
-        endApplyMaterial(m_meshData.materials, arrayMat);
+        endApplyMaterial(materials, arrayMat);
     }
     else
     {
-        // Otherwise we have to change the texture for every material group.
-        for(int i = 0; i < groups.count(); i++)
+        // Otherwise we have to change the texture for every material, but
+        // consecutive groups that use the same material are drawn together.
+        uint32_t start = 0;
+        while(start < groupCount)
         {
-            Material *mat = groupMats[i];
-            beginApplyMaterial(m_meshData.materials, mat);
-            for(uint32_t j = 0; j < instances; j++)
+            uint32_t end = start + 1;
+            while((end < groupCount) && (groups[end].matID == groups[start].matID))
+                end++;
+            Material *mat = materials->material(groups[start].matID);
+            if(mat)
             {
-                setModelViewMatrix(mvMatrices[j]);
-                bindColorBuffer(colorSegments, i, enabledColor);
-                drawMaterialGroup(groups[i]);
+                beginApplyMaterial(materials, mat);
+                for(uint32_t j = 0; j < instances; j++)
+                {
+                    setModelViewMatrix(mvMatrices[j]);
+                    bindColorBuffer(colorBuffer, colorSegments, j, enabledColor);
+                    drawMaterialGroups(groups + start, end - start);
+                }
+                endApplyMaterial(materials, mat);
             }
-            endApplyMaterial(m_meshData.materials, mat);
+            start = end;
         }
     }
     
     if(enabledColor)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
         disableVertexAttribute(A_COLOR);
+    if(instanced)
+        endInstances();
+}
+
+void RenderProgram::drawSkinnedMeshBatch(const matrix4 *mvMatrices, const uint32_t *boneBases, uint32_t instances)
+{
+    if(!m_meshData.pending || !m_meshData.bones || (m_meshData.boneCount == 0))
+        return;
+    
+    // Skin and draw the instances one after the other.
+    for(uint32_t i = 0; i < instances; i++)
+    {
+        m_meshData.boneBase = boneBases[i];
+        beginSkinMesh();
+        drawMeshBatch(&mvMatrices[i], 0, NULL, 1);
     }
 }
 
-void RenderProgram::bindColorBuffer(const BufferSegment *colorSegments, int instanceID, bool &enabledColor)
+void RenderProgram::bindColorBuffer(buffer_t colorBuffer, const BufferSegment *colorSegments,
+                                    int instanceID, bool &enabledColor)
 {
     // Make sure the attribute is actually used by the shader.
     if(m_attr[A_COLOR] < 0)
@@ -524,7 +597,7 @@ void RenderProgram::bindColorBuffer(const BufferSegment *colorSegments, int inst
     const MeshBuffer *meshBuf = m_meshData.meshBuf;
     if(colorSegments)
     {
-        // Use the actor's per-instance color buffer.
+        // Use the actor's colors in the per-instance color buffer.
         BufferSegment colorSegment = colorSegments[instanceID];
         if(colorSegment.count > 0)
         {
@@ -533,14 +606,13 @@ void RenderProgram::bindColorBuffer(const BufferSegment *colorSegments, int inst
                 enableVertexAttribute(A_COLOR);
                 enabledColor = true;
             }
-            glBindBuffer(GL_ARRAY_BUFFER, meshBuf->colorBuffer);
-            glVertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, GL_TRUE,
-                                  0, (GLvoid *)colorSegment.address());
+            m_state->bindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+            m_state->vertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, true,
+                                         0, (const void *)colorSegment.address());
         }
         else if(enabledColor)
         {
             // No color information for this actor, do not reuse the previous actor's.
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
             disableVertexAttribute(A_COLOR);
             enabledColor = false;
         }
@@ -552,37 +624,176 @@ void RenderProgram::bindColorBuffer(const BufferSegment *colorSegments, int inst
         {
             const uint8_t *colorPtr = NULL;
             enableVertexAttribute(A_COLOR);
-            if(meshBuf->vertexBuffer)
-                glBindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
-            else
+            m_state->bindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
+            if(!meshBuf->vertexBuffer)
                 colorPtr = (const uint8_t *)meshBuf->vertices.constData();
             colorPtr += offsetof(Vertex, color);
-            glVertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), colorPtr);
+            m_state->vertexAttribPointer(m_attr[A_COLOR], 4, GL_UNSIGNED_BYTE, true, sizeof(Vertex), colorPtr);
             enabledColor = true;
         }
     }
 }
 
-void RenderProgram::drawMaterialGroup(const MaterialGroup &mg)
+bool RenderProgram::needsVertexColors() const
+{
+    return (m_lightingMode == DebugVertexColor) || (m_lightingMode == DebugTextureFactor);
+}
+
+void RenderProgram::beginInstances(const matrix4 *mvMatrices, const uint32_t *boneBases,
+                                   uint32_t instances)
+{
+    // The per-instance attributes are uploaded as they are: the model-view
+    // matrices followed by the palette offsets, if any.
+    size_t matrixSize = instances * sizeof(matrix4);
+    size_t boneBaseSize = boneBases ? (instances * sizeof(uint32_t)) : 0;
+    m_state->bindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    m_state->bufferData(GL_ARRAY_BUFFER, matrixSize + boneBaseSize, NULL, GL_STREAM_DRAW);
+    m_state->bufferSubData(GL_ARRAY_BUFFER, 0, matrixSize, mvMatrices);
+    if(boneBases)
+        m_state->bufferSubData(GL_ARRAY_BUFFER, matrixSize, boneBaseSize, boneBases);
+    setInstanceAttributes(true, boneBases ? matrixSize : 0);
+    m_state->uniform1i(m_uniform[U_INSTANCED], 1);
+    m_instanceCount = instances;
+}
+
+void RenderProgram::endInstances()
+{
+    m_instanceCount = 0;
+    m_state->uniform1i(m_uniform[U_INSTANCED], 0);
+    setInstanceAttributes(false, 0);
+}
+
+void RenderProgram::setInstanceAttributes(bool enabled, size_t boneBaseOffset)
+{
+    GLuint divisor = enabled ? 1 : 0;
+    for(int i = 0; i < 4; i++)
+    {
+        int attr = m_attr[A_MODEL_VIEW_0] + i;
+        if(enabled)
+        {
+            enableVertexAttribute(A_MODEL_VIEW_0, i);
+            m_state->vertexAttribPointer(attr, 4, GL_FLOAT, false, sizeof(matrix4),
+                                         (const void *)(i * sizeof(vec4)));
+        }
+        else
+        {
+            disableVertexAttribute(A_MODEL_VIEW_0, i);
+        }
+        m_state->vertexAttribDivisor(attr, divisor);
+    }
+    if(m_attr[A_BONE_BASE] < 0)
+        return;
+    if(enabled && (boneBaseOffset > 0))
+    {
+        enableVertexAttribute(A_BONE_BASE);
+        m_state->vertexAttribPointer(m_attr[A_BONE_BASE], 1, GL_UNSIGNED_INT, false,
+                                     sizeof(uint32_t), (const void *)boneBaseOffset);
+        m_state->vertexAttribDivisor(m_attr[A_BONE_BASE], 1);
+    }
+    else
+    {
+        disableVertexAttribute(A_BONE_BASE);
+        m_state->vertexAttribDivisor(m_attr[A_BONE_BASE], 0);
+    }
+}
+
+void RenderProgram::updateBlending()
 {
     // Enable or disable blending based on the current material.
-    if(m_currentMatNeedsBlending && !m_blendingEnabled)
+    m_state->setBlending(m_currentMatNeedsBlending);
+}
+
+/*!
+  \brief Draw material groups that use the same texture. Groups without a
+  material are skipped and adjacent groups are merged into ranges.
+  */
+void RenderProgram::drawMaterialGroups(const MaterialGroup *groups, uint32_t count)
+{
+    MaterialArray *materials = m_meshData.materials;
+    MaterialGroup ranges[MaxDrawRanges];
+    uint32_t rangeCount = 0;
+    MaterialGroup merged;
+    merged.offset = merged.count = 0;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const MaterialGroup &mg = groups[i];
+        if(!materials->material(mg.matID))
+            continue;
+        if((merged.count > 0) && (mg.offset == (merged.offset + merged.count)))
+        {
+            merged.count += mg.count;
+            continue;
+        }
+        if(merged.count > 0)
+        {
+            if(rangeCount == MaxDrawRanges)
+            {
+                drawRanges(ranges, rangeCount);
+                rangeCount = 0;
+            }
+            ranges[rangeCount++] = merged;
+        }
+        merged = mg;
+    }
+    if(merged.count > 0)
     {
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        m_blendingEnabled = true;
+        if(rangeCount == MaxDrawRanges)
+        {
+            drawRanges(ranges, rangeCount);
+            rangeCount = 0;
+        }
+        ranges[rangeCount++] = merged;
     }
-    else if(!m_currentMatNeedsBlending && m_blendingEnabled)
+    drawRanges(ranges, rangeCount);
+}
+
+/*!
+  \brief Draw ranges of indices with one glMultiDrawElements call, or one
+  call per range when drawing instances or a mesh without indices.
+  */
+void RenderProgram::drawRanges(const MaterialGroup *ranges, uint32_t count)
+{
+    if((count == 1) || (m_instanceCount > 0) || !m_meshData.haveIndices)
     {
-        glDisable(GL_BLEND);
-        m_blendingEnabled = false;
+        for(uint32_t i = 0; i < count; i++)
+            drawMaterialGroup(ranges[i]);
+        return;
+    }
+    else if(count == 0)
+    {
+        return;
     }
     
+    int counts[MaxDrawRanges];
+    const void *offsets[MaxDrawRanges];
+    for(uint32_t i = 0; i < count; i++)
+    {
+        counts[i] = ranges[i].count;
+        offsets[i] = m_meshData.indices + (ranges[i].offset * m_meshData.indexSize);
+    }
+    updateBlending();
+    m_state->multiDrawElements(GL_TRIANGLES, counts, m_meshData.indexType, offsets, count);
+    m_drawCalls++;
+}
+
+void RenderProgram::drawMaterialGroup(const MaterialGroup &mg)
+{
+    updateBlending();
+    
     const GLuint mode = GL_TRIANGLES;
-    if(m_meshData.haveIndices)
-        glDrawElements(mode, mg.count, GL_UNSIGNED_INT, m_meshData.indices + mg.offset);
+    const uint8_t *indices = m_meshData.indices + (mg.offset * m_meshData.indexSize);
+    if(m_instanceCount > 0)
+    {
+        if(m_meshData.haveIndices)
+            m_state->drawElementsInstanced(mode, mg.count, m_meshData.indexType,
+                                           indices, m_instanceCount);
+        else
+            m_state->drawArraysInstanced(mode, mg.offset, mg.count, m_instanceCount);
+    }
+    else if(m_meshData.haveIndices)
+        m_state->drawElements(mode, mg.count, m_meshData.indexType, indices);
     else
-        glDrawArrays(mode, mg.offset, mg.count);
+        m_state->drawArrays(mode, mg.offset, mg.count);
     m_drawCalls++;
 }
 
@@ -592,57 +803,92 @@ void RenderProgram::endDrawMesh()
         return;
     if(m_meshData.bones && (m_meshData.boneCount > 0))
         endSkinMesh();
-    //XXX No unbind / do unbind at the end of the frame.
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    // Buffers are unbound at the end of the frame. Vertex arrays keep their
+    // position, normal and texture attributes enabled.
     for(int i = 0; i < 4; i++)
         disableVertexAttribute(A_MODEL_VIEW_0, i);
     disableVertexAttribute(A_BONE_INDEX);
-    disableVertexAttribute(A_POSITION);
-    disableVertexAttribute(A_NORMAL);
-    disableVertexAttribute(A_TEX_COORDS);
+    if(m_meshData.vertexArray == 0)
+    {
+        disableVertexAttribute(A_POSITION);
+        disableVertexAttribute(A_NORMAL);
+        disableVertexAttribute(A_TEX_COORDS);
+        disableVertexAttribute(A_TEX_LAYER);
+    }
     disableVertexAttribute(A_COLOR);
     m_meshData.clear();
 }
 
+/*!
+  \brief Find the range of vertices used by some material groups. The whole
+  buffer is used when its indices are no longer in memory.
+  */
+static void findVertexRange(const MeshBuffer *meshBuf, const MaterialGroup *groups,
+                            uint32_t groupCount, uint32_t &first, uint32_t &count)
+{
+    if(meshBuf->indices.count() == 0)
+    {
+        first = 0;
+        count = meshBuf->vertices.count();
+        return;
+    }
+    uint32_t low = 0xffffffff, high = 0;
+    for(uint32_t i = 0; i < groupCount; i++)
+    {
+        const uint32_t *indices = meshBuf->indices.constData() + groups[i].offset;
+        for(uint32_t j = 0; j < groups[i].count; j++)
+        {
+            low = qMin(low, indices[j]);
+            high = qMax(high, indices[j]);
+        }
+    }
+    first = (low <= high) ? low : 0;
+    count = (low <= high) ? (high - low + 1) : 0;
+}
+
 void RenderProgram::beginSkinMesh()
 {
     // We can only do mesh skinning in software with a VBO as we can't overwrite the Mesh data.
+    // The buffer can be shared with other models, so only the vertices used
+    // by the mesh are overwritten.
     const MeshBuffer *meshBuf = m_meshData.meshBuf;
+    m_skinnedCount = 0;
     if(meshBuf->vertexBuffer == 0)
         return;
-    glBindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
-    // Discard the previous data.
-    glBufferData(GL_ARRAY_BUFFER, meshBuf->vertexBufferSize, NULL, GL_STREAM_DRAW);
-    // Map the VBO in memory and copy skinned vertices directly to it.
-    void *buffer = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-    if(!buffer)
+    findVertexRange(meshBuf, m_meshData.groups, m_meshData.groupCount,
+                    m_skinnedFirst, m_skinnedCount);
+    if(m_skinnedCount == 0)
         return;
-    const Vertex *src = meshBuf->vertices.constData();
-    Vertex *dst = (Vertex *)buffer;
-    for(uint32_t i = 0; i < meshBuf->vertices.count(); i++, src++, dst++)
+    m_skinnedVertices.resize(m_skinnedCount);
+    const Vertex *src = meshBuf->vertices.constData() + m_skinnedFirst;
+    Vertex *dst = m_skinnedVertices.data();
+    const vec4 *bones = m_meshData.bones->bones(m_meshData.boneBase);
+    uint32_t boneCount = m_meshData.boneCount;
+    for(uint32_t i = 0; i < m_skinnedCount; i++, src++, dst++)
     {
-        BoneTransform transform;
-        if((int)src->bone < MAX_TRANSFORMS)
-            transform = BoneTransform(m_bones[src->bone * 2], m_bones[src->bone * 2 + 1]);
-        dst->position = transform.map(src->position);
-        dst->normal = src->normal;
-        dst->bone = src->bone;
-        dst->texCoords = src->texCoords;
-        dst->color = src->color;
+        Vertex v = *src;
+        if(v.bone < boneCount)
+        {
+            const vec4 *dq = bones + (v.bone * 2);
+            v.position = dualquat(dq[0], dq[1]).map(v.position);
+        }
+        *dst = v;
     }
-    glUnmapBuffer(GL_ARRAY_BUFFER);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    m_state->bindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
+    m_state->bufferSubData(GL_ARRAY_BUFFER, m_skinnedFirst * sizeof(Vertex),
+                           m_skinnedCount * sizeof(Vertex), m_skinnedVertices.constData());
 }
 
 void RenderProgram::endSkinMesh()
 {
     // Restore the old mesh data that was overwritten by beginSkinMesh.
     const MeshBuffer *meshBuf = m_meshData.meshBuf;
-    if(meshBuf->vertexBuffer == 0)
+    if((meshBuf->vertexBuffer == 0) || (m_skinnedCount == 0))
         return;
-    glBindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, meshBuf->vertexBufferSize, meshBuf->vertices.constData());
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    m_state->bindBuffer(GL_ARRAY_BUFFER, meshBuf->vertexBuffer);
+    m_state->bufferSubData(GL_ARRAY_BUFFER, m_skinnedFirst * sizeof(Vertex),
+                           m_skinnedCount * sizeof(Vertex), meshBuf->vertices.constData() + m_skinnedFirst);
+    m_skinnedCount = 0;
 }
 
 static const vec3 cubeVertices[] =
@@ -671,13 +917,16 @@ static void fromEightCorners(MeshBuffer *meshBuffer, const vec3 *corners)
         Vertex &v1 = v[(i * 3) + 0];
         Vertex &v2 = v[(i * 3) + 1];
         Vertex &v3 = v[(i * 3) + 2];
+        vec3 u = (corners[idx2] - corners[idx1]), v = (corners[idx3] - corners[idx1]);
+        v1.packNormal(vec3::cross(u, v).normalized());
+        v1.packTexCoords(vec2(0.0, 0.0));
+        v1.layer = 0;
+        v1.bone = 0;
+        v1.color = 0xff000000;
+        v2 = v3 = v1;
         v1.position = corners[idx1];
         v2.position = corners[idx2];
         v3.position = corners[idx3];
-        vec3 u = (v2.position - v1.position), v = (v3.position - v1.position);
-        v1.normal = v2.normal = v3.normal = vec3::cross(u, v).normalized();
-        v1.texCoords = v2.texCoords = v3.texCoords = vec3(0.0, 0.0, 1.0);
-        v1.color = v2.color = v3.color = 0xff000000;
     }
 }
 
@@ -709,13 +958,13 @@ void RenderProgram::uploadCube()
     texture_t texID = 0;
     uint32_t target = GL_TEXTURE_2D_ARRAY;
     glGenTextures(1, &texID);
-    glBindTexture(target, texID);
+    m_state->bindTexture(target, texID);
     glTexImage3D(target, 0, GL_RGBA, 1, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, &colorABGR);
     glTexParameterf(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameterf(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameterf(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameterf(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glBindTexture(target, 0);
+    m_state->bindTexture(target, 0);
     mat->setTexture(texID);
     mat->setSubTexture(0);
 }
@@ -749,6 +998,10 @@ void RenderProgram::drawFrustum(const Frustum &frustum)
 UniformSkinningProgram::UniformSkinningProgram(RenderContext *renderCtx) : RenderProgram(renderCtx)
 {
     m_bonesLoc = -1;
+    m_bones.resize(MAX_TRANSFORMS * 2);
+    // The initial values of the uniform are not transforms.
+    m_usedSlots = MAX_TRANSFORMS;
+    m_warnedBoneCount = false;
 }
 
 bool UniformSkinningProgram::init()
@@ -759,7 +1012,30 @@ bool UniformSkinningProgram::init()
 
 void UniformSkinningProgram::beginSkinMesh()
 {
-    glUniform4fv(m_bonesLoc, MAX_TRANSFORMS * 2, (const GLfloat *)m_bones);
+    // Only upload the bones used by the mesh. The slots used by the previous
+    // mesh past this mesh's bones are reset to the identity transform.
+    const BonePalette *palette = m_meshData.bones;
+    uint32_t count = m_meshData.boneCount;
+    if(count > (uint32_t)MAX_TRANSFORMS)
+    {
+        if(!m_warnedBoneCount)
+        {
+            fprintf(stderr, "warning: skin has %d bones, only the first %d are used.\n",
+                    count, MAX_TRANSFORMS);
+            m_warnedBoneCount = true;
+        }
+        count = MAX_TRANSFORMS;
+    }
+    uint32_t slots = qMax(count, m_usedSlots);
+    vec4 *bones = m_bones.data();
+    memcpy(bones, palette->bones(m_meshData.boneBase), count * 2 * sizeof(vec4));
+    for(uint32_t i = count; i < slots; i++)
+    {
+        bones[i * 2] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        bones[i * 2 + 1] = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+    m_state->uniform4fv(m_bonesLoc, slots * 2, (const float *)bones);
+    m_usedSlots = count;
 }
 
 void UniformSkinningProgram::endSkinMesh()
@@ -771,20 +1047,34 @@ void UniformSkinningProgram::endSkinMesh()
 TextureSkinningProgram::TextureSkinningProgram(RenderContext *renderCtx) : RenderProgram(renderCtx)
 {
     m_boneTexture = 0;
+    m_bonesPerRow = 0;
+    m_boneTextureRows = 0;
+    m_maxBoneTextureRows = 0;
     m_bonesLoc = -1;
+    m_boneBaseLoc = -1;
+    m_bonesSizeLoc = -1;
+    m_uploadedPalette = NULL;
+    m_uploadedEpoch = 0;
+    m_uploadedBones = 0;
 }
 
 TextureSkinningProgram::~TextureSkinningProgram()
 {
     if(m_boneTexture != 0)
+    {
         glDeleteTextures(1, &m_boneTexture);
+        m_state->textureDeleted(m_boneTexture);
+    }
 }
 
 bool TextureSkinningProgram::init()
 {
-    int32_t texUnits = 0;
+    int32_t texUnits = 0, maxTextureSize = 0;
     glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &texUnits);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
     m_bonesLoc = glGetUniformLocation(m_program, "u_bones");
+    m_boneBaseLoc = glGetUniformLocation(m_program, "u_boneBase");
+    m_bonesSizeLoc = glGetUniformLocation(m_program, "u_bonesSize");
     if(m_bonesLoc < 0)
     {
         fprintf(stderr, "error: uniform 'u_bones' is inactive.\n");
@@ -800,37 +1090,152 @@ bool TextureSkinningProgram::init()
         fprintf(stderr, "error: extension 'ARB_texture_float' is not supported.\n");
         return false;
     }
+    if(!RenderProgram::init())
+        return false;
     glGenTextures(1, &m_boneTexture);
-    setBoneTransforms(0, 0);
-    glBindTexture(GL_TEXTURE_2D, m_boneTexture);
+    m_state->bindTexture(GL_TEXTURE_2D, m_boneTexture);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 2, MAX_TRANSFORMS, 0,
+    
+    // Lay the palette out over several rows, the texture would otherwise
+    // become taller than GL_MAX_TEXTURE_SIZE with a few hundred characters.
+    m_bonesPerRow = qMin((uint32_t)MAX_TRANSFORMS, (uint32_t)maxTextureSize / 2);
+    m_maxBoneTextureRows = (uint32_t)maxTextureSize;
+    m_boneTextureRows = 1;
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_bonesPerRow * 2, m_boneTextureRows, 0,
         GL_RGBA, GL_FLOAT, NULL);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    m_state->bindTexture(GL_TEXTURE_2D, 0);
     return true;
 }
 
+void TextureSkinningProgram::drawSkinnedMeshBatch(const matrix4 *mvMatrices, const uint32_t *boneBases, uint32_t instances)
+{
+    if(!m_supportsInstancing || (m_attr[A_BONE_BASE] < 0) || (instances < 2)
+        || !paletteFits(m_meshData.bones))
+    {
+        RenderProgram::drawSkinnedMeshBatch(mvMatrices, boneBases, instances);
+        return;
+    }
+    if(!m_meshData.pending || !m_meshData.bones || (m_meshData.boneCount == 0))
+        return;
+    
+    // Make sure bones allocated after beginDrawMesh are in the texture too.
+    m_state->activeTexture(GL_TEXTURE1);
+    uploadBones(m_meshData.bones);
+    m_state->activeTexture(GL_TEXTURE0);
+    m_state->uniform2f(m_bonesSizeLoc, (float)(m_bonesPerRow * 2), (float)m_boneTextureRows);
+    
+    // Draw all instances with one call per material group.
+    beginInstances(mvMatrices, boneBases, instances);
+    drawMeshBatch(mvMatrices, 0, NULL, 1);
+    endInstances();
+}
+
 void TextureSkinningProgram::beginSkinMesh()
 {
-    // upload bone transforms to the transform texture
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, m_boneTexture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 2, MAX_TRANSFORMS,
-        GL_RGBA, GL_FLOAT, m_bones);
-    glActiveTexture(GL_TEXTURE0);
-    glUniform1i(m_bonesLoc, 1);
-    m_textureBinds++;
+    const BonePalette *palette = m_meshData.bones;
+    uint32_t boneBase = m_meshData.boneBase;
+    m_state->activeTexture(GL_TEXTURE1);
+    if(m_state->bindTexture(GL_TEXTURE_2D, m_boneTexture))
+        m_textureBinds++;
+    if(paletteFits(palette))
+    {
+        uploadBones(palette);
+    }
+    else
+    {
+        // The palette does not fit in the texture, only upload the mesh's bones.
+        reserveBones(m_meshData.boneCount);
+        uploadBoneRange(palette->bones(boneBase), 0, m_meshData.boneCount);
+        m_uploadedPalette = NULL;
+        boneBase = 0;
+    }
+    m_state->activeTexture(GL_TEXTURE0);
+    m_state->uniform1i(m_bonesLoc, 1);
+    m_state->uniform1f(m_boneBaseLoc, (float)boneBase);
+    m_state->uniform2f(m_bonesSizeLoc, (float)(m_bonesPerRow * 2), (float)m_boneTextureRows);
+}
+
+bool TextureSkinningProgram::paletteFits(const BonePalette *palette) const
+{
+    return palette->boneCount() <= (m_maxBoneTextureRows * m_bonesPerRow);
+}
+
+/*!
+  \brief Make the texture big enough to hold the given number of bones, as
+  long as the texture does not become larger than the maximum size.
+  */
+void TextureSkinningProgram::reserveBones(uint32_t count)
+{
+    uint32_t rows = (count + m_bonesPerRow - 1) / m_bonesPerRow;
+    rows = qMin(rows, m_maxBoneTextureRows);
+    if(rows > m_boneTextureRows)
+    {
+        m_boneTextureRows = rows;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_bonesPerRow * 2, m_boneTextureRows, 0,
+            GL_RGBA, GL_FLOAT, NULL);
+        m_uploadedBones = 0;
+    }
+}
+
+void TextureSkinningProgram::uploadBones(const BonePalette *palette)
+{
+    // The whole palette is shared by all the meshes drawn during the frame.
+    // Only upload the bones that were allocated since the last upload.
+    if((palette != m_uploadedPalette) || (palette->epoch() != m_uploadedEpoch))
+    {
+        m_uploadedPalette = palette;
+        m_uploadedEpoch = palette->epoch();
+        m_uploadedBones = 0;
+    }
+    
+    // Resize the texture if the palette has grown too big for it.
+    uint32_t boneCount = palette->boneCount();
+    reserveBones(palette->capacity());
+    if(boneCount > m_uploadedBones)
+    {
+        uploadBoneRange(palette->bones(m_uploadedBones), m_uploadedBones,
+                        boneCount - m_uploadedBones);
+        m_uploadedBones = boneCount;
+    }
+}
+
+/*!
+  \brief Copy count bones to the texture, starting at the bone index first.
+  Bones are stored row after row, with two texels per bone.
+  */
+void TextureSkinningProgram::uploadBoneRange(const vec4 *bones, uint32_t first, uint32_t count)
+{
+    while(count > 0)
+    {
+        uint32_t row = first / m_bonesPerRow;
+        uint32_t column = first % m_bonesPerRow;
+        uint32_t uploaded = 0;
+        if((column == 0) && (count >= m_bonesPerRow))
+        {
+            // Upload as many whole rows as possible at once.
+            uint32_t rows = count / m_bonesPerRow;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, m_bonesPerRow * 2, rows,
+                GL_RGBA, GL_FLOAT, bones);
+            uploaded = rows * m_bonesPerRow;
+        }
+        else
+        {
+            uploaded = qMin(count, m_bonesPerRow - column);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, column * 2, row, uploaded * 2, 1,
+                GL_RGBA, GL_FLOAT, bones);
+        }
+        bones += uploaded * 2;
+        first += uploaded;
+        count -= uploaded;
+    }
 }
 
 void TextureSkinningProgram::endSkinMesh()
 {
-    // restore state
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glActiveTexture(GL_TEXTURE0);
+    // The bone texture stays bound to its unit until the end of the frame.
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -838,10 +1243,16 @@ void TextureSkinningProgram::endSkinMesh()
 void MeshDataGL2::clear()
 {
     meshBuf = NULL;
+    groups = NULL;
+    groupCount = 0;
     bones = NULL;
+    boneBase = 0;
     boneCount = 0;
     materials = NULL;
     haveIndices = false;
+    vertexArray = 0;
     indices = NULL;
+    indexSize = sizeof(uint32_t);
+    indexType = GL_UNSIGNED_INT;
     pending = false;
 }
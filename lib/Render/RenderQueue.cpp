@@ -0,0 +1,163 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <string.h>
+#include "EQuilibre/Render/RenderQueue.h"
+
+const uint32_t RenderQueue::ProgramBits = 8;
+const uint32_t RenderQueue::TextureBits = 14;
+const uint32_t RenderQueue::GroupBits = 24;
+const uint32_t RenderQueue::DepthBits = 16;
+
+static const uint32_t PassShift = 62;
+
+RenderQueue::RenderQueue()
+{
+}
+
+uint32_t RenderQueue::count() const
+{
+    return m_items.count();
+}
+
+const RenderItem * RenderQueue::items() const
+{
+    return m_items.constData();
+}
+
+/*!
+  \brief Create the sort key of an item. Fields that are too large for the key
+  are truncated, which only affects how well items are grouped.
+  */
+uint64_t RenderQueue::makeKey(Pass pass, uint32_t program, uint32_t texture,
+                              uint32_t group, uint32_t depth)
+{
+    uint64_t p = program & ((1 << ProgramBits) - 1);
+    uint64_t t = texture & ((1 << TextureBits) - 1);
+    uint64_t g = group & ((1 << GroupBits) - 1);
+    uint64_t d = depth & ((1 << DepthBits) - 1);
+    uint64_t key = (uint64_t)pass << PassShift;
+    if(pass == TransparentPass)
+    {
+        // Farthest first, then by state.
+        uint64_t invDepth = ((1 << DepthBits) - 1) - d;
+        uint32_t shift = PassShift - DepthBits;
+        key |= invDepth << shift;
+        shift -= ProgramBits;
+        key |= p << shift;
+        shift -= TextureBits;
+        key |= t << shift;
+        key |= g;
+    }
+    else
+    {
+        // State first, then nearest first.
+        uint32_t shift = PassShift - ProgramBits;
+        key |= p << shift;
+        shift -= TextureBits;
+        key |= t << shift;
+        shift -= GroupBits;
+        key |= g << shift;
+        key |= d;
+    }
+    return key;
+}
+
+/*!
+  \brief Map a distance from the camera to the range used by the depth field
+  of sort keys. Distances past maxDistance are clamped.
+  */
+uint32_t RenderQueue::quantizeDepth(float distance, float maxDistance)
+{
+    const uint32_t maxDepth = (1 << DepthBits) - 1;
+    if(!(distance > 0.0f) || !(maxDistance > 0.0f))
+        return 0;
+    else if(distance >= maxDistance)
+        return maxDepth;
+    return (uint32_t)((distance / maxDistance) * maxDepth);
+}
+
+RenderQueue::Pass RenderQueue::keyPass(uint64_t key)
+{
+    return (Pass)(key >> PassShift);
+}
+
+void RenderQueue::add(uint64_t key, uint32_t source, uint32_t index)
+{
+    RenderItem item;
+    item.key = key;
+    item.source = source;
+    item.index = index;
+    m_items.append(item);
+}
+
+void RenderQueue::sort()
+{
+    if(m_scratch.count() < m_items.count())
+        m_scratch.resize(m_items.count());
+    radixSort(m_items.data(), m_scratch.data(), m_items.count());
+}
+
+void RenderQueue::clear()
+{
+    // Keep the memory around for the next frame.
+    m_items.resize(0);
+}
+
+/*!
+  \brief Sort items by key with a stable LSD radix sort, one byte at a time.
+  The histograms of all bytes are computed in one pass over the items and the
+  bytes that are the same for all items are skipped. scratch must be able to
+  hold count items. The sorted items end up in items.
+  */
+void RenderQueue::radixSort(RenderItem *items, RenderItem *scratch, uint32_t count)
+{
+    if(count < 2)
+        return;
+    
+    uint32_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint64_t key = items[i].key;
+        for(uint32_t b = 0; b < 8; b++)
+            counts[b][(key >> (b * 8)) & 0xff]++;
+    }
+    
+    RenderItem *src = items;
+    RenderItem *dst = scratch;
+    for(uint32_t b = 0; b < 8; b++)
+    {
+        uint32_t *byteCounts = counts[b];
+        uint32_t shift = b * 8;
+        if(byteCounts[(src[0].key >> shift) & 0xff] == count)
+            continue;
+        
+        // Turn the histogram into the offset of each bucket.
+        uint32_t offset = 0;
+        for(uint32_t j = 0; j < 256; j++)
+        {
+            uint32_t bucketSize = byteCounts[j];
+            byteCounts[j] = offset;
+            offset += bucketSize;
+        }
+        for(uint32_t i = 0; i < count; i++)
+            dst[byteCounts[(src[i].key >> shift) & 0xff]++] = src[i];
+        qSwap(src, dst);
+    }
+    if(src != items)
+        memcpy(items, src, count * sizeof(RenderItem));
+}
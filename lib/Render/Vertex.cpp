@@ -14,10 +14,88 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
+#include <cmath>
+#include <cstdio>
+#include <QtAlgorithms>
 #include "EQuilibre/Render/Vertex.h"
 #include "EQuilibre/Render/Material.h"
 #include "EQuilibre/Render/RenderContext.h"
 
+const float Vertex::TexCoordScale = 1.0f / 256.0f;
+const uint32_t Vertex::MaxLayers = 256;
+const uint32_t Vertex::MaxBones = 256;
+
+static int8_t packSnorm8(float v)
+{
+    return (int8_t)qBound(-127.0f, floorf((v * 127.0f) + 0.5f), 127.0f);
+}
+
+static float signNotZero(float v)
+{
+    return (v < 0.0f) ? -1.0f : 1.0f;
+}
+
+vec3 Vertex::unpackNormal() const
+{
+    float x = normal[0] / 127.0f, y = normal[1] / 127.0f;
+    float z = 1.0f - fabs(x) - fabs(y);
+    if(z < 0.0f)
+    {
+        float fx = (1.0f - fabs(y)) * signNotZero(x);
+        float fy = (1.0f - fabs(x)) * signNotZero(y);
+        x = fx;
+        y = fy;
+    }
+    return vec3(x, y, z).normalized();
+}
+
+/*!
+  \brief Encode the normal by projecting it on the octahedron |x|+|y|+|z| = 1
+  and folding the lower half over the upper half. A zero vector is encoded as
+  (0, 0, 1).
+  */
+void Vertex::packNormal(const vec3 &n)
+{
+    float sum = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if(sum == 0.0f)
+    {
+        normal[0] = normal[1] = 0;
+        return;
+    }
+    float x = n.x / sum, y = n.y / sum;
+    if(n.z < 0.0f)
+    {
+        float fx = (1.0f - fabs(y)) * signNotZero(x);
+        float fy = (1.0f - fabs(x)) * signNotZero(y);
+        x = fx;
+        y = fy;
+    }
+    normal[0] = packSnorm8(x);
+    normal[1] = packSnorm8(y);
+}
+
+vec2 Vertex::unpackTexCoords() const
+{
+    return vec2(texCoords[0] * TexCoordScale, texCoords[1] * TexCoordScale);
+}
+
+/*!
+  \brief Pack the texture coordinates, clamping them to the range of the format.
+  \return false if the coordinates had to be clamped.
+  */
+bool Vertex::packTexCoords(const vec2 &tc)
+{
+    float x = floorf((tc.x / TexCoordScale) + 0.5f);
+    float y = floorf((tc.y / TexCoordScale) + 0.5f);
+    float clampedX = qBound(-32768.0f, x, 32767.0f);
+    float clampedY = qBound(-32768.0f, y, 32767.0f);
+    texCoords[0] = (int16_t)clampedX;
+    texCoords[1] = (int16_t)clampedY;
+    return (clampedX == x) && (clampedY == y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 BufferSegment::BufferSegment()
 {
     elementSize = 0;
@@ -37,11 +115,14 @@ size_t BufferSegment::address() const
 
 ////////////////////////////////////////////////////////////////////////////////
 
+const uint32_t MeshData::NoRange = 0xffffffff;
+
 MeshData::MeshData(MeshBuffer *buffer, uint32_t groups)
 {
     this->buffer = buffer;
     matGroups = new MaterialGroup[groups];
     groupCount = groups;
+    firstRange = NoRange;
 }
 
 MeshData::~MeshData()
@@ -54,6 +135,17 @@ void MeshData::updateTexCoords(MaterialArray *array, bool useMap)
     buffer->updateTexCoords(array, matGroups, groupCount, indexSegment.offset, useMap);
 }
 
+/*!
+  \brief Material groups of the mesh, ready to be drawn from the buffer. The
+  buffer's draw ranges are built first if the mesh is not in them yet.
+  */
+const MaterialGroup * MeshData::ranges() const
+{
+    if(firstRange == NoRange)
+        buffer->buildRanges();
+    return buffer->ranges.constData() + firstRange;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 MeshBuffer::MeshBuffer()
@@ -64,6 +156,7 @@ MeshBuffer::MeshBuffer()
     vertexBufferSize = 0;
     indexBufferSize = 0;
     colorBufferSize = 0;
+    indexSize = sizeof(uint32_t);
 }
 
 MeshBuffer::~MeshBuffer()
@@ -88,47 +181,189 @@ void MeshBuffer::addMaterialGroups(MeshData *mesh)
     }
 }
 
+/*!
+  \brief Build the table of draw ranges of all meshes in the buffer, so that
+  drawing a mesh does not need to offset its material groups.
+  */
+void MeshBuffer::buildRanges()
+{
+    ranges.clear();
+    foreach(MeshData *mesh, meshes)
+    {
+        mesh->firstRange = ranges.count();
+        for(uint32_t i = 0; i < mesh->groupCount; i++)
+        {
+            MaterialGroup mg = mesh->matGroups[i];
+            mg.offset += mesh->indexSegment.offset;
+            ranges.append(mg);
+        }
+    }
+}
+
+struct IndexRun
+{
+    uint32_t order;
+    uint32_t start;
+    MaterialGroup *group;
+};
+
+static bool indexRunLessThan(const IndexRun &a, const IndexRun &b)
+{
+    return a.order < b.order;
+}
+
+/*!
+  \brief Reorder the index buffer so that the groups of all meshes that use
+  the same material are next to each other, in mesh order. Opaque materials
+  come before transparent ones. The groups of a mesh are then spread over the
+  buffer, so their offsets become relative to the start of the buffer.
+  */
+void MeshBuffer::groupIndicesByMaterial(MaterialArray *materials)
+{
+    QVector<IndexRun> runs;
+    foreach(MeshData *mesh, meshes)
+    {
+        for(uint32_t i = 0; i < mesh->groupCount; i++)
+        {
+            MaterialGroup &mg(mesh->matGroups[i]);
+            Material *mat = materials ? materials->material(mg.matID) : NULL;
+            bool transparent = mat && !mat->isOpaque();
+            IndexRun run;
+            run.order = (transparent ? 0x80000000 : 0) | mg.matID;
+            run.start = mesh->indexSegment.offset + mg.offset;
+            run.group = &mg;
+            runs.append(run);
+        }
+    }
+    qStableSort(runs.begin(), runs.end(), indexRunLessThan);
+    
+    QVector<uint32_t> newIndices;
+    newIndices.reserve(indices.count());
+    foreach(const IndexRun &run, runs)
+    {
+        const uint32_t *runIndices = indices.constData() + run.start;
+        run.group->offset = newIndices.count();
+        for(uint32_t i = 0; i < run.group->count; i++)
+            newIndices.append(runIndices[i]);
+    }
+    indices = newIndices;
+    ranges.clear();
+    foreach(MeshData *mesh, meshes)
+    {
+        mesh->indexSegment.offset = 0;
+        mesh->firstRange = MeshData::NoRange;
+    }
+}
+
 void MeshBuffer::updateTexCoords(MaterialArray *array, const MaterialGroup *matGroups,
                                  uint32_t groupCount, uint32_t startIndex, bool useMap)
 {
     Vertex *vertices = this->vertices.data();
     const uint32_t *indices = this->indices.constData() + startIndex;
     
+    // Vertices can be shared by several groups, only update them once.
+    uint32_t firstVertex = 0xffffffff, lastVertex = 0;
+    for(uint32_t i = 0; i < groupCount; i++)
+    {
+        const uint32_t *mgIndices = indices + matGroups[i].offset;
+        for(uint32_t j = 0; j < matGroups[i].count; j++)
+        {
+            firstVertex = qMin(firstVertex, mgIndices[j]);
+            lastVertex = qMax(lastVertex, mgIndices[j]);
+        }
+    }
+    if(firstVertex > lastVertex)
+        return;
+    QVector<uint8_t> updated(lastVertex - firstVertex + 1, 0);
+    
     int maxWidth = array->maxWidth(), maxHeight = array->maxHeight();
+    uint32_t clampedLayers = 0, clampedTexCoords = 0;
     for(uint32_t i = 0; i < groupCount; i++)
     {
         const MaterialGroup &mg(matGroups[i]);
         Material *mat = array->material(mg.matID);
-        float matScalingX = 1.0, matScalingY = 1.0, z = (mg.matID + 1);
+        float matScalingX = 1.0, matScalingY = 1.0;
+        uint32_t layer = mg.matID;
         if(!useMap && mat)
         { 
             // XXX put the scaling info in the uniform array.
             matScalingX = (float)mat->width() / (float)maxWidth;
             matScalingY = (float)mat->height() / (float)maxHeight;
-            z = mat->subTexture();
+            layer = qMax(mat->subTexture(), 1u) - 1;
+        }
+        if(layer >= Vertex::MaxLayers)
+        {
+            layer = Vertex::MaxLayers - 1;
+            clampedLayers++;
         }
         
         const uint32_t *mgIndices = indices + mg.offset;
         for(uint32_t i = 0; i < mg.count; i++)
         {
             uint32_t vertexID = mgIndices[i];
-            if(vertices[vertexID].texCoords.z == 0)
+            if(updated[vertexID - firstVertex])
+                continue;
+            Vertex &v(vertices[vertexID]);
+            if((matScalingX != 1.0f) || (matScalingY != 1.0f))
             {
-                vertices[vertexID].texCoords.x *= matScalingX;
-                vertices[vertexID].texCoords.y *= matScalingY;
-                vertices[vertexID].texCoords.z = z;
+                vec2 tc = v.unpackTexCoords();
+                if(!v.packTexCoords(vec2(tc.x * matScalingX, tc.y * matScalingY)))
+                    clampedTexCoords++;
             }
+            v.layer = (uint8_t)layer;
+            updated[vertexID - firstVertex] = 1;
         }
     }
+    if(clampedLayers > 0)
+        fprintf(stderr, "Warning: %u material groups use a layer past %u, clamped\n",
+                clampedLayers, Vertex::MaxLayers - 1);
+    if(clampedTexCoords > 0)
+        fprintf(stderr, "Warning: %u texture coordinates out of range, clamped\n",
+                clampedTexCoords);
+}
+
+/*!
+  \brief Smallest index size, in bytes, that can address all the vertices.
+  */
+uint32_t MeshBuffer::indexSizeFor(uint32_t vertexCount)
+{
+    return (vertexCount <= 65536) ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+/*!
+  \brief Copy the indices to a 16-bit array. All vertices must be addressable
+  with 16-bit indices.
+  */
+void MeshBuffer::shortIndices(QVector<uint16_t> &dst) const
+{
+    Q_ASSERT(indexSizeFor(vertices.count()) == sizeof(uint16_t));
+    dst.resize(indices.count());
+    const uint32_t *src = indices.constData();
+    uint16_t *dstIndices = dst.data();
+    for(int i = 0; i < indices.count(); i++)
+        dstIndices[i] = (uint16_t)src[i];
 }
 
 void MeshBuffer::upload(RenderContext *renderCtx)
 {
-    // Create the GPU buffers.
+    buildRanges();
+    
+    // Create the GPU buffers. Indices are uploaded as 16-bit integers when the
+    // buffer has few enough vertices.
     vertexBufferSize = vertices.count() * sizeof(Vertex);
-    indexBufferSize = indices.count() * sizeof(uint32_t);
     vertexBuffer = renderCtx->createBuffer(vertices.constData(), vertexBufferSize);
-    indexBuffer = renderCtx->createBuffer(indices.constData(), indexBufferSize);
+    indexSize = indexSizeFor(vertices.count());
+    indexBufferSize = indices.count() * indexSize;
+    if(indexSize == sizeof(uint16_t))
+    {
+        QVector<uint16_t> packed;
+        shortIndices(packed);
+        indexBuffer = renderCtx->createBuffer(packed.constData(), indexBufferSize);
+    }
+    else
+    {
+        indexBuffer = renderCtx->createBuffer(indices.constData(), indexBufferSize);
+    }
 }
 
 void MeshBuffer::clear(RenderContext *renderCtx)
@@ -136,6 +371,7 @@ void MeshBuffer::clear(RenderContext *renderCtx)
     foreach(MeshData *m, meshes)
         delete m;
     meshes.clear();
+    ranges.clear();
     clearVertices();
     clearIndices();
     clearColors();
@@ -144,7 +380,10 @@ void MeshBuffer::clear(RenderContext *renderCtx)
         renderCtx->freeBuffers(&vertexBuffer, 1);
         renderCtx->freeBuffers(&indexBuffer, 1);
         renderCtx->freeBuffers(&colorBuffer, 1);
+        foreach(VertexArray va, vertexArrays)
+            renderCtx->freeVertexArray(va.name);
     }
+    vertexArrays.clear();
 }
 
 void MeshBuffer::clearVertices()
@@ -164,3 +403,115 @@ void MeshBuffer::clearColors()
     colors.clear();
     colors.squeeze();
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+BonePalette::BonePalette()
+{
+    m_count = 0;
+    m_epoch = 0;
+}
+
+uint32_t BonePalette::boneCount() const
+{
+    return m_count;
+}
+
+uint32_t BonePalette::capacity() const
+{
+    return m_data.count() / 2;
+}
+
+uint32_t BonePalette::epoch() const
+{
+    return m_epoch;
+}
+
+const vec4 * BonePalette::constData() const
+{
+    return m_data.constData();
+}
+
+uint32_t BonePalette::allocate(uint32_t count)
+{
+    uint32_t base = m_count;
+    uint32_t needed = (m_count + count) * 2;
+    if(needed > (uint32_t)m_data.count())
+    {
+        // Grow geometrically to avoid reallocating every frame.
+        uint32_t newSize = qMax(needed, (uint32_t)m_data.count() * 2);
+        m_data.resize(newSize);
+    }
+    m_count += count;
+    return base;
+}
+
+vec4 * BonePalette::bones(uint32_t base)
+{
+    Q_ASSERT(base <= m_count);
+    return m_data.data() + (base * 2);
+}
+
+const vec4 * BonePalette::bones(uint32_t base) const
+{
+    Q_ASSERT(base <= m_count);
+    return m_data.constData() + (base * 2);
+}
+
+BoneTransform BonePalette::transform(uint32_t index) const
+{
+    if(index >= m_count)
+        return BoneTransform();
+    const vec4 *dq = m_data.constData() + (index * 2);
+    return BoneTransform::fromDualQuaternion(dq[0], dq[1]);
+}
+
+void BonePalette::setTransform(uint32_t index, const BoneTransform &transform)
+{
+    Q_ASSERT(index < m_count);
+    vec4 *dq = m_data.data() + (index * 2);
+    transform.toDualQuaternion(dq[0], dq[1]);
+}
+
+void BonePalette::clear()
+{
+    // Keep the memory around, the palette is usually refilled every frame.
+    m_count = 0;
+    m_epoch++;
+}
+
+/*!
+  \brief Check that the bone ranges of several instances (each using boneCount
+  bones starting at bases[i]) fit in the palette without overlapping and that
+  they only contain unit dual quaternions. This does not require a GL context.
+  */
+bool BonePalette::checkLayout(const uint32_t *bases, uint32_t boneCount, uint32_t instances) const
+{
+    const float epsilon = 1e-3f;
+    QVector<uint32_t> sorted;
+    for(uint32_t i = 0; i < instances; i++)
+    {
+        if((bases[i] + boneCount) > m_count)
+            return false;
+        sorted.append(bases[i]);
+    }
+    qSort(sorted.begin(), sorted.end());
+    for(int i = 1; i < sorted.count(); i++)
+    {
+        if((sorted[i - 1] + boneCount) > sorted[i])
+            return false;
+    }
+    for(int i = 0; i < sorted.count(); i++)
+    {
+        const vec4 *dq = bones(sorted[i]);
+        for(uint32_t j = 0; j < boneCount; j++, dq += 2)
+        {
+            // The real part must be a unit quaternion, orthogonal to the dual part.
+            if(qAbs(vec4::dot(dq[0], dq[0]) - 1.0f) > epsilon)
+                return false;
+            if(qAbs(vec4::dot(dq[0], dq[1])) > epsilon)
+                return false;
+        }
+    }
+    return true;
+}
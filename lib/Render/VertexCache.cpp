@@ -0,0 +1,352 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include "EQuilibre/Render/VertexCache.h"
+#include "EQuilibre/Render/Vertex.h"
+
+VertexCache::VertexCache(uint32_t size, Policy policy)
+{
+    m_entries.resize(size);
+    m_size = size;
+    m_policy = policy;
+    clear();
+}
+
+uint32_t VertexCache::size() const
+{
+    return m_size;
+}
+
+VertexCache::Policy VertexCache::policy() const
+{
+    return m_policy;
+}
+
+/*!
+  \brief Look up a vertex in the cache, adding it if it was not there.
+  \return true if the vertex was in the cache.
+  */
+bool VertexCache::access(uint32_t vertexID)
+{
+    uint32_t *entries = m_entries.data();
+    for(uint32_t i = 0; i < m_count; i++)
+    {
+        if(entries[i] != vertexID)
+            continue;
+        if(m_policy == LRU)
+        {
+            // Move the vertex to the front.
+            for(uint32_t j = i; j > 0; j--)
+                entries[j] = entries[j - 1];
+            entries[0] = vertexID;
+        }
+        return true;
+    }
+    
+    if(m_size == 0)
+        return false;
+    if(m_policy == LRU)
+    {
+        // Evict the least recently used vertex, at the back.
+        uint32_t last = qMin(m_count, m_size - 1);
+        for(uint32_t j = last; j > 0; j--)
+            entries[j] = entries[j - 1];
+        entries[0] = vertexID;
+    }
+    else
+    {
+        entries[m_next] = vertexID;
+        m_next = (m_next + 1) % m_size;
+    }
+    m_count = qMin(m_count + 1, m_size);
+    return false;
+}
+
+void VertexCache::clear()
+{
+    m_count = 0;
+    m_next = 0;
+}
+
+/*!
+  \brief Average number of vertices transformed per triangle (cache misses
+  divided by the number of triangles). 0.5 is the best a regular grid can do
+  and 3 means that no vertex is ever reused.
+  */
+float VertexCache::acmr(const uint32_t *indices, uint32_t indexCount, uint32_t cacheSize,
+                        Policy policy)
+{
+    uint32_t triangles = indexCount / 3;
+    if(triangles == 0)
+        return 0.0f;
+    VertexCache cache(cacheSize, policy);
+    uint32_t misses = 0;
+    for(uint32_t i = 0; i < (triangles * 3); i++)
+        misses += !cache.access(indices[i]);
+    return (float)misses / (float)triangles;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t VertexCacheOptimizer::CacheSize = 32;
+
+static const float CacheDecayPower = 1.5f;
+static const float LastTriangleScore = 0.75f;
+static const float ValenceBoostScale = 2.0f;
+static const float ValenceBoostPower = 0.5f;
+static const uint32_t NoVertex = 0xffffffff;
+
+VertexCacheOptimizer::VertexCacheOptimizer()
+{
+    // The vertices of the last triangle get a fixed score, so that the
+    // optimizer does not always pick a triangle that shares an edge with it.
+    m_cacheScores.resize(CacheSize);
+    for(uint32_t i = 0; i < CacheSize; i++)
+    {
+        if(i < 3)
+        {
+            m_cacheScores[i] = LastTriangleScore;
+        }
+        else
+        {
+            float scale = 1.0f / (CacheSize - 3);
+            m_cacheScores[i] = powf(1.0f - ((i - 3) * scale), CacheDecayPower);
+        }
+    }
+    
+    // Vertices with few triangles left get a boost, to avoid leaving lone
+    // triangles behind.
+    m_valenceScores.resize(32);
+    m_valenceScores[0] = 0.0f;
+    for(int i = 1; i < m_valenceScores.count(); i++)
+        m_valenceScores[i] = ValenceBoostScale * powf((float)i, -ValenceBoostPower);
+}
+
+static bool contains(const uint32_t *vertices, uint32_t count, uint32_t v)
+{
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(vertices[i] == v)
+            return true;
+    }
+    return false;
+}
+
+float VertexCacheOptimizer::vertexScore(int cachePos, uint32_t remaining) const
+{
+    if(remaining == 0)
+        return -1.0f;
+    float score = (cachePos >= 0) ? m_cacheScores[cachePos] : 0.0f;
+    if(remaining < (uint32_t)m_valenceScores.count())
+        score += m_valenceScores[remaining];
+    else
+        score += ValenceBoostScale * powf((float)remaining, -ValenceBoostPower);
+    return score;
+}
+
+/*!
+  \brief Reorder the triangles of an indexed triangle list in place. Indices
+  must be in the range [firstVertex, firstVertex + vertexCount). The winding of
+  triangles is kept.
+  */
+void VertexCacheOptimizer::optimizeTriangles(uint32_t *indices, uint32_t indexCount,
+                                             uint32_t firstVertex, uint32_t vertexCount)
+{
+    const uint32_t triCount = indexCount / 3;
+    if(triCount < 2)
+        return;
+    
+    // Find the triangles that use each vertex.
+    m_remaining.fill(0, vertexCount);
+    for(uint32_t i = 0; i < (triCount * 3); i++)
+    {
+        Q_ASSERT((indices[i] >= firstVertex) && ((indices[i] - firstVertex) < vertexCount));
+        m_remaining[indices[i] - firstVertex]++;
+    }
+    m_adjOffsets.resize(vertexCount + 1);
+    uint32_t offset = 0;
+    for(uint32_t v = 0; v < vertexCount; v++)
+    {
+        m_adjOffsets[v] = offset;
+        offset += m_remaining[v];
+    }
+    m_adjOffsets[vertexCount] = offset;
+    m_adjTriangles.resize(offset);
+    m_remaining.fill(0, vertexCount);
+    for(uint32_t t = 0; t < triCount; t++)
+    {
+        for(uint32_t k = 0; k < 3; k++)
+        {
+            uint32_t v = indices[(t * 3) + k] - firstVertex;
+            m_adjTriangles[m_adjOffsets[v] + m_remaining[v]] = t;
+            m_remaining[v]++;
+        }
+    }
+    
+    // Compute the initial scores.
+    m_cachePos.fill(-1, vertexCount);
+    m_scores.resize(vertexCount);
+    for(uint32_t v = 0; v < vertexCount; v++)
+        m_scores[v] = vertexScore(-1, m_remaining[v]);
+    m_triAdded.fill(0, triCount);
+    int bestTri = -1;
+    float bestScore = -1.0f;
+    for(uint32_t t = 0; t < triCount; t++)
+    {
+        const uint32_t *tri = indices + (t * 3);
+        float score = m_scores[tri[0] - firstVertex] + m_scores[tri[1] - firstVertex]
+                    + m_scores[tri[2] - firstVertex];
+        if(score > bestScore)
+        {
+            bestScore = score;
+            bestTri = t;
+        }
+    }
+    
+    // Add triangles one at a time, picking the best one among the triangles
+    // that use a vertex in the cache.
+    uint32_t cache[CacheSize + 3];
+    uint32_t cacheCount = 0;
+    uint32_t cursor = 0;
+    m_output.resize(triCount * 3);
+    for(uint32_t added = 0; added < triCount; added++)
+    {
+        if(bestTri < 0)
+        {
+            // Dead end, continue with the next triangle in the original order.
+            while(m_triAdded[cursor])
+                cursor++;
+            bestTri = cursor;
+        }
+        
+        const uint32_t *tri = indices + (bestTri * 3);
+        m_triAdded[bestTri] = 1;
+        uint32_t newCache[CacheSize + 3];
+        uint32_t newCount = 0;
+        for(uint32_t k = 0; k < 3; k++)
+        {
+            uint32_t v = tri[k] - firstVertex;
+            m_output[(added * 3) + k] = tri[k];
+            if(!contains(newCache, newCount, v))
+                newCache[newCount++] = v;
+            
+            // Remove the triangle from the vertex' remaining triangles.
+            uint32_t *adj = m_adjTriangles.data() + m_adjOffsets[v];
+            uint32_t remaining = m_remaining[v];
+            for(uint32_t j = 0; j < remaining; j++)
+            {
+                if(adj[j] == (uint32_t)bestTri)
+                {
+                    adj[j] = adj[remaining - 1];
+                    adj[remaining - 1] = bestTri;
+                    break;
+                }
+            }
+            m_remaining[v]--;
+        }
+        uint32_t triVertices = newCount;
+        for(uint32_t i = 0; i < cacheCount; i++)
+        {
+            if(!contains(newCache, triVertices, cache[i]))
+                newCache[newCount++] = cache[i];
+        }
+        
+        // Update the scores of the vertices that were in the cache, and then
+        // of their triangles.
+        for(uint32_t i = 0; i < newCount; i++)
+        {
+            uint32_t v = newCache[i];
+            m_cachePos[v] = (i < CacheSize) ? (int)i : -1;
+            m_scores[v] = vertexScore(m_cachePos[v], m_remaining[v]);
+        }
+        bestTri = -1;
+        bestScore = -1.0f;
+        for(uint32_t i = 0; i < newCount; i++)
+        {
+            uint32_t v = newCache[i];
+            const uint32_t *adj = m_adjTriangles.constData() + m_adjOffsets[v];
+            for(uint32_t j = 0; j < m_remaining[v]; j++)
+            {
+                uint32_t t = adj[j];
+                const uint32_t *other = indices + (t * 3);
+                float score = m_scores[other[0] - firstVertex] + m_scores[other[1] - firstVertex]
+                            + m_scores[other[2] - firstVertex];
+                if(score > bestScore)
+                {
+                    bestScore = score;
+                    bestTri = t;
+                }
+            }
+        }
+        cacheCount = qMin(newCount, CacheSize);
+        for(uint32_t i = 0; i < cacheCount; i++)
+            cache[i] = newCache[i];
+    }
+    for(uint32_t i = 0; i < (triCount * 3); i++)
+        indices[i] = m_output[i];
+}
+
+/*!
+  \brief Reorder the triangles of each material group of the mesh, then its
+  vertices in the order they are first used.
+  \param vertexOrder Receives the previous position of each vertex, relative
+  to the start of the mesh, so that per-vertex data stored elsewhere can be
+  reordered the same way.
+  */
+void VertexCacheOptimizer::optimizeMesh(MeshData *mesh, QVector<uint32_t> &vertexOrder)
+{
+    MeshBuffer *buffer = mesh->buffer;
+    const uint32_t firstVertex = mesh->vertexSegment.offset;
+    const uint32_t vertexCount = mesh->vertexSegment.count;
+    uint32_t *indices = buffer->indices.data() + mesh->indexSegment.offset;
+    for(uint32_t i = 0; i < mesh->groupCount; i++)
+    {
+        const MaterialGroup &mg(mesh->matGroups[i]);
+        optimizeTriangles(indices + mg.offset, mg.count, firstVertex, vertexCount);
+    }
+    
+    // Number vertices in the order they are first used. Unused vertices go last.
+    m_remap.fill(NoVertex, vertexCount);
+    vertexOrder.resize(vertexCount);
+    uint32_t next = 0;
+    for(uint32_t i = 0; i < mesh->indexSegment.count; i++)
+    {
+        uint32_t v = indices[i] - firstVertex;
+        if(m_remap[v] == NoVertex)
+        {
+            m_remap[v] = next;
+            vertexOrder[next++] = v;
+        }
+    }
+    for(uint32_t v = 0; v < vertexCount; v++)
+    {
+        if(m_remap[v] == NoVertex)
+        {
+            m_remap[v] = next;
+            vertexOrder[next++] = v;
+        }
+    }
+    
+    QVector<Vertex> oldVertices(vertexCount);
+    Vertex *vertices = buffer->vertices.data() + firstVertex;
+    for(uint32_t v = 0; v < vertexCount; v++)
+        oldVertices[v] = vertices[v];
+    for(uint32_t v = 0; v < vertexCount; v++)
+        vertices[v] = oldVertices[vertexOrder[v]];
+    for(uint32_t i = 0; i < mesh->indexSegment.count; i++)
+        indices[i] = firstVertex + m_remap[indices[i] - firstVertex];
+}
@@ -15,12 +15,15 @@
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.attribute vec3 a_position;
 
 attribute vec3 a_position;
-attribute vec3 a_normal;
-attribute vec3 a_texCoords;
+attribute vec2 a_normal; // octahedral encoding
+attribute vec2 a_texCoords; // 8.8 fixed-point
+attribute float a_texLayer;
 attribute vec4 a_color;
+attribute mat4 a_modelViewMatrix; // per-instance attribute
 
 uniform mat4 u_modelViewMatrix;
 uniform mat4 u_projectionMatrix;
+uniform int u_instanced;
 
 uniform int u_mapMaterialSlots;
 uniform vec3 u_materialSlotMap[256];
@@ -36,6 +39,8 @@ uniform float u_fogStart;
 uniform float u_fogEnd;
 uniform float u_fogDensity;
 
+const float TEX_COORD_SCALE = 1.0 / 256.0;
+
 varying vec3 v_color;
 varying float v_texFactor;
 varying vec3 v_texCoords;
@@ -43,12 +48,13 @@ varying float v_fogFactor;
 
 void main()
 {
-    vec4 viewPos = u_modelViewMatrix * vec4(a_position, 1.0);
+    mat4 modelView = (u_instanced > 0) ? a_modelViewMatrix : u_modelViewMatrix;
+    vec4 viewPos = modelView * vec4(a_position, 1.0);
     gl_Position = u_projectionMatrix * viewPos;
     
     // Transform texture coordinates if using the material map.
-    float baseTex = a_texCoords.z - 1.0;
-    vec2 baseTexCoords = a_texCoords.xy;
+    float baseTex = a_texLayer;
+    vec2 baseTexCoords = a_texCoords * TEX_COORD_SCALE;
     vec3 matInfo = u_materialSlotMap[int(baseTex)];
     vec2 mappedTexCoords = baseTexCoords * matInfo.xy;
     float mappedTex = matInfo.z - 1.0;
@@ -15,10 +15,13 @@
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 attribute vec3 a_position;
-attribute vec3 a_normal;
-attribute vec3 a_texCoords;
+attribute vec2 a_normal; // octahedral encoding
+attribute vec2 a_texCoords; // 8.8 fixed-point
+attribute float a_texLayer;
 attribute vec4 a_color;
 attribute float a_boneIndex; // to be compatible with OpenGL < 3.0
+attribute mat4 a_modelViewMatrix; // per-instance attributes
+attribute float a_boneBase;
 
 uniform mat4 u_modelViewMatrix;
 uniform mat4 u_projectionMatrix;
@@ -31,50 +34,47 @@ uniform float u_fogEnd;
 uniform float u_fogDensity;
 
 uniform sampler2D u_bones;
-const vec2 u_bonesSize = vec2(2.0f, 256.0f);
+uniform vec2 u_bonesSize;
+uniform float u_boneBase;
+uniform int u_instanced;
+
+const float TEX_COORD_SCALE = 1.0 / 256.0;
 
 varying vec3 v_color;
 varying float v_texFactor;
 varying vec3 v_texCoords;
 varying float v_fogFactor;
 
-// http://qt.gitorious.org/qt/qt/blobs/raw/4.7/src/gui/math3d/qquaternion.h
-vec4 mult_quat(vec4 q1, vec4 q2)
-{
-    float ww = (q1.z + q1.x) * (q2.x + q2.y);
-    float yy = (q1.w - q1.y) * (q2.w + q2.z);
-    float zz = (q1.w + q1.y) * (q2.w - q2.z);
-    float xx = ww + yy + zz;
-    float qq = 0.5 * (xx + (q1.z - q1.x) * (q2.x - q2.y));
-
-    float w = qq - ww + (q1.z - q1.y) * (q2.y - q2.z);
-    float x = qq - xx + (q1.x + q1.w) * (q2.x + q2.w);
-    float y = qq - yy + (q1.w - q1.x) * (q2.y + q2.z);
-    float z = qq - zz + (q1.z + q1.y) * (q2.w - q2.x);
-    return vec4(x, y, z, w);
-}
-
-// rotate the point v by the quaternion q
-vec3 rotate_by_quat(vec3 v, vec4 q)
+// transform the point v by the unit dual quaternion (d0, d1)
+vec3 transform_by_dual_quat(vec3 v, vec4 d0, vec4 d1)
 {
-    return vec3(mult_quat(mult_quat(q, vec4(v, 0.0)), vec4(-q.x, -q.y, -q.z, q.w)));
+    vec3 rotated = v + 2.0 * cross(d0.xyz, cross(d0.xyz, v) + d0.w * v);
+    vec3 trans = 2.0 * (d0.w * d1.xyz - d1.w * d0.xyz + cross(d0.xyz, d1.xyz));
+    return rotated + trans;
 }
 
-vec4 skin(vec3 pos)
+vec4 skin(vec3 pos, float boneBase)
 {
-    vec4 translation = texture2D(u_bones, vec2(0.0f, a_boneIndex) / u_bonesSize);
-    vec4 rotation = texture2D(u_bones, vec2(1.0f, a_boneIndex) / u_bonesSize);
-    return vec4(rotate_by_quat(pos, rotation) + translation.xyz, 1.0);
+    // Bones are stored row after row, with two texels per bone.
+    float bonesPerRow = u_bonesSize.x * 0.5;
+    float bone = boneBase + a_boneIndex;
+    float row = floor((bone + 0.5) / bonesPerRow);
+    float column = (bone - row * bonesPerRow) * 2.0;
+    vec4 d0 = texture2D(u_bones, vec2(column + 0.5, row + 0.5) / u_bonesSize);
+    vec4 d1 = texture2D(u_bones, vec2(column + 1.5, row + 0.5) / u_bonesSize);
+    return vec4(transform_by_dual_quat(pos, d0, d1), 1.0);
 }
 
 void main()
 {
-    vec4 viewPos = u_modelViewMatrix * skin(a_position);
+    mat4 modelView = (u_instanced > 0) ? a_modelViewMatrix : u_modelViewMatrix;
+    float boneBase = (u_instanced > 0) ? a_boneBase : u_boneBase;
+    vec4 viewPos = modelView * skin(a_position, boneBase);
     gl_Position = u_projectionMatrix * viewPos;
     
     // Transform texture coordinates if using the material map.
-    float baseTex = a_texCoords.z - 1.0;
-    vec2 baseTexCoords = a_texCoords.xy;
+    float baseTex = a_texLayer;
+    vec2 baseTexCoords = a_texCoords * TEX_COORD_SCALE;
     vec3 matInfo = u_materialSlotMap[int(baseTex)];
     vec2 mappedTexCoords = baseTexCoords * matInfo.xy;
     float mappedTex = matInfo.z - 1.0;
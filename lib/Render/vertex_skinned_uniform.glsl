@@ -15,8 +15,9 @@
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 attribute vec3 a_position;
-attribute vec3 a_normal;
-attribute vec3 a_texCoords;
+attribute vec2 a_normal; // octahedral encoding
+attribute vec2 a_texCoords; // 8.8 fixed-point
+attribute float a_texLayer;
 attribute vec4 a_color;
 attribute float a_boneIndex; // to be compatible with OpenGL < 3.0
 
@@ -32,39 +33,25 @@ uniform float u_fogDensity;
 
 uniform vec4 u_bones[512];
 
+const float TEX_COORD_SCALE = 1.0 / 256.0;
+
 varying vec3 v_color;
 varying float v_texFactor;
 varying vec3 v_texCoords;
 varying float v_fogFactor;
 
-// http://qt.gitorious.org/qt/qt/blobs/raw/4.7/src/gui/math3d/qquaternion.h
-vec4 mult_quat(vec4 q1, vec4 q2)
-{
-    float ww = (q1.z + q1.x) * (q2.x + q2.y);
-    float yy = (q1.w - q1.y) * (q2.w + q2.z);
-    float zz = (q1.w + q1.y) * (q2.w - q2.z);
-    float xx = ww + yy + zz;
-    float qq = 0.5 * (xx + (q1.z - q1.x) * (q2.x - q2.y));
-
-    float w = qq - ww + (q1.z - q1.y) * (q2.y - q2.z);
-    float x = qq - xx + (q1.x + q1.w) * (q2.x + q2.w);
-    float y = qq - yy + (q1.w - q1.x) * (q2.y + q2.z);
-    float z = qq - zz + (q1.z + q1.y) * (q2.w - q2.x);
-    return vec4(x, y, z, w);
-}
-
-// rotate the point v by the quaternion q
-vec3 rotate_by_quat(vec3 v, vec4 q)
+// transform the point v by the unit dual quaternion (d0, d1)
+vec3 transform_by_dual_quat(vec3 v, vec4 d0, vec4 d1)
 {
-    return vec3(mult_quat(mult_quat(q, vec4(v, 0.0)), vec4(-q.x, -q.y, -q.z, q.w)));
+    vec3 rotated = v + 2.0 * cross(d0.xyz, cross(d0.xyz, v) + d0.w * v);
+    vec3 trans = 2.0 * (d0.w * d1.xyz - d1.w * d0.xyz + cross(d0.xyz, d1.xyz));
+    return rotated + trans;
 }
 
 vec4 skin(vec3 pos)
 {
     int i = int(a_boneIndex) * 2;
-    vec4 trans = u_bones[i];
-    vec4 rot = u_bones[i + 1];
-    return vec4(rotate_by_quat(pos, rot) + trans.xyz, 1.0);
+    return vec4(transform_by_dual_quat(pos, u_bones[i], u_bones[i + 1]), 1.0);
 }
 
 void main()
@@ -73,8 +60,8 @@ void main()
     gl_Position = u_projectionMatrix * viewPos;
     
     // Transform texture coordinates if using the material map.
-    float baseTex = a_texCoords.z - 1.0;
-    vec2 baseTexCoords = a_texCoords.xy;
+    float baseTex = a_texLayer;
+    vec2 baseTexCoords = a_texCoords * TEX_COORD_SCALE;
     vec3 matInfo = u_materialSlotMap[int(baseTex)];
     vec2 mappedTexCoords = baseTexCoords * matInfo.xy;
     float mappedTex = matInfo.z - 1.0;
@@ -176,7 +176,7 @@ void CharacterViewerWindow::loadActor(QString name)
 
 void CharacterViewerWindow::loadPalette(QString name)
 {
-    m_scene->actor()->setPaletteName(name);
+    m_scene->actor()->setSkin(name.toUInt());
     updateLists();
 }
 
@@ -262,7 +262,9 @@ void CharacterViewerWindow::updateLists()
         foreach(WLDModelSkin *skin, charModel->skins())
             m_paletteText->addItem(skin->name());
         m_actorText->setCurrentIndex(m_actorText->findText(m_scene->selectedModelName()));
-        m_paletteText->setCurrentIndex(m_paletteText->findText(m_scene->actor()->paletteName()));
+        WLDModelSkin *currentSkin = charModel->skin(m_scene->actor()->skinID());
+        if(currentSkin)
+            m_paletteText->setCurrentIndex(m_paletteText->findText(currentSkin->name()));
         m_animationText->setCurrentIndex(m_animationText->findText(m_scene->selectedAnimName()));
     }
     m_actorText->setEnabled(m_actorText->count() > 1);
@@ -377,7 +379,7 @@ void CharacterScene::setSelectedModelName(QString name)
 {
     WLDModel *model = m_game->findCharacter(name, m_renderCtx);
     m_player->setModel(model);
-    m_player->setPaletteName("00");
+    m_player->setSkin(0);
     setSelectedAnimName("POS");
     m_meshName = name;
 }
@@ -458,7 +460,6 @@ void CharacterScene::drawFrame()
     
     if(m_player->model())
     {
-        m_player->setSkin(m_player->paletteName().toUInt());
         m_player->setAnimTime(currentTime());
         m_player->draw(m_renderCtx, prog);
     }
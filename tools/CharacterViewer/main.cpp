@@ -54,7 +54,7 @@ void initCharViewer(CharacterViewerWindow *v)
         WLDModel *charModel = charActor->model();
         charModel->skeleton()->copyAnimationsFrom(skelActor->model()->skeleton());
         charActor->setAnimName("P01");
-        //charActor->setPaletteName("03");
+        //charActor->setSkin(3);
     }*/
 }
 
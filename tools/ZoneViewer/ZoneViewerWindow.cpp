@@ -115,6 +115,12 @@ void ZoneViewerWindow::initMenus()
     m_cullZoneObjectsAction = new QAction("Frustum Culling of Zone Objects", this);
     m_cullZoneObjectsAction->setCheckable(true);
     m_cullZoneObjectsAction->setChecked(m_scene->game()->cullObjects());
+    m_usePVSAction = new QAction("Region Visibility Culling", this);
+    m_usePVSAction->setCheckable(true);
+    m_usePVSAction->setChecked(m_scene->game()->usePVS());
+    m_occlusionCullingAction = new QAction("Occlusion Culling", this);
+    m_occlusionCullingAction->setCheckable(true);
+    m_occlusionCullingAction->setChecked(m_scene->game()->occlusionCulling());
     m_showSoundTriggersAction = new QAction("Show Sound Triggers", this);
     m_showSoundTriggersAction->setCheckable(true);
 
@@ -128,6 +134,8 @@ void ZoneViewerWindow::initMenus()
     renderMenu->addAction(m_showZoneAction);
     renderMenu->addAction(m_showZoneObjectsAction);
     renderMenu->addAction(m_cullZoneObjectsAction);
+    renderMenu->addAction(m_usePVSAction);
+    renderMenu->addAction(m_occlusionCullingAction);
     renderMenu->addAction(m_showFogAction);
     renderMenu->addAction(m_showSoundTriggersAction);
 
@@ -151,6 +159,8 @@ void ZoneViewerWindow::initMenus()
     connect(m_showZoneObjectsAction, SIGNAL(toggled(bool)), m_scene, SLOT(showZoneObjects(bool)));
     connect(m_showFogAction, SIGNAL(toggled(bool)), m_scene, SLOT(showFog(bool)));
     connect(m_cullZoneObjectsAction, SIGNAL(toggled(bool)), m_scene, SLOT(setFrustumCulling(bool)));
+    connect(m_usePVSAction, SIGNAL(toggled(bool)), m_scene, SLOT(setRegionCulling(bool)));
+    connect(m_occlusionCullingAction, SIGNAL(toggled(bool)), m_scene, SLOT(setOcclusionCulling(bool)));
     connect(m_showSoundTriggersAction, SIGNAL(toggled(bool)), m_scene, SLOT(showSoundTriggers(bool)));
 }
 
@@ -309,6 +319,16 @@ void ZoneScene::setFrustumCulling(bool enabled)
     m_game->setCullObjects(enabled);
 }
 
+void ZoneScene::setRegionCulling(bool enabled)
+{
+    m_game->setUsePVS(enabled);
+}
+
+void ZoneScene::setOcclusionCulling(bool enabled)
+{
+    m_game->setOcclusionCulling(enabled);
+}
+
 void ZoneScene::showSoundTriggers(bool show)
 {
     m_game->setShowSoundTriggers(show);
@@ -71,6 +71,8 @@ private:
     QAction *m_showZoneObjectsAction;
     QAction *m_showFogAction;
     QAction *m_cullZoneObjectsAction;
+    QAction *m_usePVSAction;
+    QAction *m_occlusionCullingAction;
     QAction *m_showSoundTriggersAction;
 };
 
@@ -102,6 +104,8 @@ public slots:
     void showZoneObjects(bool show);
     void showFog(bool show);
     void setFrustumCulling(bool enabled);
+    void setRegionCulling(bool enabled);
+    void setOcclusionCulling(bool enabled);
     void showSoundTriggers(bool show);
 
 private:
@@ -0,0 +1,88 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include "EQuilibre/Game/ActorStore.h"
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+int benchActors(const QStringList &args)
+{
+    const int actorCount = intArg(args, 0, 50000);
+    const int ticks = intArg(args, 1, 600);
+    const float dt = 1.0f / 60.0f;
+    const float zoneSize = 4000.0f;
+    
+    // Spread the actors randomly over the zone.
+    srand(42);
+    ActorStore store;
+    for(int i = 0; i < actorCount; i++)
+    {
+        uint32_t handle = store.create();
+        store.position(handle) = vec3(randomFloat(-zoneSize, zoneSize),
+                                      randomFloat(-zoneSize, zoneSize),
+                                      randomFloat(-50.0f, 50.0f));
+        store.orientation(handle) = vec3(0.0f, 0.0f, randomFloat(0.0f, 360.0f));
+        store.velocity(handle) = vec3(randomFloat(-10.0f, 10.0f), randomFloat(-10.0f, 10.0f), 0.0f);
+        store.animationTime(handle) = randomFloat(0.0f, 2.0f);
+        store.skinID(handle) = rand() % 4;
+        store.radius(handle) = 3.0f;
+        store.height(handle) = 6.0f;
+    }
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(1000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    
+    BenchTimer moveTimer("movement");
+    BenchTimer animTimer("animation");
+    BenchTimer cullTimer("culling");
+    BenchTimer tickTimer("tick");
+    QVector<uint32_t> visible;
+    uint64_t totalVisible = 0;
+    for(int i = 0; i < ticks; i++)
+    {
+        // Rotate the camera around the center of the zone.
+        float angle = (float)i / ticks * 6.2831853f;
+        frustum.setEye(vec3(0.0, 0.0, 20.0));
+        frustum.setFocus(vec3(cos(angle), sin(angle), 20.0));
+        frustum.update();
+        
+        tickTimer.begin();
+        moveTimer.begin();
+        store.updateMovement(dt);
+        moveTimer.end();
+        animTimer.begin();
+        store.updateAnimations(dt);
+        animTimer.end();
+        cullTimer.begin();
+        visible.clear();
+        store.findVisible(frustum, visible);
+        cullTimer.end();
+        tickTimer.end();
+        totalVisible += visible.count();
+    }
+    
+    fprintf(stdout, "%d actors, %d ticks, %.1f visible actors on average\n",
+            actorCount, ticks, (double)totalVisible / qMax(ticks, 1));
+    moveTimer.report();
+    animTimer.report();
+    cullTimer.report();
+    tickTimer.report();
+    return 0;
+}
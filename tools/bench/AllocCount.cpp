@@ -0,0 +1,83 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cstdlib>
+#include <new>
+#include "Bench.h"
+
+static uint64_t heapAllocationCount = 0;
+
+/*!
+  \brief Number of heap allocations made by the process so far.
+  */
+uint64_t heapAllocations()
+{
+    return heapAllocationCount;
+}
+
+#if defined(__GLIBC__)
+// Interpose the C allocator, which Qt containers and operator new use.
+extern "C"
+{
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void *p, size_t size);
+
+void * malloc(size_t size)
+{
+    heapAllocationCount++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+    heapAllocationCount++;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void *p, size_t size)
+{
+    heapAllocationCount++;
+    return __libc_realloc(p, size);
+}
+}
+#else
+// Only allocations made through operator new can be counted.
+void * operator new(size_t size) throw(std::bad_alloc)
+{
+    heapAllocationCount++;
+    void *p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new[](size_t size) throw(std::bad_alloc)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    free(p);
+}
+#endif
@@ -0,0 +1,344 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QSet>
+#include <QVector>
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+static const float CellSizes[] = {0.0f, 32.0f, 64.0f, 128.0f, 256.0f, 512.0f};
+static const int CellSizeCount = sizeof(CellSizes) / sizeof(float);
+
+struct BenchObject
+{
+    AABox bounds;
+    uint32_t mesh;
+    uint32_t triangles;
+};
+
+/*!
+  \brief Culling unit: either one object or the objects of a cell.
+  */
+class CellActor : public WLDActor
+{
+public:
+    CellActor(uint32_t id) : WLDActor(Static)
+    {
+        this->id = id;
+        meshCount = 0;
+        triangles = 0;
+    }
+    
+    void addObject(uint32_t index, const BenchObject &obj)
+    {
+        if(objects.isEmpty())
+            m_boundsAA = obj.bounds;
+        else
+            m_boundsAA.extendTo(obj.bounds);
+        m_location = m_boundsAA.center();
+        objects.append(index);
+        triangles += obj.triangles;
+        if(!meshes.contains(obj.mesh))
+        {
+            meshes.insert(obj.mesh);
+            meshCount++;
+        }
+    }
+    
+    uint32_t id;
+    QVector<uint32_t> objects;
+    QSet<uint32_t> meshes;
+    uint32_t meshCount;
+    uint32_t triangles;
+};
+
+static void createObjects(QVector<BenchObject> &objects, int count)
+{
+    // Place props in clusters, each cluster using a few of the zone's meshes.
+    const float zoneSize = 3000.0f;
+    const uint32_t meshCount = 40;
+    srand(42);
+    vec3 cluster;
+    uint32_t clusterMeshes[4] = {0, 0, 0, 0};
+    for(int i = 0; i < count; i++)
+    {
+        if((i % 50) == 0)
+        {
+            cluster = vec3(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize),
+                           randomFloat(-100.0f, 100.0f));
+            for(int j = 0; j < 4; j++)
+                clusterMeshes[j] = rand() % meshCount;
+        }
+        vec3 pos = cluster + vec3(randomFloat(-200.0f, 200.0f), randomFloat(-200.0f, 200.0f),
+                                  randomFloat(-10.0f, 10.0f));
+        BenchObject obj;
+        obj.mesh = clusterMeshes[rand() % 4];
+        float size = (obj.mesh % 10) ? (2.0f + (obj.mesh % 8)) : (20.0f + obj.mesh);
+        obj.triangles = 20 + (obj.mesh * 37) % 400;
+        vec3 extent(size, size, size);
+        obj.bounds = AABox(pos - extent, pos + extent);
+        objects.append(obj);
+    }
+}
+
+static void createFlyThrough(const AABox &bounds, int count, QVector<vec3> &eyes,
+                             QVector<float> &yaws)
+{
+    // Fly through the zone at mid-height, turning slowly.
+    srand(7);
+    vec3 center = bounds.center(), extent = (bounds.high - bounds.low) * 0.5f;
+    vec3 pos = center;
+    float yaw = 0.0f;
+    for(int i = 0; i < count; i++)
+    {
+        yaw += randomFloat(-5.0f, 5.0f);
+        float angle = yaw * (float)(M_PI / 180.0);
+        vec3 next = pos + vec3(cos(angle), sin(angle), 0.0f) * 10.0f;
+        if((fabs(next.x - center.x) > extent.x) || (fabs(next.y - center.y) > extent.y))
+            yaw += 180.0f;
+        else
+            pos = next;
+        eyes.append(pos);
+        yaws.append(yaw);
+    }
+}
+
+static void setCamera(Frustum &frustum, const vec3 &eye, float yaw)
+{
+    float angle = yaw * (float)(M_PI / 180.0);
+    frustum.setEye(eye);
+    frustum.setFocus(eye + vec3(cos(angle), sin(angle), 0.0f));
+    frustum.update();
+}
+
+/*!
+  \brief Check that cells only group small objects that share a cell, and
+  that every object is in exactly one culling unit.
+  */
+static int checkCells(const QVector<BenchObject> &objects, const QVector<uint32_t> &cells,
+                      uint32_t cellCount, float cellSize)
+{
+    int errors = 0;
+    QVector<int> cellObjects(cellCount);
+    QVector<vec3> cellOrigins(cellCount);
+    for(int i = 0; i < objects.count(); i++)
+    {
+        uint32_t cell = cells[i];
+        if(cell == WLDBatchActor::NoCell)
+            continue;
+        if(cell >= cellCount)
+        {
+            errors++;
+            continue;
+        }
+        const AABox &bb = objects[i].bounds;
+        vec3 size = bb.high - bb.low, center = bb.center();
+        if(qMax(qMax(size.x, size.y), size.z) > cellSize)
+            errors++;
+        vec3 origin(floor(center.x / cellSize), floor(center.y / cellSize),
+                    floor(center.z / cellSize));
+        if(cellObjects[cell] == 0)
+            cellOrigins[cell] = origin;
+        else if((origin.x != cellOrigins[cell].x) || (origin.y != cellOrigins[cell].y) ||
+                (origin.z != cellOrigins[cell].z))
+            errors++;
+        cellObjects[cell]++;
+    }
+    for(uint32_t i = 0; i < cellCount; i++)
+    {
+        if(cellObjects[i] < 2)
+            errors++;
+    }
+    return errors;
+}
+
+static int benchSyntheticCells(int frames)
+{
+    QVector<BenchObject> objects;
+    createObjects(objects, 10000);
+    AABox bounds = objects[0].bounds;
+    QVector<AABox> objectBounds;
+    foreach(BenchObject obj, objects)
+    {
+        bounds.extendTo(obj.bounds);
+        objectBounds.append(obj.bounds);
+    }
+    QVector<vec3> eyes;
+    QVector<float> yaws;
+    createFlyThrough(bounds, frames, eyes, yaws);
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(1000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    fprintf(stdout, "%d objects, %d frames\n", objects.count(), frames);
+    fprintf(stdout, "%6s %6s %6s %8s %8s %8s %8s %8s %10s %8s\n", "cell", "units", "cells",
+            "visible", "objects", "exact", "packets", "draws", "triangles", "cull ms");
+    int errors = 0;
+    for(int c = 0; c < CellSizeCount; c++)
+    {
+        float cellSize = CellSizes[c];
+        QVector<uint32_t> cells(objects.count());
+        uint32_t cellCount = WLDBatchActor::findCells(objectBounds.constData(), objects.count(),
+                                                      cellSize, cells.data());
+        errors += checkCells(objects, cells, cellCount, cellSize);
+        
+        // One culling unit per cell and per object left out of the cells.
+        QVector<CellActor *> units(cellCount);
+        QVector<WLDActor *> actors;
+        QVector<uint32_t> objectUnits(objects.count());
+        for(uint32_t i = 0; i < cellCount; i++)
+            units[i] = new CellActor(i);
+        for(int i = 0; i < objects.count(); i++)
+        {
+            if(cells[i] == WLDBatchActor::NoCell)
+            {
+                objectUnits[i] = units.count();
+                units.append(new CellActor(units.count()));
+            }
+            else
+            {
+                objectUnits[i] = cells[i];
+            }
+            units[objectUnits[i]]->addObject(i, objects[i]);
+        }
+        foreach(CellActor *unit, units)
+            actors.append(unit);
+        LinearOctree tree(8);
+        tree.build(actors);
+        
+        BenchTimer cullTimer("cull");
+        QVector<uint32_t> visible(tree.actorCount());
+        QVector<int> unitFrames(units.count());
+        QSet<uint32_t> singleMeshes;
+        uint64_t visibleUnits = 0, drawnObjects = 0, exactObjects = 0;
+        uint64_t packets = 0, draws = 0, triangles = 0;
+        for(int i = 0; i < frames; i++)
+        {
+            setCamera(frustum, eyes[i], yaws[i]);
+            cullTimer.begin();
+            uint32_t found = tree.findVisible(frustum, visible.data(), true);
+            cullTimer.end();
+            
+            // Objects drawn one by one are merged with other objects that use
+            // the same mesh, batches are drawn with one packet per mesh.
+            singleMeshes.clear();
+            visibleUnits += found;
+            for(uint32_t j = 0; j < found; j++)
+            {
+                CellActor *unit = static_cast<CellActor *>(tree.actor(visible[j]));
+                unitFrames[unit->id] = i + 1;
+                drawnObjects += unit->objects.count();
+                packets += unit->meshCount;
+                triangles += unit->triangles;
+                if(unit->objects.count() == 1)
+                    singleMeshes.insert(objects[unit->objects[0]].mesh);
+                else
+                    draws += unit->meshCount;
+            }
+            draws += singleMeshes.count();
+            
+            // Every object in the frustum must be drawn.
+            for(int j = 0; j < objects.count(); j++)
+            {
+                if(frustum.containsAABox(objects[j].bounds) == OUTSIDE)
+                    continue;
+                exactObjects++;
+                if(unitFrames[objectUnits[j]] != (i + 1))
+                    errors++;
+            }
+        }
+        
+        double n = qMax(frames, 1);
+        fprintf(stdout, "%6.0f %6d %6d %8.1f %8.1f %8.1f %8.1f %8.1f %10.0f %8.3f\n",
+                cellSize, units.count(), cellCount, visibleUnits / n, drawnObjects / n,
+                exactObjects / n, packets / n, draws / n, triangles / n,
+                cullTimer.average() * 1000.0);
+        foreach(CellActor *unit, units)
+            delete unit;
+    }
+    return reportErrors(errors);
+}
+
+static int benchZoneCells(int frames, QString assetDir, QString zoneName)
+{
+    fprintf(stdout, "%6s %6s %6s %8s %8s %8s %8s\n", "cell", "units", "cells",
+            "visible", "objects", "packets", "cull ms");
+    for(int c = 0; c < CellSizeCount; c++)
+    {
+        float cellSize = CellSizes[c];
+        Game game;
+        game.setObjectCellSize(cellSize);
+        Zone zone(&game);
+        if(!loadBenchZone(zone, assetDir, zoneName))
+            return 1;
+        ZoneObjects *objects = zone.objects();
+        QVector<vec3> eyes;
+        QVector<float> yaws;
+        createFlyThrough(zone.terrain()->bounds(), frames, eyes, yaws);
+        
+        Frustum frustum;
+        frustum.setAspect(16.0f / 9.0f);
+        frustum.setFarPlane(1000.0f);
+        frustum.setUp(vec3(0.0, 0.0, 1.0));
+        BenchTimer cullTimer("cull");
+        uint64_t visibleUnits = 0, drawnObjects = 0, packets = 0;
+        for(int i = 0; i < frames; i++)
+        {
+            setCamera(frustum, eyes[i], yaws[i]);
+            cullTimer.begin();
+            zone.cull(frustum);
+            cullTimer.end();
+            const QVector<WLDBatchActor *> &batches = objects->visibleBatches();
+            visibleUnits += objects->visibleObjects().count() + batches.count();
+            drawnObjects += objects->visibleObjects().count();
+            packets += objects->visibleObjects().count();
+            foreach(WLDBatchActor *batch, batches)
+            {
+                drawnObjects += batch->objects().count();
+                packets += batch->parts().count();
+            }
+        }
+        
+        double n = qMax(frames, 1);
+        QVector<WLDActor *> actors;
+        objects->addTo(actors);
+        fprintf(stdout, "%6.0f %6d %6d %8.1f %8.1f %8.1f %8.3f\n",
+                cellSize, actors.count(), objects->batches().count(), visibleUnits / n,
+                drawnObjects / n, packets / n, cullTimer.average() * 1000.0);
+        zone.clear(NULL);
+    }
+    return 0;
+}
+
+/*!
+  \brief Compare culling and draw counts of zone objects merged into cells of
+  several sizes, along a camera path flying through the zone (or through
+  random objects). Packets are the draws without instancing, while draws
+  count objects that use the same mesh as one instanced draw.
+  */
+int benchBatching(const QStringList &args)
+{
+    const int frames = intArg(args, 0, 1000);
+    if(args.count() >= 3)
+        return benchZoneCells(frames, args[1], args[2]);
+    return benchSyntheticCells(frames);
+}
@@ -0,0 +1,87 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdio>
+#include <cstdlib>
+#include <QStringList>
+#include "EQuilibre/Game/Zone.h"
+#include "Bench.h"
+
+BenchTimer::BenchTimer(QString name)
+{
+    m_name = name;
+    m_start = 0.0;
+    m_total = 0.0;
+    m_max = 0.0;
+    m_runs = 0;
+}
+
+void BenchTimer::begin()
+{
+    m_start = currentTime();
+}
+
+void BenchTimer::end()
+{
+    double duration = currentTime() - m_start;
+    m_total += duration;
+    m_max = qMax(m_max, duration);
+    m_runs++;
+}
+
+double BenchTimer::average() const
+{
+    return (m_runs > 0) ? (m_total / m_runs) : 0.0;
+}
+
+void BenchTimer::report() const
+{
+    fprintf(stdout, "%-24s avg %8.3f ms  max %8.3f ms  (%d runs)\n",
+            m_name.toLatin1().constData(), average() * 1000.0, m_max * 1000.0, m_runs);
+}
+
+int intArg(const QStringList &args, int index, int defaultValue)
+{
+    bool ok = false;
+    int value = args.value(index).toInt(&ok);
+    return ok ? value : defaultValue;
+}
+
+float randomFloat(float low, float high)
+{
+    return low + (high - low) * ((float)rand() / (float)RAND_MAX);
+}
+
+/*!
+  \brief Load a zone for a benchmark, reporting it if it could not be loaded.
+  */
+bool loadBenchZone(Zone &zone, const QString &assetDir, const QString &zoneName)
+{
+    if(zone.load(assetDir, zoneName))
+        return true;
+    fprintf(stderr, "could not load zone '%s'\n", zoneName.toLatin1().constData());
+    return false;
+}
+
+/*!
+  \brief Print the number of errors found by a benchmark.
+  \return Exit code of the benchmark.
+  */
+int reportErrors(int errors)
+{
+    fprintf(stdout, "%d errors\n", errors);
+    return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#ifndef EQUILIBRE_BENCH_H
+#define EQUILIBRE_BENCH_H
+
+#include <QStringList>
+#include "EQuilibre/Render/Platform.h"
+
+class Zone;
+
+// Headless benchmarks. Each one returns the process exit code.
+int benchActors(const QStringList &args);
+int benchBatching(const QStringList &args);
+int benchChunks(const QStringList &args);
+int benchCommands(const QStringList &args);
+int benchGLState(const QStringList &args);
+int benchIndices(const QStringList &args);
+int benchLOD(const QStringList &args);
+int benchMath(const QStringList &args);
+int benchMeshPool(const QStringList &args);
+int benchOctree(const QStringList &args);
+int benchPalette(const QStringList &args);
+int benchPVS(const QStringList &args);
+int benchZoneCull(const QStringList &args);
+int benchRegions(const QStringList &args);
+int benchMovingActors(const QStringList &args);
+int benchCull(const QStringList &args);
+int benchOcclusion(const QStringList &args);
+int benchSortKeys(const QStringList &args);
+int benchTerrain(const QStringList &args);
+int benchVertex(const QStringList &args);
+int benchVertexCache(const QStringList &args);
+
+/*!
+  \brief Measure the average duration of a block of code over several runs.
+  */
+class BenchTimer
+{
+public:
+    BenchTimer(QString name);
+    void begin();
+    void end();
+    double average() const;
+    void report() const;
+
+private:
+    QString m_name;
+    double m_start;
+    double m_total;
+    double m_max;
+    int m_runs;
+};
+
+int intArg(const QStringList &args, int index, int defaultValue);
+float randomFloat(float low, float high);
+bool loadBenchZone(Zone &zone, const QString &assetDir, const QString &zoneName);
+int reportErrors(int errors);
+uint64_t heapAllocations();
+
+#endif
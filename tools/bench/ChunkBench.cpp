@@ -0,0 +1,387 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Game/Fragments.h"
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/WLDModel.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+static const uint32_t TargetTriangles[] = {256, 512, 1024, 2048, 4096};
+static const int TargetCount = sizeof(TargetTriangles) / sizeof(uint32_t);
+
+/*!
+  \brief Zone-like set of regions: a BSP tree of the zone split along the
+  largest axis, with the bounds and triangle count of each region.
+  */
+struct ChunkZone
+{
+    QVector<RegionTreeNode> nodes;
+    AABoxArray bounds;
+    QVector<uint32_t> triangles;
+    uint32_t regionCount;
+    uint32_t wordCount;
+    QVector<uint32_t> pvsBits;
+};
+
+static void createZone(ChunkZone &zone, int regionCount)
+{
+    // Split boxes breadth-first until there are enough leaves.
+    AABox zoneBounds(vec3(-2000.0f, -2000.0f, -200.0f), vec3(2000.0f, 2000.0f, 200.0f));
+    RegionTreeNode empty = {vec3(), 0.0f, 0, 0, 0};
+    QVector<AABox> boxes;
+    zone.nodes.append(empty);
+    boxes.append(zoneBounds);
+    int leaves = 1;
+    for(int q = 0; leaves < regionCount; q++)
+    {
+        AABox box = boxes[q];
+        vec3 size = box.high - box.low;
+        int axis = (size.x > size.y) ? ((size.x > size.z) ? 0 : 2) : ((size.y > size.z) ? 1 : 2);
+        vec3 normal;
+        ((float *)&normal)[axis] = 1.0f;
+        float split = ((float *)&box.low)[axis] + ((float *)&size)[axis] * randomFloat(0.3f, 0.7f);
+        zone.nodes[q].normal = normal;
+        zone.nodes[q].distance = -split;
+        AABox front = box, back = box;
+        ((float *)&front.low)[axis] = split;
+        ((float *)&back.high)[axis] = split;
+        zone.nodes.append(empty);
+        boxes.append(front);
+        zone.nodes[q].left = zone.nodes.count();
+        zone.nodes.append(empty);
+        boxes.append(back);
+        zone.nodes[q].right = zone.nodes.count();
+        leaves++;
+    }
+    
+    // Number the leaves. A few more regions are not in the tree at all.
+    uint32_t regionID = 1;
+    for(int i = 0; i < zone.nodes.count(); i++)
+    {
+        if(zone.nodes[i].left == 0)
+            zone.nodes[i].regionID = regionID++;
+    }
+    uint32_t treeRegions = regionID - 1;
+    zone.regionCount = treeRegions + (treeRegions / 64);
+    zone.bounds.resize(zone.regionCount + 1);
+    zone.triangles.fill(0, zone.regionCount + 1);
+    for(int i = 0; i < zone.nodes.count(); i++)
+    {
+        uint32_t id = zone.nodes[i].regionID;
+        if(id == 0)
+            continue;
+        // Geometry only fills part of a region, many regions are empty.
+        AABox box = boxes[i];
+        vec3 size = box.high - box.low;
+        box.high.z = box.low.z + size.z * randomFloat(0.1f, 0.5f);
+        zone.bounds.set(id, box);
+        if((rand() % 4) != 0)
+            zone.triangles[id] = (rand() % 8 == 0) ? (200 + rand() % 3000) : (2 + rand() % 120);
+    }
+    for(uint32_t id = treeRegions + 1; id <= zone.regionCount; id++)
+    {
+        vec3 p(randomFloat(-2000.0f, 2000.0f), randomFloat(-2000.0f, 2000.0f), 0.0f);
+        zone.bounds.set(id, AABox(p, p + vec3(20.0f, 20.0f, 20.0f)));
+        zone.triangles[id] = 2 + rand() % 60;
+    }
+    
+    // Each region sees the regions within some distance.
+    zone.wordCount = (zone.regionCount + 32) / 32;
+    zone.pvsBits.fill(0, (zone.regionCount + 1) * zone.wordCount);
+    for(uint32_t i = 1; i <= zone.regionCount; i++)
+    {
+        uint32_t *bits = zone.pvsBits.data() + (i * zone.wordCount);
+        vec3 center = zone.bounds.at(i).center();
+        float range = randomFloat(200.0f, 1200.0f);
+        for(uint32_t j = 1; j <= zone.regionCount; j++)
+        {
+            if((i == j) || ((zone.bounds.at(j).center() - center).lengthSquared() < (range * range)))
+                bits[j / 32] |= (1u << (j % 32));
+        }
+    }
+}
+
+static void loadZone(ChunkZone &zone, ZoneTerrain *terrain)
+{
+    zone.regionCount = terrain->regionCount();
+    zone.bounds.resize(zone.regionCount + 1);
+    zone.triangles.fill(0, zone.regionCount + 1);
+    for(uint32_t i = 1; i <= zone.regionCount; i++)
+    {
+        WLDStaticActor *actor = terrain->regionActor(i);
+        if(!actor)
+            continue;
+        zone.bounds.set(i, actor->boundsAA());
+        zone.triangles[i] = actor->mesh()->def()->m_indices.count() / 3;
+    }
+    const RegionPVS &pvs = terrain->pvs();
+    zone.wordCount = pvs.wordCount();
+    zone.pvsBits.resize((zone.regionCount + 1) * zone.wordCount);
+    for(uint32_t i = 0; i < (zone.regionCount + 1) * zone.wordCount; i++)
+        zone.pvsBits[i] = pvs.bits(0)[i];
+}
+
+static float largestExtent(const AABox &b)
+{
+    vec3 extent = b.high - b.low;
+    return qMax(extent.x, qMax(extent.y, extent.z));
+}
+
+static bool sameChunks(const TerrainChunks &a, const TerrainChunks &b, uint32_t regionCount)
+{
+    if(a.count() != b.count())
+        return false;
+    for(uint32_t i = 0; i < a.count(); i++)
+    {
+        const TerrainChunk &ca = a.chunk(i), &cb = b.chunk(i);
+        if((ca.firstRegion != cb.firstRegion) || (ca.regionCount != cb.regionCount) ||
+            (ca.triangleCount != cb.triangleCount))
+            return false;
+        for(uint32_t j = 0; j < ca.regionCount; j++)
+        {
+            if(a.regions()[ca.firstRegion + j] != b.regions()[cb.firstRegion + j])
+                return false;
+        }
+    }
+    for(uint32_t i = 1; i <= regionCount; i++)
+    {
+        if(a.chunkOf(i) != b.chunkOf(i))
+            return false;
+    }
+    return true;
+}
+
+/*!
+  \brief Check the chunks built from the zone's regions: every region with
+  triangles is in exactly one chunk, chunks respect the limits unless they
+  hold a single region, the bounds and triangle counts are right and the
+  chunk PVS is exactly the union of the region PVS.
+  */
+static int checkChunks(const ChunkZone &zone, const RegionTree &tree,
+                       const TerrainChunks &chunks, uint32_t target, float maxSize)
+{
+    int errors = 0;
+    QVector<int> seen(zone.regionCount + 1, 0);
+    for(uint32_t i = 0; i < chunks.count(); i++)
+    {
+        const TerrainChunk &chunk = chunks.chunk(i);
+        uint32_t triangles = 0;
+        for(uint32_t j = 0; j < chunk.regionCount; j++)
+        {
+            uint32_t regionID = chunks.regions()[chunk.firstRegion + j];
+            seen[regionID]++;
+            triangles += zone.triangles[regionID];
+            errors += (chunks.chunkOf(regionID) != i);
+            errors += !chunk.bounds.contains(zone.bounds.at(regionID));
+        }
+        errors += (triangles != chunk.triangleCount);
+        if(chunk.regionCount > 1)
+        {
+            errors += (chunk.triangleCount > target);
+            errors += (largestExtent(chunk.bounds) > maxSize);
+        }
+    }
+    for(uint32_t i = 1; i <= zone.regionCount; i++)
+    {
+        int expected = (zone.triangles[i] > 0) ? 1 : 0;
+        errors += (seen[i] != expected);
+        errors += ((expected == 0) && (chunks.chunkOf(i) != TerrainChunks::NoChunk));
+    }
+    
+    // Building again must give the same chunks.
+    TerrainChunks again;
+    again.build(tree, zone.bounds, zone.triangles.constData(), zone.regionCount, target, maxSize);
+    errors += !sameChunks(chunks, again, zone.regionCount);
+    
+    QVector<uint32_t> expectedBits(chunks.wordCount());
+    for(uint32_t i = 1; i <= zone.regionCount; i++)
+    {
+        const uint32_t *regionBits = zone.pvsBits.constData() + (i * zone.wordCount);
+        expectedBits.fill(0);
+        for(uint32_t j = 1; j <= zone.regionCount; j++)
+        {
+            uint32_t chunkID = chunks.chunkOf(j);
+            if((regionBits[j / 32] & (1u << (j % 32))) && (chunkID != TerrainChunks::NoChunk))
+                expectedBits[chunkID / 32] |= (1u << (chunkID % 32));
+        }
+        const uint32_t *chunkBits = chunks.pvsBits(i);
+        for(uint32_t j = 0; j < chunks.wordCount(); j++)
+            errors += (chunkBits[j] != expectedBits[j]);
+    }
+    return errors;
+}
+
+static void reportChunks(const ChunkZone &zone, const TerrainChunks &chunks,
+                         uint32_t target, int errors)
+{
+    uint32_t count = chunks.count(), regions = 0, maxTriangles = 0, totalTriangles = 0;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        regions += chunks.chunk(i).regionCount;
+        maxTriangles = qMax(maxTriangles, chunks.chunk(i).triangleCount);
+        totalTriangles += chunks.chunk(i).triangleCount;
+    }
+    double n = qMax(count, 1u);
+    fprintf(stdout, "target %5d: %5d chunks for %5d regions, %5.1f regions/chunk, "
+            "%6.0f triangles/chunk (max %5d), %d errors\n",
+            target, count, regions, regions / n, totalTriangles / n, maxTriangles, errors);
+}
+
+/*!
+  \brief Cull the regions and the chunks along a camera path with the PVS and
+  check that no visible region is left out of the visible chunks.
+  */
+static int flyThrough(const ChunkZone &zone, const RegionTree &tree,
+                      const TerrainChunks &chunks, int frames)
+{
+    AABoxArray chunkBounds;
+    chunkBounds.resize(chunks.wordCount() * 32);
+    for(uint32_t i = 0; i < chunks.count(); i++)
+        chunkBounds.set(i, chunks.chunk(i).bounds);
+    AABoxArray regionBounds;
+    regionBounds.resize(zone.wordCount * 32);
+    QVector<uint32_t> regionMask(zone.wordCount, 0);
+    vec3 low(1e9f, 1e9f, 1e9f), high(-1e9f, -1e9f, -1e9f);
+    for(uint32_t i = 1; i <= zone.regionCount; i++)
+    {
+        if(zone.triangles[i] == 0)
+            continue;
+        AABox b = zone.bounds.at(i);
+        regionBounds.set(i, b);
+        regionMask[i / 32] |= (1u << (i % 32));
+        low = vec3(qMin(low.x, b.low.x), qMin(low.y, b.low.y), qMin(low.z, b.low.z));
+        high = vec3(qMax(high.x, b.high.x), qMax(high.y, b.high.y), qMax(high.z, b.high.z));
+    }
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(2000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    BenchTimer regionTimer("cull regions");
+    BenchTimer chunkTimer("cull chunks");
+    QVector<uint32_t> mask(zone.wordCount), regionBits(zone.wordCount);
+    QVector<uint32_t> chunkBits(chunks.wordCount());
+    uint64_t regionsDrawn = 0, chunksDrawn = 0, regionTriangles = 0, chunkTriangles = 0;
+    int errors = 0;
+    for(int f = 0; f < frames; f++)
+    {
+        vec3 eye(randomFloat(low.x, high.x), randomFloat(low.y, high.y),
+                 randomFloat(low.z, high.z));
+        float angle = randomFloat(0.0f, 2.0f * (float)M_PI);
+        frustum.setEye(eye);
+        frustum.setFocus(eye + vec3(cos(angle), sin(angle), 0.0f));
+        frustum.update();
+        uint32_t current = tree.findRegion(eye);
+        if((current == 0) || (current > zone.regionCount))
+            continue;
+        
+        const uint32_t *pvs = zone.pvsBits.constData() + (current * zone.wordCount);
+        for(uint32_t i = 0; i < zone.wordCount; i++)
+            mask[i] = pvs[i] & regionMask[i];
+        regionTimer.begin();
+        frustum.findVisibleBits(regionBounds, mask.constData(), 0, zone.wordCount,
+                                regionBits.data());
+        regionTimer.end();
+        chunkTimer.begin();
+        frustum.findVisibleBits(chunkBounds, chunks.pvsBits(current), 0,
+                                chunks.wordCount(), chunkBits.data());
+        chunkTimer.end();
+        
+        for(uint32_t i = 1; i <= zone.regionCount; i++)
+        {
+            if(!(regionBits[i / 32] & (1u << (i % 32))))
+                continue;
+            regionsDrawn++;
+            regionTriangles += zone.triangles[i];
+            uint32_t chunkID = chunks.chunkOf(i);
+            errors += ((chunkID == TerrainChunks::NoChunk) ||
+                       !(chunkBits[chunkID / 32] & (1u << (chunkID % 32))));
+        }
+        for(uint32_t i = 0; i < chunks.count(); i++)
+        {
+            if(chunkBits[i / 32] & (1u << (i % 32)))
+            {
+                chunksDrawn++;
+                chunkTriangles += chunks.chunk(i).triangleCount;
+            }
+        }
+    }
+    
+    double n = qMax(frames, 1);
+    fprintf(stdout, "per frame: %.1f regions (%.0f triangles) or %.1f chunks (%.0f triangles), "
+            "%d missed regions\n", regionsDrawn / n, regionTriangles / n,
+            chunksDrawn / n, chunkTriangles / n, errors);
+    regionTimer.report();
+    chunkTimer.report();
+    return errors;
+}
+
+/*!
+  \brief Cluster zone regions into terrain chunks with several target sizes,
+  checking the chunks and comparing region and chunk culling.
+  */
+int benchChunks(const QStringList &args)
+{
+    const int regionCount = intArg(args, 0, 4000);
+    const int frames = intArg(args, 1, 500);
+    ChunkZone zone;
+    Game *game = NULL;
+    Zone *gameZone = NULL;
+    RegionTree tree;
+    srand(11);
+    if(args.count() >= 4)
+    {
+        game = new Game();
+        gameZone = new Zone(game);
+        if(!loadBenchZone(*gameZone, args[2], args[3]))
+            return 1;
+        loadZone(zone, gameZone->terrain());
+    }
+    else
+    {
+        createZone(zone, regionCount);
+        tree.build(zone.nodes);
+    }
+    const RegionTree &regionTree = gameZone ? gameZone->terrain()->regionTree() : tree;
+    
+    int errors = 0;
+    for(int i = 0; i < TargetCount; i++)
+    {
+        uint32_t target = TargetTriangles[i];
+        TerrainChunks chunks;
+        chunks.build(regionTree, zone.bounds, zone.triangles.constData(), zone.regionCount,
+                     target, TerrainChunks::DefaultMaxSize);
+        chunks.buildPVS(zone.pvsBits.constData(), zone.wordCount);
+        int chunkErrors = checkChunks(zone, regionTree, chunks, target,
+                                      TerrainChunks::DefaultMaxSize);
+        reportChunks(zone, chunks, target, chunkErrors);
+        errors += chunkErrors;
+        if(target == TerrainChunks::DefaultTargetTriangles)
+            errors += flyThrough(zone, regionTree, chunks, frames);
+    }
+    if(gameZone)
+        gameZone->clear(NULL);
+    delete gameZone;
+    delete game;
+    return reportErrors(errors);
+}
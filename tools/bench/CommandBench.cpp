@@ -0,0 +1,210 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdlib>
+#include <QVector>
+#include <QtAlgorithms>
+#include "EQuilibre/Render/CommandQueue.h"
+#include "EQuilibre/Render/Material.h"
+#include "Bench.h"
+
+static bool vec3LessThan(const vec3 &a, const vec3 &b)
+{
+    if(a.x != b.x)
+        return a.x < b.x;
+    else if(a.y != b.y)
+        return a.y < b.y;
+    return a.z < b.z;
+}
+
+/*!
+  \brief Synthetic scene: meshes that share one buffer and a few material
+  arrays, some of whose materials are transparent.
+  */
+class CommandScene
+{
+public:
+    CommandScene(int meshCount, int arrayCount);
+    ~CommandScene();
+    
+    MeshBuffer buffer;
+    QVector<MeshData *> meshes;
+    QVector<MaterialArray *> arrays;
+};
+
+CommandScene::CommandScene(int meshCount, int arrayCount)
+{
+    const int materialCount = 8;
+    for(int i = 0; i < arrayCount; i++)
+    {
+        MaterialArray *array = new MaterialArray();
+        for(int j = 0; j < materialCount; j++)
+        {
+            Material *mat = new Material();
+            mat->setOpaque(j < 6);
+            array->setMaterial(j, mat);
+        }
+        arrays.append(array);
+    }
+    for(int i = 0; i < meshCount; i++)
+    {
+        uint32_t groupCount = 1 + (rand() % 4);
+        MeshData *mesh = buffer.createMesh(groupCount);
+        mesh->indexSegment.offset = i * 1000;
+        for(uint32_t j = 0; j < groupCount; j++)
+        {
+            mesh->matGroups[j].id = j;
+            mesh->matGroups[j].offset = j * 100;
+            mesh->matGroups[j].count = 30 + (rand() % 60);
+            mesh->matGroups[j].matID = rand() % materialCount;
+        }
+        meshes.append(mesh);
+    }
+}
+
+CommandScene::~CommandScene()
+{
+    foreach(MaterialArray *array, arrays)
+        delete array;
+}
+
+int benchCommands(const QStringList &args)
+{
+    const int objectCount = intArg(args, 0, 2000);
+    const int frames = intArg(args, 1, 50);
+    const int meshCount = 60;
+    const uint32_t maxDepth = (1 << RenderQueue::DepthBits) - 1;
+    
+    srand(42);
+    CommandScene scene(meshCount, 4);
+    QVector<int> objectMeshes(objectCount);
+    for(int i = 0; i < objectCount; i++)
+        objectMeshes[i] = rand() % meshCount;
+    
+    CommandQueue queue;
+    NullBackend immediate, batched;
+    BenchTimer recordTimer("record packets");
+    BenchTimer executeTimer("sort and execute");
+    uint64_t immediateMeshes = 0, batchedMeshes = 0, batches = 0, packets = 0;
+    uint64_t immediateDraws = 0, instancedDraws = 0;
+    // The first frames fill the queue's containers and arena.
+    const int warmupFrames = 2;
+    uint64_t frameAllocs = 0;
+    int missing = 0, orderErrors = 0;
+    for(int f = 0; f < frames; f++)
+    {
+        // Record the objects in traversal order, as the zone would. The
+        // transformation encodes the object (x), pass (y) and depth (z).
+        uint64_t allocsBefore = heapAllocations();
+        recordTimer.begin();
+        queue.clear();
+        DrawPacket sky;
+        sky.meshBuf = &scene.buffer;
+        sky.materials = scene.arrays[0];
+        sky.transform = queue.addTransform(matrix4::translate(-1.0f, 0.0f, 0.0f));
+        sky.state = DrawPacket::NoDepthWrite;
+        queue.addGroups(sky, scene.meshes[0]);
+        queue.add(RenderQueue::makeKey(RenderQueue::SkyPass, 0, 0, 0, 0), sky);
+        for(int i = 0; i < objectCount; i++)
+        {
+            int meshID = objectMeshes[i];
+            int arrayID = meshID % scene.arrays.count();
+            MaterialArray *materials = scene.arrays[arrayID];
+            uint32_t depth = rand() % (maxDepth + 1);
+            for(int pass = RenderQueue::OpaquePass; pass <= RenderQueue::TransparentPass; pass++)
+            {
+                DrawPacket packet;
+                packet.meshBuf = &scene.buffer;
+                packet.materials = materials;
+                packet.transform = queue.addTransform(matrix4::translate(i, pass, depth));
+                packet.state = DrawPacket::InstanceColors;
+                queue.addGroups(packet, scene.meshes[meshID], materials,
+                                pass == RenderQueue::OpaquePass);
+                queue.add(RenderQueue::makeKey((RenderQueue::Pass)pass, 2, arrayID,
+                                               meshID, depth), packet);
+            }
+        }
+        recordTimer.end();
+        uint64_t recordAllocs = heapAllocations() - allocsBefore;
+        packets += queue.packetCount();
+        
+        // Without the queue, every packet is drawn on its own.
+        immediate.reset();
+        for(uint32_t i = 0; i < queue.packetCount(); i++)
+        {
+            const DrawPacket &packet = queue.packets()[i];
+            immediateDraws += packet.groupCount;
+            immediate.beginDrawMesh(packet.meshBuf, queue.groups(packet), packet.groupCount,
+                                    packet.materials, NULL, 0, 0);
+            immediate.drawMeshBatch(&queue.transform(packet.transform), 0, NULL, 1);
+            immediate.endDrawMesh();
+        }
+        immediateMeshes += immediate.meshes;
+        
+        batched.reset();
+        allocsBefore = heapAllocations();
+        executeTimer.begin();
+        queue.execute(&batched);
+        executeTimer.end();
+        if(f >= warmupFrames)
+            frameAllocs += recordAllocs + (heapAllocations() - allocsBefore);
+        batchedMeshes += batched.meshes;
+        instancedDraws += batched.drawCalls;
+        batches += queue.batchCount();
+        
+        // Every packet must be drawn exactly once.
+        QVector<vec3> expected = immediate.drawnOrigins;
+        QVector<vec3> drawn = batched.drawnOrigins;
+        qSort(expected.begin(), expected.end(), vec3LessThan);
+        qSort(drawn.begin(), drawn.end(), vec3LessThan);
+        for(int i = 0; i < expected.count(); i++)
+        {
+            if((i >= drawn.count()) || vec3LessThan(expected[i], drawn[i]) ||
+               vec3LessThan(drawn[i], expected[i]))
+                missing++;
+        }
+        missing += qMax(drawn.count() - expected.count(), 0);
+        
+        // The sky comes first, then opaque packets, then transparent packets
+        // from back to front.
+        const QVector<vec3> &order = batched.drawnOrigins;
+        orderErrors += (order.count() > 0) && (order[0].x != -1.0f);
+        for(int i = 2; i < order.count(); i++)
+        {
+            const vec3 &a = order[i - 1], &b = order[i];
+            if(b.y < a.y)
+                orderErrors++;
+            else if((a.y == RenderQueue::TransparentPass) &&
+                    (b.y == RenderQueue::TransparentPass) && (b.z > a.z))
+                orderErrors++;
+        }
+    }
+    
+    int errors = missing + orderErrors + (int)frameAllocs;
+    double perFrame = 1.0 / qMax(frames, 1);
+    fprintf(stdout, "%d objects, %d meshes, %d frames, %.1f packets per frame\n",
+            objectCount, meshCount, frames, packets * perFrame);
+    fprintf(stdout, "mesh binds per frame: %.1f immediate, %.1f batched (%.1f batches)\n",
+            immediateMeshes * perFrame, batchedMeshes * perFrame, batches * perFrame);
+    fprintf(stdout, "draw calls per frame: %.1f immediate, %.1f instanced\n",
+            immediateDraws * perFrame, instancedDraws * perFrame);
+    recordTimer.report();
+    executeTimer.report();
+    fprintf(stdout, "heap allocations after %d frames: %d (%d KB arena)\n",
+            warmupFrames, (int)frameAllocs, (int)(queue.arena().capacity() / 1024));
+    fprintf(stdout, "%d missing draws, %d order errors\n", missing, orderErrors);
+    return reportErrors(errors);
+}
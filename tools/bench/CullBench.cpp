@@ -0,0 +1,137 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+/*!
+  \brief Check that the batched frustum tests give the same results as
+  Frustum::containsAABox, and compare their speed.
+  */
+int benchCull(const QStringList &args)
+{
+    const int count = intArg(args, 0, 100000);
+    const int frames = intArg(args, 1, 100);
+    const float zoneSize = 3000.0f;
+    
+    srand(42);
+    QVector<AABox> boxes(count);
+    AABoxArray boxArray;
+    QVector<vec3> centers(count);
+    QVector<float> radii(count);
+    QVector<uint32_t> indices;
+    for(int i = 0; i < count; i++)
+    {
+        vec3 pos(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize),
+                 randomFloat(-200.0f, 200.0f));
+        vec3 extent(randomFloat(1.0f, 50.0f), randomFloat(1.0f, 50.0f), randomFloat(1.0f, 50.0f));
+        boxes[i] = AABox(pos - extent, pos + extent);
+        boxArray.append(boxes[i]);
+        centers[i] = pos;
+        radii[i] = extent.x;
+        if(rand() % 3)
+            indices.append(i);
+    }
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(2000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    
+    BenchTimer scalarTimer("scalar boxes");
+    BenchTimer batchTimer("batched boxes");
+    BenchTimer indexedTimer("batched indexed boxes");
+    BenchTimer scalarSphereTimer("scalar spheres");
+    BenchTimer sphereTimer("batched spheres");
+    QVector<uint8_t> expected(count), results(count);
+    QVector<uint32_t> visible(count), expectedVisible(count);
+    int errors = 0;
+    uint64_t totalVisible = 0;
+    for(int f = 0; f < frames; f++)
+    {
+        vec3 eye(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize), 0.0f);
+        float angle = randomFloat(0.0f, 6.2831853f);
+        frustum.setEye(eye);
+        frustum.setFocus(eye + vec3(cos(angle), sin(angle), randomFloat(-0.3f, 0.3f)));
+        frustum.update();
+        
+        scalarTimer.begin();
+        for(int i = 0; i < count; i++)
+            expected[i] = frustum.containsAABox(boxes[i]);
+        scalarTimer.end();
+        
+        batchTimer.begin();
+        frustum.containsAABoxes(boxArray, 0, count, results.data());
+        batchTimer.end();
+        for(int i = 0; i < count; i++)
+            errors += (results[i] != expected[i]);
+        
+        uint32_t found = frustum.findVisible(boxArray, 0, count, visible.data());
+        uint32_t expectedFound = 0;
+        for(int i = 0; i < count; i++)
+        {
+            if(expected[i] != OUTSIDE)
+                expectedVisible[expectedFound++] = i;
+        }
+        errors += (found != expectedFound);
+        for(uint32_t i = 0; (i < found) && (i < expectedFound); i++)
+            errors += (visible[i] != expectedVisible[i]);
+        totalVisible += found;
+        
+        indexedTimer.begin();
+        found = frustum.findVisibleIndexed(boxArray, indices.constData(), indices.count(), visible.data());
+        indexedTimer.end();
+        expectedFound = 0;
+        foreach(uint32_t index, indices)
+        {
+            if(expected[index] != OUTSIDE)
+                errors += (visible[expectedFound++] != index);
+        }
+        errors += (found != expectedFound);
+        
+        scalarSphereTimer.begin();
+        expectedFound = 0;
+        const Plane *planes = frustum.planes();
+        for(int i = 0; i < count; i++)
+        {
+            bool inside = true;
+            for(int j = 0; (j < 6) && inside; j++)
+                inside = (planes[j].distance(centers[i]) >= -radii[i]);
+            if(inside)
+                expectedVisible[expectedFound++] = i;
+        }
+        scalarSphereTimer.end();
+        
+        sphereTimer.begin();
+        found = frustum.findVisible(centers.constData(), radii.constData(), count, visible.data());
+        sphereTimer.end();
+        errors += (found != expectedFound);
+        for(uint32_t i = 0; (i < found) && (i < expectedFound); i++)
+            errors += (visible[i] != expectedVisible[i]);
+    }
+    
+    fprintf(stdout, "%d boxes, %d frames, %.1f visible boxes on average, %d errors\n",
+            count, frames, (double)totalVisible / qMax(frames, 1), errors);
+    scalarTimer.report();
+    batchTimer.report();
+    indexedTimer.report();
+    scalarSphereTimer.report();
+    sphereTimer.report();
+    return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,775 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cstdlib>
+#include <cstring>
+#include <QMap>
+#include <QVector>
+#include <GL/glew.h>
+#include "EQuilibre/Render/CommandQueue.h"
+#include "EQuilibre/Render/GLState.h"
+#include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/RenderContext.h"
+#include "EQuilibre/Render/RenderProgram.h"
+#include "Bench.h"
+
+static const uint32_t MaxAttribs = 16;
+
+static uint64_t hashData(uint64_t hash, const void *data, size_t size)
+{
+    // FNV-1a
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t hashValue(uint64_t hash, uint64_t value)
+{
+    return hashData(hash, &value, sizeof(value));
+}
+
+/*!
+  \brief Device that simulates the GL state instead of drawing. The effective
+  state at each draw call is hashed, so that two ways of drawing the same
+  frame can be compared.
+  */
+class RecordingDevice : public GLDevice
+{
+public:
+    RecordingDevice(bool vertexArrays);
+    
+    virtual bool hasVertexArrays() const;
+    virtual void useProgram(uint32_t program);
+    virtual void bindBuffer(uint32_t target, buffer_t buffer);
+    virtual void bufferData(uint32_t target, size_t size, const void *data, uint32_t usage);
+    virtual void bufferSubData(uint32_t target, size_t offset, size_t size, const void *data);
+    virtual void getBufferSubData(uint32_t target, size_t offset, size_t size, void *data);
+    virtual uint32_t createVertexArray();
+    virtual void deleteVertexArray(uint32_t vertexArray);
+    virtual void bindVertexArray(uint32_t vertexArray);
+    virtual void enableVertexAttribArray(uint32_t index);
+    virtual void disableVertexAttribArray(uint32_t index);
+    virtual void vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                     bool normalized, int stride, const void *pointer);
+    virtual void vertexAttribDivisor(uint32_t index, uint32_t divisor);
+    virtual void activeTexture(uint32_t unit);
+    virtual void bindTexture(uint32_t target, texture_t texture);
+    virtual void enable(uint32_t cap);
+    virtual void disable(uint32_t cap);
+    virtual void blendFunc(uint32_t src, uint32_t dst);
+    virtual void depthMask(bool write);
+    virtual void uniform1i(int location, int32_t value);
+    virtual void uniform1f(int location, float value);
+    virtual void uniform2f(int location, float x, float y);
+    virtual void uniform3fv(int location, int count, const float *values);
+    virtual void uniform4fv(int location, int count, const float *values);
+    virtual void uniformMatrix4fv(int location, int count, const float *values);
+    virtual void drawArrays(uint32_t mode, int first, int count);
+    virtual void drawArraysInstanced(uint32_t mode, int first, int count, int instances);
+    virtual void drawElements(uint32_t mode, int count, uint32_t type, const void *indices);
+    virtual void drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                       const void *indices, int instances);
+    virtual void multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                   const void * const *indices, int drawCount);
+    
+    /** Change the bindings behind the back of GLState, like other code would. */
+    void bindExternal(uint32_t seed);
+    
+    uint64_t calls;
+    uint64_t vertexArraysCreated;
+    /** Hash of the effective state of each draw call, in order. */
+    QVector<uint64_t> draws;
+
+private:
+    struct Attrib
+    {
+        bool enabled;
+        buffer_t buffer;
+        const void *pointer;
+        int size;
+        uint32_t type;
+        bool normalized;
+        int stride;
+        uint32_t divisor;
+    };
+    
+    struct ArrayObject
+    {
+        buffer_t elementBuffer;
+        Attrib attribs[MaxAttribs];
+    };
+    
+    void setUniform(int location, uint32_t type, const void *data, size_t size);
+    void draw(uint64_t callHash);
+    
+    bool m_vertexArrays;
+    uint32_t m_nextVertexArray;
+    uint32_t m_program;
+    buffer_t m_arrayBuffer;
+    uint32_t m_vertexArray;
+    QMap<uint32_t, ArrayObject> m_arrays;
+    uint32_t m_activeTexture;
+    QMap<uint64_t, texture_t> m_textures;
+    bool m_blending;
+    uint64_t m_blendFunc;
+    bool m_depthWrite;
+    QMap<uint32_t, QMap<int, QVector<uint32_t> > > m_uniforms;
+};
+
+RecordingDevice::RecordingDevice(bool vertexArrays)
+{
+    ArrayObject defaultArray;
+    memset(&defaultArray, 0, sizeof(ArrayObject));
+    calls = 0;
+    vertexArraysCreated = 0;
+    m_vertexArrays = vertexArrays;
+    m_nextVertexArray = 1;
+    m_program = 0;
+    m_arrayBuffer = 0;
+    m_vertexArray = 0;
+    m_arrays.insert(0, defaultArray);
+    m_activeTexture = GL_TEXTURE0;
+    m_blending = false;
+    m_blendFunc = 0;
+    m_depthWrite = true;
+}
+
+bool RecordingDevice::hasVertexArrays() const
+{
+    return m_vertexArrays;
+}
+
+void RecordingDevice::useProgram(uint32_t program)
+{
+    calls++;
+    m_program = program;
+}
+
+void RecordingDevice::bindBuffer(uint32_t target, buffer_t buffer)
+{
+    calls++;
+    if(target == GL_ELEMENT_ARRAY_BUFFER)
+        m_arrays[m_vertexArray].elementBuffer = buffer;
+    else if(target == GL_ARRAY_BUFFER)
+        m_arrayBuffer = buffer;
+}
+
+void RecordingDevice::bufferData(uint32_t target, size_t size, const void *data, uint32_t usage)
+{
+    calls++;
+}
+
+void RecordingDevice::bufferSubData(uint32_t target, size_t offset, size_t size, const void *data)
+{
+    calls++;
+}
+
+void RecordingDevice::getBufferSubData(uint32_t target, size_t offset, size_t size, void *data)
+{
+    calls++;
+    memset(data, 0, size);
+}
+
+uint32_t RecordingDevice::createVertexArray()
+{
+    ArrayObject array;
+    memset(&array, 0, sizeof(ArrayObject));
+    calls++;
+    vertexArraysCreated++;
+    uint32_t name = m_nextVertexArray++;
+    m_arrays.insert(name, array);
+    return name;
+}
+
+void RecordingDevice::deleteVertexArray(uint32_t vertexArray)
+{
+    calls++;
+    m_arrays.remove(vertexArray);
+    if(m_vertexArray == vertexArray)
+        m_vertexArray = 0;
+}
+
+void RecordingDevice::bindVertexArray(uint32_t vertexArray)
+{
+    calls++;
+    Q_ASSERT(m_arrays.contains(vertexArray));
+    m_vertexArray = vertexArray;
+}
+
+void RecordingDevice::enableVertexAttribArray(uint32_t index)
+{
+    calls++;
+    if(index < MaxAttribs)
+        m_arrays[m_vertexArray].attribs[index].enabled = true;
+}
+
+void RecordingDevice::disableVertexAttribArray(uint32_t index)
+{
+    calls++;
+    if(index < MaxAttribs)
+        m_arrays[m_vertexArray].attribs[index].enabled = false;
+}
+
+void RecordingDevice::vertexAttribPointer(uint32_t index, int size, uint32_t type,
+                                          bool normalized, int stride, const void *pointer)
+{
+    calls++;
+    if(index >= MaxAttribs)
+        return;
+    Attrib &attrib = m_arrays[m_vertexArray].attribs[index];
+    attrib.buffer = m_arrayBuffer;
+    attrib.pointer = pointer;
+    attrib.size = size;
+    attrib.type = type;
+    attrib.normalized = normalized;
+    attrib.stride = stride;
+}
+
+void RecordingDevice::vertexAttribDivisor(uint32_t index, uint32_t divisor)
+{
+    calls++;
+    if(index < MaxAttribs)
+        m_arrays[m_vertexArray].attribs[index].divisor = divisor;
+}
+
+void RecordingDevice::activeTexture(uint32_t unit)
+{
+    calls++;
+    m_activeTexture = unit;
+}
+
+void RecordingDevice::bindTexture(uint32_t target, texture_t texture)
+{
+    calls++;
+    m_textures.insert(((uint64_t)m_activeTexture << 32) | target, texture);
+}
+
+void RecordingDevice::enable(uint32_t cap)
+{
+    calls++;
+    if(cap == GL_BLEND)
+        m_blending = true;
+}
+
+void RecordingDevice::disable(uint32_t cap)
+{
+    calls++;
+    if(cap == GL_BLEND)
+        m_blending = false;
+}
+
+void RecordingDevice::blendFunc(uint32_t src, uint32_t dst)
+{
+    calls++;
+    m_blendFunc = ((uint64_t)src << 32) | dst;
+}
+
+void RecordingDevice::depthMask(bool write)
+{
+    calls++;
+    m_depthWrite = write;
+}
+
+void RecordingDevice::setUniform(int location, uint32_t type, const void *data, size_t size)
+{
+    calls++;
+    if(location < 0)
+        return;
+    Q_ASSERT(m_program != 0);
+    QVector<uint32_t> value(1 + (size / sizeof(uint32_t)));
+    value[0] = type;
+    memcpy(value.data() + 1, data, size);
+    m_uniforms[m_program].insert(location, value);
+}
+
+void RecordingDevice::uniform1i(int location, int32_t value)
+{
+    setUniform(location, 1, &value, sizeof(value));
+}
+
+void RecordingDevice::uniform1f(int location, float value)
+{
+    setUniform(location, 2, &value, sizeof(value));
+}
+
+void RecordingDevice::uniform2f(int location, float x, float y)
+{
+    float values[2] = {x, y};
+    setUniform(location, 3, values, sizeof(values));
+}
+
+void RecordingDevice::uniform3fv(int location, int count, const float *values)
+{
+    setUniform(location, 4, values, count * 3 * sizeof(float));
+}
+
+void RecordingDevice::uniform4fv(int location, int count, const float *values)
+{
+    setUniform(location, 5, values, count * 4 * sizeof(float));
+}
+
+void RecordingDevice::uniformMatrix4fv(int location, int count, const float *values)
+{
+    setUniform(location, 6, values, count * 16 * sizeof(float));
+}
+
+void RecordingDevice::draw(uint64_t hash)
+{
+    // Vertex array names differ between runs, only their content matters.
+    calls++;
+    hash = hashValue(hash, m_program);
+    const QMap<int, QVector<uint32_t> > &uniforms = m_uniforms[m_program];
+    QMap<int, QVector<uint32_t> >::const_iterator it;
+    for(it = uniforms.constBegin(); it != uniforms.constEnd(); ++it)
+    {
+        hash = hashValue(hash, it.key());
+        hash = hashData(hash, it.value().constData(), it.value().count() * sizeof(uint32_t));
+    }
+    const ArrayObject &array = m_arrays[m_vertexArray];
+    hash = hashValue(hash, array.elementBuffer);
+    for(uint32_t i = 0; i < MaxAttribs; i++)
+    {
+        const Attrib &attrib = array.attribs[i];
+        if(!attrib.enabled)
+            continue;
+        hash = hashValue(hash, i);
+        hash = hashValue(hash, attrib.buffer);
+        hash = hashValue(hash, (uint64_t)(size_t)attrib.pointer);
+        hash = hashValue(hash, attrib.size);
+        hash = hashValue(hash, attrib.type);
+        hash = hashValue(hash, attrib.normalized);
+        hash = hashValue(hash, attrib.stride);
+        hash = hashValue(hash, attrib.divisor);
+    }
+    QMap<uint64_t, texture_t>::const_iterator tex;
+    for(tex = m_textures.constBegin(); tex != m_textures.constEnd(); ++tex)
+    {
+        if(tex.value() == 0)
+            continue;
+        hash = hashValue(hash, tex.key());
+        hash = hashValue(hash, tex.value());
+    }
+    hash = hashValue(hash, m_blending);
+    if(m_blending)
+        hash = hashValue(hash, m_blendFunc);
+    hash = hashValue(hash, m_depthWrite);
+    draws.append(hash);
+}
+
+void RecordingDevice::drawArrays(uint32_t mode, int first, int count)
+{
+    uint64_t hash = hashValue(14695981039346656037ULL, 1);
+    hash = hashValue(hash, mode);
+    hash = hashValue(hash, first);
+    draw(hashValue(hash, count));
+}
+
+void RecordingDevice::drawArraysInstanced(uint32_t mode, int first, int count, int instances)
+{
+    uint64_t hash = hashValue(14695981039346656037ULL, 2);
+    hash = hashValue(hash, mode);
+    hash = hashValue(hash, first);
+    hash = hashValue(hash, count);
+    draw(hashValue(hash, instances));
+}
+
+void RecordingDevice::drawElements(uint32_t mode, int count, uint32_t type, const void *indices)
+{
+    uint64_t hash = hashValue(14695981039346656037ULL, 3);
+    hash = hashValue(hash, mode);
+    hash = hashValue(hash, count);
+    hash = hashValue(hash, type);
+    draw(hashValue(hash, (uint64_t)(size_t)indices));
+}
+
+void RecordingDevice::drawElementsInstanced(uint32_t mode, int count, uint32_t type,
+                                            const void *indices, int instances)
+{
+    uint64_t hash = hashValue(14695981039346656037ULL, 4);
+    hash = hashValue(hash, mode);
+    hash = hashValue(hash, count);
+    hash = hashValue(hash, type);
+    hash = hashValue(hash, (uint64_t)(size_t)indices);
+    draw(hashValue(hash, instances));
+}
+
+void RecordingDevice::multiDrawElements(uint32_t mode, const int *counts, uint32_t type,
+                                        const void * const *indices, int drawCount)
+{
+    // Equivalent to drawing each range with drawElements.
+    for(int i = 0; i < drawCount; i++)
+    {
+        drawElements(mode, counts[i], type, indices[i]);
+        calls--;
+    }
+    calls++;
+}
+
+void RecordingDevice::bindExternal(uint32_t seed)
+{
+    // Only change state that the programs set before using it.
+    if(m_vertexArrays)
+        m_vertexArray = 0;
+    m_program = seed & 1;
+    m_arrayBuffer = 7000 + seed;
+    m_arrays[m_vertexArray].elementBuffer = 7100 + seed;
+    m_activeTexture = GL_TEXTURE0 + (seed % 2);
+    m_textures.insert(((uint64_t)GL_TEXTURE0 << 32) | GL_TEXTURE_2D_ARRAY, 7200 + seed);
+    m_blending = (seed % 3) == 0;
+    m_blendFunc = 0;
+    m_depthWrite = (seed % 2) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+  \brief Program with made-up attribute and uniform locations, since there is
+  no GL context to link a real one.
+  */
+class TestProgram : public RenderProgram
+{
+public:
+    TestProgram(RenderContext *renderCtx, uint32_t name, bool instancing);
+    virtual ~TestProgram();
+};
+
+TestProgram::TestProgram(RenderContext *renderCtx, uint32_t name, bool instancing)
+    : RenderProgram(renderCtx)
+{
+    m_program = name;
+    m_attr[A_POSITION] = 0;
+    m_attr[A_NORMAL] = 1;
+    m_attr[A_TEX_COORDS] = 2;
+    m_attr[A_COLOR] = 3;
+    m_attr[A_BONE_INDEX] = 4;
+    m_attr[A_TEX_LAYER] = 5;
+    m_attr[A_MODEL_VIEW_0] = instancing ? 6 : -1;
+    m_attr[A_BONE_BASE] = -1;
+    for(int i = 0; i <= U_MAX; i++)
+        m_uniform[i] = i;
+    m_supportsInstancing = instancing;
+    m_instanceBuffer = instancing ? (900 + name) : 0;
+}
+
+TestProgram::~TestProgram()
+{
+    // The names were not created by GL.
+    m_program = 0;
+    m_instanceBuffer = 0;
+}
+
+/*!
+  \brief Synthetic scene: static meshes in a few pooled buffers, skinned meshes
+  and one mesh whose vertices stay in client memory.
+  */
+class StateScene
+{
+public:
+    StateScene();
+    ~StateScene();
+    
+    QVector<MeshBuffer *> buffers;
+    QVector<MeshData *> meshes;
+    QVector<MeshData *> skinnedMeshes;
+    QVector<MaterialArray *> arrays;
+    MeshBuffer clientBuffer;
+    MeshData *clientMesh;
+};
+
+static MeshData * createMesh(MeshBuffer *buffer, uint32_t vertexCount, uint32_t materialCount)
+{
+    uint32_t first = buffer->vertices.count();
+    for(uint32_t i = 0; i < vertexCount; i++)
+    {
+        Vertex v;
+        v.position = vec3(i, first, 0.0f);
+        v.packNormal(vec3(0.0f, 0.0f, 1.0f));
+        v.packTexCoords(vec2(0.0f, 0.0f));
+        v.layer = 0;
+        v.bone = i % 4;
+        v.color = 0xffffffff;
+        buffer->vertices.append(v);
+    }
+    uint32_t groupCount = 1 + (rand() % 3);
+    MeshData *mesh = buffer->createMesh(groupCount);
+    mesh->indexSegment.offset = buffer->indices.count();
+    for(uint32_t g = 0; g < groupCount; g++)
+    {
+        MaterialGroup &mg = mesh->matGroups[g];
+        mg.id = g;
+        mg.offset = buffer->indices.count() - mesh->indexSegment.offset;
+        mg.count = 3 * (1 + (rand() % 20));
+        mg.matID = rand() % materialCount;
+        for(uint32_t j = 0; j < mg.count; j++)
+            buffer->indices.append(first + (rand() % vertexCount));
+    }
+    mesh->indexSegment.count = buffer->indices.count() - mesh->indexSegment.offset;
+    return mesh;
+}
+
+StateScene::StateScene()
+{
+    const uint32_t materialCount = 6;
+    for(int i = 0; i < 3; i++)
+    {
+        MaterialArray *array = new MaterialArray();
+        for(uint32_t j = 0; j < materialCount; j++)
+        {
+            // Some materials have no texture, some share a texture.
+            Material *mat = new Material();
+            mat->setOpaque(j < 4);
+            mat->setTexture((j == 0) ? 0 : (100 + (i * 10) + (j / 2)));
+            array->setMaterial(j, mat);
+        }
+        arrays.append(array);
+    }
+    
+    // The buffer names are made up, like the ones the mesh pool would create.
+    for(int i = 0; i < 4; i++)
+    {
+        MeshBuffer *buffer = new MeshBuffer();
+        for(int j = 0; j < 10; j++)
+        {
+            MeshData *mesh = createMesh(buffer, 8 + (rand() % 32), materialCount);
+            if(i < 3)
+                meshes.append(mesh);
+            else
+                skinnedMeshes.append(mesh);
+        }
+        buffer->vertexBuffer = 10 + i;
+        buffer->indexBuffer = 20 + i;
+        buffer->indexSize = (i % 2) ? sizeof(uint16_t) : sizeof(uint32_t);
+        buffers.append(buffer);
+    }
+    clientMesh = createMesh(&clientBuffer, 24, materialCount);
+}
+
+StateScene::~StateScene()
+{
+    foreach(MaterialArray *array, arrays)
+        delete array;
+    foreach(MeshBuffer *buffer, buffers)
+        delete buffer;
+}
+
+struct StateRun
+{
+    bool shadowing;
+    bool vertexArrays;
+    uint64_t calls;
+    uint64_t redundantCalls;
+    uint64_t deviceCalls;
+    uint64_t vertexArraysCreated;
+    QVector<uint64_t> draws;
+};
+
+static void drawFrames(StateScene &scene, StateRun &run, int objectCount, int frames)
+{
+    RecordingDevice device(true);
+    RenderContext renderCtx(&device);
+    GLState *state = renderCtx.state();
+    state->setShadowing(run.shadowing);
+    state->setVertexArraysEnabled(run.vertexArrays);
+    TestProgram staticProg(&renderCtx, 1, true);
+    TestProgram skinnedProg(&renderCtx, 2, false);
+    BonePalette *palette = renderCtx.bonePalette();
+    CommandQueue staticQueue, skinnedQueue;
+    FogParams fog;
+    fog.start = 10.0f;
+    fog.end = 100.0f;
+    fog.density = 0.5f;
+    fog.color = vec4(0.5f, 0.5f, 0.5f, 1.0f);
+    
+    run.calls = run.redundantCalls = 0;
+    for(int f = 0; f < frames; f++)
+    {
+        // Every run draws the same frames.
+        srand(1000 + f);
+        device.bindExternal(f);
+        device.calls = 0;
+        state->invalidate();
+        palette->clear();
+        
+        staticQueue.clear();
+        for(int i = 0; i < objectCount; i++)
+        {
+            int meshID = rand() % scene.meshes.count();
+            MaterialArray *materials = scene.arrays[meshID % scene.arrays.count()];
+            DrawPacket packet;
+            packet.meshBuf = scene.meshes[meshID]->buffer;
+            packet.materials = materials;
+            packet.transform = staticQueue.addTransform(matrix4::translate(i, 0.0f, 0.0f));
+            packet.state = (i % 7) ? DrawPacket::DefaultState : DrawPacket::NoDepthWrite;
+            staticQueue.addGroups(packet, scene.meshes[meshID]);
+            staticQueue.add(RenderQueue::makeKey(RenderQueue::OpaquePass, 0,
+                            meshID % scene.arrays.count(), meshID, 0), packet);
+        }
+        DrawPacket client;
+        client.meshBuf = &scene.clientBuffer;
+        client.materials = scene.arrays[0];
+        client.transform = staticQueue.addTransform(matrix4::translate(-1.0f, 0.0f, 0.0f));
+        staticQueue.addGroups(client, scene.clientMesh);
+        staticQueue.add(RenderQueue::makeKey(RenderQueue::TransparentPass, 0, 0, 0, 0), client);
+        
+        skinnedQueue.clear();
+        for(int i = 0; i < (objectCount / 10); i++)
+        {
+            int meshID = rand() % scene.skinnedMeshes.count();
+            DrawPacket packet;
+            packet.meshBuf = scene.skinnedMeshes[meshID]->buffer;
+            packet.materials = scene.arrays[1];
+            packet.bones = palette;
+            packet.boneCount = 4;
+            packet.boneBase = palette->allocate(packet.boneCount);
+            vec4 *bones = palette->bones(packet.boneBase);
+            for(uint32_t j = 0; j < packet.boneCount; j++)
+            {
+                bones[j * 2] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+                bones[j * 2 + 1] = vec4(i * 0.5f, j * 0.5f, 0.0f, 0.0f);
+            }
+            packet.transform = skinnedQueue.addTransform(matrix4::translate(i, 1.0f, 0.0f));
+            if(i % 3)
+            {
+                packet.state = DrawPacket::InstanceColors;
+                packet.colorBuffer = 30;
+                packet.colors.elementSize = sizeof(uint32_t);
+                packet.colors.offset = i * 16;
+                packet.colors.count = (i % 2) ? 16 : 0;
+            }
+            skinnedQueue.addGroups(packet, scene.skinnedMeshes[meshID]);
+            skinnedQueue.add(RenderQueue::makeKey(RenderQueue::OpaquePass, 1, 1, meshID, 0), packet);
+        }
+        
+        renderCtx.setCurrentProgram(&staticProg);
+        staticProg.setLightingMode(RenderProgram::BakedLighting);
+        staticProg.setAmbientLight(vec4(0.4f, 0.4f, 0.4f, 1.0f));
+        staticProg.setFogParams(fog);
+        ProgramBackend staticBackend(&renderCtx, &staticProg);
+        staticQueue.execute(&staticBackend);
+        
+        // Other code drawing in the middle of the frame changes the bindings.
+        device.bindExternal(frames + f);
+        state->invalidate();
+        renderCtx.setCurrentProgram(&staticProg);
+        staticQueue.execute(&staticBackend);
+        
+        renderCtx.setCurrentProgram(&skinnedProg);
+        skinnedProg.setLightingMode(RenderProgram::DebugVertexColor);
+        skinnedProg.setFogParams(fog);
+        ProgramBackend skinnedBackend(&renderCtx, &skinnedProg);
+        skinnedQueue.execute(&skinnedBackend);
+        
+        state->reset();
+        run.calls += state->calls();
+        run.redundantCalls += state->redundantCalls();
+        state->resetCounters();
+        staticProg.resetFrameStats();
+        skinnedProg.resetFrameStats();
+        run.deviceCalls += device.calls;
+    }
+    run.vertexArraysCreated = device.vertexArraysCreated;
+    run.draws = device.draws;
+    
+    // The buffers outlive the context.
+    foreach(MeshBuffer *buffer, scene.buffers)
+    {
+        foreach(VertexArray va, buffer->vertexArrays)
+            renderCtx.freeVertexArray(va.name);
+        buffer->vertexArrays.clear();
+    }
+}
+
+/*!
+  \brief Check that a uniform set through the uncached path, such as a large
+  array, is not then skipped when it is set back to its previous value.
+  */
+static int checkUniformCache()
+{
+    RecordingDevice device(true);
+    RenderContext renderCtx(&device);
+    GLState *state = renderCtx.state();
+    state->setShadowing(true);
+    state->useProgram(1);
+    float small[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+    float large[32];
+    for(int i = 0; i < 32; i++)
+        large[i] = (float)i;
+    state->uniform4fv(5, 1, small);
+    state->uniform4fv(5, 8, large);
+    uint64_t before = device.calls;
+    state->uniform4fv(5, 1, small);
+    int errors = (device.calls == before);
+    state->useProgram(0);
+    return errors;
+}
+
+int benchGLState(const QStringList &args)
+{
+    const int objectCount = intArg(args, 0, 500);
+    const int frames = intArg(args, 1, 20);
+    
+    srand(42);
+    StateScene scene;
+    
+    // The first run makes every call, like the programs did before shadowing.
+    StateRun runs[4];
+    for(int i = 0; i < 4; i++)
+    {
+        runs[i].shadowing = (i & 1) != 0;
+        runs[i].vertexArrays = (i & 2) != 0;
+        runs[i].deviceCalls = 0;
+        drawFrames(scene, runs[i], objectCount, frames);
+    }
+    
+    // Every run must draw with the same effective state, and GLState must
+    // count the calls it makes.
+    int stateErrors = 0, countErrors = 0;
+    const StateRun &reference = runs[0];
+    double perFrame = 1.0 / qMax(frames, 1);
+    fprintf(stdout, "%d objects, %d frames, %.1f draw calls per frame\n",
+            objectCount, frames, reference.draws.count() * perFrame);
+    for(int i = 0; i < 4; i++)
+    {
+        const StateRun &run = runs[i];
+        if(run.draws.count() != reference.draws.count())
+            stateErrors += qAbs(run.draws.count() - reference.draws.count());
+        int count = qMin(run.draws.count(), reference.draws.count());
+        for(int j = 0; j < count; j++)
+            stateErrors += (run.draws[j] != reference.draws[j]);
+        countErrors += (run.calls != run.deviceCalls);
+        if(run.calls > reference.calls)
+            countErrors++;
+        fprintf(stdout, "shadowing %-3s vertex arrays %-3s: %8.1f GL calls per frame, "
+                "%8.1f dropped, %llu vertex arrays\n",
+                run.shadowing ? "on" : "off", run.vertexArrays ? "on" : "off",
+                run.calls * perFrame, run.redundantCalls * perFrame,
+                (unsigned long long)run.vertexArraysCreated);
+    }
+    
+    // Vertex arrays are only created once for each buffer and program.
+    if(runs[3].vertexArraysCreated != (uint64_t)(scene.buffers.count()))
+        countErrors++;
+    stateErrors += checkUniformCache();
+    
+    int errors = stateErrors + countErrors;
+    fprintf(stdout, "%d errors (%d state, %d count)\n", errors, stateErrors, countErrors);
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Vertex.h"
+#include "Bench.h"
+
+/*!
+  \brief Check the index size chosen around the 16-bit limit.
+  */
+static int checkIndexSizes()
+{
+    int errors = 0;
+    errors += (MeshBuffer::indexSizeFor(0) != 2);
+    errors += (MeshBuffer::indexSizeFor(65535) != 2);
+    errors += (MeshBuffer::indexSizeFor(65536) != 2);
+    errors += (MeshBuffer::indexSizeFor(65537) != 4);
+    errors += (MeshBuffer::indexSizeFor(1 << 20) != 4);
+    return errors;
+}
+
+/*!
+  \brief Add a mesh with random triangles to the buffer, the way meshes are
+  imported from WLD files (indices are relative to the buffer).
+  */
+static void addMesh(MeshBuffer &buffer, uint32_t vertexCount, uint32_t triangleCount)
+{
+    uint32_t firstVertex = buffer.vertices.count();
+    buffer.vertices.resize(firstVertex + vertexCount);
+    for(uint32_t i = 0; i < (triangleCount * 3); i++)
+        buffer.indices.append(firstVertex + (rand() % vertexCount));
+}
+
+static int checkShortIndices(const MeshBuffer &buffer)
+{
+    QVector<uint16_t> packed;
+    buffer.shortIndices(packed);
+    int errors = (packed.count() != buffer.indices.count()) ? 1 : 0;
+    for(int i = 0; (i < packed.count()) && (errors == 0); i++)
+        errors += (packed[i] != buffer.indices[i]);
+    return errors;
+}
+
+/*!
+  \brief Check the 16-bit index selection and report the index memory of a
+  synthetic set of assets: one buffer per character model and one buffer for
+  all zone objects, which can cross the 16-bit limit.
+  */
+int benchIndices(const QStringList &args)
+{
+    int errors = checkIndexSizes();
+    srand(42);
+    
+    // A buffer that uses every 16-bit index.
+    MeshBuffer full;
+    addMesh(full, 65536, 65536);
+    errors += checkShortIndices(full);
+    
+    QVector<MeshBuffer *> buffers;
+    for(int i = 0; i < 50; i++)
+    {
+        MeshBuffer *buffer = new MeshBuffer();
+        for(int j = 0; j < 10; j++)
+            addMesh(*buffer, 50 + (rand() % 300), 100 + (rand() % 400));
+        buffers.append(buffer);
+    }
+    MeshBuffer *objects = new MeshBuffer();
+    for(int i = 0; i < 400; i++)
+        addMesh(*objects, 50 + (rand() % 400), 100 + (rand() % 500));
+    buffers.append(objects);
+    uint32_t objectVertices = objects->vertices.count();
+    
+    uint64_t intBytes = 0, packedBytes = 0;
+    int shortBuffers = 0;
+    foreach(MeshBuffer *buffer, buffers)
+    {
+        uint32_t indexSize = MeshBuffer::indexSizeFor(buffer->vertices.count());
+        intBytes += buffer->indices.count() * sizeof(uint32_t);
+        packedBytes += buffer->indices.count() * indexSize;
+        if(indexSize == sizeof(uint16_t))
+        {
+            errors += checkShortIndices(*buffer);
+            shortBuffers++;
+        }
+        delete buffer;
+    }
+    
+    fprintf(stdout, "%d of %d buffers use 16-bit indices (objects: %d vertices)\n",
+            shortBuffers, buffers.count(), objectVertices);
+    fprintf(stdout, "index memory: %.2f MB, was %.2f MB\n",
+            packedBytes / (1024.0 * 1024.0), intBytes / (1024.0 * 1024.0));
+    
+    if(args.count() >= 2)
+    {
+        Game game;
+        Zone zone(&game);
+        if(!loadBenchZone(zone, args[0], args[1]))
+            return 1;
+        MeshBuffer *terrain = zone.terrain()->buffer();
+        uint32_t indexSize = MeshBuffer::indexSizeFor(terrain->vertices.count());
+        fprintf(stdout, "terrain: %d vertices, %d-bit indices, %.2f MB\n",
+                terrain->vertices.count(), indexSize * 8,
+                (terrain->indices.count() * indexSize) / (1024.0 * 1024.0));
+    }
+    return reportErrors(errors);
+}
@@ -0,0 +1,356 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cfloat>
+#include <cmath>
+#include <QVector>
+#include "EQuilibre/Game/Fragments.h"
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDModel.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/MeshSimplifier.h"
+#include "Bench.h"
+
+/*!
+  \brief Closest point to p on the triangle abc (from Real-Time Collision
+  Detection, 5.1.5).
+  */
+static vec3 closestPointOnTriangle(const vec3 &p, const vec3 &a, const vec3 &b, const vec3 &c)
+{
+    vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = vec3::dot(ab, ap), d2 = vec3::dot(ac, ap);
+    if((d1 <= 0.0f) && (d2 <= 0.0f))
+        return a;
+    vec3 bp = p - b;
+    float d3 = vec3::dot(ab, bp), d4 = vec3::dot(ac, bp);
+    if((d3 >= 0.0f) && (d4 <= d3))
+        return b;
+    float vc = (d1 * d4) - (d3 * d2);
+    if((vc <= 0.0f) && (d1 >= 0.0f) && (d3 <= 0.0f))
+        return a + (ab * (d1 / (d1 - d3)));
+    vec3 cp = p - c;
+    float d5 = vec3::dot(ab, cp), d6 = vec3::dot(ac, cp);
+    if((d6 >= 0.0f) && (d5 <= d6))
+        return c;
+    float vb = (d5 * d2) - (d1 * d6);
+    if((vb <= 0.0f) && (d2 >= 0.0f) && (d6 <= 0.0f))
+        return a + (ac * (d2 / (d2 - d6)));
+    float va = (d3 * d6) - (d5 * d4);
+    if((va <= 0.0f) && ((d4 - d3) >= 0.0f) && ((d5 - d6) >= 0.0f))
+        return b + ((c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))));
+    float denom = 1.0f / (va + vb + vc);
+    return a + (ab * (vb * denom)) + (ac * (vc * denom));
+}
+
+/*!
+  \brief Largest distance between a vertex of the original mesh and the
+  surface of the simplified one.
+  */
+static float measureError(const Vertex *vertices, const QVector<uint32_t> &original,
+                          const QVector<uint32_t> &simplified)
+{
+    QVector<uint8_t> used(0);
+    uint32_t maxVertex = 0;
+    foreach(uint32_t index, original)
+        maxVertex = qMax(maxVertex, index);
+    used.fill(0, maxVertex + 1);
+    foreach(uint32_t index, original)
+        used[index] = 1;
+    
+    float maxDist = 0.0f;
+    for(uint32_t v = 0; v <= maxVertex; v++)
+    {
+        if(!used[v])
+            continue;
+        const vec3 &p = vertices[v].position;
+        float minDist = FLT_MAX;
+        for(int i = 0; (i + 2) < simplified.count(); i += 3)
+        {
+            vec3 q = closestPointOnTriangle(p, vertices[simplified[i]].position,
+                                            vertices[simplified[i + 1]].position,
+                                            vertices[simplified[i + 2]].position);
+            minDist = qMin(minDist, (q - p).lengthSquared());
+        }
+        maxDist = qMax(maxDist, minDist);
+    }
+    return sqrtf(maxDist);
+}
+
+/*!
+  \brief Synthetic mesh with its material groups.
+  */
+class TestMesh
+{
+public:
+    QString name;
+    QVector<Vertex> vertices;
+    QVector<uint32_t> indices;
+    QVector<MaterialGroup> groups;
+    float radius;
+    
+    void addVertex(const vec3 &pos, uint8_t bone);
+    void addGroup(uint32_t matID, uint32_t offset);
+    uint32_t checkLevels();
+};
+
+void TestMesh::addVertex(const vec3 &pos, uint8_t bone)
+{
+    Vertex v;
+    v.position = pos;
+    v.packNormal(vec3(0.0f, 0.0f, 1.0f));
+    v.packTexCoords(vec2(0.0f, 0.0f));
+    v.layer = 0;
+    v.bone = bone;
+    v.color = 0xffffffff;
+    vertices.append(v);
+}
+
+void TestMesh::addGroup(uint32_t matID, uint32_t offset)
+{
+    MaterialGroup mg;
+    mg.id = 0;
+    mg.offset = offset;
+    mg.count = indices.count() - offset;
+    mg.matID = matID;
+    groups.append(mg);
+}
+
+/*!
+  \brief Grid in the XY plane, with the height given by a few waves. The left
+  and right halves use different materials and the bottom and top halves
+  different bones.
+  */
+static void makeGrid(TestMesh &mesh, uint32_t size, float amplitude)
+{
+    mesh.name = QString(amplitude > 0.0f ? "terrain %1x%1" : "plane %1x%1").arg(size);
+    for(uint32_t y = 0; y <= size; y++)
+    {
+        for(uint32_t x = 0; x <= size; x++)
+        {
+            float z = amplitude * sinf(x * 0.2f) * cosf(y * 0.15f);
+            mesh.addVertex(vec3(x, y, z), (y < (size / 2)) ? 0 : 1);
+        }
+    }
+    for(uint32_t half = 0; half < 2; half++)
+    {
+        uint32_t offset = mesh.indices.count();
+        for(uint32_t y = 0; y < size; y++)
+        {
+            for(uint32_t x = (half * size / 2); x < ((half + 1) * size / 2); x++)
+            {
+                uint32_t a = (y * (size + 1)) + x, b = a + 1, c = a + size + 1, d = c + 1;
+                const uint32_t quad[] = {a, b, d, a, d, c};
+                for(int i = 0; i < 6; i++)
+                    mesh.indices.append(quad[i]);
+            }
+        }
+        mesh.addGroup(half, offset);
+    }
+    mesh.radius = size * 0.7071f;
+}
+
+/*!
+  \brief UV sphere whose first and last meridians are separate vertices, like
+  a texture seam.
+  */
+static void makeSphere(TestMesh &mesh, uint32_t rings, uint32_t segments, float radius)
+{
+    mesh.name = QString("sphere %1x%2").arg(rings).arg(segments);
+    for(uint32_t r = 0; r <= rings; r++)
+    {
+        float theta = (float)M_PI * r / rings;
+        for(uint32_t s = 0; s <= segments; s++)
+        {
+            float phi = 2.0f * (float)M_PI * s / segments;
+            vec3 pos(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+            mesh.addVertex(pos * radius, 0);
+        }
+    }
+    for(uint32_t r = 0; r < rings; r++)
+    {
+        for(uint32_t s = 0; s < segments; s++)
+        {
+            uint32_t a = (r * (segments + 1)) + s, b = a + 1, c = a + segments + 1, d = c + 1;
+            if(r > 0)
+            {
+                mesh.indices.append(a);
+                mesh.indices.append(c);
+                mesh.indices.append(b);
+            }
+            if(r < (rings - 1))
+            {
+                mesh.indices.append(b);
+                mesh.indices.append(c);
+                mesh.indices.append(d);
+            }
+        }
+    }
+    mesh.addGroup(0, 0);
+    mesh.radius = radius;
+}
+
+/*!
+  \brief Simplify the mesh to the sizes used for levels of detail and check
+  the triangle reduction, the error bound and that seams and material group
+  boundaries are kept.
+  */
+uint32_t TestMesh::checkLevels()
+{
+    uint32_t errors = 0;
+    uint32_t vertexCount = vertices.count();
+    
+    // Positions that must still be drawn: those of vertices shared by several
+    // groups or that have the same position as another vertex. Such vertices
+    // are never moved, although a copy of a seam vertex can lose its triangles.
+    QVector<uint32_t> vertexGroups(vertexCount, 0xffffffff);
+    QVector<uint32_t> welded(vertexCount);
+    QVector<uint8_t> keep(vertexCount, 0);
+    for(int i = 0; i < groups.count(); i++)
+    {
+        for(uint32_t j = 0; j < groups[i].count; j++)
+        {
+            uint32_t v = indices[groups[i].offset + j];
+            if((vertexGroups[v] != 0xffffffff) && (vertexGroups[v] != (uint32_t)i))
+                keep[v] = 1;
+            vertexGroups[v] = i;
+        }
+    }
+    for(uint32_t i = 0; i < vertexCount; i++)
+    {
+        welded[i] = i;
+        for(uint32_t j = 0; j < i; j++)
+        {
+            const vec3 &a = vertices[i].position, &b = vertices[j].position;
+            if((a.x == b.x) && (a.y == b.y) && (a.z == b.z))
+            {
+                welded[i] = welded[j];
+                keep[i] = keep[welded[j]] = 1;
+                break;
+            }
+        }
+    }
+    
+    MeshSimplifier simplifier;
+    QVector<uint32_t> lodIndices;
+    QVector<MaterialGroup> lodGroups(groups.count());
+    float maxError = radius * 0.05f;
+    for(uint32_t level = 1; level < WLDMesh::MaxLODs; level++)
+    {
+        uint32_t target = ((indices.count() >> level) / 3) * 3;
+        uint32_t count = simplifier.simplify(vertices.constData(), vertexCount,
+                                             indices.constData(), groups.constData(),
+                                             groups.count(), target, maxError,
+                                             lodIndices, lodGroups.data());
+        uint32_t levelErrors = 0;
+        levelErrors += ((count % 3) != 0) || (count > (uint32_t)indices.count());
+        levelErrors += (count != (uint32_t)lodIndices.count());
+        levelErrors += (simplifier.error() > maxError);
+        uint32_t offset = 0;
+        for(int i = 0; i < groups.count(); i++)
+        {
+            levelErrors += (lodGroups[i].offset != offset);
+            levelErrors += (lodGroups[i].matID != groups[i].matID);
+            offset += lodGroups[i].count;
+        }
+        levelErrors += (offset != count);
+        QVector<uint8_t> used(vertexCount, 0);
+        foreach(uint32_t index, lodIndices)
+        {
+            if(index < vertexCount)
+                used[welded[index]] = 1;
+            else
+                levelErrors++;
+        }
+        foreach(uint32_t index, indices)
+            levelErrors += (keep[index] && !used[welded[index]]);
+        
+        // The error bounds the distance of the removed vertices to the planes
+        // of their triangles, which should also bound their distance to the
+        // simplified surface for these smooth meshes.
+        float measured = measureError(vertices.constData(), indices, lodIndices);
+        levelErrors += (measured > (simplifier.error() + 1e-4f));
+        
+        fprintf(stdout, "%-18s LOD %d  %6d -> %6d triangles (%5.1f%%)  error %.4f measured %.4f (max %.4f)\n",
+                name.toLatin1().constData(), level, indices.count() / 3, count / 3,
+                100.0 * count / qMax(indices.count(), 1), simplifier.error(), measured,
+                maxError);
+        errors += levelErrors;
+    }
+    return errors;
+}
+
+/*!
+  \brief Report the levels of detail generated for the objects of a zone.
+  */
+static int benchZoneLODs(const QString &assetDir, const QString &zoneName)
+{
+    Game game;
+    Zone zone(&game);
+    if(!loadBenchZone(zone, assetDir, zoneName))
+        return 1;
+    
+    int errors = 0;
+    uint32_t meshCount = 0, totals[4] = {0, 0, 0, 0};
+    MeshBuffer buffer;
+    foreach(WLDMesh *mesh, zone.objects()->models().values())
+    {
+        if(!mesh->data())
+            mesh->importFrom(&buffer);
+        mesh->importLODs(&buffer);
+        MeshData *base = mesh->data();
+        fprintf(stdout, "%-24s", mesh->def()->name().toLatin1().constData());
+        for(uint32_t level = 0; level < mesh->lodCount(); level++)
+        {
+            MeshData *lod = mesh->lod(level);
+            const uint32_t *indices = buffer.indices.constData() + lod->indexSegment.offset;
+            for(uint32_t i = 0; i < lod->indexSegment.count; i++)
+            {
+                errors += (indices[i] < base->vertexSegment.offset) ||
+                          (indices[i] >= (base->vertexSegment.offset + base->vertexSegment.count));
+            }
+            totals[level] += lod->indexSegment.count / 3;
+            fprintf(stdout, "  %6d (%.3f)", lod->indexSegment.count / 3, mesh->lodError(level));
+        }
+        fprintf(stdout, "\n");
+        meshCount++;
+    }
+    fprintf(stdout, "total triangles per level:");
+    for(uint32_t level = 0; level < WLDMesh::MaxLODs; level++)
+        fprintf(stdout, " %d", totals[level]);
+    fprintf(stdout, "\n%d meshes, %d errors\n", meshCount, errors);
+    return (errors > 0) ? 1 : 0;
+}
+
+/*!
+  \brief Check the mesh simplifier on synthetic meshes, or report the levels
+  of detail generated for the objects of a zone.
+  */
+int benchLOD(const QStringList &args)
+{
+    if(args.count() >= 2)
+        return benchZoneLODs(args[0], args[1]);
+    
+    QVector<TestMesh> meshes(4);
+    makeGrid(meshes[0], 32, 0.0f);
+    makeGrid(meshes[1], 64, 2.0f);
+    makeSphere(meshes[2], 16, 32, 10.0f);
+    makeSphere(meshes[3], 32, 64, 10.0f);
+    uint32_t errors = 0;
+    for(int i = 0; i < meshes.count(); i++)
+        errors += meshes[i].checkLevels();
+    return reportErrors(errors);
+}
@@ -0,0 +1,216 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Render/LinearMath.h"
+#include "EQuilibre/Render/SIMDMath.h"
+#include "Bench.h"
+
+static QQuaternion randomRotation()
+{
+    QQuaternion q(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f),
+                  randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f));
+    return q.normalized();
+}
+
+static vec3 randomPoint(float range)
+{
+    return vec3(randomFloat(-range, range), randomFloat(-range, range),
+                randomFloat(-range, range));
+}
+
+static float distance(const vec3 &a, const vec3 &b)
+{
+    return sqrtf((a - b).lengthSquared());
+}
+
+/*!
+  \brief Largest component difference between two rotations, taking into
+  account that q and -q are the same rotation.
+  */
+static float rotationError(const quat &a, const QQuaternion &b)
+{
+    vec4 v = a.toVec4();
+    float e1 = 0.0f, e2 = 0.0f;
+    float ref[4] = {(float)b.x(), (float)b.y(), (float)b.z(), (float)b.scalar()};
+    float val[4] = {v.x, v.y, v.z, v.w};
+    for(int i = 0; i < 4; i++)
+    {
+        e1 = qMax(e1, fabsf(val[i] - ref[i]));
+        e2 = qMax(e2, fabsf(val[i] + ref[i]));
+    }
+    return qMin(e1, e2);
+}
+
+class AccuracyCheck
+{
+public:
+    AccuracyCheck(const char *name, float tolerance)
+    {
+        m_name = name;
+        m_tolerance = tolerance;
+        m_maxError = 0.0f;
+    }
+
+    void add(float error)
+    {
+        m_maxError = qMax(m_maxError, error);
+    }
+
+    bool report() const
+    {
+        bool passed = (m_maxError <= m_tolerance);
+        fprintf(stdout, "%-24s max error %10.3g  tolerance %10.3g  %s\n",
+                m_name, m_maxError, m_tolerance, passed ? "ok" : "FAILED");
+        return passed;
+    }
+
+private:
+    const char *m_name;
+    float m_tolerance;
+    float m_maxError;
+};
+
+/*!
+  \brief Check the SIMD math types against the BoneTransform/QQuaternion
+  implementation, then compare the speed of both for bone interpolation.
+  */
+int benchMath(const QStringList &args)
+{
+    const int count = intArg(args, 0, 100000);
+    const float range = 100.0f;
+    srand(42);
+    
+    AccuracyCheck mulCheck("quat mul", 1e-6f);
+    AccuracyCheck rotateCheck("quat rotate", 5e-4f);
+    AccuracyCheck nlerpCheck("quat nlerp", 1e-6f);
+    AccuracyCheck slerpCheck("quat slerpFast", 1e-3f);
+    AccuracyCheck dqMapCheck("dualquat map", 5e-4f);
+    AccuracyCheck dqMulCheck("dualquat mul", 5e-4f);
+    AccuracyCheck affineCheck("affine3 map", 5e-4f);
+    AccuracyCheck affine4Check("affine3 mapPoints", 5e-4f);
+    
+    QVector<vec3> points(count), mapped(count);
+    for(int i = 0; i < count; i++)
+        points[i] = randomPoint(range);
+    
+    for(int i = 0; i < count; i++)
+    {
+        QQuaternion qa = randomRotation(), qb = randomRotation();
+        quat a(qa), b(qb);
+        vec3 p = points[i];
+        mulCheck.add(rotationError(a * b, qa * qb));
+        
+        QVector3D rp = qa.rotatedVector(QVector3D(p.x, p.y, p.z));
+        rotateCheck.add(distance(a.rotate(p), vec3(rp.x(), rp.y(), rp.z())));
+        
+        // Interpolate between nearby rotations, like consecutive animation frames.
+        QQuaternion qc = (qa * QQuaternion(1.0, randomFloat(-0.5f, 0.5f),
+            randomFloat(-0.5f, 0.5f), randomFloat(-0.5f, 0.5f))).normalized();
+        float t = randomFloat(0.0f, 1.0f);
+        quat c(qc);
+        slerpCheck.add(rotationError(quat::slerpFast(a, c, t), QQuaternion::slerp(qa, qc, t)));
+        quat n = quat::nlerp(a, c, t);
+        nlerpCheck.add(fabsf(float4::dot(n.q, n.q) - 1.0f));
+        
+        BoneTransform ta, tb;
+        ta.rotation = qa;
+        ta.location = QVector4D(p.x, p.y, p.z, 1.0);
+        vec3 loc2 = randomPoint(range);
+        tb.rotation = qb;
+        tb.location = QVector4D(loc2.x, loc2.y, loc2.z, 1.0);
+        dualquat da = dualquat::fromRotationTranslation(a, p);
+        dualquat db = dualquat::fromRotationTranslation(b, loc2);
+        vec3 v = randomPoint(range);
+        dqMapCheck.add(distance(da.map(v), ta.map(v)));
+        
+        // Composition: tb followed by ta.
+        BoneTransform tab;
+        tab.location = ta.map(tb.location);
+        tab.rotation = ta.rotation * tb.rotation;
+        dqMulCheck.add(distance((da * db).map(v), tab.map(v)));
+        
+        affine3 m = affine3::fromDualQuaternion(da);
+        affineCheck.add(distance(m.map(v), ta.map(v)));
+    }
+    
+    // Batched transforms of many points with the same transformation.
+    QQuaternion qr = randomRotation();
+    vec3 tr = randomPoint(range);
+    BoneTransform ref;
+    ref.rotation = qr;
+    ref.location = QVector4D(tr.x, tr.y, tr.z, 1.0);
+    affine3 m = affine3::fromRotationTranslation(quat(qr), tr);
+    m.mapPoints(points.constData(), mapped.data(), count);
+    for(int i = 0; i < count; i++)
+        affine4Check.add(distance(mapped[i], ref.map(points[i])));
+    
+    bool passed = true;
+    passed &= mulCheck.report();
+    passed &= rotateCheck.report();
+    passed &= nlerpCheck.report();
+    passed &= slerpCheck.report();
+    passed &= dqMapCheck.report();
+    passed &= dqMulCheck.report();
+    passed &= affineCheck.report();
+    passed &= affine4Check.report();
+    
+    // Speed: interpolate and compose bone transformations, as done when
+    // evaluating an animation.
+    QVector<BoneTransform> frames(count + 1);
+    for(int i = 0; i <= count; i++)
+    {
+        frames[i].rotation = randomRotation();
+        vec3 loc = randomPoint(range);
+        frames[i].location = QVector4D(loc.x, loc.y, loc.z, 1.0);
+    }
+    QVector<vec4> out(count * 2);
+    BenchTimer oldTimer("BoneTransform");
+    BenchTimer newTimer("quat/dualquat");
+    for(int run = 0; run < 10; run++)
+    {
+        oldTimer.begin();
+        BoneTransform parent;
+        for(int i = 0; i < count; i++)
+        {
+            BoneTransform bone = BoneTransform::interpolate(frames[i], frames[i + 1], 0.3);
+            BoneTransform eff;
+            eff.location = parent.map(bone.location);
+            eff.rotation = parent.rotation * bone.rotation;
+            eff.toDualQuaternion(out[i * 2], out[i * 2 + 1]);
+        }
+        oldTimer.end();
+        
+        newTimer.begin();
+        quat parentRot;
+        for(int i = 0; i < count; i++)
+        {
+            quat rot = quat::slerpFast(quat(frames[i].rotation), quat(frames[i + 1].rotation), 0.3f);
+            const QVector4D &l1 = frames[i].location, &l2 = frames[i + 1].location;
+            vec3 loc((float)(l1.x() + (l2.x() - l1.x()) * 0.3f),
+                     (float)(l1.y() + (l2.y() - l1.y()) * 0.3f),
+                     (float)(l1.z() + (l2.z() - l1.z()) * 0.3f));
+            dualquat::fromRotationTranslation(parentRot * rot, parentRot.rotate(loc))
+                .store(out[i * 2], out[i * 2 + 1]);
+        }
+        newTimer.end();
+    }
+    oldTimer.report();
+    newTimer.report();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Render/MeshPool.h"
+#include "EQuilibre/Render/Vertex.h"
+#include "Bench.h"
+
+/*!
+  \brief Model whose meshes are added to the pool together, like the parts of
+  a character. Each vertex holds the model's ID and its own index so that the
+  geometry can be checked after it has been moved.
+  */
+struct TestModel
+{
+    uint32_t id;
+    uint32_t handle;
+    uint32_t vertexCount;
+    uint32_t material;
+    QVector<uint32_t> indices;
+    QVector<MeshData *> meshes;
+    QVector<uint32_t> vertexOffsets;
+    QVector<uint32_t> indexOffsets;
+};
+
+static void createModel(TestModel &model, uint32_t id, uint32_t maxVertices, MeshPool &pool,
+                        bool keepGeometry = false)
+{
+    MeshBuffer staging;
+    model.id = id;
+    model.material = rand() % 16;
+    uint32_t meshCount = 1 + (rand() % 3);
+    for(uint32_t i = 0; i < meshCount; i++)
+    {
+        uint32_t first = staging.vertices.count();
+        uint32_t count = 3 + (rand() % (maxVertices / meshCount));
+        for(uint32_t j = 0; j < count; j++)
+        {
+            Vertex v;
+            v.position = vec3(id, first + j, 0.0f);
+            v.packNormal(vec3(0.0f, 0.0f, 1.0f));
+            v.packTexCoords(vec2(0.0f, 0.0f));
+            v.layer = 0;
+            v.bone = 0;
+            v.color = 0xffffffff;
+            staging.vertices.append(v);
+        }
+        MeshData *mesh = staging.createMesh(1 + (rand() % 3));
+        mesh->vertexSegment.offset = first;
+        mesh->vertexSegment.count = count;
+        mesh->vertexSegment.elementSize = sizeof(Vertex);
+        mesh->indexSegment.offset = staging.indices.count();
+        mesh->indexSegment.elementSize = sizeof(uint32_t);
+        for(uint32_t g = 0; g < mesh->groupCount; g++)
+        {
+            MaterialGroup &mg = mesh->matGroups[g];
+            mg.id = g;
+            mg.offset = staging.indices.count() - mesh->indexSegment.offset;
+            mg.count = 3 * (1 + (rand() % 200));
+            mg.matID = g;
+            for(uint32_t j = 0; j < mg.count; j++)
+                staging.indices.append(first + (rand() % count));
+        }
+        mesh->indexSegment.count = staging.indices.count() - mesh->indexSegment.offset;
+        model.meshes.append(mesh);
+        model.vertexOffsets.append(first);
+        model.indexOffsets.append(mesh->indexSegment.offset);
+    }
+    model.vertexCount = staging.vertices.count();
+    model.indices = staging.indices;
+    model.handle = pool.add(&staging, keepGeometry);
+}
+
+/*!
+  \brief Check that the model's vertices, indices and meshes are where its
+  allocation says they are.
+  */
+static int checkModel(const TestModel &model, const MeshPool &pool)
+{
+    if(!pool.contains(model.handle))
+        return 1;
+    int errors = 0;
+    const MeshAllocation &alloc = pool.allocation(model.handle);
+    const MeshBuffer *buffer = alloc.buffer;
+    errors += (alloc.vertexCount != model.vertexCount);
+    errors += (alloc.indexCount != (uint32_t)model.indices.count());
+    errors += (alloc.meshes.count() != model.meshes.count());
+    if(((alloc.baseVertex + alloc.vertexCount) > (uint32_t)buffer->vertices.count()) ||
+       ((alloc.indexOffset + alloc.indexCount) > (uint32_t)buffer->indices.count()))
+        return errors + 1;
+    for(uint32_t i = 0; i < model.vertexCount; i++)
+    {
+        const vec3 &pos = buffer->vertices[alloc.baseVertex + i].position;
+        errors += (pos.x != model.id) || (pos.y != i);
+    }
+    for(int i = 0; i < model.indices.count(); i++)
+        errors += (buffer->indices[alloc.indexOffset + i] != (model.indices[i] + alloc.baseVertex));
+    for(int i = 0; i < model.meshes.count(); i++)
+    {
+        MeshData *mesh = model.meshes[i];
+        errors += (mesh->buffer != buffer) || !buffer->meshes.contains(mesh);
+        errors += (mesh->vertexSegment.offset != (alloc.baseVertex + model.vertexOffsets[i]));
+        errors += (mesh->indexSegment.offset != (alloc.indexOffset + model.indexOffsets[i]));
+        const MaterialGroup *ranges = mesh->ranges();
+        for(uint32_t g = 0; g < mesh->groupCount; g++)
+        {
+            errors += (ranges[g].offset != (mesh->indexSegment.offset + mesh->matGroups[g].offset));
+            errors += (ranges[g].count != mesh->matGroups[g].count);
+        }
+    }
+    return errors;
+}
+
+/*!
+  \brief Check that no two allocations of a buffer overlap and that indices
+  fit in the buffer's index size.
+  */
+static int checkLayout(const QVector<TestModel> &models, const MeshPool &pool)
+{
+    int errors = 0;
+    for(int i = 0; i < models.count(); i++)
+    {
+        const MeshAllocation &a = pool.allocation(models[i].handle);
+        errors += (a.buffer->indexSize == sizeof(uint16_t)) &&
+                  ((a.baseVertex + a.vertexCount) > 65536);
+        for(int j = i + 1; j < models.count(); j++)
+        {
+            const MeshAllocation &b = pool.allocation(models[j].handle);
+            if(a.buffer != b.buffer)
+                continue;
+            errors += (a.vertexCount > 0) && (b.vertexCount > 0) &&
+                      (a.baseVertex < (b.baseVertex + b.vertexCount)) &&
+                      (b.baseVertex < (a.baseVertex + a.vertexCount));
+            errors += (a.indexCount > 0) && (b.indexCount > 0) &&
+                      (a.indexOffset < (b.indexOffset + b.indexCount)) &&
+                      (b.indexOffset < (a.indexOffset + a.indexCount));
+        }
+    }
+    return errors;
+}
+
+/*!
+  \brief Count the vertex buffer binds needed to draw every model once, in
+  material order, when each model has its own buffer and with the pool.
+  */
+static void countBinds(const QVector<TestModel> &models, const MeshPool &pool,
+                       uint32_t &modelBinds, uint32_t &poolBinds)
+{
+    modelBinds = poolBinds = 0;
+    const MeshBuffer *current = NULL;
+    for(uint32_t material = 0; material < 16; material++)
+    {
+        foreach(const TestModel &model, models)
+        {
+            if(model.material != material)
+                continue;
+            const MeshBuffer *buffer = pool.allocation(model.handle).buffer;
+            modelBinds++;
+            poolBinds += (buffer != current);
+            current = buffer;
+        }
+    }
+}
+
+static int checkAll(const QVector<TestModel> &globals, const QVector<TestModel> &zone,
+                    const MeshPool &pool)
+{
+    int errors = 0;
+    QVector<TestModel> all(globals);
+    all += zone;
+    foreach(const TestModel &model, all)
+        errors += checkModel(model, pool);
+    errors += checkLayout(all, pool);
+    return errors;
+}
+
+/*!
+  \brief Load and unload the models of several zones into a mesh pool that
+  also holds global models, checking the geometry of every model after adding,
+  removing and defragmenting.
+  */
+int benchMeshPool(const QStringList &args)
+{
+    const int modelCount = intArg(args, 0, 400);
+    const int rounds = intArg(args, 1, 8);
+    const uint32_t maxVertices = 2000;
+    srand(7);
+    MeshPool pool;
+    int errors = 0;
+    uint32_t nextID = 0;
+    
+    // Models that do not fit in a default buffer get one of their own.
+    TestModel large;
+    createModel(large, nextID++, MeshPool::DefaultVertexCapacity * 2, pool);
+    while(large.vertexCount <= MeshPool::DefaultVertexCapacity)
+    {
+        pool.remove(large.handle);
+        large = TestModel();
+        createModel(large, nextID++, MeshPool::DefaultVertexCapacity * 2, pool);
+    }
+    errors += checkModel(large, pool);
+    errors += (pool.allocation(large.handle).buffer->indexSize != sizeof(uint32_t));
+    pool.remove(large.handle);
+    pool.defragment(NULL);
+    errors += (pool.bufferCount() != 0);
+    
+    // Models that keep their geometry in memory do not share buffers with
+    // models that don't.
+    TestModel kept, freed;
+    createModel(kept, nextID++, maxVertices, pool, true);
+    createModel(freed, nextID++, maxVertices, pool, false);
+    errors += checkModel(kept, pool) + checkModel(freed, pool);
+    errors += (pool.allocation(kept.handle).buffer == pool.allocation(freed.handle).buffer);
+    pool.remove(kept.handle);
+    pool.remove(freed.handle);
+    pool.defragment(NULL);
+    errors += (pool.bufferCount() != 0);
+    
+    QVector<TestModel> globals(modelCount / 4);
+    for(int i = 0; i < globals.count(); i++)
+        createModel(globals[i], nextID++, maxVertices, pool);
+    errors += checkAll(globals, QVector<TestModel>(), pool);
+    
+    BenchTimer addTimer("add");
+    BenchTimer removeTimer("remove");
+    BenchTimer defragTimer("defragment");
+    for(int round = 0; round < rounds; round++)
+    {
+        // Load a zone, unload some of its models and load others in the holes.
+        QVector<TestModel> zone(modelCount);
+        addTimer.begin();
+        for(int i = 0; i < zone.count(); i++)
+        {
+            createModel(zone[i], nextID++, maxVertices, pool);
+            
+            // Global models are also loaded while in a zone, which leaves
+            // them between zone models.
+            if((i % 50) == 0)
+            {
+                globals.append(TestModel());
+                createModel(globals.last(), nextID++, maxVertices, pool);
+            }
+        }
+        addTimer.end();
+        for(int i = zone.count() - 1; i >= 0; i--)
+        {
+            if((rand() % 3) == 0)
+            {
+                pool.remove(zone[i].handle);
+                zone.remove(i);
+            }
+        }
+        uint32_t buffersBefore = pool.bufferCount();
+        for(int i = 0; i < (modelCount / 8); i++)
+        {
+            zone.append(TestModel());
+            createModel(zone.last(), nextID++, maxVertices / 4, pool);
+        }
+        errors += checkAll(globals, zone, pool);
+        QVector<TestModel> loaded(globals);
+        loaded += zone;
+        uint32_t modelBinds = 0, poolBinds = 0;
+        countBinds(loaded, pool, modelBinds, poolBinds);
+        fprintf(stdout, "round %d: %4d models in %2d buffers (%d before refill), "
+                "%7d vertices, %4d free ranges, binds %4d -> %3d\n",
+                round, pool.allocationCount(), pool.bufferCount(), buffersBefore,
+                pool.usedVertices(), pool.freeRangeCount(), modelBinds, poolBinds);
+        
+        // Switch zones: the global models must survive defragmentation.
+        removeTimer.begin();
+        foreach(const TestModel &model, zone)
+            pool.remove(model.handle);
+        removeTimer.end();
+        defragTimer.begin();
+        pool.defragment(NULL);
+        defragTimer.end();
+        errors += (pool.allocationCount() != (uint32_t)globals.count());
+        errors += (pool.freeRangeCount() > (pool.bufferCount() * 2));
+        errors += checkAll(globals, QVector<TestModel>(), pool);
+    }
+    addTimer.report();
+    removeTimer.report();
+    defragTimer.report();
+    return reportErrors(errors);
+}
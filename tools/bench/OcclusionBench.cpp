@@ -0,0 +1,240 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Render/Geometry.h"
+#include "EQuilibre/Render/OcclusionBuffer.h"
+#include "Bench.h"
+
+static void addQuad(QVector<vec3> &triangles, vec3 center, vec3 u, vec3 v)
+{
+    vec3 a = center - u - v, b = center + u - v, c = center + u + v, d = center - u + v;
+    triangles.append(a);
+    triangles.append(b);
+    triangles.append(c);
+    triangles.append(a);
+    triangles.append(c);
+    triangles.append(d);
+}
+
+/*!
+  \brief Return the distance along the ray to the nearest triangle it hits,
+  or a negative value if it hits none.
+  */
+static float castRay(const vec3 &origin, const vec3 &dir, const QVector<vec3> &triangles)
+{
+    float nearest = -1.0f;
+    for(int i = 0; (i + 2) < triangles.count(); i += 3)
+    {
+        vec3 e1 = triangles[i + 1] - triangles[i];
+        vec3 e2 = triangles[i + 2] - triangles[i];
+        vec3 p = vec3::cross(dir, e2);
+        float det = vec3::dot(e1, p);
+        if(fabs(det) < 1e-9f)
+            continue;
+        float invDet = 1.0f / det;
+        vec3 s = origin - triangles[i];
+        float u = vec3::dot(s, p) * invDet;
+        if((u < 0.0f) || (u > 1.0f))
+            continue;
+        vec3 q = vec3::cross(s, e1);
+        float v = vec3::dot(dir, q) * invDet;
+        if((v < 0.0f) || ((u + v) > 1.0f))
+            continue;
+        float t = vec3::dot(e2, q) * invDet;
+        if((t > 0.0f) && ((nearest < 0.0f) || (t < nearest)))
+            nearest = t;
+    }
+    return nearest;
+}
+
+static int checkFixedScene(OcclusionBuffer &buffer, Frustum &frustum)
+{
+    // A wall 100 units in front of the camera, hiding part of the screen.
+    frustum.setEye(vec3(0.0, 0.0, 0.0));
+    frustum.setFocus(vec3(1.0, 0.0, 0.0));
+    frustum.update();
+    QVector<vec3> wall;
+    addQuad(wall, vec3(100.0, 0.0, 0.0), vec3(0.0, 50.0, 0.0), vec3(0.0, 0.0, 30.0));
+    matrix4 viewProj = frustum.projection() * frustum.camera();
+    buffer.clear(viewProj);
+    buffer.addOccluder(wall.constData(), wall.count() / 3);
+    buffer.rasterize();
+    
+    int errors = 0;
+    // Behind the wall.
+    errors += !buffer.isOccluded(AABox(vec3(300.0, -20.0, -20.0), vec3(310.0, 20.0, 20.0)));
+    // In front of the wall.
+    errors += buffer.isOccluded(AABox(vec3(50.0, -5.0, -5.0), vec3(60.0, 5.0, 5.0)));
+    // Behind the wall but sticking out past its edge.
+    errors += buffer.isOccluded(AABox(vec3(300.0, 140.0, -5.0), vec3(310.0, 160.0, 5.0)));
+    // Going through the wall.
+    errors += buffer.isOccluded(AABox(vec3(95.0, -5.0, -5.0), vec3(105.0, 5.0, 5.0)));
+    // Behind the camera.
+    errors += buffer.isOccluded(AABox(vec3(-60.0, -5.0, -5.0), vec3(-50.0, 5.0, 5.0)));
+    // Off-screen.
+    errors += buffer.isOccluded(AABox(vec3(300.0, 1000.0, -5.0), vec3(310.0, 1010.0, 5.0)));
+    
+    // Looking along the wall from up close, so that it crosses the near plane.
+    frustum.setEye(vec3(99.0, 0.0, 0.0));
+    frustum.setFocus(vec3(99.0, 1.0, 0.0));
+    frustum.update();
+    viewProj = frustum.projection() * frustum.camera();
+    buffer.clear(viewProj);
+    buffer.addOccluder(wall.constData(), wall.count() / 3);
+    buffer.rasterize();
+    errors += !buffer.isOccluded(AABox(vec3(110.0, 40.0, -5.0), vec3(115.0, 45.0, 5.0)));
+    errors += buffer.isOccluded(AABox(vec3(90.0, 40.0, -5.0), vec3(95.0, 45.0, 5.0)));
+    if(errors > 0)
+        fprintf(stdout, "%d errors in the fixed scene\n", errors);
+    return errors;
+}
+
+/*!
+  \brief Check that the occlusion buffer matches ray-traced depth, that it
+  gives the same results with one or several threads, and time it.
+  */
+int benchOcclusion(const QStringList &args)
+{
+    const int wallCount = intArg(args, 0, 100);
+    const int frames = intArg(args, 1, 50);
+    const int boxCount = 10000;
+    const int samplesPerFrame = 2000;
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(2000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    OcclusionBuffer single, threaded;
+    threaded.setThreadCount(4);
+    int errors = checkFixedScene(single, frustum);
+    
+    // Random walls and boxes in front of the camera.
+    srand(42);
+    QVector<vec3> walls;
+    for(int i = 0; i < wallCount; i++)
+    {
+        float dist = randomFloat(20.0f, 600.0f);
+        vec3 center(dist, randomFloat(-0.8f, 0.8f) * dist, randomFloat(-0.4f, 0.4f) * dist);
+        float angle = randomFloat(-1.2f, 1.2f);
+        vec3 u(sin(angle), cos(angle), 0.0f);
+        addQuad(walls, center, u * randomFloat(5.0f, 60.0f), vec3(0.0, 0.0, randomFloat(5.0f, 40.0f)));
+    }
+    QVector<AABox> boxes(boxCount);
+    for(int i = 0; i < boxCount; i++)
+    {
+        float dist = randomFloat(10.0f, 1000.0f);
+        vec3 center(dist, randomFloat(-0.8f, 0.8f) * dist, randomFloat(-0.4f, 0.4f) * dist);
+        vec3 extent(randomFloat(0.5f, 10.0f), randomFloat(0.5f, 10.0f), randomFloat(0.5f, 10.0f));
+        boxes[i] = AABox(center - extent, center + extent);
+    }
+    
+    BenchTimer singleTimer("rasterize (1 thread)");
+    BenchTimer threadedTimer("rasterize (4 threads)");
+    BenchTimer testTimer("test boxes");
+    int depthMismatches = 0, threadMismatches = 0, falseOcclusions = 0, samples = 0;
+    uint64_t totalOccluded = 0;
+    const float tanHalf = tan(45.0 * 0.5 * M_PI / 180.0);
+    for(int f = 0; f < frames; f++)
+    {
+        vec3 eye(0.0f, 0.0f, randomFloat(-10.0f, 10.0f));
+        float yaw = randomFloat(-0.3f, 0.3f);
+        vec3 forward(cos(yaw), sin(yaw), 0.0f);
+        frustum.setEye(eye);
+        frustum.setFocus(eye + forward);
+        frustum.update();
+        matrix4 viewProj = frustum.projection() * frustum.camera();
+        
+        singleTimer.begin();
+        single.clear(viewProj);
+        single.addOccluder(walls.constData(), walls.count() / 3);
+        single.rasterize();
+        singleTimer.end();
+        threadedTimer.begin();
+        threaded.clear(viewProj);
+        threaded.addOccluder(walls.constData(), walls.count() / 3);
+        threaded.rasterize();
+        threadedTimer.end();
+        int pixels = single.width() * single.height();
+        for(int i = 0; i < pixels; i++)
+            threadMismatches += (single.depth()[i] != threaded.depth()[i]);
+        
+        // Compare the depth of random pixels with the nearest wall hit by a
+        // ray through the pixel's center.
+        vec3 right = vec3::cross(forward, frustum.up()).normalized();
+        vec3 up = vec3::cross(right, forward);
+        for(int i = 0; i < samplesPerFrame; i++)
+        {
+            int px = rand() % single.width(), py = rand() % single.height();
+            float ndcX = ((px + 0.5f) / single.width()) * 2.0f - 1.0f;
+            float ndcY = 1.0f - ((py + 0.5f) / single.height()) * 2.0f;
+            vec3 dir = forward + right * (ndcX * tanHalf * frustum.aspect()) + up * (ndcY * tanHalf);
+            // With this direction the distance along the ray is the view depth.
+            float t = castRay(eye, dir, walls);
+            float expected = (t > 0.0f) ? (1.0f / t) : 0.0f;
+            float actual = single.depth()[(py * single.width()) + px];
+            if(fabs(actual - expected) > (1e-3f * qMax(actual, expected)))
+                depthMismatches++;
+            samples++;
+        }
+        
+        // Occluded boxes should not have any face center or their center in
+        // view and not hidden by a wall.
+        testTimer.begin();
+        QVector<int> occluded;
+        for(int i = 0; i < boxCount; i++)
+        {
+            if(single.isOccluded(boxes[i]))
+                occluded.append(i);
+        }
+        testTimer.end();
+        totalOccluded += occluded.count();
+        foreach(int index, occluded)
+        {
+            const AABox &b = boxes[index];
+            vec3 c = b.center();
+            vec3 points[7] = {c, vec3(b.low.x, c.y, c.z), vec3(b.high.x, c.y, c.z),
+                              vec3(c.x, b.low.y, c.z), vec3(c.x, b.high.y, c.z),
+                              vec3(c.x, c.y, b.low.z), vec3(c.x, c.y, b.high.z)};
+            for(int j = 0; j < 7; j++)
+            {
+                if(frustum.containsPoint(points[j]) == OUTSIDE)
+                    continue;
+                float t = castRay(eye, points[j] - eye, walls);
+                if((t < 0.0f) || (t > 0.999f))
+                {
+                    falseOcclusions++;
+                    break;
+                }
+            }
+        }
+    }
+    
+    // Pixel centers that fall on a wall's edge can go either way.
+    int depthErrors = (depthMismatches > (samples / 1000)) ? depthMismatches : 0;
+    errors += depthErrors + threadMismatches + falseOcclusions;
+    fprintf(stdout, "%d walls, %d boxes, %d frames, %.1f occluded boxes on average\n",
+            wallCount, boxCount, frames, (double)totalOccluded / qMax(frames, 1));
+    fprintf(stdout, "%d/%d depth mismatches, %d thread mismatches, %d false occlusions\n",
+            depthMismatches, samples, threadMismatches, falseOcclusions);
+    singleTimer.report();
+    threadedTimer.report();
+    testTimer.report();
+    return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+/*!
+  \brief Actor with arbitrary bounds, used when no zone is given.
+  */
+class BenchActor : public WLDActor
+{
+public:
+    BenchActor(const AABox &bounds) : WLDActor(Static)
+    {
+        setBounds(bounds);
+    }
+    
+    void setBounds(const AABox &bounds)
+    {
+        m_boundsAA = bounds;
+        m_location = bounds.center();
+    }
+};
+
+static void createActors(QVector<WLDActor *> &actors, int count)
+{
+    // Place objects in clusters, like buildings and trees in a zone.
+    const float zoneSize = 3000.0f;
+    srand(42);
+    vec3 cluster;
+    for(int i = 0; i < count; i++)
+    {
+        if((i % 50) == 0)
+            cluster = vec3(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize),
+                           randomFloat(-100.0f, 100.0f));
+        vec3 pos = cluster + vec3(randomFloat(-200.0f, 200.0f), randomFloat(-200.0f, 200.0f),
+                                  randomFloat(-10.0f, 10.0f));
+        float size = (rand() % 10) ? randomFloat(1.0f, 10.0f) : randomFloat(20.0f, 100.0f);
+        vec3 extent(size, size, size);
+        actors.append(new BenchActor(AABox(pos - extent, pos + extent)));
+    }
+}
+
+static void collectCallback(WLDActor *actor, void *user)
+{
+    ((QVector<WLDActor *> *)user)->append(actor);
+}
+
+/*!
+  \brief Compare the pointer-based OctreeIndex and the LinearOctree, building
+  them from the objects of a zone (or random objects) and culling them with
+  cameras placed in the zone.
+  */
+int benchOctree(const QStringList &args)
+{
+    const int frames = intArg(args, 0, 1000);
+    Game *game = NULL;
+    Zone *zone = NULL;
+    QVector<WLDActor *> actors;
+    bool ownActors = false;
+    if(args.count() >= 3)
+    {
+        game = new Game();
+        zone = new Zone(game);
+        if(!loadBenchZone(*zone, args[1], args[2]))
+            return 1;
+        zone->objects()->addTo(actors);
+    }
+    else
+    {
+        createActors(actors, 20000);
+        ownActors = true;
+    }
+    if(actors.count() == 0)
+        return 1;
+    
+    AABox bounds = actors[0]->boundsAA();
+    foreach(WLDActor *actor, actors)
+        bounds.extendTo(actor->boundsAA());
+    
+    BenchTimer pointerBuild("OctreeIndex build");
+    BenchTimer linearBuild("LinearOctree build");
+    pointerBuild.begin();
+    OctreeIndex pointerTree(bounds, 8);
+    foreach(WLDActor *actor, actors)
+        pointerTree.add(actor);
+    pointerBuild.end();
+    linearBuild.begin();
+    LinearOctree linearTree(8);
+    linearTree.build(actors);
+    linearBuild.end();
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(1000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    
+    BenchTimer pointerCull("OctreeIndex cull");
+    BenchTimer linearCull("LinearOctree cull");
+    QVector<WLDActor *> pointerVisible;
+    QVector<uint32_t> linearVisible(linearTree.actorCount());
+    QVector<WLDActor *> sorted1, sorted2;
+    uint64_t totalVisible = 0;
+    int mismatches = 0;
+    srand(7);
+    vec3 center = bounds.center(), extent = (bounds.high - bounds.low) * 0.5f;
+    for(int i = 0; i < frames; i++)
+    {
+        // Random camera inside the zone, looking horizontally.
+        vec3 eye(center.x + randomFloat(-extent.x, extent.x),
+                 center.y + randomFloat(-extent.y, extent.y),
+                 center.z + randomFloat(-extent.z, extent.z));
+        float angle = randomFloat(0.0f, 6.2831853f);
+        frustum.setEye(eye);
+        frustum.setFocus(eye + vec3(cos(angle), sin(angle), 0.0f));
+        frustum.update();
+        
+        pointerVisible.clear();
+        pointerCull.begin();
+        pointerTree.findVisible(frustum, collectCallback, &pointerVisible, true);
+        pointerCull.end();
+        
+        linearCull.begin();
+        uint32_t found = linearTree.findVisible(frustum, linearVisible.data(), true);
+        linearCull.end();
+        totalVisible += found;
+        
+        // Both structures must find the same actors.
+        sorted1 = pointerVisible;
+        sorted2.resize(found);
+        for(uint32_t j = 0; j < found; j++)
+            sorted2[j] = linearTree.actor(linearVisible[j]);
+        qSort(sorted1.begin(), sorted1.end());
+        qSort(sorted2.begin(), sorted2.end());
+        if(sorted1 != sorted2)
+            mismatches++;
+    }
+    
+    fprintf(stdout, "%d actors, %d nodes, %d frames, %.1f visible actors on average\n",
+            actors.count(), linearTree.nodeCount(), frames,
+            (double)totalVisible / qMax(frames, 1));
+    pointerBuild.report();
+    linearBuild.report();
+    pointerCull.report();
+    linearCull.report();
+    if(mismatches > 0)
+        fprintf(stdout, "%d frames with different results\n", mismatches);
+    
+    if(ownActors)
+    {
+        foreach(WLDActor *actor, actors)
+            delete actor;
+    }
+    if(zone)
+    {
+        zone->clear(NULL);
+        delete zone;
+    }
+    delete game;
+    return (mismatches > 0) ? 1 : 0;
+}
+
+template<typename T>
+static int checkMovingQuery(OctreeIndex &tree, const T &volume,
+                            const QVector<BenchActor *> &actors,
+                            const QVector<bool> &indexed)
+{
+    // Compare the actors found using the tree with a brute-force search.
+    QVector<WLDActor *> found, expected;
+    tree.findVisible(volume, collectCallback, &found, true);
+    for(int i = 0; i < actors.count(); i++)
+    {
+        if(indexed[i] && (volume.containsAABox(actors[i]->boundsAA()) != OUTSIDE))
+            expected.append(actors[i]);
+    }
+    qSort(found.begin(), found.end());
+    qSort(expected.begin(), expected.end());
+    return (found != expected) ? 1 : 0;
+}
+
+/*!
+  \brief Move many actors around an OctreeIndex at the movement tick rate,
+  adding and removing some of them, and check query results against a
+  brute-force search.
+  */
+int benchMovingActors(const QStringList &args)
+{
+    const int count = intArg(args, 0, 5000);
+    const int ticks = intArg(args, 1, 600);
+    const float zoneSize = 3000.0f;
+    const float dt = 1.0f / 60.0f;
+    
+    srand(42);
+    AABox bounds(vec3(-zoneSize, -zoneSize, -zoneSize), vec3(zoneSize, zoneSize, zoneSize));
+    OctreeIndex tree(bounds, 8);
+    QVector<BenchActor *> actors(count);
+    QVector<vec3> velocities(count);
+    QVector<float> sizes(count);
+    QVector<bool> indexed(count);
+    for(int i = 0; i < count; i++)
+    {
+        vec3 pos(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize),
+                 randomFloat(-100.0f, 100.0f));
+        sizes[i] = (rand() % 20) ? randomFloat(2.0f, 8.0f) : randomFloat(20.0f, 60.0f);
+        vec3 extent(sizes[i], sizes[i], sizes[i] * 2.0f);
+        velocities[i] = vec3(randomFloat(-300.0f, 300.0f), randomFloat(-300.0f, 300.0f), 0.0f);
+        actors[i] = new BenchActor(AABox(pos - extent, pos + extent));
+        tree.add(actors[i]);
+        indexed[i] = true;
+    }
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(1000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    
+    BenchTimer moveTimer("move + update");
+    BenchTimer cullTimer("frustum query");
+    int mismatches = 0, queries = 0;
+    for(int t = 0; t < ticks; t++)
+    {
+        moveTimer.begin();
+        for(int i = 0; i < count; i++)
+        {
+            if(!indexed[i])
+                continue;
+            // Actors wander a bit outside of the tree before turning back.
+            BenchActor *actor = actors[i];
+            vec3 pos = actor->location() + velocities[i] * dt;
+            if((pos.x < -zoneSize * 1.1f) || (pos.x > zoneSize * 1.1f))
+                velocities[i].x = -velocities[i].x;
+            if((pos.y < -zoneSize * 1.1f) || (pos.y > zoneSize * 1.1f))
+                velocities[i].y = -velocities[i].y;
+            vec3 extent(sizes[i], sizes[i], sizes[i] * 2.0f);
+            actor->setBounds(AABox(pos - extent, pos + extent));
+            tree.move(actor);
+        }
+        tree.update();
+        moveTimer.end();
+        
+        // Despawn and respawn a few actors.
+        for(int j = 0; j < qMax(1, count / 200); j++)
+        {
+            int i = rand() % count;
+            if(indexed[i])
+                tree.remove(actors[i]);
+            else
+                tree.add(actors[i]);
+            indexed[i] = !indexed[i];
+        }
+        
+        if((t % 10) == 0)
+        {
+            vec3 eye(randomFloat(-zoneSize, zoneSize), randomFloat(-zoneSize, zoneSize), 0.0f);
+            float angle = randomFloat(0.0f, 6.2831853f);
+            frustum.setEye(eye);
+            frustum.setFocus(eye + vec3(cos(angle), sin(angle), 0.0f));
+            frustum.update();
+            cullTimer.begin();
+            QVector<WLDActor *> found;
+            tree.findVisible(frustum, collectCallback, &found, true);
+            cullTimer.end();
+            mismatches += checkMovingQuery(tree, frustum, actors, indexed);
+            mismatches += checkMovingQuery(tree, Sphere(eye, randomFloat(50.0f, 500.0f)),
+                                           actors, indexed);
+            queries += 2;
+        }
+    }
+    
+    int expectedCount = 0;
+    foreach(bool i, indexed)
+        expectedCount += i ? 1 : 0;
+    if(tree.count() != expectedCount)
+        mismatches++;
+    fprintf(stdout, "%d actors, %d ticks, %d queries, %d with different results\n",
+            count, ticks, queries, mismatches);
+    moveTimer.report();
+    cullTimer.report();
+    foreach(BenchActor *actor, actors)
+        delete actor;
+    return (mismatches > 0) ? 1 : 0;
+}
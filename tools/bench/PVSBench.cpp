@@ -0,0 +1,264 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QFile>
+#include <QTextStream>
+#include <QVector>
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Geometry.h"
+#include "Bench.h"
+
+struct CameraPoint
+{
+    vec3 pos;
+    float yaw;
+};
+
+static bool loadCameraPath(QString path, QVector<CameraPoint> &points)
+{
+    // One camera per line: x y z yaw (in degrees).
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly))
+        return false;
+    QTextStream stream(&file);
+    while(!stream.atEnd())
+    {
+        QStringList fields = stream.readLine().split(' ', QString::SkipEmptyParts);
+        if(fields.count() < 4)
+            continue;
+        CameraPoint p;
+        p.pos = vec3(fields[0].toFloat(), fields[1].toFloat(), fields[2].toFloat());
+        p.yaw = fields[3].toFloat();
+        points.append(p);
+    }
+    return true;
+}
+
+static void createCameraPath(const AABox &bounds, int count, QVector<CameraPoint> &points)
+{
+    // Walk through the zone at mid-height, turning slowly.
+    srand(7);
+    vec3 center = bounds.center(), extent = (bounds.high - bounds.low) * 0.5f;
+    CameraPoint p;
+    p.pos = center;
+    p.yaw = 0.0f;
+    for(int i = 0; i < count; i++)
+    {
+        p.yaw += (((float)rand() / (float)RAND_MAX) - 0.5f) * 10.0f;
+        float angle = p.yaw * (float)(M_PI / 180.0);
+        vec3 next = p.pos + vec3(cos(angle), sin(angle), 0.0f) * 5.0f;
+        if((fabs(next.x - center.x) > extent.x) || (fabs(next.y - center.y) > extent.y))
+            p.yaw += 180.0f;
+        else
+            p.pos = next;
+        points.append(p);
+    }
+}
+
+static void findObjectRegions(ZoneTerrain *terrain, LinearOctree *tree,
+                              QVector<uint32_t> &objectRegions)
+{
+    // Find the region each object is in from its bounding sphere, as the zone does.
+    objectRegions.resize(tree->actorCount());
+    for(uint32_t i = 0; i < tree->actorCount(); i++)
+    {
+        AABox bb = tree->actorBounds(i);
+        vec3 extent = (bb.high - bb.low) * 0.5f;
+        objectRegions[i] = terrain->findContainingRegion(Sphere(bb.center(),
+                                                                sqrt(extent.lengthSquared())));
+    }
+}
+
+/*!
+  \brief Compare the number of terrain chunks and objects drawn with and without
+  the region PVS, along a camera path recorded in a file or generated.
+  */
+int benchPVS(const QStringList &args)
+{
+    if(args.count() < 2)
+    {
+        fprintf(stderr, "usage: bench pvs <assetDir> <zoneName> [cameraPath]\n");
+        return 1;
+    }
+    Game game;
+    Zone zone(&game);
+    if(!loadBenchZone(zone, args[0], args[1]))
+        return 1;
+    ZoneTerrain *terrain = zone.terrain();
+    LinearOctree *tree = zone.actorIndex();
+    QVector<CameraPoint> path;
+    if(args.count() >= 3)
+    {
+        if(!loadCameraPath(args[2], path))
+        {
+            fprintf(stderr, "could not load camera path '%s'\n", args[2].toLatin1().constData());
+            return 1;
+        }
+    }
+    else
+    {
+        createCameraPath(terrain->bounds(), 2000, path);
+    }
+    
+    QVector<uint32_t> objectRegions;
+    findObjectRegions(terrain, tree, objectRegions);
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(2000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    BenchTimer allTimer("chunks without PVS");
+    BenchTimer pvsTimer("chunks with PVS");
+    QVector<uint32_t> visible(tree->actorCount());
+    uint64_t chunksAll = 0, chunksPVS = 0, objectsAll = 0, objectsPVS = 0;
+    int framesInRegion = 0;
+    foreach(CameraPoint p, path)
+    {
+        float angle = p.yaw * (float)(M_PI / 180.0);
+        frustum.setEye(p.pos);
+        frustum.setFocus(p.pos + vec3(cos(angle), sin(angle), 0.0f));
+        frustum.update();
+        
+        terrain->resetVisible();
+        allTimer.begin();
+        terrain->showAllChunks(frustum);
+        allTimer.end();
+        uint32_t allCount = terrain->visibleChunkCount();
+        chunksAll += allCount;
+        
+        uint32_t found = tree->findVisible(frustum, visible.data(), true);
+        objectsAll += found;
+        if(terrain->findCurrentRegion(p.pos) == 0)
+        {
+            // Without a current region the PVS can't be used.
+            chunksPVS += allCount;
+            objectsPVS += found;
+            continue;
+        }
+        framesInRegion++;
+        terrain->resetVisible();
+        pvsTimer.begin();
+        terrain->showNearbyChunks(frustum);
+        pvsTimer.end();
+        chunksPVS += terrain->visibleChunkCount();
+        for(uint32_t i = 0; i < found; i++)
+        {
+            if(terrain->isRegionVisible(objectRegions[visible[i]]))
+                objectsPVS++;
+        }
+    }
+    
+    double frames = qMax(path.count(), 1);
+    fprintf(stdout, "%d cameras, %d inside a region, %d regions, %d chunks, %d objects\n",
+            path.count(), framesInRegion, terrain->pvs().regionCount(),
+            terrain->chunks().count(), tree->actorCount());
+    fprintf(stdout, "chunks drawn: %.1f without PVS, %.1f with PVS\n",
+            chunksAll / frames, chunksPVS / frames);
+    fprintf(stdout, "objects drawn: %.1f without PVS, %.1f with PVS\n",
+            objectsAll / frames, objectsPVS / frames);
+    allTimer.report();
+    pvsTimer.report();
+    zone.clear(NULL);
+    return 0;
+}
+
+/*!
+  \brief Check that culling the zone with several threads gives the same
+  visible sets as culling it serially, and compare the wall time.
+  */
+int benchZoneCull(const QStringList &args)
+{
+    if(args.count() < 2)
+    {
+        fprintf(stderr, "usage: bench zonecull <assetDir> <zoneName> [threads]\n");
+        return 1;
+    }
+    const int maxThreads = intArg(args, 2, 4);
+    Game game;
+    Zone zone(&game);
+    if(!loadBenchZone(zone, args[0], args[1]))
+        return 1;
+    ZoneTerrain *terrain = zone.terrain();
+    ZoneObjects *objects = zone.objects();
+    LinearOctree *tree = zone.actorIndex();
+    QVector<CameraPoint> path;
+    createCameraPath(terrain->bounds(), 1000, path);
+    
+    QVector<uint32_t> objectRegions;
+    findObjectRegions(terrain, tree, objectRegions);
+    
+    Frustum frustum;
+    frustum.setAspect(16.0f / 9.0f);
+    frustum.setFarPlane(2000.0f);
+    frustum.setUp(vec3(0.0, 0.0, 1.0));
+    QVector<BenchTimer *> timers;
+    for(int threads = 1; threads <= maxThreads; threads *= 2)
+        timers.append(new BenchTimer(QString("cull (%1 threads)").arg(threads)));
+    QVector<uint32_t> visible(tree->actorCount());
+    int mismatches = 0;
+    foreach(CameraPoint p, path)
+    {
+        float angle = p.yaw * (float)(M_PI / 180.0);
+        frustum.setEye(p.pos);
+        frustum.setFocus(p.pos + vec3(cos(angle), sin(angle), 0.0f));
+        frustum.update();
+        
+        // Serial reference, as the zone used to cull.
+        terrain->resetVisible();
+        bool usePVS = (terrain->findCurrentRegion(p.pos) != 0);
+        if(usePVS)
+            terrain->showNearbyChunks(frustum);
+        else
+            terrain->showAllChunks(frustum);
+        QVector<uint32_t> expectedChunks = terrain->visibleChunks();
+        QVector<WLDStaticActor *> expectedObjects;
+        uint32_t found = tree->findVisible(frustum, visible.data(), true);
+        for(uint32_t i = 0; i < found; i++)
+        {
+            if(usePVS && !terrain->isRegionVisible(objectRegions[visible[i]]))
+                continue;
+            WLDStaticActor *actor = tree->actor(visible[i])->cast<WLDStaticActor>();
+            if(actor && actor->frag())
+                expectedObjects.append(actor);
+        }
+        
+        int timerIndex = 0;
+        for(int threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            game.setCullThreadCount(threads);
+            BenchTimer *timer = timers[timerIndex++];
+            timer->begin();
+            zone.cull(frustum);
+            timer->end();
+            mismatches += (terrain->visibleChunks() != expectedChunks);
+            mismatches += (objects->visibleObjects() != expectedObjects);
+        }
+    }
+    
+    fprintf(stdout, "%d cameras, %d regions, %d objects, %d mismatches\n",
+            path.count(), terrain->pvs().regionCount(), tree->actorCount(), mismatches);
+    foreach(BenchTimer *timer, timers)
+    {
+        timer->report();
+        delete timer;
+    }
+    zone.clear(NULL);
+    return (mismatches > 0) ? 1 : 0;
+}
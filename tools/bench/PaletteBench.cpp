@@ -0,0 +1,126 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Render/Vertex.h"
+#include "Bench.h"
+
+static BoneTransform randomTransform()
+{
+    BoneTransform t;
+    t.rotation = QQuaternion(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f),
+                             randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f)).normalized();
+    t.location = QVector4D(randomFloat(-100.0f, 100.0f), randomFloat(-100.0f, 100.0f),
+                           randomFloat(-100.0f, 100.0f), 1.0f);
+    return t;
+}
+
+/*!
+  \brief Allocate the bones of many character instances in a palette, like
+  a frame does, and check the layout of the palette after every frame.
+  */
+int benchPalette(const QStringList &args)
+{
+    const int characters = intArg(args, 0, 500);
+    const int frames = intArg(args, 1, 50);
+    // A few skeletons, each drawn by many instances.
+    const uint32_t skeletonBones[] = {1, 22, 43, 58, 64};
+    const int skeletons = sizeof(skeletonBones) / sizeof(uint32_t);
+    const float epsilon = 1e-3f;
+
+    srand(42);
+    BonePalette palette;
+    QVector<uint32_t> bases[skeletons];
+    QVector<BoneTransform> expected;
+    BenchTimer fillTimer("allocate and fill");
+    BenchTimer checkTimer("check layout");
+    int errors = 0;
+    uint32_t lastEpoch = palette.epoch();
+    for(int f = 0; f < frames; f++)
+    {
+        palette.clear();
+        errors += (palette.boneCount() != 0);
+        errors += (palette.epoch() == lastEpoch);
+        lastEpoch = palette.epoch();
+        for(int s = 0; s < skeletons; s++)
+            bases[s].clear();
+        expected.clear();
+
+        // Not every character is visible every frame.
+        int instances = characters - (rand() % qMax(characters / 4, 1));
+        expected.reserve(instances * skeletonBones[skeletons - 1]);
+        fillTimer.begin();
+        for(int i = 0; i < instances; i++)
+        {
+            int s = rand() % skeletons;
+            uint32_t boneCount = skeletonBones[s];
+            uint32_t base = palette.allocate(boneCount);
+            bases[s].append(base);
+            for(uint32_t j = 0; j < boneCount; j++)
+            {
+                BoneTransform t = randomTransform();
+                palette.setTransform(base + j, t);
+                expected.append(t);
+            }
+        }
+        fillTimer.end();
+        errors += (palette.capacity() < palette.boneCount());
+
+        checkTimer.begin();
+        for(int s = 0; s < skeletons; s++)
+        {
+            if(!palette.checkLayout(bases[s].constData(), skeletonBones[s], bases[s].count()))
+                errors++;
+        }
+        checkTimer.end();
+
+        // Bones are allocated one after the other, so the palette holds the
+        // transforms in the order they were set.
+        errors += (palette.boneCount() != (uint32_t)expected.count());
+        for(int i = 0; (i < expected.count()) && (i < (int)palette.boneCount()); i++)
+        {
+            vec3 p(randomFloat(-10.0f, 10.0f), randomFloat(-10.0f, 10.0f),
+                   randomFloat(-10.0f, 10.0f));
+            vec3 a = palette.transform(i).map(p);
+            vec3 b = expected[i].map(p);
+            float error = qMax(qAbs(a.x - b.x), qMax(qAbs(a.y - b.y), qAbs(a.z - b.z)));
+            errors += (error > epsilon);
+        }
+    }
+
+    // The check must reject overlapping ranges, ranges past the end of the
+    // palette and bones that are not unit dual quaternions.
+    if(skeletons > 1 && (bases[1].count() > 1))
+    {
+        QVector<uint32_t> overlap = bases[1];
+        overlap[1] = overlap[0] + 1;
+        errors += palette.checkLayout(overlap.constData(), skeletonBones[1], overlap.count());
+        QVector<uint32_t> outside = bases[1];
+        outside[0] = palette.boneCount();
+        errors += palette.checkLayout(outside.constData(), skeletonBones[1], outside.count());
+        vec4 *dq = palette.bones(bases[1][0]);
+        dq[0] = vec4(dq[0].x * 2.0f, dq[0].y * 2.0f, dq[0].z * 2.0f, dq[0].w * 2.0f);
+        errors += palette.checkLayout(bases[1].constData(), skeletonBones[1], bases[1].count());
+    }
+
+    fprintf(stdout, "%d characters, %d frames, %d bones in the last frame (capacity %d), %d errors\n",
+            characters, frames, palette.boneCount(), palette.capacity(), errors);
+    fillTimer.report();
+    checkTimer.report();
+    return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Game/Fragments.h"
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/PFSArchive.h"
+#include "EQuilibre/Game/WLDData.h"
+#include "EQuilibre/Game/Zone.h"
+#include "Bench.h"
+
+/*!
+  \brief Recursive descent of the fragment's nodes, as the zone used to do.
+  */
+static uint32_t findRegionRecursive(const QVector<RegionTreeNode> &nodes,
+                                    const vec3 &pos, uint32_t nodeIdx)
+{
+    if(nodeIdx == 0)
+        return 0;
+    const RegionTreeNode &node = nodes[nodeIdx - 1];
+    if(node.regionID != 0)
+        return node.regionID;
+    float distance = vec3::dot(node.normal, pos) + node.distance;
+    return findRegionRecursive(nodes, pos, (distance >= 0.0f) ? node.left : node.right);
+}
+
+static void findRegionsRecursive(const QVector<RegionTreeNode> &nodes, const Sphere &s,
+                                 uint32_t nodeIdx, QVector<uint32_t> &regions)
+{
+    if(nodeIdx == 0)
+        return;
+    const RegionTreeNode &node = nodes[nodeIdx - 1];
+    if(node.regionID != 0)
+    {
+        regions.append(node.regionID);
+        return;
+    }
+    float distance = vec3::dot(node.normal, s.pos) + node.distance;
+    if((distance >= 0.0f) || (s.radius >= -distance))
+        findRegionsRecursive(nodes, s, node.left, regions);
+    if((distance <= 0.0f) || (s.radius >= distance))
+        findRegionsRecursive(nodes, s, node.right, regions);
+}
+
+/*!
+  \brief Create a random BSP tree of the box, with nodes stored breadth-first
+  like in the fragment (1-based, leaves being nodes with a region ID).
+  */
+static void createTree(const AABox &bounds, int depth, QVector<RegionTreeNode> &nodes)
+{
+    QVector<QPair<AABox, int> > queue;
+    uint32_t regionID = 1;
+    RegionTreeNode empty = {vec3(), 0.0f, 0, 0, 0};
+    nodes.append(empty);
+    queue.append(qMakePair(bounds, 0));
+    for(int q = 0; q < queue.count(); q++)
+    {
+        AABox box = queue[q].first;
+        int level = queue[q].second;
+        RegionTreeNode &node = nodes[q];
+        if((level >= depth) || ((level > 4) && ((rand() % 8) == 0)))
+        {
+            node.regionID = regionID++;
+            continue;
+        }
+        
+        // Split along the largest axis, with a slightly tilted plane.
+        vec3 size = box.high - box.low;
+        int axis = (size.x > size.y) ? ((size.x > size.z) ? 0 : 2) : ((size.y > size.z) ? 1 : 2);
+        vec3 normal(randomFloat(-0.1f, 0.1f), randomFloat(-0.1f, 0.1f), randomFloat(-0.1f, 0.1f));
+        ((float *)&normal)[axis] = 1.0f;
+        normal = normal.normalized();
+        vec3 center = box.center();
+        float split = ((float *)&center)[axis] + ((float *)&size)[axis] * randomFloat(-0.2f, 0.2f);
+        vec3 onPlane = center;
+        ((float *)&onPlane)[axis] = split;
+        node.normal = normal;
+        node.distance = -vec3::dot(normal, onPlane);
+        
+        AABox front = box, back = box;
+        ((float *)&front.low)[axis] = split;
+        ((float *)&back.high)[axis] = split;
+        // Some children are empty, like outside the zone.
+        bool noBack = (level > 2) && ((rand() % 16) == 0);
+        nodes.append(empty);
+        nodes[q].left = nodes.count();
+        queue.append(qMakePair(front, level + 1));
+        if(!noBack)
+        {
+            nodes.append(empty);
+            nodes[q].right = nodes.count();
+            queue.append(qMakePair(back, level + 1));
+        }
+    }
+}
+
+/*!
+  \brief Classify points and spheres with the flat region tree, one at a
+  time and in a batch, and compare with the recursive descent.
+  */
+int benchRegions(const QStringList &args)
+{
+    const int count = intArg(args, 0, 100000);
+    Game *game = NULL;
+    Zone *zone = NULL;
+    QVector<RegionTreeNode> nodes;
+    AABox bounds;
+    srand(42);
+    if(args.count() >= 3)
+    {
+        game = new Game();
+        zone = new Zone(game);
+        if(!loadBenchZone(*zone, args[1], args[2]))
+            return 1;
+        bounds = zone->terrain()->bounds();
+        
+        // Load the fragment nodes for the recursive descent.
+        PFSArchive archive(QString("%1/%2.s3d").arg(args[1]).arg(args[2]));
+        WLDData *wld = WLDData::fromArchive(&archive, QString("%1.wld").arg(args[2]));
+        if(wld)
+        {
+            WLDFragmentArray<RegionTreeFragment> trees = wld->table()->byKind<RegionTreeFragment>();
+            if(trees.count() == 1)
+                nodes = trees[0]->m_nodes;
+            delete wld;
+        }
+    }
+    else
+    {
+        bounds = AABox(vec3(-3000.0f, -3000.0f, -500.0f), vec3(3000.0f, 3000.0f, 500.0f));
+        createTree(bounds, 14, nodes);
+    }
+    
+    RegionTree tree;
+    tree.build(nodes);
+    QVector<vec3> points(count);
+    for(int i = 0; i < count; i++)
+        points[i] = vec3(randomFloat(bounds.low.x, bounds.high.x),
+                         randomFloat(bounds.low.y, bounds.high.y),
+                         randomFloat(bounds.low.z, bounds.high.z));
+    
+    BenchTimer recursiveTimer("recursive points");
+    BenchTimer flatTimer("flat points");
+    BenchTimer batchTimer("batched points");
+    QVector<uint32_t> expected(count), single(count), batch(count), scratch;
+    const int runs = 10;
+    for(int r = 0; r < runs; r++)
+    {
+        recursiveTimer.begin();
+        for(int i = 0; i < count; i++)
+            expected[i] = findRegionRecursive(nodes, points[i], 1);
+        recursiveTimer.end();
+        flatTimer.begin();
+        for(int i = 0; i < count; i++)
+            single[i] = tree.findRegion(points[i]);
+        flatTimer.end();
+        batchTimer.begin();
+        tree.findRegions(points.constData(), count, batch.data(), scratch);
+        batchTimer.end();
+    }
+    int errors = 0;
+    for(int i = 0; i < count; i++)
+        errors += ((single[i] != expected[i]) || (batch[i] != expected[i]));
+    
+    // Sphere queries must return the same regions in the same order.
+    const uint32_t maxRegions = 256;
+    uint32_t regions[maxRegions];
+    QVector<uint32_t> expectedRegions;
+    for(int i = 0; i < qMin(count, 10000); i++)
+    {
+        Sphere s(points[i], randomFloat(1.0f, 100.0f));
+        expectedRegions.clear();
+        findRegionsRecursive(nodes, s, 1, expectedRegions);
+        uint32_t found = tree.findRegions(s, regions, maxRegions);
+        if(expectedRegions.count() > (int)maxRegions)
+            continue;
+        bool same = (found == (uint32_t)expectedRegions.count());
+        for(uint32_t j = 0; same && (j < found); j++)
+            same = (regions[j] == expectedRegions[j]);
+        uint32_t containing = tree.findContainingRegion(s);
+        if(containing != 0)
+            same &= (found == 1) && (regions[0] == containing);
+        errors += same ? 0 : 1;
+    }
+    
+    fprintf(stdout, "%d fragment nodes, %d flat nodes, %d points, %d errors\n",
+            nodes.count(), tree.nodeCount(), count, errors);
+    recursiveTimer.report();
+    flatTimer.report();
+    batchTimer.report();
+    if(zone)
+    {
+        zone->clear(NULL);
+        delete zone;
+    }
+    delete game;
+    return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdlib>
+#include <QVector>
+#include <QtAlgorithms>
+#include "EQuilibre/Render/RenderQueue.h"
+#include "Bench.h"
+
+static bool renderItemLessThan(const RenderItem &a, const RenderItem &b)
+{
+    return a.key < b.key;
+}
+
+/*!
+  \brief Check that keys order passes, state and depth as documented.
+  */
+static int checkKeyOrder()
+{
+    int errors = 0;
+    const RenderQueue::Pass opaque = RenderQueue::OpaquePass;
+    const RenderQueue::Pass transparent = RenderQueue::TransparentPass;
+    uint32_t maxDepth = (1 << RenderQueue::DepthBits) - 1;
+    uint64_t sky = RenderQueue::makeKey(RenderQueue::SkyPass, 255, 0, 0, maxDepth);
+    uint64_t nearOpaque = RenderQueue::makeKey(opaque, 1, 2, 3, 10);
+    uint64_t farOpaque = RenderQueue::makeKey(opaque, 1, 2, 3, 1000);
+    uint64_t otherGroup = RenderQueue::makeKey(opaque, 1, 2, 4, 0);
+    uint64_t otherProgram = RenderQueue::makeKey(opaque, 2, 0, 0, 0);
+    uint64_t nearTransparent = RenderQueue::makeKey(transparent, 0, 0, 0, 10);
+    uint64_t farTransparent = RenderQueue::makeKey(transparent, 3, 3, 3, 1000);
+    // Sky first, then opaque sorted by state then front to back, then
+    // transparent back to front.
+    errors += !(sky < nearOpaque);
+    errors += !(nearOpaque < farOpaque);
+    errors += !(farOpaque < otherGroup);
+    errors += !(otherGroup < otherProgram);
+    errors += !(otherProgram < farTransparent);
+    errors += !(farTransparent < nearTransparent);
+    errors += (RenderQueue::keyPass(sky) != RenderQueue::SkyPass);
+    errors += (RenderQueue::keyPass(farOpaque) != opaque);
+    errors += (RenderQueue::keyPass(nearTransparent) != transparent);
+    errors += (RenderQueue::quantizeDepth(-1.0f, 100.0f) != 0);
+    errors += (RenderQueue::quantizeDepth(50.0f, 100.0f) >= RenderQueue::quantizeDepth(51.0f, 100.0f));
+    errors += (RenderQueue::quantizeDepth(200.0f, 100.0f) != maxDepth);
+    return errors;
+}
+
+/*!
+  \brief Count how many times the group (mesh) changes between consecutive
+  items, which is roughly the number of beginDrawMesh calls.
+  */
+static int groupChanges(const RenderItem *items, int count, const QVector<uint32_t> &groups)
+{
+    int changes = 0;
+    for(int i = 1; i < count; i++)
+        changes += (groups[items[i].index] != groups[items[i - 1].index]);
+    return changes;
+}
+
+int benchSortKeys(const QStringList &args)
+{
+    const int itemCount = intArg(args, 0, 5000);
+    const int frames = intArg(args, 1, 200);
+    int errors = checkKeyOrder();
+    
+    // Random items from a few programs and textures and a few hundred meshes,
+    // with some transparent ones.
+    srand(42);
+    BenchTimer radixTimer("radix sort");
+    BenchTimer qsortTimer("qStableSort");
+    QVector<RenderItem> items(itemCount), scratch(itemCount), reference;
+    QVector<uint32_t> groups(itemCount);
+    int unsortedChanges = 0, sortedChanges = 0, sortErrors = 0;
+    for(int f = 0; f < frames; f++)
+    {
+        for(int i = 0; i < itemCount; i++)
+        {
+            RenderQueue::Pass pass = ((rand() % 10) == 0) ? RenderQueue::TransparentPass
+                                                          : RenderQueue::OpaquePass;
+            uint32_t group = rand() % 300;
+            uint32_t program = 1 + (group % 3);
+            uint32_t texture = group % 50;
+            uint32_t depth = rand() % (1 << RenderQueue::DepthBits);
+            // Some duplicate keys to check that the sort is stable.
+            if((rand() % 8) == 0)
+                depth = 0;
+            items[i].key = RenderQueue::makeKey(pass, program, texture, group, depth);
+            items[i].source = program;
+            items[i].index = i;
+            groups[i] = group;
+        }
+        reference = items;
+        unsortedChanges += groupChanges(items.constData(), itemCount, groups);
+        
+        radixTimer.begin();
+        RenderQueue::radixSort(items.data(), scratch.data(), itemCount);
+        radixTimer.end();
+        qsortTimer.begin();
+        qStableSort(reference.begin(), reference.end(), renderItemLessThan);
+        qsortTimer.end();
+        
+        for(int i = 0; i < itemCount; i++)
+        {
+            if((items[i].key != reference[i].key) || (items[i].index != reference[i].index))
+                sortErrors++;
+        }
+        sortedChanges += groupChanges(items.constData(), itemCount, groups);
+    }
+    errors += sortErrors;
+    
+    fprintf(stdout, "%d items, %d frames\n", itemCount, frames);
+    fprintf(stdout, "%.1f mesh changes per frame unsorted, %.1f sorted\n",
+            (double)unsortedChanges / qMax(frames, 1), (double)sortedChanges / qMax(frames, 1));
+    radixTimer.report();
+    qsortTimer.report();
+    return reportErrors(errors);
+}
@@ -0,0 +1,223 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdlib>
+#include <QVector>
+#include <QtAlgorithms>
+#include "EQuilibre/Render/CommandQueue.h"
+#include "EQuilibre/Render/Material.h"
+#include "Bench.h"
+
+/*!
+  \brief Maximum number of ranges drawn by one glMultiDrawElements call, as in
+  RenderProgram::drawMaterialGroups.
+  */
+static const uint32_t MaxDrawRanges = 64;
+
+/*!
+  \brief Synthetic terrain: regions that each use a few materials of a shared
+  array, stored in one buffer region by region (as loaded from the zone file)
+  and in a second buffer reordered material by material.
+  */
+class TerrainScene
+{
+public:
+    TerrainScene(int regionCount);
+    
+    MaterialArray materials;
+    MeshBuffer regionBuffer;
+    MeshBuffer materialBuffer;
+    QVector<MeshData *> regionMeshes;
+    QVector<MeshData *> materialMeshes;
+};
+
+TerrainScene::TerrainScene(int regionCount)
+{
+    const int materialCount = 40;
+    for(int i = 0; i < materialCount; i++)
+    {
+        Material *mat = new Material();
+        mat->setOpaque(i < (materialCount - 4));
+        materials.setMaterial(i, mat);
+    }
+    // Every index is a distinct value so that the drawn indices can be compared.
+    uint32_t indexCount = 0;
+    for(int i = 0; i < regionCount; i++)
+    {
+        uint32_t groupCount = 1 + (rand() % 6);
+        MeshData *regionMesh = regionBuffer.createMesh(groupCount);
+        MeshData *materialMesh = materialBuffer.createMesh(groupCount);
+        regionMesh->indexSegment.offset = indexCount;
+        uint32_t firstMat = rand() % materialCount;
+        uint32_t offset = 0;
+        for(uint32_t j = 0; j < groupCount; j++)
+        {
+            MaterialGroup &mg(regionMesh->matGroups[j]);
+            mg.id = j;
+            mg.offset = offset;
+            mg.count = 3 * (10 + (rand() % 200));
+            mg.matID = (firstMat + j * 7) % materialCount;
+            for(uint32_t k = 0; k < mg.count; k++)
+                regionBuffer.indices.append(indexCount++);
+            offset += mg.count;
+            materialMesh->matGroups[j] = mg;
+        }
+        regionMesh->indexSegment.count = offset;
+        materialMesh->indexSegment = regionMesh->indexSegment;
+        regionMeshes.append(regionMesh);
+        materialMeshes.append(materialMesh);
+    }
+    materialBuffer.indices = regionBuffer.indices;
+    materialBuffer.groupIndicesByMaterial(&materials);
+}
+
+/*!
+  \brief Count the draw calls needed for a packet's groups. Without a texture
+  array each group is drawn with its own material and only groups with the
+  same material can share a multi-draw call.
+  */
+static uint32_t countDrawCalls(const MaterialGroup *groups, uint32_t count,
+                               bool textureArray, bool multiDraw)
+{
+    uint32_t calls = 0, ranges = 0;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        bool sameMaterial = (i > 0) && (textureArray || (groups[i].matID == groups[i - 1].matID));
+        bool adjacent = (i > 0) && (groups[i].offset == (groups[i - 1].offset + groups[i - 1].count));
+        if(sameMaterial && adjacent)
+            continue;
+        if(!multiDraw || !sameMaterial || (ranges == MaxDrawRanges))
+        {
+            calls++;
+            ranges = 0;
+        }
+        ranges++;
+    }
+    return calls;
+}
+
+/*!
+  \brief Append the indices drawn by a packet's groups, sorted.
+  */
+static void drawnIndices(const MeshBuffer &buffer, const MaterialGroup *groups,
+                         uint32_t count, QVector<uint32_t> &indices)
+{
+    indices.resize(0);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t *groupIndices = buffer.indices.constData() + groups[i].offset;
+        for(uint32_t j = 0; j < groups[i].count; j++)
+            indices.append(groupIndices[j]);
+    }
+    qSort(indices.begin(), indices.end());
+}
+
+int benchTerrain(const QStringList &args)
+{
+    const int regionCount = intArg(args, 0, 3000);
+    const int frames = intArg(args, 1, 200);
+    const int window = qMin(regionCount, 400);
+    
+    srand(42);
+    TerrainScene scene(regionCount);
+    CommandQueue regionQueue, materialQueue;
+    QVector<MaterialGroup> visibleGroups;
+    QVector<uint32_t> visible, regionIndices, materialIndices;
+    BenchTimer regionTimer("queue (region layout)");
+    BenchTimer materialTimer("queue (material layout)");
+    uint64_t ranges[2] = {0, 0}, arrayCalls[3] = {0, 0, 0}, materialCalls[3] = {0, 0, 0};
+    int visibleRegions = 0, errors = 0;
+    
+    // Fly over the regions: the camera sees a window of regions that slides
+    // through the zone, some of which are culled.
+    for(int f = 0; f < frames; f++)
+    {
+        int start = (f * (regionCount - window)) / qMax(frames - 1, 1);
+        visible.resize(0);
+        for(int i = start; i < (start + window); i++)
+        {
+            if((rand() % 3) != 0)
+                visible.append(i);
+        }
+        visibleRegions += visible.count();
+        
+        for(int pass = 0; pass < 2; pass++)
+        {
+            bool opaque = (pass == 0);
+            DrawPacket regionPacket;
+            regionPacket.meshBuf = &scene.regionBuffer;
+            regionPacket.materials = &scene.materials;
+            regionTimer.begin();
+            foreach(uint32_t regionID, visible)
+                regionQueue.addGroups(regionPacket, scene.regionMeshes[regionID], &scene.materials, opaque);
+            regionTimer.end();
+            
+            DrawPacket materialPacket;
+            materialPacket.meshBuf = &scene.materialBuffer;
+            materialPacket.materials = &scene.materials;
+            materialTimer.begin();
+            visibleGroups.resize(0);
+            foreach(uint32_t regionID, visible)
+            {
+                MeshData *mesh = scene.materialMeshes[regionID];
+                const MaterialGroup *meshRanges = mesh->ranges();
+                for(uint32_t j = 0; j < mesh->groupCount; j++)
+                {
+                    Material *mat = scene.materials.material(meshRanges[j].matID);
+                    if(mat && (mat->isOpaque() == opaque))
+                        visibleGroups.append(meshRanges[j]);
+                }
+            }
+            materialQueue.addSortedGroups(materialPacket, visibleGroups.constData(),
+                                          visibleGroups.count());
+            materialTimer.end();
+            
+            const MaterialGroup *regionGroups = regionQueue.groups(regionPacket);
+            const MaterialGroup *materialGroups = materialQueue.groups(materialPacket);
+            ranges[0] += regionPacket.groupCount;
+            ranges[1] += materialPacket.groupCount;
+            arrayCalls[0] += countDrawCalls(regionGroups, regionPacket.groupCount, true, false);
+            arrayCalls[1] += countDrawCalls(materialGroups, materialPacket.groupCount, true, false);
+            arrayCalls[2] += countDrawCalls(materialGroups, materialPacket.groupCount, true, true);
+            materialCalls[0] += countDrawCalls(regionGroups, regionPacket.groupCount, false, false);
+            materialCalls[1] += countDrawCalls(materialGroups, materialPacket.groupCount, false, false);
+            materialCalls[2] += countDrawCalls(materialGroups, materialPacket.groupCount, false, true);
+            
+            // Both layouts have to draw the same triangles.
+            drawnIndices(scene.regionBuffer, regionGroups, regionPacket.groupCount, regionIndices);
+            drawnIndices(scene.materialBuffer, materialGroups, materialPacket.groupCount, materialIndices);
+            if(regionIndices != materialIndices)
+                errors++;
+        }
+        regionQueue.clear();
+        materialQueue.clear();
+    }
+    
+    double n = qMax(frames, 1);
+    fprintf(stdout, "%d regions, %d frames, %.1f visible regions per frame\n",
+            regionCount, frames, visibleRegions / n);
+    fprintf(stdout, "ranges per frame: %.1f region layout, %.1f material layout\n",
+            ranges[0] / n, ranges[1] / n);
+    fprintf(stdout, "draw calls per frame (texture array): %.1f region layout, "
+            "%.1f material layout, %.1f multi-draw\n",
+            arrayCalls[0] / n, arrayCalls[1] / n, arrayCalls[2] / n);
+    fprintf(stdout, "draw calls per frame (texture per material): %.1f region layout, "
+            "%.1f material layout, %.1f multi-draw\n",
+            materialCalls[0] / n, materialCalls[1] / n, materialCalls[2] / n);
+    regionTimer.report();
+    materialTimer.report();
+    return reportErrors(errors);
+}
@@ -0,0 +1,183 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cmath>
+#include <cstdlib>
+#include <QVector>
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/Material.h"
+#include "EQuilibre/Render/Vertex.h"
+#include "Bench.h"
+
+/*!
+  \brief Size of the previous vertex format: position, normal and texture
+  coordinates as three vec3, color, bone and padding.
+  */
+static const uint32_t FloatVertexSize = 48;
+
+/*!
+  \brief Largest angle allowed between a normal and its decoded value.
+  */
+static const float MaxNormalError = 1.0f;
+
+static vec3 randomDirection()
+{
+    vec3 v;
+    do
+    {
+        v = vec3(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f));
+    } while((v.lengthSquared() > 1.0f) || (v.lengthSquared() < 1e-4f));
+    return v.normalized();
+}
+
+static float angleDegrees(const vec3 &a, const vec3 &b)
+{
+    float d = qBound(-1.0f, vec3::dot(a.normalized(), b.normalized()), 1.0f);
+    return acosf(d) * (180.0f / (float)M_PI);
+}
+
+/*!
+  \brief Check that the material groups of a mesh set the texture layer of
+  their vertices and that shared vertices are only updated once.
+  */
+static int checkLayers()
+{
+    MeshBuffer buffer;
+    MaterialArray materials;
+    MeshData *mesh = buffer.createMesh(2);
+    buffer.vertices.resize(4);
+    const uint32_t indices[] = {0, 1, 2, 1, 3, 2};
+    for(int i = 0; i < 6; i++)
+        buffer.indices.append(indices[i]);
+    mesh->matGroups[0].offset = 0;
+    mesh->matGroups[0].count = 3;
+    mesh->matGroups[0].matID = 3;
+    mesh->matGroups[1].offset = 3;
+    mesh->matGroups[1].count = 3;
+    mesh->matGroups[1].matID = 255;
+    mesh->updateTexCoords(&materials, true);
+    const uint8_t expected[] = {3, 3, 3, 255};
+    int errors = 0;
+    for(int i = 0; i < 4; i++)
+        errors += (buffer.vertices[i].layer != expected[i]);
+    return errors;
+}
+
+int benchVertex(const QStringList &args)
+{
+    const int count = intArg(args, 0, 100000);
+    int errors = (sizeof(Vertex) != 24) ? 1 : 0;
+    errors += checkLayers();
+    
+    // Normals: random directions and normals as stored in WLD files.
+    srand(42);
+    float maxNormalError = 0.0f, maxWLDNormalError = 0.0f;
+    Vertex v;
+    for(int i = 0; i < count; i++)
+    {
+        vec3 n = randomDirection();
+        v.packNormal(n);
+        maxNormalError = qMax(maxNormalError, angleDegrees(n, v.unpackNormal()));
+        
+        vec3 wldNormal((rand() % 255) - 127, (rand() % 255) - 127, (rand() % 255) - 127);
+        if(wldNormal.lengthSquared() == 0.0f)
+            continue;
+        wldNormal = wldNormal * (1.0f / 127.0f);
+        v.packNormal(wldNormal);
+        maxWLDNormalError = qMax(maxWLDNormalError, angleDegrees(wldNormal, v.unpackNormal()));
+    }
+    v.packNormal(vec3());
+    errors += (v.unpackNormal().z != 1.0f);
+    errors += (maxNormalError > MaxNormalError) || (maxWLDNormalError > MaxNormalError);
+    
+    // Texture coordinates: multiples of 1/256 in range are exact, scaled ones
+    // are rounded to the nearest multiple.
+    float maxWLDCoordError = 0.0f, maxScaledCoordError = 0.0f;
+    for(int i = 0; i < count; i++)
+    {
+        vec2 tc(((rand() % 65536) - 32768) * Vertex::TexCoordScale,
+                ((rand() % 65536) - 32768) * Vertex::TexCoordScale);
+        v.packTexCoords(tc);
+        vec2 decoded = v.unpackTexCoords();
+        maxWLDCoordError = qMax(maxWLDCoordError, qMax(fabsf(decoded.x - tc.x), fabsf(decoded.y - tc.y)));
+        
+        float scale = randomFloat(0.01f, 1.0f);
+        vec2 scaled(tc.x * scale, tc.y * scale);
+        v.packTexCoords(scaled);
+        decoded = v.unpackTexCoords();
+        maxScaledCoordError = qMax(maxScaledCoordError, qMax(fabsf(decoded.x - scaled.x),
+                                                             fabsf(decoded.y - scaled.y)));
+    }
+    errors += (maxWLDCoordError != 0.0f);
+    errors += (maxScaledCoordError > (0.5f * Vertex::TexCoordScale * 1.001f));
+    
+    // Coordinates out of range are clamped and reported.
+    errors += !v.packTexCoords(vec2(-128.0f, 127.0f));
+    errors += v.packTexCoords(vec2(200.0f, -0.5f));
+    errors += (v.unpackTexCoords().x != (32767.0f * Vertex::TexCoordScale));
+    errors += v.packTexCoords(vec2(0.5f, -128.5f));
+    errors += (v.unpackTexCoords().y != -128.0f);
+    
+    // Time the conversion done by importers.
+    QVector<vec3> positions(count), normals(count);
+    QVector<vec2> texCoords(count);
+    for(int i = 0; i < count; i++)
+    {
+        positions[i] = vec3(randomFloat(-1000.0f, 1000.0f), randomFloat(-1000.0f, 1000.0f),
+                            randomFloat(-1000.0f, 1000.0f));
+        normals[i] = randomDirection();
+        texCoords[i] = vec2(randomFloat(-4.0f, 4.0f), randomFloat(-4.0f, 4.0f));
+    }
+    QVector<Vertex> vertices(count);
+    BenchTimer packTimer("pack vertices");
+    for(int run = 0; run < 20; run++)
+    {
+        packTimer.begin();
+        for(int i = 0; i < count; i++)
+        {
+            Vertex &dst(vertices[i]);
+            dst.position = positions[i];
+            dst.packNormal(normals[i]);
+            dst.packTexCoords(texCoords[i]);
+            dst.layer = 0;
+            dst.bone = 0;
+            dst.color = 0xffffffff;
+        }
+        packTimer.end();
+    }
+    
+    fprintf(stdout, "vertex size: %d bytes, was %d\n", (int)sizeof(Vertex), FloatVertexSize);
+    fprintf(stdout, "max normal error: %.3f degrees (random), %.3f degrees (WLD)\n",
+            maxNormalError, maxWLDNormalError);
+    fprintf(stdout, "max tex coord error: %g (WLD), %g (scaled)\n",
+            maxWLDCoordError, maxScaledCoordError);
+    packTimer.report();
+    
+    // Memory used by the vertices of a zone's terrain.
+    if(args.count() >= 3)
+    {
+        Game game;
+        Zone zone(&game);
+        if(!loadBenchZone(zone, args[1], args[2]))
+            return 1;
+        uint32_t vertexCount = zone.terrain()->buffer()->vertices.count();
+        fprintf(stdout, "terrain: %d vertices, %.2f MB, was %.2f MB\n", vertexCount,
+                (vertexCount * sizeof(Vertex)) / (1024.0 * 1024.0),
+                (vertexCount * FloatVertexSize) / (1024.0 * 1024.0));
+    }
+    return reportErrors(errors);
+}
@@ -0,0 +1,291 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <cstdlib>
+#include <QVector>
+#include <QtAlgorithms>
+#include "EQuilibre/Game/Fragments.h"
+#include "EQuilibre/Game/Game.h"
+#include "EQuilibre/Game/WLDActor.h"
+#include "EQuilibre/Game/WLDModel.h"
+#include "EQuilibre/Game/Zone.h"
+#include "EQuilibre/Render/VertexCache.h"
+#include "Bench.h"
+
+struct TrianglePos
+{
+    vec3 p[3];
+};
+
+static bool vec3LessThan(const vec3 &a, const vec3 &b)
+{
+    if(a.x != b.x)
+        return a.x < b.x;
+    else if(a.y != b.y)
+        return a.y < b.y;
+    return a.z < b.z;
+}
+
+static bool triangleLessThan(const TrianglePos &a, const TrianglePos &b)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        if(vec3LessThan(a.p[i], b.p[i]))
+            return true;
+        else if(vec3LessThan(b.p[i], a.p[i]))
+            return false;
+    }
+    return false;
+}
+
+/*!
+  \brief Append the triangles of an index range as positions, rotated so that
+  the smallest vertex comes first (which keeps the winding) and sorted.
+  */
+static void sortedTriangles(const vec3 *positions, const uint32_t *indices, uint32_t count,
+                            QVector<TrianglePos> &triangles)
+{
+    triangles.resize(0);
+    for(uint32_t i = 0; (i + 2) < count; i += 3)
+    {
+        TrianglePos tri;
+        uint32_t first = 0;
+        for(uint32_t k = 0; k < 3; k++)
+        {
+            tri.p[k] = positions[indices[i + k]];
+            if(vec3LessThan(tri.p[k], tri.p[first]))
+                first = k;
+        }
+        TrianglePos rotated;
+        for(uint32_t k = 0; k < 3; k++)
+            rotated.p[k] = tri.p[(first + k) % 3];
+        triangles.append(rotated);
+    }
+    qSort(triangles.begin(), triangles.end(), triangleLessThan);
+}
+
+static bool sameTriangles(const QVector<TrianglePos> &a, const QVector<TrianglePos> &b)
+{
+    if(a.count() != b.count())
+        return false;
+    for(int i = 0; i < a.count(); i++)
+    {
+        for(int k = 0; k < 3; k++)
+        {
+            if(vec3LessThan(a[i].p[k], b[i].p[k]) || vec3LessThan(b[i].p[k], a[i].p[k]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/*!
+  \brief ACMR of one mesh before and after optimization, with the caches of
+  some common sizes.
+  */
+class CacheStats
+{
+public:
+    CacheStats();
+    void add(const uint32_t *before, const uint32_t *after, uint32_t indexCount);
+    void print(const char *name) const;
+    
+    uint32_t triangles;
+    double fifoBefore, fifoAfter;
+    double lruBefore, lruAfter;
+};
+
+CacheStats::CacheStats()
+{
+    triangles = 0;
+    fifoBefore = fifoAfter = lruBefore = lruAfter = 0.0;
+}
+
+void CacheStats::add(const uint32_t *before, const uint32_t *after, uint32_t indexCount)
+{
+    uint32_t count = indexCount / 3;
+    fifoBefore += VertexCache::acmr(before, indexCount, 16) * count;
+    fifoAfter += VertexCache::acmr(after, indexCount, 16) * count;
+    lruBefore += VertexCache::acmr(before, indexCount, 32, VertexCache::LRU) * count;
+    lruAfter += VertexCache::acmr(after, indexCount, 32, VertexCache::LRU) * count;
+    triangles += count;
+}
+
+void CacheStats::print(const char *name) const
+{
+    double n = qMax(triangles, 1u);
+    fprintf(stdout, "%-24s %7d triangles  FIFO-16 %.3f -> %.3f  LRU-32 %.3f -> %.3f\n",
+            name, triangles, fifoBefore / n, fifoAfter / n, lruBefore / n, lruAfter / n);
+}
+
+/*!
+  \brief Compare the original triangles of a WLD mesh with the imported ones.
+  */
+static int compareMesh(WLDMesh *mesh, CacheStats &stats, CacheStats &total)
+{
+    MeshDefFragment *def = mesh->def();
+    MeshData *data = mesh->data();
+    QVector<vec3> defPositions;
+    foreach(vec3 v, def->m_vertices)
+        defPositions.append(v + def->m_center);
+    QVector<uint32_t> before;
+    foreach(uint16_t index, def->m_indices)
+        before.append(index);
+    
+    QVector<vec3> positions;
+    QVector<uint32_t> after;
+    const Vertex *vertices = data->buffer->vertices.constData() + data->vertexSegment.offset;
+    for(uint32_t i = 0; i < data->vertexSegment.count; i++)
+        positions.append(vertices[i].position);
+    const uint32_t *indices = data->buffer->indices.constData() + data->indexSegment.offset;
+    for(uint32_t i = 0; i < data->indexSegment.count; i++)
+        after.append(indices[i] - data->vertexSegment.offset);
+    if(before.count() != after.count())
+        return 1;
+    
+    int errors = 0;
+    QVector<TrianglePos> beforeTris, afterTris;
+    for(uint32_t i = 0; i < data->groupCount; i++)
+    {
+        const MaterialGroup &mg(data->matGroups[i]);
+        sortedTriangles(defPositions.constData(), before.constData() + mg.offset, mg.count, beforeTris);
+        sortedTriangles(positions.constData(), after.constData() + mg.offset, mg.count, afterTris);
+        errors += !sameTriangles(beforeTris, afterTris);
+    }
+    stats.add(before.constData(), after.constData(), after.count());
+    total.add(before.constData(), after.constData(), after.count());
+    return errors;
+}
+
+/*!
+  \brief Synthetic mesh: a grid whose triangles are in random order, like the
+  triangles of the WLD meshes within a material.
+  */
+static int checkGrid(uint32_t size, CacheStats &total)
+{
+    MeshBuffer buffer;
+    MeshData *mesh = buffer.createMesh(1);
+    for(uint32_t y = 0; y <= size; y++)
+    {
+        for(uint32_t x = 0; x <= size; x++)
+        {
+            Vertex v;
+            v.position = vec3(x, y, 0.0f);
+            buffer.vertices.append(v);
+        }
+    }
+    for(uint32_t y = 0; y < size; y++)
+    {
+        for(uint32_t x = 0; x < size; x++)
+        {
+            uint32_t a = (y * (size + 1)) + x, b = a + 1, c = a + size + 1, d = c + 1;
+            const uint32_t quad[] = {a, b, d, a, d, c};
+            for(int i = 0; i < 6; i++)
+                buffer.indices.append(quad[i]);
+        }
+    }
+    uint32_t triCount = size * size * 2;
+    for(uint32_t i = triCount - 1; i > 0; i--)
+    {
+        uint32_t j = rand() % (i + 1);
+        for(int k = 0; k < 3; k++)
+            qSwap(buffer.indices[(i * 3) + k], buffer.indices[(j * 3) + k]);
+    }
+    mesh->vertexSegment.count = buffer.vertices.count();
+    mesh->indexSegment.count = buffer.indices.count();
+    mesh->matGroups[0].offset = 0;
+    mesh->matGroups[0].count = buffer.indices.count();
+    mesh->matGroups[0].matID = 0;
+    
+    QVector<vec3> positions;
+    foreach(Vertex v, buffer.vertices)
+        positions.append(v.position);
+    QVector<uint32_t> before = buffer.indices;
+    QVector<uint32_t> order;
+    VertexCacheOptimizer optimizer;
+    optimizer.optimizeMesh(mesh, order);
+    
+    QVector<vec3> newPositions;
+    foreach(Vertex v, buffer.vertices)
+        newPositions.append(v.position);
+    QVector<TrianglePos> beforeTris, afterTris;
+    sortedTriangles(positions.constData(), before.constData(), before.count(), beforeTris);
+    sortedTriangles(newPositions.constData(), buffer.indices.constData(), buffer.indices.count(), afterTris);
+    int errors = !sameTriangles(beforeTris, afterTris);
+    for(int i = 0; i < order.count(); i++)
+        errors += vec3LessThan(newPositions[i], positions[order[i]])
+                || vec3LessThan(positions[order[i]], newPositions[i]);
+    
+    CacheStats stats;
+    stats.add(before.constData(), buffer.indices.constData(), buffer.indices.count());
+    total.add(before.constData(), buffer.indices.constData(), buffer.indices.count());
+    stats.print(QString("grid %1x%1").arg(size).toLatin1().constData());
+    return errors;
+}
+
+/*!
+  \brief Report the average cache miss ratio (ACMR) of every mesh of a zone, or
+  of synthetic grids, before and after the vertex cache optimization done when
+  importing meshes. Also check that the same triangles are drawn.
+  */
+int benchVertexCache(const QStringList &args)
+{
+    int errors = 0;
+    CacheStats total;
+    srand(42);
+    if(args.count() < 2)
+    {
+        const uint32_t sizes[] = {4, 16, 64, 128};
+        for(int i = 0; i < 4; i++)
+            errors += checkGrid(sizes[i], total);
+        total.print("total");
+        return reportErrors(errors);
+    }
+    
+    Game game;
+    Zone zone(&game);
+    if(!loadBenchZone(zone, args[0], args[1]))
+        return 1;
+    
+    // Terrain regions are imported when loading the zone, objects when
+    // uploading them.
+    QVector<WLDMesh *> meshes;
+    ZoneTerrain *terrain = zone.terrain();
+    for(uint32_t i = 1; i <= terrain->regionCount(); i++)
+    {
+        WLDStaticActor *actor = terrain->regionActor(i);
+        if(actor)
+            meshes.append(actor->mesh());
+    }
+    MeshBuffer objectBuffer;
+    foreach(WLDMesh *mesh, zone.objects()->models().values())
+    {
+        if(!mesh->data())
+            mesh->importFrom(&objectBuffer);
+        meshes.append(mesh);
+    }
+    
+    foreach(WLDMesh *mesh, meshes)
+    {
+        CacheStats stats;
+        int meshErrors = compareMesh(mesh, stats, total);
+        stats.print(mesh->def()->name().toLatin1().constData());
+        errors += meshErrors;
+    }
+    total.print("total");
+    fprintf(stdout, "%d meshes, %d errors\n", meshes.count(), errors);
+    return (errors > 0) ? 1 : 0;
+}
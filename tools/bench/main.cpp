@@ -0,0 +1,113 @@
+// Copyright (C) 2012 PiB <pixelbound@gmail.com>
+//  
+// EQuilibre is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+#include <QStringList>
+#include "Bench.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench <benchmark> [args...]\n");
+    fprintf(stderr, "benchmarks:\n");
+    fprintf(stderr, "  actors [count] [ticks]    update and cull actors in the actor store\n");
+    fprintf(stderr, "  batching [frames] [assetDir zoneName]\n");
+    fprintf(stderr, "                            compare culling and draws of objects merged into cells\n");
+    fprintf(stderr, "  bsp [count] [assetDir zoneName]\n");
+    fprintf(stderr, "                            classify points with the zone region tree\n");
+    fprintf(stderr, "  chunks [regions] [frames] [assetDir zoneName]\n");
+    fprintf(stderr, "                            check the clustering of terrain regions into chunks\n");
+    fprintf(stderr, "  commands [objects] [frames]\n");
+    fprintf(stderr, "                            check and count the batching of the render command queue\n");
+    fprintf(stderr, "  cull [count] [frames]     check and time batched frustum culling\n");
+    fprintf(stderr, "  glstate [objects] [frames]\n");
+    fprintf(stderr, "                            check and count the GL calls dropped by state shadowing\n");
+    fprintf(stderr, "  indices [assetDir zoneName]\n");
+    fprintf(stderr, "                            check the choice of 16-bit index buffers\n");
+    fprintf(stderr, "  lod [assetDir zoneName]\n");
+    fprintf(stderr, "                            check the mesh simplifier and the levels of detail of objects\n");
+    fprintf(stderr, "  math [count]              check the accuracy and speed of the SIMD math types\n");
+    fprintf(stderr, "  meshpool [models] [rounds]\n");
+    fprintf(stderr, "                            check the mesh pool across zone loads and defragmentation\n");
+    fprintf(stderr, "  moving [count] [ticks]    move actors around a dynamic octree and check queries\n");
+    fprintf(stderr, "  occlusion [walls] [frames]\n");
+    fprintf(stderr, "                            check and time the software occlusion buffer\n");
+    fprintf(stderr, "  octree [frames] [assetDir zoneName]\n");
+    fprintf(stderr, "                            build and cull zone objects with both octrees\n");
+    fprintf(stderr, "  palette [characters] [frames]\n");
+    fprintf(stderr, "                            check the layout of the bone palette shared by characters\n");
+    fprintf(stderr, "  pvs assetDir zoneName [cameraPath]\n");
+    fprintf(stderr, "                            compare draw counts with and without the region PVS\n");
+    fprintf(stderr, "  sortkeys [items] [frames] check and time sorting render items by key\n");
+    fprintf(stderr, "  terrain [regions] [frames]\n");
+    fprintf(stderr, "                            compare terrain draw calls with both index layouts\n");
+    fprintf(stderr, "  vcache [assetDir zoneName]\n");
+    fprintf(stderr, "                            compare vertex cache misses before and after optimizing meshes\n");
+    fprintf(stderr, "  vertex [count] [assetDir zoneName]\n");
+    fprintf(stderr, "                            check the quantization error of the vertex format\n");
+    fprintf(stderr, "  zonecull assetDir zoneName [threads]\n");
+    fprintf(stderr, "                            check and time zone culling on several threads\n");
+}
+
+int main(int argc, char **argv)
+{
+    QStringList args;
+    for(int i = 2; i < argc; i++)
+        args.append(argv[i]);
+    QString name = (argc > 1) ? QString(argv[1]) : QString();
+    if(name == "actors")
+        return benchActors(args);
+    else if(name == "batching")
+        return benchBatching(args);
+    else if(name == "bsp")
+        return benchRegions(args);
+    else if(name == "chunks")
+        return benchChunks(args);
+    else if(name == "commands")
+        return benchCommands(args);
+    else if(name == "cull")
+        return benchCull(args);
+    else if(name == "glstate")
+        return benchGLState(args);
+    else if(name == "indices")
+        return benchIndices(args);
+    else if(name == "lod")
+        return benchLOD(args);
+    else if(name == "math")
+        return benchMath(args);
+    else if(name == "meshpool")
+        return benchMeshPool(args);
+    else if(name == "moving")
+        return benchMovingActors(args);
+    else if(name == "occlusion")
+        return benchOcclusion(args);
+    else if(name == "octree")
+        return benchOctree(args);
+    else if(name == "palette")
+        return benchPalette(args);
+    else if(name == "pvs")
+        return benchPVS(args);
+    else if(name == "sortkeys")
+        return benchSortKeys(args);
+    else if(name == "terrain")
+        return benchTerrain(args);
+    else if(name == "vcache")
+        return benchVertexCache(args);
+    else if(name == "vertex")
+        return benchVertex(args);
+    else if(name == "zonecull")
+        return benchZoneCull(args);
+    usage();
+    return 1;
+}